@@ -2214,6 +2214,21 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.cont_batching = false;
         }
     ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_NO_CONT_BATCHING"));
+    add_opt(common_arg(
+        {"--batch-budget"}, "N",
+        string_format("max number of tokens to evaluate per iteration while slots are generating (default: %d, 0 = n_batch)\n"
+            "the tokens of the generating slots go first and the prompts of the other slots are split fairly in the remainder", params.n_batch_budget),
+        [](common_params & params, int value) {
+            params.n_batch_budget = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_BATCH_BUDGET"));
+    add_opt(common_arg(
+        {"--parallel-batch"}, "N",
+        string_format("max number of slots processing tasks with \"priority\": \"batch\" (default: %d, 0 = no limit)", params.n_parallel_batch),
+        [](common_params & params, int value) {
+            params.n_parallel_batch = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_N_PARALLEL_BATCH"));
     add_opt(common_arg(
         {"--mmproj"}, "FILE",
         "path to a multimodal projector file. see tools/mtmd/README.md\n"
@@ -2274,6 +2289,13 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.use_mmap = false;
         }
     ).set_env("LLAMA_ARG_NO_MMAP"));
+    add_opt(common_arg(
+        {"--direct-io"},
+        "read the model with direct I/O, bypassing the page cache (Linux only, implies --no-mmap)",
+        [](common_params & params) {
+            params.use_direct_io = true;
+        }
+    ).set_env("LLAMA_ARG_DIRECT_IO"));
     add_opt(common_arg(
         {"--numa"}, "TYPE",
         "attempt optimizations that help on some NUMA systems\n"
@@ -2944,6 +2966,20 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.slot_prompt_similarity = std::stof(value);
         }
     ).set_examples({LLAMA_EXAMPLE_SERVER}));
+    add_opt(common_arg(
+        {"--kv-prefix-share"},
+        string_format("share cached prompt prefixes between slots through the unified KV cache (default: %s)", params.kv_prefix_share ? "enabled" : "disabled"),
+        [](common_params & params) {
+            params.kv_prefix_share = true;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_KV_PREFIX_SHARE"));
+    add_opt(common_arg(
+        {"-cram", "--cache-ram"}, "N",
+        string_format("maximum size in MiB of the host-memory cache for the KV state of prompts evicted from slots (default: %d, 0 = disabled)", params.cache_ram_mib),
+        [](common_params & params, int value) {
+            params.cache_ram_mib = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_CACHE_RAM"));
     add_opt(common_arg(
         {"--lora-init-without-apply"},
         string_format("load LoRA adapters without applying them (apply later via POST /lora-adapters) (default: %s)", params.lora_init_without_apply ? "enabled" : "disabled"),
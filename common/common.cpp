@@ -464,6 +464,88 @@ size_t string_find_partial_stop(const std::string_view & str, const std::string_
     return std::string::npos;
 }
 
+common_stop_matcher::common_stop_matcher(const std::vector<std::string> & words) : words(words) {
+    nodes.emplace_back();
+
+    // trie of the stop strings
+    for (size_t i = 0; i < words.size(); ++i) {
+        int32_t cur = 0;
+        for (const char c : words[i]) {
+            const auto it = nodes[cur].next.find(c);
+            if (it != nodes[cur].next.end()) {
+                cur = it->second;
+                continue;
+            }
+
+            const int32_t child = nodes.size();
+            nodes.emplace_back();
+            nodes[child].depth = nodes[cur].depth + 1;
+            nodes[cur].next[c] = child;
+            cur = child;
+        }
+
+        // the empty string and the duplicates are ignored
+        if (cur != 0 && nodes[cur].word < 0) {
+            nodes[cur].word = i;
+        }
+    }
+
+    // failure links, in breadth-first order so that the links of the shorter prefixes are ready first
+    std::vector<int32_t> queue;
+    for (const auto & it : nodes[0].next) {
+        queue.push_back(it.second);
+    }
+
+    for (size_t i = 0; i < queue.size(); ++i) {
+        const int32_t cur = queue[i];
+        for (const auto & it : nodes[cur].next) {
+            node & child = nodes[it.second];
+
+            child.fail = cur == 0 ? 0 : step(nodes[cur].fail, it.first);
+            if (child.word < 0) {
+                child.word = nodes[child.fail].word;
+            }
+
+            queue.push_back(it.second);
+        }
+    }
+}
+
+int32_t common_stop_matcher::step(int32_t cur, char c) const {
+    while (true) {
+        const auto it = nodes[cur].next.find(c);
+        if (it != nodes[cur].next.end()) {
+            return it->second;
+        }
+        if (cur == 0) {
+            return 0;
+        }
+        cur = nodes[cur].fail;
+    }
+}
+
+common_stop_matcher::match common_stop_matcher::feed(const std::string_view & text) {
+    match res;
+
+    for (size_t i = 0; i < text.size(); ++i) {
+        state = step(state, text[i]);
+
+        const int32_t word = nodes[state].word;
+        if (word < 0) {
+            continue;
+        }
+
+        // keep the match that starts first, the start can be before the given text
+        const size_t end = i + 1;
+        if (res.word < 0 || end + words[res.word].size() < res.end + words[word].size()) {
+            res.word = word;
+            res.end  = end;
+        }
+    }
+
+    return res;
+}
+
 std::string regex_escape(const std::string & s) {
     static const std::regex special_chars("[.^$|()*+?\\[\\]{}\\\\]");
     return std::regex_replace(s, special_chars, "\\$&");
@@ -1107,6 +1189,7 @@ struct llama_model_params common_model_params_to_llama(common_params & params) {
     mparams.use_mmap        = params.use_mmap;
     mparams.use_mlock       = params.use_mlock;
     mparams.check_tensors   = params.check_tensors;
+    mparams.use_direct_io   = params.use_direct_io;
 
     if (params.kv_overrides.empty()) {
         mparams.kv_overrides = NULL;
@@ -1275,27 +1358,29 @@ std::vector<llama_token> common_tokenize(
   const struct llama_context * ctx,
            const std::string & text,
                         bool   add_special,
-                        bool   parse_special) {
+                        bool   parse_special,
+                     int32_t   n_threads) {
     const llama_model * model = llama_get_model(ctx);
     const llama_vocab * vocab = llama_model_get_vocab(model);
-    return common_tokenize(vocab, text, add_special, parse_special);
+    return common_tokenize(vocab, text, add_special, parse_special, n_threads);
 }
 
 std::vector<llama_token> common_tokenize(
     const struct llama_vocab * vocab,
            const std::string & text,
                         bool   add_special,
-                        bool   parse_special) {
+                        bool   parse_special,
+                     int32_t   n_threads) {
     // upper limit for the number of tokens
     int n_tokens = text.length() + 2 * add_special;
     std::vector<llama_token> result(n_tokens);
-    n_tokens = llama_tokenize(vocab, text.data(), text.length(), result.data(), result.size(), add_special, parse_special);
+    n_tokens = llama_tokenize_parallel(vocab, text.data(), text.length(), result.data(), result.size(), add_special, parse_special, n_threads);
     if (n_tokens == std::numeric_limits<int32_t>::min()) {
         throw std::runtime_error("Tokenization failed: input text too large, tokenization result exceeds int32_t limit");
     }
     if (n_tokens < 0) {
         result.resize(-n_tokens);
-        int check = llama_tokenize(vocab, text.data(), text.length(), result.data(), result.size(), add_special, parse_special);
+        int check = llama_tokenize_parallel(vocab, text.data(), text.length(), result.data(), result.size(), add_special, parse_special, n_threads);
         GGML_ASSERT(check == -n_tokens);
     } else {
         result.resize(n_tokens);
@@ -1347,6 +1432,30 @@ std::string common_detokenize(const struct llama_vocab * vocab, const std::vecto
     return text;
 }
 
+void common_detokenizer_push(llama_detokenizer * detok, llama_token token, bool special, std::string & text) {
+    const size_t n_text = text.size();
+
+    text.resize(n_text + 16);
+    int32_t n_chars = llama_detokenizer_push(detok, token, &text[n_text], 16, special);
+    if (n_chars < 0) {
+        text.resize(n_text - n_chars);
+        n_chars = llama_detokenizer_push(detok, token, &text[n_text], -n_chars, special);
+        GGML_ASSERT(n_chars >= 0);
+    }
+
+    text.resize(n_text + n_chars);
+}
+
+void common_detokenizer_flush(llama_detokenizer * detok, std::string & text) {
+    const size_t n_text = text.size();
+
+    text.resize(n_text + llama_detokenizer_n_pending(detok));
+    const int32_t n_chars = llama_detokenizer_flush(detok, &text[n_text], text.size() - n_text);
+    GGML_ASSERT(n_chars >= 0);
+
+    text.resize(n_text + n_chars);
+}
+
 //
 // Embedding utils
 //
@@ -334,6 +334,7 @@ struct common_params {
     bool input_prefix_bos  = false; // prefix BOS to user inputs, preceding input_prefix
     bool use_mmap          = true;  // use mmap for faster loads
     bool use_mlock         = false; // use mlock to keep model in memory
+    bool use_direct_io     = false; // read the model with direct I/O, bypassing the page cache
     bool verbose_prompt    = false; // print prompt tokens before generation
     bool display_prompt    = true;  // print prompt before generation
     bool no_kv_offload     = false; // disable KV offloading
@@ -396,6 +397,10 @@ struct common_params {
     std::string slot_save_path;
 
     float slot_prompt_similarity = 0.5f;
+    int32_t n_batch_budget       = 0;     // max number of tokens per server iteration while slots are generating (0 = n_batch)
+    int32_t n_parallel_batch     = 0;     // max number of slots processing batch-priority tasks (0 = no limit)
+    bool  kv_prefix_share        = false; // attach cached prompt prefixes across slots via seq_cp
+    int32_t cache_ram_mib        = 0;     // size limit of the host-memory prompt cache in MiB (0 = disabled)
 
     // batched-bench params
     bool is_pp_shared = false;
@@ -524,6 +529,45 @@ static bool string_starts_with(const std::string & str,
 bool string_ends_with(const std::string_view & str, const std::string_view & suffix);
 size_t string_find_partial_stop(const std::string_view & str, const std::string_view & stop);
 
+// Aho-Corasick automaton over a set of stop strings, fed with the text as it is generated
+// each byte is processed once, regardless of the number of stop strings
+struct common_stop_matcher {
+    struct match {
+        int32_t word = -1; // index of the stop string, -1 if there is no match
+        size_t  end  = 0;  // end of the stop string, in bytes from the start of the text passed to feed()
+    };
+
+    common_stop_matcher(const std::vector<std::string> & words = {});
+
+    // process the next bytes of the text
+    // returns the stop string that starts first among those that end in these bytes
+    match feed(const std::string_view & text);
+
+    // length of the longest suffix of the text that is the start of a stop string
+    size_t n_partial() const { return nodes[state].depth; }
+
+    // start over with an empty text
+    void reset() { state = 0; }
+
+    const std::vector<std::string> & get_words() const { return words; }
+
+private:
+    struct node {
+        std::map<char, int32_t> next;
+
+        int32_t fail  = 0;
+        int32_t word  = -1; // longest stop string that is a suffix of this node
+        size_t  depth = 0;
+    };
+
+    int32_t step(int32_t cur, char c) const;
+
+    std::vector<std::string> words;
+    std::vector<node> nodes;
+
+    int32_t state = 0;
+};
+
 bool string_parse_kv_override(const char * data, std::vector<llama_model_kv_override> & overrides);
 void string_process_escapes(std::string & input);
 
@@ -594,17 +638,20 @@ size_t common_lcs(const llama_tokens & a, const llama_tokens & b);
 
 // tokenizes a string into a vector of tokens
 // should work similar to Python's `tokenizer.encode`
+// n_threads > 1 tokenizes large texts in parallel, with the same result
 std::vector<llama_token> common_tokenize(
   const struct llama_context * ctx,
            const std::string & text,
                         bool   add_special,
-                        bool   parse_special = false);
+                        bool   parse_special = false,
+                     int32_t   n_threads     = 1);
 
 std::vector<llama_token> common_tokenize(
     const struct llama_vocab * vocab,
            const std::string & text,
                         bool   add_special,
-                        bool   parse_special = false);
+                        bool   parse_special = false,
+                     int32_t   n_threads     = 1);
 
 // tokenizes a token into a piece, optionally renders special/control tokens
 // should work similar to Python's `tokenizer.id_to_piece`
@@ -631,6 +678,18 @@ std::string common_detokenize(
         const std::vector<llama_token> & tokens,
                                   bool   special = true);
 
+// appends the complete UTF-8 characters of the token to text, see llama_detokenizer_push
+void common_detokenizer_push(
+        struct llama_detokenizer * detok,
+                     llama_token   token,
+                            bool   special,
+                   std::string   & text);
+
+// appends the held bytes of an incomplete character to text
+void common_detokenizer_flush(
+        struct llama_detokenizer * detok,
+                   std::string   & text);
+
 //
 // Embedding utils
 //
@@ -3,7 +3,9 @@
 #include "common.h"
 #include "log.h"
 
+#include <atomic>
 #include <cmath>
+#include <thread>
 #include <unordered_map>
 #include <algorithm>
 
@@ -112,14 +114,7 @@ struct common_sampler {
 
     llama_token_data_array cur_p;
 
-    void set_logits(struct llama_context * ctx, int idx) {
-        const auto * logits = llama_get_logits_ith(ctx, idx);
-
-        const llama_model * model = llama_get_model(ctx);
-        const llama_vocab * vocab = llama_model_get_vocab(model);
-
-        const int n_vocab = llama_vocab_n_tokens(vocab);
-
+    void set_logits(const float * logits, int n_vocab) {
         cur.resize(n_vocab);
 
         for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
@@ -335,8 +330,8 @@ void common_perf_print(const struct llama_context * ctx, const struct common_sam
     }
 }
 
-llama_token common_sampler_sample(struct common_sampler * gsmpl, struct llama_context * ctx, int idx, bool grammar_first) {
-    gsmpl->set_logits(ctx, idx);
+static llama_token common_sampler_sample_impl(struct common_sampler * gsmpl, const float * logits, int n_vocab, bool grammar_first) {
+    gsmpl->set_logits(logits, n_vocab);
 
     auto & grmr  = gsmpl->grmr;
     auto & chain = gsmpl->chain;
@@ -371,7 +366,7 @@ llama_token common_sampler_sample(struct common_sampler * gsmpl, struct llama_co
 
     // resampling:
     // if the token is not valid, sample again, but first apply the grammar sampler and then the sampling chain
-    gsmpl->set_logits(ctx, idx);
+    gsmpl->set_logits(logits, n_vocab);
 
     llama_sampler_apply(grmr,  &cur_p);
     llama_sampler_apply(chain, &cur_p);
@@ -381,6 +376,55 @@ llama_token common_sampler_sample(struct common_sampler * gsmpl, struct llama_co
     return cur_p.data[cur_p.selected].id;
 }
 
+llama_token common_sampler_sample(struct common_sampler * gsmpl, struct llama_context * ctx, int idx, bool grammar_first) {
+    const llama_vocab * vocab = llama_model_get_vocab(llama_get_model(ctx));
+
+    return common_sampler_sample_impl(gsmpl, llama_get_logits_ith(ctx, idx), llama_vocab_n_tokens(vocab), grammar_first);
+}
+
+std::vector<llama_token> common_sampler_sample_batch(const std::vector<common_sampler *> & gsmpls, struct llama_context * ctx, const std::vector<int> & idxs, int n_threads, bool grammar_first) {
+    GGML_ASSERT(gsmpls.size() == idxs.size());
+
+    const int n_samplers = gsmpls.size();
+
+    const llama_vocab * vocab = llama_model_get_vocab(llama_get_model(ctx));
+
+    const int n_vocab = llama_vocab_n_tokens(vocab);
+
+    // the context is not thread-safe, get all the logits before sampling
+    std::vector<const float *> logits(n_samplers);
+    for (int i = 0; i < n_samplers; ++i) {
+        logits[i] = llama_get_logits_ith(ctx, idxs[i]);
+    }
+
+    std::vector<llama_token> result(n_samplers);
+
+    std::atomic<int> i_next = 0;
+
+    auto worker = [&]() {
+        for (int i = i_next++; i < n_samplers; i = i_next++) {
+            result[i] = common_sampler_sample_impl(gsmpls[i], logits[i], n_vocab, grammar_first);
+        }
+    };
+
+    n_threads = std::max(1, std::min(n_threads, n_samplers));
+
+    std::vector<std::thread> workers;
+    workers.reserve(n_threads - 1);
+
+    for (int i = 1; i < n_threads; ++i) {
+        workers.emplace_back(worker);
+    }
+
+    worker();
+
+    for (auto & w : workers) {
+        w.join();
+    }
+
+    return result;
+}
+
 std::vector<llama_token> common_sampler_sample_and_accept_n(struct common_sampler * gsmpl, struct llama_context * ctx, const std::vector<int> & idxs, const llama_tokens & draft, bool grammar_first) {
     GGML_ASSERT(idxs.size() == draft.size() + 1 && "idxs.size() must be draft.size() + 1");
 
@@ -60,6 +60,13 @@ void common_perf_print(const struct llama_context * ctx, const struct common_sam
 //
 llama_token common_sampler_sample(struct common_sampler * gsmpl, struct llama_context * ctx, int idx, bool grammar_first = false);
 
+// sample with multiple samplers at once, e.g. for all the slots of a server after a decode
+//
+// equivalent to calling common_sampler_sample(gsmpls[i], ctx, idxs[i], grammar_first) for each i, with the samplers
+// running in parallel on up to n_threads threads. the samplers must be distinct
+//
+std::vector<llama_token> common_sampler_sample_batch(const std::vector<common_sampler *> & gsmpls, struct llama_context * ctx, const std::vector<int> & idxs, int n_threads, bool grammar_first = false);
+
 // generalized version of common_sampler_sample
 //
 // will cross-reference the sampled tokens with a batch of draft tokens and accept those that match
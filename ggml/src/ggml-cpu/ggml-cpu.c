@@ -2776,7 +2776,19 @@ struct ggml_cplan ggml_graph_plan(
                         const int64_t ne10 = node->src[1]->ne[0]; // DK
                         const int64_t ne20 = node->src[2]->ne[0]; // DV
 
-                        cur = sizeof(float)*(1*ne10 + 2*ne20)*n_tasks; // 1x head size K + 2x head size V (per thread)
+                        const int64_t n_split = ggml_compute_forward_flash_attn_ext_n_kv_split(node, n_tasks);
+
+                        if (node->src[0]->ne[1] > 1 || n_split > 1) {
+                            // tiled: Q tile + KQ tile + V tile + VKQ accumulators + M and S (per thread)
+                            cur = sizeof(float)*(GGML_FA_TILE_Q*(ne10 + GGML_FA_TILE_KV + ne20 + 2) + GGML_FA_TILE_KV*ne20)*n_tasks;
+
+                            if (n_split > 1) {
+                                // partial results of the KV slices, there are less than 2 per thread
+                                cur += sizeof(float)*GGML_FA_TILE_Q*(ne20 + 2)*2*n_tasks;
+                            }
+                        } else {
+                            cur = sizeof(float)*(1*ne10 + 2*ne20)*n_tasks; // 1x head size K + 2x head size V (per thread)
+                        }
                     } break;
                 case GGML_OP_FLASH_ATTN_BACK:
                     {
@@ -2823,6 +2835,244 @@ struct ggml_cplan ggml_graph_plan(
     return cplan;
 }
 
+// barrier elision between consecutive independent nodes
+//
+// after computing a node, a thread can move on to the next node without waiting for the other threads if the next node
+// does not touch the memory of any node computed since the last barrier and does not use shared state of the threadpool
+// (work buffer layout, chunk counters or internal barriers). this lets the threads overlap cheap ops such as norms, adds,
+// ropes and KV stores instead of synchronizing after each one of them
+// the decision depends only on the graph, so all threads execute the same sequence of barriers
+
+#define GGML_GRAPH_COMPUTE_MAX_PENDING 16
+
+struct ggml_compute_pending {
+    const struct ggml_tensor * nodes[GGML_GRAPH_COMPUTE_MAX_PENDING];
+    int n_nodes;
+
+    // per-thread work buffer stride of the pending nodes: 0 - not used, -1 - unknown layout
+    int64_t wstride;
+};
+
+// returns the per-thread work buffer stride (in floats) of a node that can run without barriers, or -1 otherwise
+static int64_t ggml_graph_compute_node_wstride(const struct ggml_tensor * node) {
+    switch (node->op) {
+        case GGML_OP_ADD:
+        case GGML_OP_SUB:
+        case GGML_OP_MUL:
+        case GGML_OP_DIV:
+            return ggml_is_quantized(node->src[0]->type) ? -1 : 0;
+        case GGML_OP_SCALE:
+        case GGML_OP_NORM:
+        case GGML_OP_RMS_NORM:
+        case GGML_OP_GET_ROWS:
+        case GGML_OP_SET_ROWS:
+        case GGML_OP_UNARY:
+        case GGML_OP_GLU:
+            return 0;
+        case GGML_OP_ROPE:
+        case GGML_OP_SOFT_MAX:
+            return node->ne[0] + CACHE_LINE_SIZE_F32;
+        default:
+            return -1;
+    }
+}
+
+static bool ggml_graph_compute_node_is_empty(const struct ggml_tensor * node) {
+    if (ggml_is_empty(node)) {
+        return true;
+    }
+
+    switch (node->op) {
+        case GGML_OP_NONE:
+        case GGML_OP_RESHAPE:
+        case GGML_OP_TRANSPOSE:
+        case GGML_OP_VIEW:
+        case GGML_OP_PERMUTE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool ggml_graph_compute_overlap(const struct ggml_tensor * a, const struct ggml_tensor * b) {
+    if (a == NULL || b == NULL || a->data == NULL || b->data == NULL) {
+        return false;
+    }
+
+    const char * a0 = (const char *) a->data;
+    const char * b0 = (const char *) b->data;
+
+    return a0 < b0 + ggml_nbytes(b) && b0 < a0 + ggml_nbytes(a);
+}
+
+// check if the node has to wait for the pending nodes
+static bool ggml_graph_compute_node_need_barrier(const struct ggml_compute_pending * pending, const struct ggml_tensor * node) {
+    if (pending->n_nodes == 0 || ggml_graph_compute_node_is_empty(node)) {
+        return false;
+    }
+
+    const int64_t wstride = ggml_graph_compute_node_wstride(node);
+    if (wstride < 0 || (wstride > 0 && pending->wstride != 0 && pending->wstride != wstride)) {
+        return true;
+    }
+
+    for (int i = 0; i < pending->n_nodes; i++) {
+        const struct ggml_tensor * prev = pending->nodes[i];
+
+        if (ggml_graph_compute_overlap(prev, node)) {
+            return true;
+        }
+
+        for (int j = 0; j < GGML_MAX_SRC; j++) {
+            // read after write
+            if (ggml_graph_compute_overlap(prev, node->src[j])) {
+                return true;
+            }
+            // write after read
+            if (ggml_graph_compute_overlap(node, prev->src[j])) {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+// check if the group of n nodes starting at node_n has to wait for the pending nodes
+static bool ggml_graph_compute_need_barrier(const struct ggml_compute_pending * pending, const struct ggml_cgraph * cgraph, int node_n, int n) {
+    if (pending->n_nodes + n > GGML_GRAPH_COMPUTE_MAX_PENDING) {
+        return true;
+    }
+
+    for (int i = 0; i < n; i++) {
+        if (ggml_graph_compute_node_need_barrier(pending, cgraph->nodes[node_n + i])) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void ggml_graph_compute_add_pending(struct ggml_compute_pending * pending, const struct ggml_tensor * node) {
+    if (ggml_graph_compute_node_is_empty(node)) {
+        return;
+    }
+
+    const int64_t wstride = ggml_graph_compute_node_wstride(node);
+    if (wstride != 0) {
+        pending->wstride = wstride;
+    }
+
+    pending->nodes[pending->n_nodes++] = node;
+}
+
+// operator fusion
+//
+// sequences of nodes that are only connected through single-use intermediate results are computed by a single kernel,
+// so that the intermediate rows do not make a round trip through memory:
+//   - RMS_NORM + MUL
+//   - ADD + RMS_NORM (+ MUL), the sum is still written since it is usually also the residual
+//   - UNARY (SILU, GELU) + MUL
+// can be disabled with the GGML_CPU_DISABLE_FUSION environment variable
+
+static bool ggml_cpu_disable_fusion = false;
+
+static bool ggml_graph_compute_is_f32_rows(const struct ggml_tensor * t) {
+    return t->type == GGML_TYPE_F32 && t->nb[0] == sizeof(float);
+}
+
+static bool ggml_graph_compute_can_fuse_rms_norm_mul(const struct ggml_cgraph * cgraph, int node_n) {
+    static const enum ggml_op ops[] = { GGML_OP_RMS_NORM, GGML_OP_MUL };
+
+    if (!ggml_can_fuse(cgraph, node_n, ops, 2)) {
+        return false;
+    }
+
+    const struct ggml_tensor * norm = cgraph->nodes[node_n];
+    const struct ggml_tensor * mul  = cgraph->nodes[node_n + 1];
+    const struct ggml_tensor * w    = mul->src[0] == norm ? mul->src[1] : mul->src[0];
+
+    // the normalized rows cannot be broadcast, only the weight can
+    return ggml_graph_compute_is_f32_rows(norm->src[0]) && ggml_graph_compute_is_f32_rows(mul) &&
+           ggml_graph_compute_is_f32_rows(w) && ggml_are_same_shape(norm, mul) &&
+           ggml_can_repeat(w, norm) && w->ne[0] == norm->ne[0];
+}
+
+// returns the number of nodes computed together with node_n (including itself)
+static int ggml_graph_compute_n_fused(const struct ggml_cgraph * cgraph, int node_n) {
+    if (ggml_cpu_disable_fusion || node_n + 1 >= cgraph->n_nodes) {
+        return 1;
+    }
+
+    const struct ggml_tensor * node = cgraph->nodes[node_n];
+    const struct ggml_tensor * next = cgraph->nodes[node_n + 1];
+
+    switch (node->op) {
+        case GGML_OP_RMS_NORM:
+            {
+                if (ggml_graph_compute_can_fuse_rms_norm_mul(cgraph, node_n)) {
+                    return 2;
+                }
+            } break;
+        case GGML_OP_ADD:
+            {
+                // the sum may have other uses, it is written anyway
+                if (next->op == GGML_OP_RMS_NORM && next->src[0] == node && node->view_src == NULL &&
+                    ggml_graph_compute_is_f32_rows(node) && ggml_graph_compute_is_f32_rows(next) &&
+                    ggml_graph_compute_is_f32_rows(node->src[0]) && ggml_are_same_shape(node->src[0], node) &&
+                    ggml_graph_compute_is_f32_rows(node->src[1]) && ggml_are_same_shape(node->src[1], node)) {
+                    return ggml_graph_compute_can_fuse_rms_norm_mul(cgraph, node_n + 1) ? 3 : 2;
+                }
+            } break;
+        case GGML_OP_UNARY:
+            {
+                static const enum ggml_op ops[] = { GGML_OP_UNARY, GGML_OP_MUL };
+
+                const enum ggml_unary_op uop = ggml_get_unary_op(node);
+
+                if ((uop == GGML_UNARY_OP_SILU || uop == GGML_UNARY_OP_GELU) && ggml_can_fuse(cgraph, node_n, ops, 2)) {
+                    const struct ggml_tensor * g = next->src[0] == node ? next->src[1] : next->src[0];
+
+                    if (node->src[0]->type == GGML_TYPE_F32 && next->type == GGML_TYPE_F32 && g->type == GGML_TYPE_F32 &&
+                        ggml_are_same_shape(g, next) && ggml_are_same_shape(node->src[0], next) &&
+                        ggml_is_contiguous_1(node->src[0]) && ggml_is_contiguous_1(g) && ggml_is_contiguous_1(next)) {
+                        return 2;
+                    }
+                }
+            } break;
+        default:
+            break;
+    }
+
+    return 1;
+}
+
+static void ggml_graph_compute_forward_fused(struct ggml_compute_params * params, const struct ggml_cgraph * cgraph, int node_n, int n_fused) {
+    struct ggml_tensor * node = cgraph->nodes[node_n];
+
+    if (n_fused == 1) {
+        ggml_compute_forward(params, node);
+        return;
+    }
+
+    switch (node->op) {
+        case GGML_OP_RMS_NORM:
+            {
+                ggml_compute_forward_rms_norm_mul(params, node, cgraph->nodes[node_n + 1]);
+            } break;
+        case GGML_OP_ADD:
+            {
+                ggml_compute_forward_add_rms_norm(params, node, cgraph->nodes[node_n + 1], n_fused == 3 ? cgraph->nodes[node_n + 2] : NULL);
+            } break;
+        case GGML_OP_UNARY:
+            {
+                ggml_compute_forward_unary_mul(params, node, cgraph->nodes[node_n + 1]);
+            } break;
+        default:
+            GGML_ABORT("fatal error");
+    }
+}
+
 static thread_ret_t ggml_graph_compute_thread(void * data) {
     struct ggml_compute_state * state = (struct ggml_compute_state *) data;
     struct ggml_threadpool    * tp    = state->threadpool;
@@ -2840,19 +3090,37 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
         /*.threadpool=*/ tp,
     };
 
-    for (int node_n = 0; node_n < cgraph->n_nodes && atomic_load_explicit(&tp->abort, memory_order_relaxed) != node_n; node_n++) {
-        struct ggml_tensor * node = cgraph->nodes[node_n];
+    struct ggml_compute_pending pending = { /*.nodes =*/ { NULL }, /*.n_nodes =*/ 0, /*.wstride =*/ 0 };
+
+    int n_fused = ggml_graph_compute_n_fused(cgraph, 0);
 
-        ggml_compute_forward(&params, node);
+    for (int node_n = 0; node_n < cgraph->n_nodes && atomic_load_explicit(&tp->abort, memory_order_relaxed) != node_n; ) {
+        ggml_graph_compute_forward_fused(&params, cgraph, node_n, n_fused);
 
+        for (int i = 0; i < n_fused; i++) {
+            ggml_graph_compute_add_pending(&pending, cgraph->nodes[node_n + i]);
+        }
+
+        node_n += n_fused;
+
+        n_fused = node_n < cgraph->n_nodes ? ggml_graph_compute_n_fused(cgraph, node_n) : 0;
+
+        if (node_n < cgraph->n_nodes && !ggml_graph_compute_need_barrier(&pending, cgraph, node_n, n_fused)) {
+            continue;
+        }
+
+        // abort only at barriers, so that no thread is ahead of the node where the computation stops
         if (state->ith == 0 && cplan->abort_callback &&
                 cplan->abort_callback(cplan->abort_callback_data)) {
-            atomic_store_explicit(&tp->abort, node_n + 1, memory_order_relaxed);
+            atomic_store_explicit(&tp->abort, node_n, memory_order_relaxed);
             tp->ec    = GGML_STATUS_ABORTED;
         }
 
-        if (node_n + 1 < cgraph->n_nodes) {
+        if (node_n < cgraph->n_nodes) {
             ggml_barrier(state->threadpool);
+
+            pending.n_nodes = 0;
+            pending.wstride = 0;
         }
     }
 
@@ -3509,6 +3777,8 @@ void ggml_cpu_init(void) {
     static bool is_first_call = true;
 
     if (is_first_call) {
+        ggml_cpu_disable_fusion = getenv("GGML_CPU_DISABLE_FUSION") != NULL;
+
         // initialize GELU, Quick GELU, SILU and EXP F32 tables
         {
             const uint64_t t_start = ggml_time_us(); UNUSED(t_start);
@@ -3473,6 +3473,67 @@ static void ggml_compute_forward_geglu(
 
 // ggml_compute_forward_swiglu
 
+// fused UNARY (SILU, GELU) + MUL: dst = act(x)*g, i.e. a gated linear unit built from separate ops
+
+static void ggml_compute_forward_unary_mul_f32(
+        const ggml_compute_params * params,
+        const ggml_tensor * act,
+        ggml_tensor * dst) {
+
+    const ggml_tensor * src0 = act->src[0];
+    const ggml_tensor * src1 = dst->src[0] == act ? dst->src[1] : dst->src[0];
+
+    GGML_ASSERT(ggml_is_contiguous_1(src0));
+    GGML_ASSERT(ggml_is_contiguous_1(src1));
+    GGML_ASSERT(ggml_is_contiguous_1(dst));
+    GGML_ASSERT(ggml_are_same_shape(src0, dst) && ggml_are_same_shape(src1, dst));
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int nc = dst->ne[0];
+    const int nr = ggml_nrows(dst);
+
+    // rows per thread
+    const int dr = (nr + nth - 1)/nth;
+
+    // row range for this thread
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, nr);
+
+    const ggml_unary_op op = ggml_get_unary_op(act);
+
+    for (int i1 = ir0; i1 < ir1; i1++) {
+        float * y = (float *) ((char *)  dst->data + i1*( dst->nb[1]));
+        float * x = (float *) ((char *) src0->data + i1*(src0->nb[1]));
+        float * g = (float *) ((char *) src1->data + i1*(src1->nb[1]));
+
+        switch (op) {
+            case GGML_UNARY_OP_SILU: ggml_vec_swiglu_f32(nc, y, x, g); break;
+            case GGML_UNARY_OP_GELU: ggml_vec_geglu_f32 (nc, y, x, g); break;
+            default:
+                GGML_ABORT("fatal error");
+        }
+    }
+}
+
+void ggml_compute_forward_unary_mul(
+        const ggml_compute_params * params,
+        const ggml_tensor * act,
+        ggml_tensor * dst) {
+
+    switch (act->src[0]->type) {
+        case GGML_TYPE_F32:
+            {
+                ggml_compute_forward_unary_mul_f32(params, act, dst);
+            } break;
+        default:
+            {
+                GGML_ABORT("fatal error");
+            }
+    }
+}
+
 static void ggml_compute_forward_swiglu_f32(
         const ggml_compute_params * params,
         ggml_tensor * dst) {
@@ -4039,6 +4100,163 @@ void ggml_compute_forward_rms_norm(
     }
 }
 
+// fused RMS_NORM + MUL: dst = rms_norm(x)*w, without writing the normalized rows to memory
+
+static void ggml_compute_forward_rms_norm_mul_f32(
+        const ggml_compute_params * params,
+        const ggml_tensor * norm,
+        ggml_tensor * dst) {
+
+    const ggml_tensor * src0 = norm->src[0];
+    const ggml_tensor * src1 = dst->src[0] == norm ? dst->src[1] : dst->src[0];
+
+    GGML_ASSERT(ggml_are_same_shape(src0, dst));
+    GGML_ASSERT(ggml_can_repeat(src1, dst) && src1->ne[0] == dst->ne[0]);
+
+    GGML_ASSERT(src0->nb[0] == sizeof(float));
+    GGML_ASSERT(src1->nb[0] == sizeof(float));
+    GGML_ASSERT( dst->nb[0] == sizeof(float));
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    GGML_TENSOR_BINARY_OP_LOCALS
+
+    float eps;
+    memcpy(&eps, norm->op_params, sizeof(float));
+
+    GGML_ASSERT(eps >= 0.0f);
+
+    for (int64_t i03 = 0; i03 < ne03; i03++) {
+        for (int64_t i02 = 0; i02 < ne02; i02++) {
+            for (int64_t i01 = ith; i01 < ne01; i01 += nth) {
+                const float * x = (float *) ((char *) src0->data + i01*nb01 + i02*nb02 + i03*nb03);
+                const float * w = (float *) ((char *) src1->data + (i01 % ne11)*nb11 + (i02 % ne12)*nb12 + (i03 % ne13)*nb13);
+
+                ggml_float sum = 0.0;
+                for (int64_t i00 = 0; i00 < ne00; i00++) {
+                    sum += (ggml_float)(x[i00] * x[i00]);
+                }
+
+                const float mean = sum/ne00;
+
+                const float scale = 1.0f/sqrtf(mean + eps);
+
+                float * y = (float *) ((char *) dst->data + i01*nb1 + i02*nb2 + i03*nb3);
+
+                for (int64_t i00 = 0; i00 < ne00; i00++) {
+                    y[i00] = (x[i00]*scale)*w[i00];
+                }
+            }
+        }
+    }
+}
+
+void ggml_compute_forward_rms_norm_mul(
+        const ggml_compute_params * params,
+        const ggml_tensor * norm,
+        ggml_tensor * dst) {
+
+    switch (norm->src[0]->type) {
+        case GGML_TYPE_F32:
+            {
+                ggml_compute_forward_rms_norm_mul_f32(params, norm, dst);
+            } break;
+        default:
+            {
+                GGML_ABORT("fatal error");
+            }
+    }
+}
+
+// fused ADD + RMS_NORM (+ MUL): the sum is still written, since it is usually also used as the residual,
+// but the rows are normalized while they are still in cache
+
+static void ggml_compute_forward_add_rms_norm_f32(
+        const ggml_compute_params * params,
+        ggml_tensor * add,
+        ggml_tensor * norm,
+        ggml_tensor * mul) {
+
+    const ggml_tensor * src0 = add->src[0];
+    const ggml_tensor * src1 = add->src[1];
+    const ggml_tensor * w    = mul ? (mul->src[0] == norm ? mul->src[1] : mul->src[0]) : nullptr;
+
+    ggml_tensor * dst = mul ? mul : norm;
+
+    GGML_ASSERT(ggml_are_same_shape(src0, add) && ggml_are_same_shape(src1, add) && ggml_are_same_shape(add, dst));
+    GGML_ASSERT(!w || (ggml_can_repeat(w, dst) && w->ne[0] == dst->ne[0] && w->nb[0] == sizeof(float)));
+
+    GGML_ASSERT(src0->nb[0] == sizeof(float));
+    GGML_ASSERT(src1->nb[0] == sizeof(float));
+    GGML_ASSERT( add->nb[0] == sizeof(float));
+    GGML_ASSERT( dst->nb[0] == sizeof(float));
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    GGML_TENSOR_BINARY_OP_LOCALS
+
+    float eps;
+    memcpy(&eps, norm->op_params, sizeof(float));
+
+    GGML_ASSERT(eps >= 0.0f);
+
+    for (int64_t i03 = 0; i03 < ne03; i03++) {
+        for (int64_t i02 = 0; i02 < ne02; i02++) {
+            for (int64_t i01 = ith; i01 < ne01; i01 += nth) {
+                const float * x0 = (float *) ((char *) src0->data + i01*nb01 + i02*nb02 + i03*nb03);
+                const float * x1 = (float *) ((char *) src1->data + i01*nb11 + i02*nb12 + i03*nb13);
+
+                float * z = (float *) ((char *) add->data + i01*add->nb[1] + i02*add->nb[2] + i03*add->nb[3]);
+
+                ggml_vec_add_f32(ne00, z, x0, x1);
+
+                ggml_float sum = 0.0;
+                for (int64_t i00 = 0; i00 < ne00; i00++) {
+                    sum += (ggml_float)(z[i00] * z[i00]);
+                }
+
+                const float mean = sum/ne00;
+
+                const float scale = 1.0f/sqrtf(mean + eps);
+
+                float * y = (float *) ((char *) dst->data + i01*nb1 + i02*nb2 + i03*nb3);
+
+                if (w) {
+                    const float * wr = (float *) ((char *) w->data + (i01 % w->ne[1])*w->nb[1] + (i02 % w->ne[2])*w->nb[2] + (i03 % w->ne[3])*w->nb[3]);
+
+                    for (int64_t i00 = 0; i00 < ne00; i00++) {
+                        y[i00] = (z[i00]*scale)*wr[i00];
+                    }
+                } else {
+                    for (int64_t i00 = 0; i00 < ne00; i00++) {
+                        y[i00] = z[i00]*scale;
+                    }
+                }
+            }
+        }
+    }
+}
+
+void ggml_compute_forward_add_rms_norm(
+        const ggml_compute_params * params,
+        ggml_tensor * add,
+        ggml_tensor * norm,
+        ggml_tensor * mul) {
+
+    switch (add->type) {
+        case GGML_TYPE_F32:
+            {
+                ggml_compute_forward_add_rms_norm_f32(params, add, norm, mul);
+            } break;
+        default:
+            {
+                GGML_ABORT("fatal error");
+            }
+    }
+}
+
 static void ggml_compute_forward_rms_norm_back_f32(
         const ggml_compute_params * params,
         ggml_tensor * dst) {
@@ -8191,6 +8409,346 @@ static void ggml_compute_forward_flash_attn_ext_f16(
     }
 }
 
+// tiled variant: each thread processes blocks of up to GGML_FA_TILE_Q query rows of the same head against
+// tiles of GGML_FA_TILE_KV K/V rows, so that every K/V row is loaded and converted once per query block
+// instead of once per query row
+//
+// when there are fewer query blocks than threads (decode), the KV sequence is also split into slices that are
+// reduced by different threads, and the partial softmax results are merged at the end (flash-decoding)
+static void ggml_compute_forward_flash_attn_ext_f16_tiled(
+        const ggml_compute_params * params,
+        const ggml_tensor * q,
+        const ggml_tensor * k,
+        const ggml_tensor * v,
+        const ggml_tensor * mask,
+        ggml_tensor * dst) {
+
+    GGML_TENSOR_LOCALS(int64_t, neq, q,   ne)
+    GGML_TENSOR_LOCALS(size_t,  nbq, q,   nb)
+    GGML_TENSOR_LOCALS(int64_t, nek, k,   ne)
+    GGML_TENSOR_LOCALS(size_t,  nbk, k,   nb)
+    GGML_TENSOR_LOCALS(int64_t, nev, v,   ne)
+    GGML_TENSOR_LOCALS(size_t,  nbv, v,   nb)
+    GGML_TENSOR_LOCALS(int64_t, ne,  dst, ne)
+    GGML_TENSOR_LOCALS(size_t,  nb,  dst, nb)
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int64_t DK = nek0;
+    const int64_t DV = nev0;
+    const int64_t N  = neq1;
+
+    GGML_ASSERT(ne0 == DV);
+    GGML_ASSERT(ne2 == N);
+
+    // input tensor rows must be contiguous
+    GGML_ASSERT(nbq0 == ggml_type_size(q->type));
+    GGML_ASSERT(nbk0 == ggml_type_size(k->type));
+    GGML_ASSERT(nbv0 == ggml_type_size(v->type));
+
+    GGML_ASSERT(neq0 == DK);
+    GGML_ASSERT(nek0 == DK);
+    GGML_ASSERT(nev0 == DV);
+
+    // dst cannot be transposed or permuted
+    GGML_ASSERT(nb0 == sizeof(float));
+    GGML_ASSERT(nb0 <= nb1);
+    GGML_ASSERT(nb1 <= nb2);
+    GGML_ASSERT(nb2 <= nb3);
+
+    // broadcast factors
+    const int64_t rk2 = neq2/nek2;
+    const int64_t rk3 = neq3/nek3;
+
+    const int64_t rv2 = neq2/nev2;
+    const int64_t rv3 = neq3/nev3;
+
+    float scale         = 1.0f;
+    float max_bias      = 0.0f;
+    float logit_softcap = 0.0f;
+
+    memcpy(&scale,         (float *) dst->op_params + 0, sizeof(float));
+    memcpy(&max_bias,      (float *) dst->op_params + 1, sizeof(float));
+    memcpy(&logit_softcap, (float *) dst->op_params + 2, sizeof(float));
+
+    if (logit_softcap != 0) {
+        scale /= logit_softcap;
+    }
+
+    const uint32_t n_head      = neq2;
+    const uint32_t n_head_log2 = 1u << (uint32_t) floor(log2(n_head));
+
+    const float m0 = powf(2.0f, -(max_bias       ) / n_head_log2);
+    const float m1 = powf(2.0f, -(max_bias / 2.0f) / n_head_log2);
+
+    ggml_type         const k_vec_dot_type = ggml_get_type_traits_cpu(k->type)->vec_dot_type;
+    ggml_from_float_t const q_to_vec_dot   = ggml_get_type_traits_cpu(k_vec_dot_type)->from_float;
+    ggml_vec_dot_t    const kq_vec_dot     = ggml_get_type_traits_cpu(k->type)->vec_dot;
+    ggml_to_float_t   const v_to_float     = ggml_get_type_traits(v->type)->to_float;
+
+    GGML_ASSERT((                            q_to_vec_dot) && "fattn: unsupported K-type");
+    GGML_ASSERT((v->type == GGML_TYPE_F32 || v_to_float  ) && "fattn: unsupported V-type");
+
+    const int64_t TQ  = GGML_FA_TILE_Q;
+    const int64_t TKV = GGML_FA_TILE_KV;
+
+    const size_t q_row_size = ggml_row_size(k_vec_dot_type, DK);
+
+    // per-thread work buffers, see ggml_graph_plan
+    float * Q_q   = (float *) params->wdata + ith*(TQ*(DK + TKV + DV + 2) + TKV*DV + CACHE_LINE_SIZE_F32);
+    float * KQ    = Q_q   + TQ*DK;  // [TQ][TKV] KQ values of the current tile
+    float * VKQ32 = KQ    + TQ*TKV; // [TQ][DV]  FP32 VKQ accumulators
+    float * V32   = VKQ32 + TQ*DV;  // [TKV][DV] current V tile converted to FP32
+    float * M     = V32   + TKV*DV; // [TQ]      maximum KQ value per query
+    float * S     = M     + TQ;     // [TQ]      sum per query
+
+    // parallelize over blocks of query rows that share a head and slices of the KV sequence, interleaved between
+    // threads so that causally masked blocks (which get cheaper towards the start of the sequence) are spread evenly
+    const int64_t nbq = (N + TQ - 1)/TQ;
+    const int64_t nb_total = nbq*neq2*neq3;
+
+    const int64_t n_split = ggml_compute_forward_flash_attn_ext_n_kv_split(dst, nth);
+
+    // KV rows per slice, rounded up to whole tiles
+    const int64_t n_kv_split = GGML_PAD((nek1 + n_split - 1)/n_split, TKV);
+
+    // partial results of the slices: [nb_total][n_split][TQ][DV + 2] (VKQ, M, S), after the per-thread buffers
+    float * part = (float *) params->wdata + nth*(TQ*(DK + TKV + DV + 2) + TKV*DV + CACHE_LINE_SIZE_F32);
+
+    for (int64_t it = ith; it < nb_total*n_split; it += nth) {
+        const int64_t ib = it/n_split;
+        const int64_t is = it%n_split;
+
+        // q indices
+        const int64_t iq3 = ib/(neq2*nbq);
+        const int64_t iq2 = (ib - iq3*neq2*nbq)/nbq;
+        const int64_t iq1_0 = (ib - iq3*neq2*nbq - iq2*nbq)*TQ;
+        const int64_t nq = MIN(TQ, N - iq1_0);
+
+        const uint32_t h = iq2; // head index
+        const float slope = (max_bias > 0.0f) ? h < n_head_log2 ? powf(m0, h + 1) : powf(m1, 2*(h - n_head_log2) + 1) : 1.0f;
+
+        // k indices
+        const int64_t ik3 = iq3 / rk3;
+        const int64_t ik2 = iq2 / rk2;
+
+        // v indices
+        const int64_t iv3 = iq3 / rv3;
+        const int64_t iv2 = iq2 / rv2;
+
+        for (int64_t iq = 0; iq < nq; ++iq) {
+            const float * pq = (const float *) ((char *) q->data + ((iq1_0 + iq)*nbq1 + iq2*nbq2 + iq3*nbq3));
+            q_to_vec_dot(pq, (char *) Q_q + iq*q_row_size, DK);
+
+            M[iq] = -INFINITY;
+            S[iq] = 0.0f;
+        }
+
+        memset(VKQ32, 0, nq*DV*sizeof(float));
+
+        const ggml_fp16_t * mp = mask ? (ggml_fp16_t *)((char *) mask->data + iq1_0*mask->nb[1] + (iq2%mask->ne[2])*mask->nb[2] + (iq3%mask->ne[3])*mask->nb[3]) : NULL;
+
+        // online softmax / attention, one K/V tile at a time
+        // ref: https://arxiv.org/pdf/2112.05682.pdf
+        const int64_t ic_start = is*n_kv_split;
+        const int64_t ic_end   = MIN(ic_start + n_kv_split, nek1);
+
+        for (int64_t ic0 = ic_start; ic0 < ic_end; ic0 += TKV) {
+            const int64_t nkv = MIN(TKV, ic_end - ic0);
+
+            // KQ = K*Q for the tile, masked entries are -INFINITY
+            bool any = false;
+
+            for (int64_t iq = 0; iq < nq; ++iq) {
+                const ggml_fp16_t * mpq = mp ? (const ggml_fp16_t *) ((const char *) mp + iq*mask->nb[1]) + ic0 : NULL;
+
+                float * kq = KQ + iq*TKV;
+
+                for (int64_t ic = 0; ic < nkv; ++ic) {
+                    const float mv = mpq ? slope*GGML_CPU_FP16_TO_FP32(mpq[ic]) : 0.0f;
+                    if (mv == -INFINITY) {
+                        kq[ic] = -INFINITY;
+                        continue;
+                    }
+
+                    float s; // KQ value
+
+                    const char * k_data = (const char *) k->data + ((ic0 + ic)*nbk1 + ik2*nbk2 + ik3*nbk3);
+                    kq_vec_dot(DK, &s, 0, k_data, 0, (const char *) Q_q + iq*q_row_size, 0, 1);
+
+                    s = s*scale; // scale KQ value
+
+                    if (logit_softcap != 0.0f) {
+                        s = logit_softcap*tanhf(s);
+                    }
+
+                    kq[ic] = s + mv; // apply mask
+
+                    any = true;
+                }
+            }
+
+            if (!any) {
+                // the whole tile is masked for all queries of the block
+                continue;
+            }
+
+            // convert the V tile once for all queries of the block
+            const float * v32 = V32;
+            int64_t v32_stride = DV;
+
+            if (v->type == GGML_TYPE_F32) {
+                // V is F32, use it in place
+                v32 = (const float *) ((const char *) v->data + (ic0*nbv1 + iv2*nbv2 + iv3*nbv3));
+                v32_stride = nbv1/sizeof(float);
+            } else {
+                for (int64_t ic = 0; ic < nkv; ++ic) {
+                    const char * v_data = (const char *) v->data + ((ic0 + ic)*nbv1 + iv2*nbv2 + iv3*nbv3);
+                    if (v->type == GGML_TYPE_F16) {
+                        ggml_cpu_fp16_to_fp32((const ggml_fp16_t *) v_data, V32 + ic*DV, DV);
+                    } else {
+                        v_to_float(v_data, V32 + ic*DV, DV);
+                    }
+                }
+            }
+
+            for (int64_t iq = 0; iq < nq; ++iq) {
+                float * kq = KQ + iq*TKV;
+
+                float Mt = -INFINITY;
+                ggml_vec_max_f32(nkv, &Mt, kq);
+
+                if (Mt == -INFINITY) {
+                    continue;
+                }
+
+                float * vkq = VKQ32 + iq*DV;
+
+                const float Mold = M[iq];
+
+                if (Mt > Mold) {
+                    // new maximum, scale VKQ and KQ sum with expf(Mold - M)
+                    M[iq] = Mt;
+
+                    const float ms = expf(Mold - Mt);
+
+                    ggml_vec_scale_f32(DV, vkq, ms);
+                    S[iq] *= ms;
+                }
+
+                // kq = expf(kq - M)
+                S[iq] += (float) ggml_vec_soft_max_f32(nkv, kq, kq, M[iq]);
+
+                // V += v*expf(s - M)
+                for (int64_t ic = 0; ic < nkv; ++ic) {
+                    if (kq[ic] != 0.0f) {
+                        ggml_vec_mad_f32(DV, vkq, v32 + ic*v32_stride, kq[ic]);
+                    }
+                }
+            }
+        }
+
+        if (n_split > 1) {
+            // store the unnormalized partial result of the slice, it is merged with the others below
+            for (int64_t iq = 0; iq < nq; ++iq) {
+                float * pp = part + (it*TQ + iq)*(DV + 2);
+
+                memcpy(pp, VKQ32 + iq*DV, DV*sizeof(float));
+                pp[DV + 0] = M[iq];
+                pp[DV + 1] = S[iq];
+            }
+            continue;
+        }
+
+        for (int64_t iq = 0; iq < nq; ++iq) {
+            float * vkq = VKQ32 + iq*DV;
+
+            // V /= S
+            const float S_inv = 1.0f/S[iq];
+            ggml_vec_scale_f32(DV, vkq, S_inv);
+
+            // dst indices
+            const int64_t i1 = iq1_0 + iq;
+            const int64_t i2 = iq2;
+            const int64_t i3 = iq3;
+
+            // permute(0, 2, 1, 3)
+            memcpy((char *) dst->data + (i3*ne2*ne1 + i2 + i1*ne1)*nb1, vkq, nb1);
+        }
+    }
+
+    if (n_split == 1) {
+        return;
+    }
+
+    ggml_barrier(params->threadpool);
+
+    // merge the partial results of the slices, one query row per thread
+    for (int64_t ir = ith; ir < nb_total*TQ; ir += nth) {
+        const int64_t ib = ir/TQ;
+        const int64_t iq = ir%TQ;
+
+        const int64_t iq3 = ib/(neq2*nbq);
+        const int64_t iq2 = (ib - iq3*neq2*nbq)/nbq;
+        const int64_t iq1 = (ib - iq3*neq2*nbq - iq2*nbq)*TQ + iq;
+
+        if (iq1 >= N) {
+            continue;
+        }
+
+        float Mr = -INFINITY;
+        for (int64_t is = 0; is < n_split; ++is) {
+            Mr = MAX(Mr, part[((ib*n_split + is)*TQ + iq)*(DV + 2) + DV]);
+        }
+
+        float * vkq = VKQ32;
+        memset(vkq, 0, DV*sizeof(float));
+
+        float Sr = 0.0f;
+        for (int64_t is = 0; is < n_split; ++is) {
+            const float * pp = part + ((ib*n_split + is)*TQ + iq)*(DV + 2);
+            if (pp[DV + 0] == -INFINITY) {
+                // the whole slice is masked
+                continue;
+            }
+
+            const float ms = expf(pp[DV + 0] - Mr);
+
+            ggml_vec_mad_f32(DV, vkq, pp, ms);
+            Sr += pp[DV + 1]*ms;
+        }
+
+        // V /= S
+        ggml_vec_scale_f32(DV, vkq, 1.0f/Sr);
+
+        // permute(0, 2, 1, 3)
+        memcpy((char *) dst->data + (iq3*ne2*ne1 + iq2 + iq1*ne1)*nb1, vkq, nb1);
+    }
+}
+
+int64_t ggml_compute_forward_flash_attn_ext_n_kv_split(const ggml_tensor * dst, int nth) {
+    const ggml_tensor * q = dst->src[0];
+    const ggml_tensor * k = dst->src[1];
+
+    const int64_t n_blocks = ((q->ne[1] + GGML_FA_TILE_Q - 1)/GGML_FA_TILE_Q)*q->ne[2]*q->ne[3];
+    if (n_blocks >= nth) {
+        return 1;
+    }
+
+    // smallest split that keeps all threads busy, or a slightly larger one that divides the work evenly
+    int64_t n_split = (nth + n_blocks - 1)/n_blocks;
+    for (int64_t s = n_split; s*n_blocks <= 2*nth; ++s) {
+        if ((s*n_blocks) % nth == 0) {
+            n_split = s;
+            break;
+        }
+    }
+
+    // the slices must be long enough to amortize the merge
+    return MAX(1, MIN(n_split, k->ne[1]/GGML_FA_SPLIT_KV_MIN));
+}
+
 void ggml_compute_forward_flash_attn_ext(
         const ggml_compute_params * params,
         const ggml_tensor * q,
@@ -8203,7 +8761,11 @@ void ggml_compute_forward_flash_attn_ext(
         case GGML_PREC_F32:
             {
                 // uses F32 accumulators
-                ggml_compute_forward_flash_attn_ext_f16(params, q, k, v, mask, dst);
+                if (q->ne[1] > 1 || ggml_compute_forward_flash_attn_ext_n_kv_split(dst, params->nth) > 1) {
+                    ggml_compute_forward_flash_attn_ext_f16_tiled(params, q, k, v, mask, dst);
+                } else {
+                    ggml_compute_forward_flash_attn_ext_f16(params, q, k, v, mask, dst);
+                }
             } break;
         default:
             {
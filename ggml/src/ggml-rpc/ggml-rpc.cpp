@@ -3,11 +3,19 @@
 #include "ggml-backend-impl.h"
 #include "ggml-cpp.h"
 
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <cinttypes>
+#include <condition_variable>
+#include <deque>
 #include <string>
+#include <thread>
 #include <vector>
+#include <map>
 #include <memory>
 #include <mutex>
+#include <random>
 #include <unordered_map>
 #include <unordered_set>
 #ifdef _WIN32
@@ -26,6 +34,14 @@
 #  include <netdb.h>
 #  include <unistd.h>
 #endif
+#ifdef __linux__
+#  include <fcntl.h>
+#  include <poll.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <sys/un.h>
+#  define RPC_SHM_SUPPORTED
+#endif
 #include <cstring>
 #include <fstream>
 #include <filesystem>
@@ -39,9 +55,74 @@ using ssize_t = __int64;
 typedef int sockfd_t;
 #endif
 
+// a response to a pipelined command, to be received into output
+struct rpc_pending_rsp {
+    void * output;
+    size_t output_size;
+    // RPC_CMD_GET_TENSOR_ENCODED: the response is decoded into output, see rpc_decode()
+    bool encoded;
+    ggml_type type;
+    size_t offset;
+    // RPC_CMD_EVENT_RECORD: the response is the status of the graphs computed before it, see socket_t::compute_status
+    bool event;
+};
+
+// a graph that the server keeps deserialized, see RPC_CMD_GRAPH_RECOMPUTE
+struct rpc_cached_graph {
+    uint64_t id;                // hash of the graph topology
+    std::vector<uint8_t> graph; // the graph as last sent, in the serialize_graph() format
+};
+
+// shared memory between a client and a server on the same host, see RPC_CMD_SHM_ATTACH
+// there is a ring buffer for each direction: the large messages are written to the ring and only their position
+// goes through the socket, the consumer releases them in order by advancing the tail of the ring
+struct rpc_shm_header {
+    std::atomic<uint64_t> tail[2];
+};
+
+struct rpc_shm {
+    int fd = -1;
+    uint8_t * base = nullptr;   // | rpc_shm_header | ring 0 (client to server) | ring 1 (server to client) |
+    size_t ring_size = 0;
+    int ring_send = 0;          // the ring produced by this side, the other one is consumed
+    uint64_t head = 0;          // next write position in ring_send
+
+    ~rpc_shm() {
+#ifdef RPC_SHM_SUPPORTED
+        if (base != nullptr) {
+            munmap(base, size());
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+#endif
+    }
+    size_t size() const { return SHM_HEADER_SIZE + 2*ring_size; }
+    rpc_shm_header * header() { return (rpc_shm_header *)base; }
+    uint8_t * ring(int i) { return base + SHM_HEADER_SIZE + i*ring_size; }
+
+    static const size_t SHM_HEADER_SIZE = 4096;
+};
+
 // cross-platform socket
 struct socket_t {
     sockfd_t fd;
+
+    // client side: the responses of the pipelined commands that have not been received yet, in order
+    std::deque<rpc_pending_rsp> pending;
+    // client side: number of pipelined commands sent and of their responses received, used as event sequence numbers
+    uint64_t n_pending_sent = 0;
+    uint64_t n_pending_recv = 0;
+    // client side: the first failure of the graphs computed on the server that has not been returned by graph_compute yet
+    ggml_status compute_status = GGML_STATUS_SUCCESS;
+    // client side: mirror of the server's graph cache, oldest first
+    std::deque<rpc_cached_graph> graphs;
+    // client side: the encodings of the tensor data negotiated with RPC_CMD_HELLO, as a mask of (1 << rpc_encoding)
+    uint32_t encodings = 0;
+    std::vector<uint8_t> recv_buf;
+    // client side: shared memory with the server, for the shm:// endpoints
+    std::unique_ptr<rpc_shm> shm;
+
     socket_t(sockfd_t fd) : fd(fd) {}
     ~socket_t() {
         GGML_PRINT_DEBUG("[%s] closing socket %d\n", __func__, this->fd);
@@ -96,16 +177,75 @@ enum rpc_cmd {
     RPC_CMD_INIT_TENSOR,
     RPC_CMD_GET_ALLOC_SIZE,
     RPC_CMD_HELLO,
+    RPC_CMD_GRAPH_RECOMPUTE,
+    RPC_CMD_EVENT_RECORD,
+    RPC_CMD_SET_TENSOR_ENCODED,
+    RPC_CMD_GET_TENSOR_ENCODED,
+    RPC_CMD_SHM_ATTACH,
     RPC_CMD_COUNT,
 };
 
+// encodings of the tensor data for RPC_CMD_SET_TENSOR_ENCODED and RPC_CMD_GET_TENSOR_ENCODED
+enum rpc_encoding {
+    RPC_ENCODING_NONE = 0, // raw bytes
+    RPC_ENCODING_RLE,      // lossless: the bytes grouped by their position in the element, run-length encoded
+    RPC_ENCODING_F16,      // lossy: F32 data converted to F16
+    RPC_ENCODING_BF16,     // lossy: F32 data converted to BF16
+    RPC_ENCODING_COUNT,
+};
+
+// Number of graphs that the server keeps deserialized for RPC_CMD_GRAPH_RECOMPUTE
+// The client and the server insert and evict the graphs in the same order, so the client knows which ones are cached
+const size_t GRAPH_CACHE_SIZE = 16;
+
 // Try RPC_CMD_SET_TENSOR_HASH first when data size is larger than this threshold
 const size_t HASH_THRESHOLD = 10 * 1024 * 1024;
 
+// Encode the tensor data only when its size is at least this threshold
+const size_t ENCODE_THRESHOLD = 4 * 1024;
+
+// The server stops receiving the commands of a client while this many of them, or this many bytes, wait for execution
+const size_t REQUEST_QUEUE_SIZE  = 256;
+const size_t REQUEST_QUEUE_BYTES = 256 * 1024 * 1024;
+
+// Messages of at least this size go through the shared memory, if there is one
+const size_t SHM_THRESHOLD = 16 * 1024;
+
+// Size of each ring buffer of the shared memory, the pages are only allocated when they are used
+// This is also the largest size that the server accepts, the larger messages go through the socket
+const size_t SHM_RING_SIZE = 64 * 1024 * 1024;
+
+// Time that the server waits for the client to send the memfd of the shared memory
+const int SHM_ATTACH_TIMEOUT_MS = 5000;
+
+// The size of a message in the shared memory has this bit set, and is followed by the position of the message in the ring
+const uint64_t SHM_MSG_FLAG = 1ULL << 63;
+
+struct rpc_msg_hello_req {
+    uint32_t encodings; // the encodings that the client wants to use
+};
+
 struct rpc_msg_hello_rsp {
     uint8_t major;
     uint8_t minor;
     uint8_t patch;
+    uint32_t encodings; // the requested encodings that the server supports
+};
+
+// the server replies with the name of an abstract unix socket, the client connects to it and sends the sealed memfd of
+// the shared memory with SCM_RIGHTS, then the server replies again with the result
+struct rpc_msg_shm_attach_req {
+    uint32_t pid;       // of the client, must match the credentials of the unix socket
+    uint64_t ring_size;
+};
+
+struct rpc_msg_shm_attach_rsp {
+    uint8_t result;
+    char name[32];      // first response: the name of the unix socket, without the leading NUL
+};
+
+struct rpc_msg_event_record_rsp {
+    int32_t status; // the first failure of the graphs computed since the previous RPC_CMD_EVENT_RECORD
 };
 
 struct rpc_msg_get_alloc_size_req {
@@ -170,6 +310,22 @@ struct rpc_msg_get_tensor_req {
     uint64_t size;
 };
 
+// followed by the encoded data
+struct rpc_msg_set_tensor_encoded_req {
+    rpc_tensor tensor;
+    uint64_t offset;
+    uint64_t size;
+    uint8_t encoding;
+};
+
+// the response is | encoding (1 byte) | encoded data |, the server may fall back to RPC_ENCODING_NONE
+struct rpc_msg_get_tensor_encoded_req {
+    rpc_tensor tensor;
+    uint64_t offset;
+    uint64_t size;
+    uint8_t encoding;
+};
+
 struct rpc_msg_copy_tensor_req {
     rpc_tensor src;
     rpc_tensor dst;
@@ -179,10 +335,6 @@ struct rpc_msg_copy_tensor_rsp {
     uint8_t result;
 };
 
-struct rpc_msg_graph_compute_rsp {
-    uint8_t result;
-};
-
 struct rpc_msg_get_device_memory_rsp {
     uint64_t free_mem;
     uint64_t total_mem;
@@ -203,9 +355,47 @@ struct ggml_backend_rpc_buffer_type_context {
     size_t max_size;
 };
 
+// scratch buffer on a server, used for the matrix multiplications with row-split weights
+struct ggml_backend_rpc_scratch {
+    ggml_backend_buffer_t buffer = nullptr;
+    const ggml_tensor * src1 = nullptr; // src1 of the last matrix multiplication, if it is still in the buffer
+};
+
 struct ggml_backend_rpc_context {
     std::string endpoint;
     std::string name;
+
+    // tensor parallelism, see ggml_backend_rpc_split_mul_mat
+    std::unordered_map<std::string, ggml_backend_rpc_scratch> scratch; // by endpoint
+    std::vector<uint8_t> src1_data;
+    std::vector<std::vector<uint8_t>> dst_data; // by device
+};
+
+struct ggml_backend_rpc_device_context {
+    std::string endpoint;
+    std::string name;
+};
+
+// a buffer type that splits the rows of the matrices across the servers
+struct ggml_backend_rpc_split_buffer_type_context {
+    int main_device;
+    std::array<float, GGML_RPC_MAX_SERVERS> tensor_split; // first row of each device, as a fraction of the rows
+    std::vector<std::string> endpoints;                    // of the devices, in the order of the registry
+    std::string name;
+};
+
+// the slices of a row-split tensor, one per device
+struct ggml_backend_rpc_split_tensor_extra {
+    int64_t row_low[GGML_RPC_MAX_SERVERS];
+    int64_t row_high[GGML_RPC_MAX_SERVERS];
+    ggml_tensor slices[GGML_RPC_MAX_SERVERS];            // only valid if the device has rows
+    ggml_backend_buffer_t buffers[GGML_RPC_MAX_SERVERS];
+};
+
+// an event is a pipelined command that the server answers once the commands sent before it are done
+struct ggml_backend_rpc_event_context {
+    std::shared_ptr<socket_t> sock;
+    uint64_t seq; // sequence number of the response to wait for, 0 if the event was never recorded
 };
 
 struct ggml_backend_rpc_buffer_context {
@@ -228,6 +418,169 @@ static uint64_t fnv_hash(const uint8_t * data, size_t len) {
     return hash;
 }
 
+// Size of the elements whose bytes are grouped by RPC_ENCODING_RLE, quantized blocks are encoded as they are
+static size_t rpc_encoding_elem_size(ggml_type type, size_t size) {
+    size_t elem_size = ggml_blck_size(type) == 1 ? ggml_type_size(type) : 1;
+    return size % elem_size == 0 ? elem_size : 1;
+}
+
+// PackBits-like run-length encoding
+// control byte c < 128: c + 1 literal bytes follow, c >= 128: the next byte is repeated c - 125 times
+static void rle_encode(const uint8_t * src, size_t n, std::vector<uint8_t> & dst) {
+    size_t i = 0;
+    while (i < n) {
+        size_t run = 1;
+        while (i + run < n && run < 130 && src[i + run] == src[i]) {
+            run++;
+        }
+        if (run >= 3) {
+            dst.push_back((uint8_t)(run + 125));
+            dst.push_back(src[i]);
+            i += run;
+            continue;
+        }
+        // literals until the next run of 3 bytes
+        const size_t start = i;
+        while (i < n && i - start < 128) {
+            if (i + 2 < n && src[i] == src[i + 1] && src[i] == src[i + 2]) {
+                break;
+            }
+            i++;
+        }
+        dst.push_back((uint8_t)(i - start - 1));
+        dst.insert(dst.end(), src + start, src + i);
+    }
+}
+
+static bool rle_decode(const uint8_t * src, size_t n, uint8_t * dst, size_t dst_size) {
+    size_t i = 0;
+    size_t j = 0;
+    while (i < n) {
+        const uint8_t c = src[i++];
+        if (c < 128) {
+            const size_t len = c + 1;
+            if (len > n - i || len > dst_size - j) {
+                return false;
+            }
+            memcpy(dst + j, src + i, len);
+            i += len;
+            j += len;
+        } else {
+            const size_t len = c - 125;
+            if (i >= n || len > dst_size - j) {
+                return false;
+            }
+            memset(dst + j, src[i++], len);
+            j += len;
+        }
+    }
+    return j == dst_size;
+}
+
+// Appends size bytes of the tensor data at offset to dst with the given encoding
+// Returns the encoding used: RPC_ENCODING_NONE if the encoding does not apply to the data or does not reduce its size
+static rpc_encoding rpc_encode(rpc_encoding encoding, ggml_type type, size_t offset, const void * data, size_t size, std::vector<uint8_t> & dst) {
+    const size_t dst_size = dst.size();
+    const bool is_f32 = type == GGML_TYPE_F32 && offset % sizeof(float) == 0 && size % sizeof(float) == 0;
+    switch (encoding) {
+        case RPC_ENCODING_RLE: {
+            const size_t elem_size = rpc_encoding_elem_size(type, size);
+            const uint8_t * src = (const uint8_t *)data;
+            if (elem_size == 1) {
+                rle_encode(src, size, dst);
+            } else {
+                const size_t n = size / elem_size;
+                std::vector<uint8_t> plane(n);
+                for (size_t b = 0; b < elem_size; b++) {
+                    for (size_t i = 0; i < n; i++) {
+                        plane[i] = src[i*elem_size + b];
+                    }
+                    rle_encode(plane.data(), n, dst);
+                    if (dst.size() - dst_size >= size) {
+                        break;
+                    }
+                }
+            }
+            if (dst.size() - dst_size < size) {
+                return RPC_ENCODING_RLE;
+            }
+            dst.resize(dst_size);
+            break;
+        }
+        case RPC_ENCODING_F16: {
+            if (!is_f32) {
+                break;
+            }
+            dst.resize(dst_size + size/2);
+            ggml_fp32_to_fp16_row((const float *)data, (ggml_fp16_t *)(dst.data() + dst_size), size/sizeof(float));
+            return RPC_ENCODING_F16;
+        }
+        case RPC_ENCODING_BF16: {
+            if (!is_f32) {
+                break;
+            }
+            dst.resize(dst_size + size/2);
+            ggml_fp32_to_bf16_row((const float *)data, (ggml_bf16_t *)(dst.data() + dst_size), size/sizeof(float));
+            return RPC_ENCODING_BF16;
+        }
+        default:
+            break;
+    }
+    dst.insert(dst.end(), (const uint8_t *)data, (const uint8_t *)data + size);
+    return RPC_ENCODING_NONE;
+}
+
+// Decodes the data encoded by rpc_encode() into size bytes at dst, returns false if the data is malformed
+static bool rpc_decode(uint8_t encoding, ggml_type type, size_t offset, const uint8_t * src, size_t src_size, void * dst, size_t size) {
+    const bool is_f32 = type == GGML_TYPE_F32 && offset % sizeof(float) == 0 && size % sizeof(float) == 0;
+    switch (encoding) {
+        case RPC_ENCODING_NONE: {
+            if (src_size != size) {
+                return false;
+            }
+            if (size > 0) {
+                memcpy(dst, src, size);
+            }
+            return true;
+        }
+        case RPC_ENCODING_RLE: {
+            const size_t elem_size = rpc_encoding_elem_size(type, size);
+            if (elem_size == 1) {
+                return rle_decode(src, src_size, (uint8_t *)dst, size);
+            }
+            // the planes are encoded one after the other, decode them together and interleave
+            std::vector<uint8_t> planes(size);
+            if (!rle_decode(src, src_size, planes.data(), size)) {
+                return false;
+            }
+            const size_t n = size / elem_size;
+            uint8_t * out = (uint8_t *)dst;
+            for (size_t b = 0; b < elem_size; b++) {
+                for (size_t i = 0; i < n; i++) {
+                    out[i*elem_size + b] = planes[b*n + i];
+                }
+            }
+            return true;
+        }
+        case RPC_ENCODING_F16: {
+            if (!is_f32 || src_size != size/2) {
+                return false;
+            }
+            ggml_fp16_to_fp32_row((const ggml_fp16_t *)src, (float *)dst, size/sizeof(float));
+            return true;
+        }
+        case RPC_ENCODING_BF16: {
+            if (!is_f32 || src_size != size/2) {
+                return false;
+            }
+            ggml_bf16_to_fp32_row((const ggml_bf16_t *)src, (float *)dst, size/sizeof(float));
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
 static std::shared_ptr<socket_t> make_socket(sockfd_t fd) {
 #ifdef _WIN32
     if (fd == INVALID_SOCKET) {
@@ -376,6 +729,236 @@ static bool recv_msg(sockfd_t sockfd, std::vector<uint8_t> & input) {
     return recv_data(sockfd, input.data(), size);
 }
 
+// reserves size bytes for a message in the ring produced by this side
+// returns false if the message must go through the socket: it is small, or the consumer has not released enough space
+// (waiting for it could deadlock, as it may be waiting for this side to receive its pipelined responses)
+static bool shm_reserve(rpc_shm * shm, size_t size, uint64_t & pos) {
+    if (shm == nullptr || size < SHM_THRESHOLD || size > shm->ring_size) {
+        return false;
+    }
+    pos = shm->head;
+    if (pos % shm->ring_size + size > shm->ring_size) {
+        // the messages do not wrap around
+        pos += shm->ring_size - pos % shm->ring_size;
+    }
+    const uint64_t tail = shm->header()->tail[shm->ring_send].load(std::memory_order_acquire);
+    if (pos + size - tail > shm->ring_size) {
+        return false;
+    }
+    shm->head = pos + size;
+    return true;
+}
+
+static uint8_t * shm_send_ptr(rpc_shm * shm, uint64_t pos) {
+    return shm->ring(shm->ring_send) + pos % shm->ring_size;
+}
+
+static const uint8_t * shm_recv_ptr(rpc_shm * shm, uint64_t pos) {
+    return shm->ring(1 - shm->ring_send) + pos % shm->ring_size;
+}
+
+// releases the received messages up to end
+static void shm_release(rpc_shm * shm, uint64_t end) {
+    shm->header()->tail[1 - shm->ring_send].store(end, std::memory_order_release);
+}
+
+// sends the size and position of a message written to the shared memory
+static bool send_shm_msg(sockfd_t sockfd, size_t msg_size, uint64_t pos) {
+    const uint64_t header[2] = { msg_size | SHM_MSG_FLAG, pos };
+    return send_data(sockfd, header, sizeof(header));
+}
+
+// receives the size of the next message, pos is set to its position if it is in the shared memory, UINT64_MAX otherwise
+static bool recv_msg_size(sockfd_t sockfd, rpc_shm * shm, uint64_t & size, uint64_t & pos) {
+    pos = UINT64_MAX;
+    if (!recv_data(sockfd, &size, sizeof(size))) {
+        return false;
+    }
+    if ((size & SHM_MSG_FLAG) == 0) {
+        return true;
+    }
+    size &= ~SHM_MSG_FLAG;
+    if (shm == nullptr || !recv_data(sockfd, &pos, sizeof(pos))) {
+        return false;
+    }
+    return size <= shm->ring_size && pos % shm->ring_size + size <= shm->ring_size;
+}
+
+// receives the data of a message whose size has been received with recv_msg_size()
+static bool recv_msg_data(sockfd_t sockfd, rpc_shm * shm, uint64_t pos, void * data, size_t size) {
+    if (pos == UINT64_MAX) {
+        return recv_data(sockfd, data, size);
+    }
+    if (size > 0) {
+        memcpy(data, shm_recv_ptr(shm, pos), size);
+    }
+    shm_release(shm, pos + size);
+    return true;
+}
+
+#ifdef RPC_SHM_SUPPORTED
+// client side: creates the shared memory, the server maps it with RPC_CMD_SHM_ATTACH
+static std::unique_ptr<rpc_shm> shm_create(size_t ring_size) {
+    auto shm = std::make_unique<rpc_shm>();
+    shm->ring_size = ring_size;
+    shm->ring_send = 0;
+    shm->fd = memfd_create("ggml-rpc", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (shm->fd < 0 || ftruncate(shm->fd, shm->size()) != 0) {
+        return nullptr;
+    }
+    // the size is fixed, so that the server cannot be made to access pages past the end of the file
+    if (fcntl(shm->fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0) {
+        return nullptr;
+    }
+    void * base = mmap(nullptr, shm->size(), PROT_READ | PROT_WRITE, MAP_SHARED, shm->fd, 0);
+    if (base == MAP_FAILED) {
+        return nullptr;
+    }
+    shm->base = (uint8_t *)base;
+    new (shm->header()) rpc_shm_header{};
+    return shm;
+}
+
+static socklen_t shm_socket_addr(const char * name, struct sockaddr_un & addr) {
+    // abstract socket: no file, removed when it is closed
+    addr = {};
+    addr.sun_family = AF_UNIX;
+    const size_t len = std::min(strlen(name), sizeof(addr.sun_path) - 1);
+    memcpy(addr.sun_path + 1, name, len);
+    return offsetof(struct sockaddr_un, sun_path) + 1 + len;
+}
+
+// client side: sends the memfd to the unix socket of the server
+static bool shm_send_fd(const char * name, int fd) {
+    auto sock = make_socket(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+    if (sock == nullptr) {
+        return false;
+    }
+    struct sockaddr_un addr;
+    socklen_t addr_len = shm_socket_addr(name, addr);
+    if (connect(sock->fd, (struct sockaddr *)&addr, addr_len) != 0) {
+        return false;
+    }
+    char data = 0;
+    struct iovec iov = { &data, 1 };
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control = {};
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    return sendmsg(sock->fd, &msg, MSG_NOSIGNAL) == 1;
+}
+
+// server side: receives the memfd from the client process announced in the request
+static int shm_recv_fd(sockfd_t listen_fd, uint32_t pid) {
+    struct pollfd pfd = { listen_fd, POLLIN, 0 };
+    if (poll(&pfd, 1, SHM_ATTACH_TIMEOUT_MS) != 1) {
+        return -1;
+    }
+    auto sock = make_socket(accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC));
+    if (sock == nullptr) {
+        return -1;
+    }
+    // only the process of the client may send the memfd, the credentials are checked by the kernel
+    struct ucred cred;
+    socklen_t cred_len = sizeof(cred);
+    if (getsockopt(sock->fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) != 0 || (uint32_t) cred.pid != pid) {
+        fprintf(stderr, "Shared memory rejected: the unix socket peer is not the client process %u\n", pid);
+        return -1;
+    }
+    struct timeval timeout = { SHM_ATTACH_TIMEOUT_MS / 1000, 0 };
+    setsockopt(sock->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    char data;
+    struct iovec iov = { &data, 1 };
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control = {};
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    if (recvmsg(sock->fd, &msg, MSG_CMSG_CLOEXEC) != 1) {
+        return -1;
+    }
+    struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == nullptr || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(int))) {
+        return -1;
+    }
+    int fd;
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    if (msg.msg_flags & MSG_CTRUNC) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static bool is_loopback_peer(sockfd_t sockfd) {
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    if (getpeername(sockfd, (struct sockaddr *)&addr, &addr_len) != 0 || addr.sin_family != AF_INET) {
+        return false;
+    }
+    return (ntohl(addr.sin_addr.s_addr) >> 24) == 127;
+}
+
+// server side: maps the shared memory created by a client on the same host
+// the memfd is passed by the client process with SCM_RIGHTS, so the server only maps memory that the client owns
+static std::unique_ptr<rpc_shm> shm_attach(sockfd_t sockfd, const rpc_msg_shm_attach_req & request) {
+    rpc_msg_shm_attach_rsp response = {};
+    std::shared_ptr<socket_t> listener;
+    if (request.ring_size > 0 && request.ring_size <= SHM_RING_SIZE && is_loopback_peer(sockfd)) {
+        listener = make_socket(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+    }
+    if (listener != nullptr) {
+        std::random_device rd;
+        snprintf(response.name, sizeof(response.name), "ggml-rpc-%08x%08x", rd(), rd());
+        struct sockaddr_un addr;
+        socklen_t addr_len = shm_socket_addr(response.name, addr);
+        response.result = bind(listener->fd, (struct sockaddr *)&addr, addr_len) == 0 && listen(listener->fd, 1) == 0;
+    }
+    if (!send_msg(sockfd, &response, sizeof(response)) || !response.result) {
+        return nullptr;
+    }
+
+    auto shm = std::make_unique<rpc_shm>();
+    shm->ring_size = request.ring_size;
+    shm->ring_send = 1;
+    shm->fd = shm_recv_fd(listener->fd, request.pid);
+    listener.reset();
+
+    // a memfd that cannot be resized, the mapping is never past the end of the file
+    const int seals = shm->fd >= 0 ? fcntl(shm->fd, F_GET_SEALS) : -1;
+    struct stat st;
+    bool ok = seals >= 0 && (seals & (F_SEAL_SHRINK | F_SEAL_GROW)) == (F_SEAL_SHRINK | F_SEAL_GROW) &&
+              fstat(shm->fd, &st) == 0 && (size_t) st.st_size == shm->size();
+    if (ok) {
+        void * base = mmap(nullptr, shm->size(), PROT_READ | PROT_WRITE, MAP_SHARED, shm->fd, 0);
+        ok = base != MAP_FAILED;
+        if (ok) {
+            shm->base = (uint8_t *)base;
+        }
+    }
+    response = {};
+    response.result = ok;
+    if (!send_msg(sockfd, &response, sizeof(response)) || !ok) {
+        return nullptr;
+    }
+    return shm;
+}
+#endif
+
 static bool parse_endpoint(const std::string & endpoint, std::string & host, int & port) {
     size_t pos = endpoint.find(':');
     if (pos == std::string::npos) {
@@ -387,73 +970,267 @@ static bool parse_endpoint(const std::string & endpoint, std::string & host, int
 }
 
 // RPC request : | rpc_cmd (1 byte) | request_size (8 bytes) | request_data (request_size bytes) |
+// with shared memory, large request data is written to the ring instead: | rpc_cmd | request_size | SHM_MSG_FLAG | position (8 bytes) |
+// the request data is the input followed by the data, so the data is not copied before it is sent
 // No response
-static bool send_rpc_cmd(const std::shared_ptr<socket_t> & sock, enum rpc_cmd cmd, const void * input, size_t input_size) {
+static bool send_rpc_cmd_data(const std::shared_ptr<socket_t> & sock, enum rpc_cmd cmd, const void * input, size_t input_size,
+                              const void * data, size_t data_size) {
     uint8_t cmd_byte = cmd;
     if (!send_data(sock->fd, &cmd_byte, sizeof(cmd_byte))) {
         return false;
     }
-    if (!send_data(sock->fd, &input_size, sizeof(input_size))) {
+    const size_t request_size = input_size + data_size;
+    uint64_t pos;
+    if (shm_reserve(sock->shm.get(), request_size, pos)) {
+        uint8_t * dst = shm_send_ptr(sock->shm.get(), pos);
+        if (input_size > 0) {
+            memcpy(dst, input, input_size);
+        }
+        if (data_size > 0) {
+            memcpy(dst + input_size, data, data_size);
+        }
+        return send_shm_msg(sock->fd, request_size, pos);
+    }
+    if (!send_data(sock->fd, &request_size, sizeof(request_size))) {
         return false;
     }
     if (!send_data(sock->fd, input, input_size)) {
         return false;
     }
+    if (!send_data(sock->fd, data, data_size)) {
+        return false;
+    }
+    return true;
+}
+
+static bool send_rpc_cmd(const std::shared_ptr<socket_t> & sock, enum rpc_cmd cmd, const void * input, size_t input_size) {
+    return send_rpc_cmd_data(sock, cmd, input, input_size, nullptr, 0);
+}
+
+static bool recv_rpc_rsp(const std::shared_ptr<socket_t> & sock, void * output, size_t output_size) {
+    // TODO: currently the output_size is always known, do we need support for commands with variable output size?
+    // even if we do, we can skip sending output_size from the server for commands with known output size
+    uint64_t out_size;
+    uint64_t pos;
+    if (!recv_msg_size(sock->fd, sock->shm.get(), out_size, pos)) {
+        return false;
+    }
+    if (out_size != output_size) {
+        return false;
+    }
+    if (!recv_msg_data(sock->fd, sock->shm.get(), pos, output, output_size)) {
+        return false;
+    }
+    return true;
+}
+
+// RPC_CMD_GET_TENSOR_ENCODED response: | encoding (1 byte) | encoded data |
+static bool recv_rpc_rsp_encoded(const std::shared_ptr<socket_t> & sock, const rpc_pending_rsp & rsp) {
+    uint64_t out_size;
+    uint64_t pos;
+    if (!recv_msg_size(sock->fd, sock->shm.get(), out_size, pos)) {
+        return false;
+    }
+    // the encoded data is never larger than the raw data
+    if (out_size < 1 || out_size - 1 > rsp.output_size) {
+        return false;
+    }
+    sock->recv_buf.resize(out_size);
+    if (!recv_msg_data(sock->fd, sock->shm.get(), pos, sock->recv_buf.data(), out_size)) {
+        return false;
+    }
+    const uint8_t * buf = sock->recv_buf.data();
+    return rpc_decode(buf[0], rsp.type, rsp.offset, buf + 1, out_size - 1, rsp.output, rsp.output_size);
+}
+
+// receive the responses of all the pipelined commands sent so far, or only of the first seq ones
+static bool recv_pending_rsp(const std::shared_ptr<socket_t> & sock, uint64_t seq = UINT64_MAX) {
+    while (!sock->pending.empty() && sock->n_pending_recv < seq) {
+        const rpc_pending_rsp rsp = sock->pending.front();
+        sock->pending.pop_front();
+        sock->n_pending_recv++;
+
+        if (rsp.event) {
+            rpc_msg_event_record_rsp response;
+            if (!recv_rpc_rsp(sock, &response, sizeof(response))) {
+                return false;
+            }
+            ggml_status status = (ggml_status)response.status;
+            if (status != GGML_STATUS_SUCCESS && sock->compute_status == GGML_STATUS_SUCCESS) {
+                fprintf(stderr, "RPC graph compute failed: %s\n", ggml_status_to_string(status));
+                sock->compute_status = status;
+            }
+        } else if (rsp.encoded) {
+            if (!recv_rpc_rsp_encoded(sock, rsp)) {
+                return false;
+            }
+        } else if (!recv_rpc_rsp(sock, rsp.output, rsp.output_size)) {
+            return false;
+        }
+    }
     return true;
 }
 
 // RPC request : | rpc_cmd (1 byte) | request_size (8 bytes) | request_data (request_size bytes) |
 // RPC response: | response_size (8 bytes) | response_data (response_size bytes) |
+// the server executes the commands in order, so the response is received after the pending ones
 static bool send_rpc_cmd(const std::shared_ptr<socket_t> & sock, enum rpc_cmd cmd, const void * input, size_t input_size, void * output, size_t output_size) {
     if (!send_rpc_cmd(sock, cmd, input, input_size)) {
         return false;
     }
-    // TODO: currently the output_size is always known, do we need support for commands with variable output size?
-    // even if we do, we can skip sending output_size from the server for commands with known output size
-    uint64_t out_size;
-    if (!recv_data(sock->fd, &out_size, sizeof(out_size))) {
+    if (!recv_pending_rsp(sock)) {
         return false;
     }
-    if (out_size != output_size) {
+    return recv_rpc_rsp(sock, output, output_size);
+}
+
+// same as above, but does not wait for the response: it is received into output by the next command with a response
+// or by recv_pending_rsp(), so output must stay valid until then
+static bool send_rpc_cmd_async(const std::shared_ptr<socket_t> & sock, enum rpc_cmd cmd, const void * input, size_t input_size, void * output, size_t output_size) {
+    if (!send_rpc_cmd(sock, cmd, input, input_size)) {
         return false;
     }
-    if (!recv_data(sock->fd, output, output_size)) {
+    sock->pending.push_back({ output, output_size, false, GGML_TYPE_COUNT, 0, false });
+    sock->n_pending_sent++;
+    return true;
+}
+
+// RPC_CMD_EVENT_RECORD is sent after each graph, so that the status of the computation is received without waiting
+// for it, by the next command with a response or by recv_pending_rsp()
+static bool send_event_record(const std::shared_ptr<socket_t> & sock) {
+    if (!send_rpc_cmd(sock, RPC_CMD_EVENT_RECORD, nullptr, 0)) {
         return false;
     }
+    sock->pending.push_back({ nullptr, sizeof(rpc_msg_event_record_rsp), false, GGML_TYPE_COUNT, 0, true });
+    sock->n_pending_sent++;
     return true;
 }
 
 // RPC client-side implementation
 
-static bool check_server_version(const std::shared_ptr<socket_t> & sock) {
-    rpc_msg_hello_rsp response;
-    bool status = send_rpc_cmd(sock, RPC_CMD_HELLO, nullptr, 0, &response, sizeof(response));
-    RPC_STATUS_ASSERT(status);
+// the encodings of the tensor data enabled with the environment variables:
+//   GGML_RPC_COMPRESS=1              lossless compression of the data sent and received
+//   GGML_RPC_TRANSFER_TYPE=f16|bf16  F32 data received in reduced precision
+static uint32_t rpc_client_encodings() {
+    uint32_t encodings = 0;
+    const char * compress = getenv("GGML_RPC_COMPRESS");
+    if (compress != nullptr && atoi(compress) != 0) {
+        encodings |= 1u << RPC_ENCODING_RLE;
+    }
+    const char * transfer_type = getenv("GGML_RPC_TRANSFER_TYPE");
+    if (transfer_type != nullptr) {
+        if (strcmp(transfer_type, "f16") == 0) {
+            encodings |= 1u << RPC_ENCODING_F16;
+        } else if (strcmp(transfer_type, "bf16") == 0) {
+            encodings |= 1u << RPC_ENCODING_BF16;
+        } else if (strcmp(transfer_type, "f32") != 0) {
+            fprintf(stderr, "WARNING: unsupported GGML_RPC_TRANSFER_TYPE: %s\n", transfer_type);
+        }
+    }
+    return encodings;
+}
+
+static bool check_server_version(const std::shared_ptr<socket_t> & sock, rpc_msg_hello_rsp & response) {
+    rpc_msg_hello_req request = {};
+    request.encodings = rpc_client_encodings();
+    // the servers before v5.0.0 close the connection because the request is not empty, and the size of the response
+    // depends on the version, so it is received as it is to report a mismatch instead of failing
+    std::vector<uint8_t> output;
+    if (!send_rpc_cmd(sock, RPC_CMD_HELLO, &request, sizeof(request)) || !recv_msg(sock->fd, output)) {
+        fprintf(stderr, "RPC server closed the connection on HELLO, the server is probably older than v5.0.0, expected v%d.%d.%d\n",
+                RPC_PROTO_MAJOR_VERSION, RPC_PROTO_MINOR_VERSION, RPC_PROTO_PATCH_VERSION);
+        return false;
+    }
+    if (output.size() < offsetof(rpc_msg_hello_rsp, encodings)) {
+        fprintf(stderr, "Invalid RPC server HELLO response of size %zu\n", output.size());
+        return false;
+    }
+    response = {};
+    memcpy(&response, output.data(), std::min(output.size(), sizeof(response)));
     if (response.major != RPC_PROTO_MAJOR_VERSION || response.minor > RPC_PROTO_MINOR_VERSION) {
-        fprintf(stderr, "RPC server version mismatch: %d.%d.%d\n", response.major, response.minor, response.patch);
+        fprintf(stderr, "RPC server version mismatch: %d.%d.%d, expected %d.%d.%d\n", response.major, response.minor, response.patch,
+                RPC_PROTO_MAJOR_VERSION, RPC_PROTO_MINOR_VERSION, RPC_PROTO_PATCH_VERSION);
+        return false;
+    }
+    if (output.size() != sizeof(response)) {
+        fprintf(stderr, "Invalid RPC server HELLO response of size %zu\n", output.size());
         return false;
     }
     if (response.minor != RPC_PROTO_MINOR_VERSION || response.patch != RPC_PROTO_PATCH_VERSION) {
         fprintf(stderr, "WARNING: RPC server version mismatch: %d.%d.%d\n", response.major, response.minor, response.patch);
     }
+    sock->encodings = response.encodings & request.encodings;
     return true;
 }
 
-static std::shared_ptr<socket_t> get_socket(const std::string & endpoint) {
-    static std::mutex mutex;
-    std::lock_guard<std::mutex> lock(mutex);
-    static std::unordered_map<std::string, std::weak_ptr<socket_t>> sockets;
-    static bool initialized = false;
-
-    auto it = sockets.find(endpoint);
-    if (it != sockets.end()) {
-        if (auto sock = it->second.lock()) {
-            return sock;
+// the encoding to use for size bytes of the tensor data at offset, lossy encodings are only used when receiving data
+static rpc_encoding rpc_choose_encoding(const std::shared_ptr<socket_t> & sock, ggml_type type, size_t offset, size_t size, bool recv) {
+    if (size < ENCODE_THRESHOLD) {
+        return RPC_ENCODING_NONE;
+    }
+    if (recv && type == GGML_TYPE_F32 && offset % sizeof(float) == 0 && size % sizeof(float) == 0) {
+        if (sock->encodings & (1u << RPC_ENCODING_F16)) {
+            return RPC_ENCODING_F16;
+        }
+        if (sock->encodings & (1u << RPC_ENCODING_BF16)) {
+            return RPC_ENCODING_BF16;
         }
     }
-    std::string host;
-    int port;
-    if (!parse_endpoint(endpoint, host, port)) {
+    if (sock->encodings & (1u << RPC_ENCODING_RLE)) {
+        return RPC_ENCODING_RLE;
+    }
+    return RPC_ENCODING_NONE;
+}
+
+static bool attach_shm(const std::shared_ptr<socket_t> & sock) {
+#ifdef RPC_SHM_SUPPORTED
+    auto shm = shm_create(SHM_RING_SIZE);
+    if (shm == nullptr) {
+        return false;
+    }
+    rpc_msg_shm_attach_req request = {};
+    request.pid = (uint32_t) getpid();
+    request.ring_size = shm->ring_size;
+    rpc_msg_shm_attach_rsp response = {};
+    bool status = send_rpc_cmd(sock, RPC_CMD_SHM_ATTACH, &request, sizeof(request), &response, sizeof(response));
+    RPC_STATUS_ASSERT(status);
+    if (!response.result) {
+        return false;
+    }
+    // the server replies again once it has received the memfd, or failed to
+    response.name[sizeof(response.name) - 1] = '\0';
+    shm_send_fd(response.name, shm->fd);
+    status = recv_rpc_rsp(sock, &response, sizeof(response));
+    RPC_STATUS_ASSERT(status);
+    if (!response.result) {
+        return false;
+    }
+    sock->shm = std::move(shm);
+    return true;
+#else
+    GGML_UNUSED(sock);
+    return false;
+#endif
+}
+
+static std::shared_ptr<socket_t> get_socket(const std::string & endpoint) {
+    static std::mutex mutex;
+    std::lock_guard<std::mutex> lock(mutex);
+    static std::unordered_map<std::string, std::weak_ptr<socket_t>> sockets;
+    static bool initialized = false;
+
+    auto it = sockets.find(endpoint);
+    if (it != sockets.end()) {
+        if (auto sock = it->second.lock()) {
+            return sock;
+        }
+    }
+    // shm://host:port uses shared memory for the large messages, the server must be on the same host
+    const std::string shm_prefix = "shm://";
+    const bool use_shm = endpoint.compare(0, shm_prefix.size(), shm_prefix) == 0;
+    std::string host;
+    int port;
+    if (!parse_endpoint(use_shm ? endpoint.substr(shm_prefix.size()) : endpoint, host, port)) {
         return nullptr;
     }
 #ifdef _WIN32
@@ -472,9 +1249,13 @@ static std::shared_ptr<socket_t> get_socket(const std::string & endpoint) {
     if (sock == nullptr) {
         return nullptr;
     }
-    if (!check_server_version(sock)) {
+    rpc_msg_hello_rsp hello = {};
+    if (!check_server_version(sock, hello)) {
         return nullptr;
     }
+    if (use_shm && !attach_shm(sock)) {
+        fprintf(stderr, "WARNING: failed to use shared memory with %s, falling back to TCP\n", endpoint.c_str());
+    }
     GGML_PRINT_DEBUG("[%s] connected to %s, sockfd=%d\n", __func__, endpoint.c_str(), sock->fd);
     sockets[endpoint] = sock;
     return sock;
@@ -485,6 +1266,8 @@ static void ggml_backend_rpc_buffer_free_buffer(ggml_backend_buffer_t buffer) {
     rpc_msg_free_buffer_req request = {ctx->remote_ptr};
     bool status = send_rpc_cmd(ctx->sock, RPC_CMD_FREE_BUFFER, &request, sizeof(request), nullptr, 0);
     RPC_STATUS_ASSERT(status);
+    // the server drops the cached graphs when a buffer is freed, as they may reference it
+    ctx->sock->graphs.clear();
     delete ctx;
 }
 
@@ -569,23 +1352,59 @@ static void ggml_backend_rpc_buffer_set_tensor(ggml_backend_buffer_t buffer, ggm
             return;
         }
     }
+    rpc_encoding encoding = rpc_choose_encoding(ctx->sock, tensor->type, offset, size, false);
+    if (encoding != RPC_ENCODING_NONE) {
+        // input serialization format: | rpc_msg_set_tensor_encoded_req | encoded data |
+        std::vector<uint8_t> input(sizeof(rpc_msg_set_tensor_encoded_req));
+        encoding = rpc_encode(encoding, tensor->type, offset, data, size, input);
+        if (encoding != RPC_ENCODING_NONE) {
+            rpc_msg_set_tensor_encoded_req request;
+            request.tensor = rpc_tensor;
+            request.offset = offset;
+            request.size = size;
+            request.encoding = encoding;
+            memcpy(input.data(), &request, sizeof(request));
+            bool status = send_rpc_cmd(ctx->sock, RPC_CMD_SET_TENSOR_ENCODED, input.data(), input.size());
+            RPC_STATUS_ASSERT(status);
+            return;
+        }
+    }
     // input serialization format: | rpc_tensor | offset (8 bytes) | data (size bytes)
-    size_t input_size = sizeof(rpc_tensor) + sizeof(uint64_t) + size;
-    std::vector<uint8_t> input(input_size, 0);
-    memcpy(input.data(), &rpc_tensor, sizeof(rpc_tensor));
-    memcpy(input.data() + sizeof(rpc_tensor), &offset, sizeof(offset));
-    memcpy(input.data() + sizeof(rpc_tensor) + sizeof(offset), data, size);
-    bool status = send_rpc_cmd(ctx->sock, RPC_CMD_SET_TENSOR, input.data(), input.size());
+    uint8_t input[sizeof(rpc_tensor) + sizeof(uint64_t)];
+    memcpy(input, &rpc_tensor, sizeof(rpc_tensor));
+    memcpy(input + sizeof(rpc_tensor), &offset, sizeof(offset));
+    bool status = send_rpc_cmd_data(ctx->sock, RPC_CMD_SET_TENSOR, input, sizeof(input), data, size);
     RPC_STATUS_ASSERT(status);
 }
 
-static void ggml_backend_rpc_buffer_get_tensor(ggml_backend_buffer_t buffer, const ggml_tensor * tensor, void * data, size_t offset, size_t size) {
-    ggml_backend_rpc_buffer_context * ctx = (ggml_backend_rpc_buffer_context *)buffer->context;
-    rpc_msg_get_tensor_req request;
+// sends RPC_CMD_GET_TENSOR or RPC_CMD_GET_TENSOR_ENCODED, the response is received into data as a pipelined one
+static bool send_get_tensor_async(const std::shared_ptr<socket_t> & sock, const ggml_tensor * tensor, void * data, size_t offset, size_t size) {
+    rpc_encoding encoding = rpc_choose_encoding(sock, tensor->type, offset, size, true);
+    if (encoding == RPC_ENCODING_NONE) {
+        rpc_msg_get_tensor_req request;
+        request.tensor = serialize_tensor(tensor);
+        request.offset = offset;
+        request.size = size;
+        return send_rpc_cmd_async(sock, RPC_CMD_GET_TENSOR, &request, sizeof(request), data, size);
+    }
+    rpc_msg_get_tensor_encoded_req request;
     request.tensor = serialize_tensor(tensor);
     request.offset = offset;
     request.size = size;
-    bool status = send_rpc_cmd(ctx->sock, RPC_CMD_GET_TENSOR, &request, sizeof(request), data, size);
+    request.encoding = encoding;
+    if (!send_rpc_cmd(sock, RPC_CMD_GET_TENSOR_ENCODED, &request, sizeof(request))) {
+        return false;
+    }
+    sock->pending.push_back({ data, size, true, tensor->type, offset, false });
+    sock->n_pending_sent++;
+    return true;
+}
+
+static void ggml_backend_rpc_buffer_get_tensor(ggml_backend_buffer_t buffer, const ggml_tensor * tensor, void * data, size_t offset, size_t size) {
+    ggml_backend_rpc_buffer_context * ctx = (ggml_backend_rpc_buffer_context *)buffer->context;
+    bool status = send_get_tensor_async(ctx->sock, tensor, data, offset, size);
+    RPC_STATUS_ASSERT(status);
+    status = recv_pending_rsp(ctx->sock);
     RPC_STATUS_ASSERT(status);
 }
 
@@ -703,6 +1522,233 @@ static ggml_backend_buffer_type_i ggml_backend_rpc_buffer_type_interface = {
     /* .is_host          = */ NULL,
 };
 
+// RPC split buffer
+
+static const char * ggml_backend_rpc_split_buffer_type_name(ggml_backend_buffer_type_t buft) {
+    ggml_backend_rpc_split_buffer_type_context * buft_ctx = (ggml_backend_rpc_split_buffer_type_context *)buft->context;
+    return buft_ctx->name.c_str();
+}
+
+static bool ggml_backend_buft_is_rpc_split(ggml_backend_buffer_type_t buft) {
+    return buft->iface.get_name == ggml_backend_rpc_split_buffer_type_name;
+}
+
+static void get_row_split(int64_t * row_low, int64_t * row_high, const ggml_tensor * tensor, const ggml_backend_rpc_split_buffer_type_context * buft_ctx, int id) {
+    const int64_t nrows = ggml_nrows(tensor);
+    const int n_devices = buft_ctx->endpoints.size();
+
+    *row_low = id == 0 ? 0 : nrows*buft_ctx->tensor_split[id];
+    *row_high = id == n_devices - 1 ? nrows : nrows*buft_ctx->tensor_split[id + 1];
+}
+
+struct ggml_backend_rpc_split_buffer_context {
+    ~ggml_backend_rpc_split_buffer_context() {
+        for (ggml_backend_rpc_split_tensor_extra * extra : tensor_extras) {
+            for (int id = 0; id < GGML_RPC_MAX_SERVERS; ++id) {
+                if (extra->buffers[id] != nullptr) {
+                    ggml_backend_buffer_free(extra->buffers[id]);
+                }
+            }
+            delete extra;
+        }
+    }
+
+    std::vector<ggml_backend_rpc_split_tensor_extra *> tensor_extras;
+};
+
+static void ggml_backend_rpc_split_buffer_free_buffer(ggml_backend_buffer_t buffer) {
+    ggml_backend_rpc_split_buffer_context * ctx = (ggml_backend_rpc_split_buffer_context *)buffer->context;
+    delete ctx;
+}
+
+static void * ggml_backend_rpc_split_buffer_get_base(ggml_backend_buffer_t buffer) {
+    // the pointers are stored in the tensor extras, this is just a dummy address and never dereferenced
+    return (void *)0x1000;
+
+    GGML_UNUSED(buffer);
+}
+
+static enum ggml_status ggml_backend_rpc_split_buffer_init_tensor(ggml_backend_buffer_t buffer, ggml_tensor * tensor) {
+    GGML_ASSERT(tensor->view_src == nullptr); // views of split tensors are not supported
+    GGML_ASSERT(ggml_is_contiguous(tensor) && tensor->ne[2] == 1 && tensor->ne[3] == 1);
+
+    ggml_backend_rpc_split_buffer_context * ctx = (ggml_backend_rpc_split_buffer_context *)buffer->context;
+    ggml_backend_rpc_split_buffer_type_context * buft_ctx = (ggml_backend_rpc_split_buffer_type_context *)buffer->buft->context;
+
+    ggml_backend_rpc_split_tensor_extra * extra = new ggml_backend_rpc_split_tensor_extra {};
+    ctx->tensor_extras.push_back(extra);
+
+    for (int id = 0; id < (int) buft_ctx->endpoints.size(); ++id) {
+        get_row_split(&extra->row_low[id], &extra->row_high[id], tensor, buft_ctx, id);
+        const int64_t nrows_split = extra->row_high[id] - extra->row_low[id];
+        if (nrows_split <= 0) {
+            continue;
+        }
+
+        // the slice is a regular tensor in a buffer of the server
+        ggml_tensor * slice = &extra->slices[id];
+        slice->type = tensor->type;
+        slice->ne[0] = tensor->ne[0];
+        slice->ne[1] = nrows_split;
+        slice->ne[2] = 1;
+        slice->ne[3] = 1;
+        slice->nb[0] = tensor->nb[0];
+        slice->nb[1] = tensor->nb[1];
+        slice->nb[2] = tensor->nb[1]*nrows_split;
+        slice->nb[3] = slice->nb[2];
+        ggml_format_name(slice, "%s (split %d)", tensor->name, id);
+
+        ggml_backend_buffer_type_t slice_buft = ggml_backend_rpc_buffer_type(buft_ctx->endpoints[id].c_str());
+        ggml_backend_buffer_t slice_buffer = ggml_backend_buft_alloc_buffer(slice_buft, ggml_backend_buft_get_alloc_size(slice_buft, slice));
+        if (slice_buffer == nullptr) {
+            GGML_LOG_ERROR("%s: failed to allocate the split %d of %s\n", __func__, id, tensor->name);
+            return GGML_STATUS_ALLOC_FAILED;
+        }
+        ggml_backend_buffer_set_usage(slice_buffer, GGML_BACKEND_BUFFER_USAGE_WEIGHTS);
+        extra->buffers[id] = slice_buffer;
+        slice->buffer = slice_buffer;
+        slice->data = ggml_backend_buffer_get_base(slice_buffer);
+        enum ggml_status status = ggml_backend_buffer_init_tensor(slice_buffer, slice);
+        if (status != GGML_STATUS_SUCCESS) {
+            return status;
+        }
+    }
+    tensor->extra = extra;
+    return GGML_STATUS_SUCCESS;
+}
+
+static void ggml_backend_rpc_split_buffer_set_tensor(ggml_backend_buffer_t buffer, ggml_tensor * tensor, const void * data, size_t offset, size_t size) {
+    // split tensors must always be set in their entirety at once
+    GGML_ASSERT(offset == 0);
+    GGML_ASSERT(size == ggml_nbytes(tensor));
+
+    ggml_backend_rpc_split_tensor_extra * extra = (ggml_backend_rpc_split_tensor_extra *)tensor->extra;
+    for (int id = 0; id < GGML_RPC_MAX_SERVERS; ++id) {
+        if (extra->buffers[id] == nullptr) {
+            continue;
+        }
+        // the rows are contiguous, so each slice is a contiguous range of the data
+        const size_t offset_split = extra->row_low[id]*tensor->nb[1];
+        ggml_backend_tensor_set(&extra->slices[id], (const char *)data + offset_split, 0, ggml_nbytes(&extra->slices[id]));
+    }
+
+    GGML_UNUSED(buffer);
+}
+
+static void ggml_backend_rpc_split_buffer_get_tensor(ggml_backend_buffer_t buffer, const ggml_tensor * tensor, void * data, size_t offset, size_t size) {
+    // split tensors must always be read in their entirety at once
+    GGML_ASSERT(offset == 0);
+    GGML_ASSERT(size == ggml_nbytes(tensor));
+
+    ggml_backend_rpc_split_tensor_extra * extra = (ggml_backend_rpc_split_tensor_extra *)tensor->extra;
+    for (int id = 0; id < GGML_RPC_MAX_SERVERS; ++id) {
+        if (extra->buffers[id] == nullptr) {
+            continue;
+        }
+        const size_t offset_split = extra->row_low[id]*tensor->nb[1];
+        ggml_backend_tensor_get(&extra->slices[id], (char *)data + offset_split, 0, ggml_nbytes(&extra->slices[id]));
+    }
+
+    GGML_UNUSED(buffer);
+}
+
+static void ggml_backend_rpc_split_buffer_clear(ggml_backend_buffer_t buffer, uint8_t value) {
+    GGML_UNUSED(buffer);
+    GGML_UNUSED(value);
+}
+
+static const ggml_backend_buffer_i ggml_backend_rpc_split_buffer_interface = {
+    /* .free_buffer     = */ ggml_backend_rpc_split_buffer_free_buffer,
+    /* .get_base        = */ ggml_backend_rpc_split_buffer_get_base,
+    /* .init_tensor     = */ ggml_backend_rpc_split_buffer_init_tensor,
+    /* .memset_tensor   = */ NULL,
+    /* .set_tensor      = */ ggml_backend_rpc_split_buffer_set_tensor,
+    /* .get_tensor      = */ ggml_backend_rpc_split_buffer_get_tensor,
+    /* .cpy_tensor      = */ NULL,
+    /* .clear           = */ ggml_backend_rpc_split_buffer_clear,
+    /* .reset           = */ NULL,
+};
+
+static ggml_backend_buffer_t ggml_backend_rpc_split_buffer_type_alloc_buffer(ggml_backend_buffer_type_t buft, size_t size) {
+    // the slices of the tensors are allocated on the servers for each tensor separately in init_tensor
+    ggml_backend_rpc_split_buffer_context * ctx = new ggml_backend_rpc_split_buffer_context();
+
+    return ggml_backend_buffer_init(buft, ggml_backend_rpc_split_buffer_interface, ctx, size);
+}
+
+static size_t ggml_backend_rpc_split_buffer_type_get_alignment(ggml_backend_buffer_type_t buft) {
+    return 128;
+
+    GGML_UNUSED(buft);
+}
+
+static const ggml_backend_buffer_type_i ggml_backend_rpc_split_buffer_type_interface = {
+    /* .get_name         = */ ggml_backend_rpc_split_buffer_type_name,
+    /* .alloc_buffer     = */ ggml_backend_rpc_split_buffer_type_alloc_buffer,
+    /* .get_alignment    = */ ggml_backend_rpc_split_buffer_type_get_alignment,
+    /* .get_max_size     = */ NULL, // defaults to SIZE_MAX
+    /* .get_alloc_size   = */ NULL, // defaults to ggml_nbytes
+    /* .is_host          = */ NULL,
+};
+
+ggml_backend_buffer_type_t ggml_backend_rpc_split_buffer_type(int main_device, const float * tensor_split) {
+    ggml_backend_reg_t reg = ggml_backend_rpc_reg();
+    const int n_devices = std::min<int>(ggml_backend_reg_dev_count(reg), GGML_RPC_MAX_SERVERS);
+    if (main_device < 0 || main_device >= n_devices) {
+        return nullptr;
+    }
+
+    static std::mutex mutex;
+    std::lock_guard<std::mutex> lock(mutex);
+
+    static std::map<std::pair<int, std::array<float, GGML_RPC_MAX_SERVERS>>, struct ggml_backend_buffer_type> buft_map;
+
+    std::array<float, GGML_RPC_MAX_SERVERS> tensor_split_arr = {};
+
+    bool all_zero = tensor_split == nullptr || std::all_of(tensor_split, tensor_split + n_devices, [](float x) { return x == 0.0f; });
+    if (all_zero) {
+        // same number of rows on each server
+        for (int i = 0; i < n_devices; ++i) {
+            tensor_split_arr[i] = (float) i / n_devices;
+        }
+    } else {
+        float split_sum = 0.0f;
+        for (int i = 0; i < n_devices; ++i) {
+            tensor_split_arr[i] = split_sum;
+            split_sum += tensor_split[i];
+        }
+        for (int i = 0; i < n_devices; ++i) {
+            tensor_split_arr[i] /= split_sum;
+        }
+    }
+
+    auto it = buft_map.find({main_device, tensor_split_arr});
+    if (it != buft_map.end()) {
+        return &it->second;
+    }
+
+    std::vector<std::string> endpoints;
+    for (int i = 0; i < n_devices; ++i) {
+        ggml_backend_dev_t dev = ggml_backend_reg_dev_get(reg, i);
+        endpoints.push_back(((ggml_backend_rpc_device_context *)dev->context)->endpoint);
+    }
+    auto * ctx = new ggml_backend_rpc_split_buffer_type_context {
+        /* .main_device  = */ main_device,
+        /* .tensor_split = */ tensor_split_arr,
+        /* .endpoints    = */ endpoints,
+        /* .name         = */ "RPC[" + endpoints[main_device] + "]_Split",
+    };
+
+    struct ggml_backend_buffer_type buft {
+        /* .iface   = */ ggml_backend_rpc_split_buffer_type_interface,
+        /* .device  = */ ggml_backend_reg_dev_get(reg, main_device),
+        /* .context = */ ctx,
+    };
+
+    auto result = buft_map.emplace(std::make_pair(main_device, tensor_split_arr), buft);
+    return &result.first->second;
+}
+
 static const char * ggml_backend_rpc_name(ggml_backend_t backend) {
     ggml_backend_rpc_context * rpc_ctx = (ggml_backend_rpc_context *)backend->context;
 
@@ -711,16 +1757,37 @@ static const char * ggml_backend_rpc_name(ggml_backend_t backend) {
 
 static void ggml_backend_rpc_free(ggml_backend_t backend) {
     ggml_backend_rpc_context * rpc_ctx = (ggml_backend_rpc_context *)backend->context;
+    for (auto & it : rpc_ctx->scratch) {
+        ggml_backend_buffer_free(it.second.buffer);
+    }
     delete rpc_ctx;
     delete backend;
 }
 
 static void ggml_backend_rpc_synchronize(ggml_backend_t backend) {
+    ggml_backend_rpc_context * rpc_ctx = (ggml_backend_rpc_context *)backend->context;
+    auto sock = get_socket(rpc_ctx->endpoint);
+    bool status = recv_pending_rsp(sock);
+    RPC_STATUS_ASSERT(status);
+}
+
+static void ggml_backend_rpc_set_tensor_async(ggml_backend_t backend, ggml_tensor * tensor, const void * data, size_t offset, size_t size) {
+    // SET_TENSOR has no response, and the data is copied before returning
+    ggml_backend_rpc_buffer_set_tensor(tensor->buffer, tensor, data, offset, size);
+
+    GGML_UNUSED(backend);
+}
+
+static void ggml_backend_rpc_get_tensor_async(ggml_backend_t backend, const ggml_tensor * tensor, void * data, size_t offset, size_t size) {
+    ggml_backend_rpc_buffer_context * ctx = (ggml_backend_rpc_buffer_context *)tensor->buffer->context;
+    bool status = send_get_tensor_async(ctx->sock, tensor, data, offset, size);
+    RPC_STATUS_ASSERT(status);
+
     GGML_UNUSED(backend);
-    // this is no-op because we don't have any async operations
 }
 
-static void add_tensor(ggml_tensor * tensor, std::vector<rpc_tensor> & tensors, std::unordered_set<ggml_tensor*> & visited) {
+static void add_tensor(ggml_tensor * tensor, std::vector<rpc_tensor> & tensors, std::unordered_set<ggml_tensor*> & visited,
+                       const std::unordered_set<ggml_tensor*> & nodes) {
     if (tensor == nullptr) {
         return;
     }
@@ -728,19 +1795,27 @@ static void add_tensor(ggml_tensor * tensor, std::vector<rpc_tensor> & tensors,
         return;
     }
     visited.insert(tensor);
-    for (int i = 0; i < GGML_MAX_SRC; i++) {
-        add_tensor(tensor->src[i], tensors, visited);
+    rpc_tensor result = serialize_tensor(tensor);
+    if (nodes.find(tensor) != nodes.end()) {
+        for (int i = 0; i < GGML_MAX_SRC; i++) {
+            add_tensor(tensor->src[i], tensors, visited, nodes);
+        }
+    } else {
+        // the tensor is not computed by this graph, e.g. a node of a previous part of a larger graph
+        // the server only needs its data, sending its sources would send the whole graph up to this point
+        memset(result.src, 0, sizeof(result.src));
     }
-    add_tensor(tensor->view_src, tensors, visited);
-    tensors.push_back(serialize_tensor(tensor));
+    add_tensor(tensor->view_src, tensors, visited, nodes);
+    tensors.push_back(result);
 }
 
 static void serialize_graph(const ggml_cgraph * cgraph, std::vector<uint8_t> & output) {
     uint32_t n_nodes = cgraph->n_nodes;
     std::vector<rpc_tensor> tensors;
     std::unordered_set<ggml_tensor*> visited;
+    std::unordered_set<ggml_tensor*> nodes(cgraph->nodes, cgraph->nodes + n_nodes);
     for (uint32_t i = 0; i < n_nodes; i++) {
-        add_tensor(cgraph->nodes[i], tensors, visited);
+        add_tensor(cgraph->nodes[i], tensors, visited, nodes);
     }
     // serialization format:
     // | n_nodes (4 bytes) | nodes (n_nodes * sizeof(uint64_t) | n_tensors (4 bytes) | tensors (n_tensors * sizeof(rpc_tensor)) |
@@ -757,22 +1832,383 @@ static void serialize_graph(const ggml_cgraph * cgraph, std::vector<uint8_t> & o
     memcpy(out_tensors, tensors.data(), n_tensors * sizeof(rpc_tensor));
 }
 
-static enum ggml_status ggml_backend_rpc_graph_compute(ggml_backend_t backend, ggml_cgraph * cgraph) {
+// two serialized tensors are the same graph node if they differ only in their parameters (shape, data, op params)
+static bool rpc_tensor_same_node(const rpc_tensor & a, const rpc_tensor & b) {
+    if (a.id != b.id || a.type != b.type || a.op != b.op || a.view_src != b.view_src) {
+        return false;
+    }
+    for (int i = 0; i < GGML_MAX_SRC; i++) {
+        if (a.src[i] != b.src[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// hash of the graph topology: the nodes and the ids, types, ops and sources of the tensors
+static uint64_t graph_topology_hash(const std::vector<uint8_t> & graph) {
+    uint32_t n_nodes;
+    memcpy(&n_nodes, graph.data(), sizeof(n_nodes));
+    uint32_t n_tensors;
+    memcpy(&n_tensors, graph.data() + sizeof(n_nodes) + n_nodes*sizeof(uint64_t), sizeof(n_tensors));
+    const rpc_tensor * tensors = (const rpc_tensor *)(graph.data() + sizeof(n_nodes) + n_nodes*sizeof(uint64_t) + sizeof(n_tensors));
+
+    std::vector<uint64_t> topology;
+    topology.reserve(1 + n_nodes + n_tensors*(3 + GGML_MAX_SRC));
+    topology.push_back(n_nodes);
+    for (uint32_t i = 0; i < n_nodes; i++) {
+        uint64_t id;
+        memcpy(&id, graph.data() + sizeof(n_nodes) + i*sizeof(uint64_t), sizeof(id));
+        topology.push_back(id);
+    }
+    for (uint32_t i = 0; i < n_tensors; i++) {
+        const rpc_tensor & t = tensors[i];
+        topology.push_back(t.id);
+        topology.push_back(((uint64_t) t.type << 32) | t.op);
+        topology.insert(topology.end(), t.src, t.src + GGML_MAX_SRC);
+        topology.push_back(t.view_src);
+    }
+    return fnv_hash((const uint8_t *) topology.data(), topology.size() * sizeof(uint64_t));
+}
+
+// returns the cached graph with the same topology, or nullptr
+static rpc_cached_graph * find_cached_graph(const std::shared_ptr<socket_t> & sock, uint64_t id, const std::vector<uint8_t> & graph) {
+    for (auto & cached : sock->graphs) {
+        if (cached.id != id) {
+            continue;
+        }
+        // rule out hash collisions
+        if (cached.graph.size() != graph.size()) {
+            return nullptr;
+        }
+        uint32_t n_nodes;
+        memcpy(&n_nodes, graph.data(), sizeof(n_nodes));
+        size_t tensors_offset = sizeof(n_nodes) + n_nodes*sizeof(uint64_t) + sizeof(uint32_t);
+        if (memcmp(cached.graph.data(), graph.data(), tensors_offset) != 0) {
+            return nullptr;
+        }
+        size_t n_tensors = (graph.size() - tensors_offset) / sizeof(rpc_tensor);
+        const rpc_tensor * a = (const rpc_tensor *)(cached.graph.data() + tensors_offset);
+        const rpc_tensor * b = (const rpc_tensor *)(graph.data() + tensors_offset);
+        for (size_t i = 0; i < n_tensors; i++) {
+            if (!rpc_tensor_same_node(a[i], b[i])) {
+                return nullptr;
+            }
+        }
+        return &cached;
+    }
+    return nullptr;
+}
+
+// the graph is computed asynchronously: GRAPH_COMPUTE has no response, and the results are available to the commands
+// sent after it, e.g. GET_TENSOR, because the server executes the commands of a client in order
+// the status of the computation is received with the EVENT_RECORD sent after it
+// graphs that are not cached are sent with id 0
+static void rpc_graph_compute(const std::shared_ptr<socket_t> & sock, const ggml_cgraph * cgraph, bool cache) {
+    std::vector<uint8_t> graph;
+    serialize_graph(cgraph, graph);
+    uint64_t id = cache ? graph_topology_hash(graph) : 0;
+
+    rpc_cached_graph * cached = id != 0 ? find_cached_graph(sock, id, graph) : nullptr;
+    if (cached != nullptr) {
+        // the server already has this graph, send only the tensors whose parameters changed
+        // serialization format:
+        // | graph_id (8 bytes) | n_changed (4 bytes) | indices (n_changed * sizeof(uint32_t)) | tensors (n_changed * sizeof(rpc_tensor)) |
+        uint32_t n_nodes;
+        memcpy(&n_nodes, graph.data(), sizeof(n_nodes));
+        size_t tensors_offset = sizeof(n_nodes) + n_nodes*sizeof(uint64_t) + sizeof(uint32_t);
+        uint32_t n_tensors = (graph.size() - tensors_offset) / sizeof(rpc_tensor);
+        rpc_tensor * old_tensors = (rpc_tensor *)(cached->graph.data() + tensors_offset);
+        const rpc_tensor * new_tensors = (const rpc_tensor *)(graph.data() + tensors_offset);
+
+        std::vector<uint32_t> indices;
+        for (uint32_t i = 0; i < n_tensors; i++) {
+            if (memcmp(&old_tensors[i], &new_tensors[i], sizeof(rpc_tensor)) != 0) {
+                indices.push_back(i);
+                old_tensors[i] = new_tensors[i];
+            }
+        }
+        uint32_t n_changed = indices.size();
+        std::vector<uint8_t> input(sizeof(id) + sizeof(n_changed) + n_changed*(sizeof(uint32_t) + sizeof(rpc_tensor)));
+        uint8_t * dst = input.data();
+        memcpy(dst, &id, sizeof(id));
+        dst += sizeof(id);
+        memcpy(dst, &n_changed, sizeof(n_changed));
+        dst += sizeof(n_changed);
+        memcpy(dst, indices.data(), n_changed*sizeof(uint32_t));
+        dst += n_changed*sizeof(uint32_t);
+        for (uint32_t i : indices) {
+            memcpy(dst, &new_tensors[i], sizeof(rpc_tensor));
+            dst += sizeof(rpc_tensor);
+        }
+        bool status = send_rpc_cmd(sock, RPC_CMD_GRAPH_RECOMPUTE, input.data(), input.size()) && send_event_record(sock);
+        RPC_STATUS_ASSERT(status);
+        return;
+    }
+
+    // serialization format:
+    // | graph_id (8 bytes) | graph (see serialize_graph) |
+    std::vector<uint8_t> input(sizeof(id) + graph.size());
+    memcpy(input.data(), &id, sizeof(id));
+    memcpy(input.data() + sizeof(id), graph.data(), graph.size());
+    bool status = send_rpc_cmd(sock, RPC_CMD_GRAPH_COMPUTE, input.data(), input.size()) && send_event_record(sock);
+    RPC_STATUS_ASSERT(status);
+    if (id == 0) {
+        return;
+    }
+
+    // the server caches the graph the same way
+    for (auto it = sock->graphs.begin(); it != sock->graphs.end(); ++it) {
+        if (it->id == id) {
+            sock->graphs.erase(it);
+            break;
+        }
+    }
+    sock->graphs.push_back({ id, std::move(graph) });
+    if (sock->graphs.size() > GRAPH_CACHE_SIZE) {
+        sock->graphs.pop_front();
+    }
+}
+
+static void ggml_backend_rpc_event_record(ggml_backend_t backend, ggml_backend_event_t event) {
     ggml_backend_rpc_context * rpc_ctx = (ggml_backend_rpc_context *)backend->context;
-    std::vector<uint8_t> input;
-    serialize_graph(cgraph, input);
-    rpc_msg_graph_compute_rsp response;
+    ggml_backend_rpc_event_context * event_ctx = (ggml_backend_rpc_event_context *)event->context;
+    auto sock = get_socket(rpc_ctx->endpoint);
+    bool status = send_event_record(sock);
+    RPC_STATUS_ASSERT(status);
+    event_ctx->sock = sock;
+    event_ctx->seq = sock->n_pending_sent;
+}
+
+static void ggml_backend_rpc_event_wait(ggml_backend_t backend, ggml_backend_event_t event) {
+    ggml_backend_rpc_context * rpc_ctx = (ggml_backend_rpc_context *)backend->context;
+    ggml_backend_rpc_event_context * event_ctx = (ggml_backend_rpc_event_context *)event->context;
     auto sock = get_socket(rpc_ctx->endpoint);
-    bool status = send_rpc_cmd(sock, RPC_CMD_GRAPH_COMPUTE, input.data(), input.size(), &response, sizeof(response));
+    if (event_ctx->sock == sock) {
+        // the server executes the commands in order, nothing to wait for
+        return;
+    }
+    // the event is on another server, wait on the host
+    bool status = recv_pending_rsp(event_ctx->sock, event_ctx->seq);
     RPC_STATUS_ASSERT(status);
-    return (enum ggml_status)response.result;
+}
+
+static bool ggml_backend_rpc_is_split_mul_mat(const ggml_tensor * node) {
+    return node->op == GGML_OP_MUL_MAT && node->src[0]->buffer && ggml_backend_buft_is_rpc_split(node->src[0]->buffer->buft);
+}
+
+// scratch buffer of at least size bytes on a server
+static ggml_backend_rpc_scratch & ggml_backend_rpc_get_scratch(ggml_backend_rpc_context * ctx, const std::string & endpoint, size_t size) {
+    ggml_backend_rpc_scratch & scratch = ctx->scratch[endpoint];
+    if (scratch.buffer == nullptr || ggml_backend_buffer_get_size(scratch.buffer) < size) {
+        if (scratch.buffer != nullptr) {
+            ggml_backend_buffer_free(scratch.buffer);
+        }
+        scratch.buffer = ggml_backend_buft_alloc_buffer(ggml_backend_rpc_buffer_type(endpoint.c_str()), size);
+        scratch.src1 = nullptr;
+        GGML_ASSERT(scratch.buffer != nullptr);
+    }
+    return scratch;
+}
+
+static void ggml_backend_rpc_tensor_place(ggml_tensor * tensor, ggml_backend_buffer_t buffer, size_t offset) {
+    tensor->buffer = buffer;
+    tensor->data = (char *)ggml_backend_buffer_get_base(buffer) + offset;
+}
+
+// matrix multiplication with row-split weights (tensor parallelism)
+// each server multiplies its rows of src0 by src1, and the results are gathered in dst on the server of this backend:
+//  - src1 is sent to the other servers through the client, once for all the weights that multiply it, e.g. Q, K and V
+//  - this server computes its rows while the other servers compute theirs
+//  - the rows computed by the other servers are copied into dst through the client
+static void ggml_backend_rpc_split_mul_mat(ggml_backend_rpc_context * ctx, const std::shared_ptr<socket_t> & sock, ggml_tensor * dst) {
+    const ggml_tensor * src0 = dst->src[0];
+    ggml_tensor * src1 = dst->src[1];
+
+    ggml_backend_rpc_split_tensor_extra * extra = (ggml_backend_rpc_split_tensor_extra *)src0->extra;
+    ggml_backend_rpc_split_buffer_type_context * buft_ctx = (ggml_backend_rpc_split_buffer_type_context *)src0->buffer->buft->context;
+    const int n_devices = buft_ctx->endpoints.size();
+    const int main_device = buft_ctx->main_device;
+    GGML_ASSERT(buft_ctx->endpoints[main_device] == ctx->endpoint);
+
+    const size_t src1_size = ggml_nbytes(src1);
+    const size_t alignment = 128;
+
+    ggml_init_params params = {
+        /*.mem_size   =*/ ggml_tensor_overhead()*4*GGML_RPC_MAX_SERVERS + ggml_graph_overhead_custom(GGML_RPC_MAX_SERVERS, false)*(GGML_RPC_MAX_SERVERS + 2),
+        /*.mem_buffer =*/ NULL,
+        /*.no_alloc   =*/ true,
+    };
+    ggml_context_ptr ctx_ptr { ggml_init(params) };
+    GGML_ASSERT(ctx_ptr != nullptr);
+    ggml_context * tctx = ctx_ptr.get();
+
+    // copy of the rows of a device into dst
+    auto cpy_rows = [&](ggml_tensor * rows, int id) {
+        ggml_tensor * view = ggml_view_4d(tctx, dst, rows->ne[0], rows->ne[1], rows->ne[2], rows->ne[3],
+            dst->nb[1], dst->nb[2], dst->nb[3], extra->row_low[id]*dst->nb[0]);
+        view->buffer = dst->buffer;
+        ggml_tensor * cpy = ggml_cpy(tctx, rows, view);
+        cpy->buffer = dst->buffer;
+        return cpy;
+    };
+    auto new_rows = [&](int id, ggml_backend_buffer_t buffer, size_t offset) {
+        ggml_tensor * rows = ggml_new_tensor_4d(tctx, dst->type, extra->row_high[id] - extra->row_low[id], dst->ne[1], dst->ne[2], dst->ne[3]);
+        ggml_backend_rpc_tensor_place(rows, buffer, offset);
+        return rows;
+    };
+
+    // scratch of this server: | rows of each device |
+    std::vector<size_t> rows_offs(n_devices, 0);
+    size_t main_scratch_size = 0;
+    for (int id = 0; id < n_devices; ++id) {
+        rows_offs[id] = main_scratch_size;
+        const int64_t nrows_split = extra->row_high[id] - extra->row_low[id];
+        if (nrows_split > 0) {
+            main_scratch_size += GGML_PAD(nrows_split*ggml_nbytes(dst)/dst->ne[0], alignment);
+        }
+    }
+    ggml_backend_buffer_t main_scratch = ggml_backend_rpc_get_scratch(ctx, ctx->endpoint, main_scratch_size).buffer;
+
+    // other servers, scratch: | src1 | rows |
+    ctx->dst_data.resize(n_devices);
+    bool src1_fetched = false;
+    for (int id = 0; id < n_devices; ++id) {
+        const int64_t nrows_split = extra->row_high[id] - extra->row_low[id];
+        if (id == main_device || nrows_split <= 0) {
+            continue;
+        }
+        const size_t rows_offset = GGML_PAD(src1_size, alignment);
+        const size_t rows_size = nrows_split*ggml_nbytes(dst)/dst->ne[0];
+        ggml_backend_rpc_scratch & scratch = ggml_backend_rpc_get_scratch(ctx, buft_ctx->endpoints[id], rows_offset + rows_size);
+
+        ggml_tensor * src1_split = ggml_new_tensor(tctx, src1->type, GGML_MAX_DIMS, src1->ne);
+        for (int i = 0; i < GGML_MAX_DIMS; ++i) {
+            src1_split->nb[i] = src1->nb[i];
+        }
+        ggml_backend_rpc_tensor_place(src1_split, scratch.buffer, 0);
+        if (scratch.src1 != src1) {
+            if (!src1_fetched) {
+                ctx->src1_data.resize(src1_size);
+                ggml_backend_tensor_get(src1, ctx->src1_data.data(), 0, src1_size);
+                src1_fetched = true;
+            }
+            ggml_backend_tensor_set(src1_split, ctx->src1_data.data(), 0, src1_size);
+            scratch.src1 = src1;
+        }
+
+        ggml_tensor * rows = ggml_mul_mat(tctx, &extra->slices[id], src1_split);
+        ggml_backend_rpc_tensor_place(rows, scratch.buffer, rows_offset);
+        ggml_cgraph * gf = ggml_new_graph_custom(tctx, 1, false);
+        ggml_graph_add_node(gf, rows);
+
+        // the result is received when gathering the rows
+        auto sock_split = ((ggml_backend_rpc_buffer_context *)scratch.buffer->context)->sock;
+        rpc_graph_compute(sock_split, gf, false);
+        ctx->dst_data[id].resize(rows_size);
+        ggml_backend_rpc_get_tensor_async(nullptr, rows, ctx->dst_data[id].data(), 0, rows_size);
+    }
+
+    // this server
+    if (extra->row_high[main_device] > extra->row_low[main_device]) {
+        ggml_tensor * rows = ggml_mul_mat(tctx, &extra->slices[main_device], src1);
+        ggml_backend_rpc_tensor_place(rows, main_scratch, rows_offs[main_device]);
+        ggml_cgraph * gf = ggml_new_graph_custom(tctx, 2, false);
+        ggml_graph_add_node(gf, rows);
+        ggml_graph_add_node(gf, cpy_rows(rows, main_device));
+        rpc_graph_compute(sock, gf, false);
+    }
+
+    // gather the rows of the other servers
+    ggml_cgraph * gf = ggml_new_graph_custom(tctx, GGML_RPC_MAX_SERVERS, false);
+    for (int id = 0; id < n_devices; ++id) {
+        const int64_t nrows_split = extra->row_high[id] - extra->row_low[id];
+        if (id == main_device || nrows_split <= 0) {
+            continue;
+        }
+        auto sock_split = ((ggml_backend_rpc_buffer_context *)ctx->scratch[buft_ctx->endpoints[id]].buffer->context)->sock;
+        bool status = recv_pending_rsp(sock_split);
+        RPC_STATUS_ASSERT(status);
+        // the failures of the other servers are returned with the ones of this server
+        if (sock->compute_status == GGML_STATUS_SUCCESS) {
+            sock->compute_status = sock_split->compute_status;
+        }
+        sock_split->compute_status = GGML_STATUS_SUCCESS;
+
+        ggml_tensor * rows = new_rows(id, main_scratch, rows_offs[id]);
+        ggml_backend_tensor_set(rows, ctx->dst_data[id].data(), 0, ctx->dst_data[id].size());
+        ggml_graph_add_node(gf, cpy_rows(rows, id));
+    }
+    if (gf->n_nodes > 0) {
+        rpc_graph_compute(sock, gf, false);
+    }
+}
+
+static bool ggml_backend_rpc_is_view_op(enum ggml_op op) {
+    return op == GGML_OP_NONE || op == GGML_OP_VIEW || op == GGML_OP_RESHAPE || op == GGML_OP_PERMUTE || op == GGML_OP_TRANSPOSE;
+}
+
+// forget the copies of src1 on the other servers if the graph overwrites it
+static void ggml_backend_rpc_invalidate_scratch(ggml_backend_rpc_context * ctx, const ggml_cgraph * cgraph) {
+    for (auto & it : ctx->scratch) {
+        const ggml_tensor * src1 = it.second.src1;
+        if (src1 == nullptr) {
+            continue;
+        }
+        const char * src1_begin = (const char *)src1->data;
+        const char * src1_end = src1_begin + ggml_nbytes(src1);
+        for (int i = 0; i < cgraph->n_nodes; i++) {
+            const ggml_tensor * node = cgraph->nodes[i];
+            const char * node_begin = (const char *)node->data;
+            const char * node_end = node_begin + ggml_nbytes(node);
+            if (!ggml_backend_rpc_is_view_op(node->op) && node_begin < src1_end && src1_begin < node_end) {
+                it.second.src1 = nullptr;
+                break;
+            }
+        }
+    }
+}
+
+static enum ggml_status ggml_backend_rpc_graph_compute(ggml_backend_t backend, ggml_cgraph * cgraph) {
+    ggml_backend_rpc_context * rpc_ctx = (ggml_backend_rpc_context *)backend->context;
+    auto sock = get_socket(rpc_ctx->endpoint);
+
+    // the matrix multiplications with row-split weights are computed by all the servers, the rest of the graph by this one
+    for (auto & it : rpc_ctx->scratch) {
+        it.second.src1 = nullptr;
+    }
+    int i0 = 0;
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        ggml_tensor * node = cgraph->nodes[i];
+        if (!ggml_backend_rpc_is_split_mul_mat(node)) {
+            continue;
+        }
+        if (i > i0) {
+            ggml_cgraph gv = ggml_graph_view(cgraph, i0, i);
+            rpc_graph_compute(sock, &gv, true);
+            ggml_backend_rpc_invalidate_scratch(rpc_ctx, &gv);
+        }
+        ggml_backend_rpc_split_mul_mat(rpc_ctx, sock, node);
+        i0 = i + 1;
+    }
+    if (i0 == 0) {
+        rpc_graph_compute(sock, cgraph, true);
+    } else if (i0 < cgraph->n_nodes) {
+        ggml_cgraph gv = ggml_graph_view(cgraph, i0, cgraph->n_nodes);
+        rpc_graph_compute(sock, &gv, true);
+    }
+
+    // the graph is not computed yet, return the first failure of the previous ones, e.g. found by synchronize
+    ggml_status status = sock->compute_status;
+    sock->compute_status = GGML_STATUS_SUCCESS;
+    return status;
 }
 
 static ggml_backend_i ggml_backend_rpc_interface = {
     /* .get_name                = */ ggml_backend_rpc_name,
     /* .free                    = */ ggml_backend_rpc_free,
-    /* .set_tensor_async        = */ NULL,
-    /* .get_tensor_async        = */ NULL,
+    /* .set_tensor_async        = */ ggml_backend_rpc_set_tensor_async,
+    /* .get_tensor_async        = */ ggml_backend_rpc_get_tensor_async,
     /* .cpy_tensor_async        = */ NULL,
     /* .synchronize             = */ ggml_backend_rpc_synchronize,
     /* .graph_plan_create       = */ NULL,
@@ -780,8 +2216,8 @@ static ggml_backend_i ggml_backend_rpc_interface = {
     /* .graph_plan_update       = */ NULL,
     /* .graph_plan_compute      = */ NULL,
     /* .graph_compute           = */ ggml_backend_rpc_graph_compute,
-    /* .event_record            = */ NULL,
-    /* .event_wait              = */ NULL,
+    /* .event_record            = */ ggml_backend_rpc_event_record,
+    /* .event_wait              = */ ggml_backend_rpc_event_wait,
 };
 
 ggml_backend_buffer_type_t ggml_backend_rpc_buffer_type(const char * endpoint) {
@@ -820,6 +2256,9 @@ ggml_backend_t ggml_backend_rpc_init(const char * endpoint) {
     ggml_backend_rpc_context * ctx = new ggml_backend_rpc_context {
         /* .endpoint  = */ endpoint,
         /* .name      = */ "RPC[" + std::string(endpoint) + "]",
+        /* .scratch   = */ {},
+        /* .src1_data = */ {},
+        /* .dst_data  = */ {},
     };
 
     ggml_backend_t backend = new ggml_backend {
@@ -862,24 +2301,33 @@ public:
     }
     ~rpc_server();
 
-    void hello(rpc_msg_hello_rsp & response);
+    void hello(const rpc_msg_hello_req & request, rpc_msg_hello_rsp & response);
     void alloc_buffer(const rpc_msg_alloc_buffer_req & request, rpc_msg_alloc_buffer_rsp & response);
     void get_alignment(rpc_msg_get_alignment_rsp & response);
     void get_max_size(rpc_msg_get_max_size_rsp & response);
     bool buffer_get_base(const rpc_msg_buffer_get_base_req & request, rpc_msg_buffer_get_base_rsp & response);
     bool free_buffer(const rpc_msg_free_buffer_req & request);
     bool buffer_clear(const rpc_msg_buffer_clear_req & request);
-    bool set_tensor(const std::vector<uint8_t> & input);
+    bool set_tensor(const uint8_t * input, size_t input_size);
+    bool set_tensor_encoded(const std::vector<uint8_t> & input);
     bool set_tensor_hash(const rpc_msg_set_tensor_hash_req & request, rpc_msg_set_tensor_hash_rsp & response);
     bool get_tensor(const rpc_msg_get_tensor_req & request, std::vector<uint8_t> & response);
+    bool get_tensor(const rpc_msg_get_tensor_req & request, void * data);
+    bool get_tensor_encoded(const rpc_msg_get_tensor_encoded_req & request, std::vector<uint8_t> & response);
     bool copy_tensor(const rpc_msg_copy_tensor_req & request, rpc_msg_copy_tensor_rsp & response);
-    bool graph_compute(const std::vector<uint8_t> & input, rpc_msg_graph_compute_rsp & response);
+    bool graph_compute(const std::vector<uint8_t> & input);
+    bool graph_recompute(const std::vector<uint8_t> & input);
+    void event_record(rpc_msg_event_record_rsp & response);
     bool init_tensor(const rpc_msg_init_tensor_req & request);
     bool get_alloc_size(const rpc_msg_get_alloc_size_req & request, rpc_msg_get_alloc_size_rsp & response);
 
 private:
     bool get_cached_file(uint64_t hash, std::vector<uint8_t> & data);
+    void save_cached_file(const void * data, size_t size);
     ggml_tensor * deserialize_tensor(struct ggml_context * ctx, const rpc_tensor * tensor);
+    ggml_tensor * deserialize_tensor_region(struct ggml_context * ctx, const rpc_tensor * tensor, uint64_t offset, uint64_t size);
+    bool update_tensor(ggml_tensor * result, const rpc_tensor * tensor);
+    void compute(ggml_cgraph * graph);
     ggml_tensor * create_node(uint64_t id,
                               struct ggml_context * ctx,
                               const std::unordered_map<uint64_t, const rpc_tensor*> & tensor_ptrs,
@@ -889,13 +2337,28 @@ private:
     ggml_backend_t backend;
     const char * cache_dir;
     std::unordered_set<ggml_backend_buffer_t> buffers;
+
+    // deserialized graph kept for RPC_CMD_GRAPH_RECOMPUTE
+    struct cached_graph {
+        uint64_t id;
+        ggml_context_ptr ctx;
+        ggml_cgraph * graph;
+        std::vector<rpc_tensor> tensors;     // the serialized tensors as last received
+        std::vector<ggml_tensor *> results;  // the deserialized tensors, in the same order
+    };
+    std::deque<cached_graph> graphs;
+
+    // the first failure of the graphs computed since the previous RPC_CMD_EVENT_RECORD
+    ggml_status compute_status = GGML_STATUS_SUCCESS;
 };
 
-void rpc_server::hello(rpc_msg_hello_rsp & response) {
+void rpc_server::hello(const rpc_msg_hello_req & request, rpc_msg_hello_rsp & response) {
     response.major = RPC_PROTO_MAJOR_VERSION;
     response.minor = RPC_PROTO_MINOR_VERSION;
     response.patch = RPC_PROTO_PATCH_VERSION;
-    GGML_PRINT_DEBUG("[%s] version: %d.%d.%d\n", __func__, response.major, response.minor, response.patch);
+    // all the encodings are supported
+    response.encodings = request.encodings & ((1u << RPC_ENCODING_COUNT) - 1);
+    GGML_PRINT_DEBUG("[%s] version: %d.%d.%d, encodings: 0x%x\n", __func__, response.major, response.minor, response.patch, response.encodings);
 }
 
 bool rpc_server::get_alloc_size(const rpc_msg_get_alloc_size_req & request, rpc_msg_get_alloc_size_rsp & response) {
@@ -971,6 +2434,8 @@ bool rpc_server::buffer_get_base(const rpc_msg_buffer_get_base_req & request, rp
 
 bool rpc_server::free_buffer(const rpc_msg_free_buffer_req & request) {
     GGML_PRINT_DEBUG("[%s] remote_ptr: %" PRIx64 "\n", __func__, request.remote_ptr);
+    // the cached graphs may reference the buffer, the client drops its copy of the cache as well
+    graphs.clear();
     ggml_backend_buffer_t buffer = reinterpret_cast<ggml_backend_buffer_t>(request.remote_ptr);
     if (buffers.find(buffer) == buffers.end()) {
         GGML_LOG_ERROR("[%s] buffer not found\n", __func__);
@@ -1008,7 +2473,16 @@ ggml_tensor * rpc_server::deserialize_tensor(struct ggml_context * ctx, const rp
         return nullptr;
     }
 
+    if (!update_tensor(result, tensor)) {
+        return nullptr;
+    }
+    return result;
+}
+
+// sets the parameters of a deserialized tensor, everything but its type and sources
+bool rpc_server::update_tensor(ggml_tensor * result, const rpc_tensor * tensor) {
     for (uint32_t i = 0; i < GGML_MAX_DIMS; i++) {
+        result->ne[i] = tensor->ne[i];
         result->nb[i] = tensor->nb[i];
     }
     result->buffer = reinterpret_cast<ggml_backend_buffer_t>(tensor->buffer);
@@ -1031,20 +2505,40 @@ ggml_tensor * rpc_server::deserialize_tensor(struct ggml_context * ctx, const rp
     }
     result->flags = tensor->flags;
     result->data = reinterpret_cast<void *>(tensor->data);
+    result->view_offs = tensor->view_offs;
     ggml_set_name(result, tensor->name);
-    return result;
+    return true;
 }
 
 
-bool rpc_server::set_tensor(const std::vector<uint8_t> & input) {
+// deserializes a tensor and checks that the data region at offset is within its buffer
+ggml_tensor * rpc_server::deserialize_tensor_region(struct ggml_context * ctx, const rpc_tensor * tensor, uint64_t offset, uint64_t size) {
+    ggml_tensor * result = deserialize_tensor(ctx, tensor);
+    if (result == nullptr) {
+        GGML_LOG_ERROR("[%s] error deserializing tensor\n", __func__);
+        return nullptr;
+    }
+    // sanitize tensor->data
+    const size_t p0 = (size_t) ggml_backend_buffer_get_base(result->buffer);
+    const size_t p1 = p0 + ggml_backend_buffer_get_size(result->buffer);
+
+    if (tensor->data + offset < p0 || tensor->data + offset >= p1 || size > (p1 - tensor->data - offset)) {
+        GGML_LOG_ERROR("[%s] tensor data region (data=0x%" PRIx64 ", offset=%" PRIu64 ", size=%" PRIu64 ") out of buffer bounds [0x%zx, 0x%zx)\n",
+                       __func__, tensor->data, offset, size, p0, p1);
+        return nullptr;
+    }
+    return result;
+}
+
+bool rpc_server::set_tensor(const uint8_t * input, size_t input_size) {
     // serialization format: | rpc_tensor | offset (8 bytes) | data (size bytes) |
-    if (input.size() < sizeof(rpc_tensor) + sizeof(uint64_t)) {
+    if (input_size < sizeof(rpc_tensor) + sizeof(uint64_t)) {
         return false;
     }
-    const rpc_tensor * in_tensor = (const rpc_tensor *)input.data();
+    const rpc_tensor * in_tensor = (const rpc_tensor *)input;
     uint64_t offset;
-    memcpy(&offset, input.data() + sizeof(rpc_tensor), sizeof(offset));
-    const size_t size = input.size() - sizeof(rpc_tensor) - sizeof(offset);
+    memcpy(&offset, input + sizeof(rpc_tensor), sizeof(offset));
+    const size_t size = input_size - sizeof(rpc_tensor) - sizeof(offset);
 
     struct ggml_init_params params {
         /*.mem_size   =*/ ggml_tensor_overhead(),
@@ -1054,37 +2548,60 @@ bool rpc_server::set_tensor(const std::vector<uint8_t> & input) {
     ggml_context_ptr ctx_ptr { ggml_init(params) };
     GGML_ASSERT(ctx_ptr != nullptr);
     ggml_context * ctx = ctx_ptr.get();
-    ggml_tensor * tensor = deserialize_tensor(ctx, in_tensor);
+    ggml_tensor * tensor = deserialize_tensor_region(ctx, in_tensor, offset, size);
     if (tensor == nullptr) {
-        GGML_LOG_ERROR("[%s] error deserializing tensor\n", __func__);
         return false;
     }
     GGML_PRINT_DEBUG("[%s] buffer: %p, data: %p, offset: %" PRIu64 ", size: %zu\n", __func__, (void*)tensor->buffer, tensor->data, offset, size);
 
-    // sanitize tensor->data
-    {
-        const size_t p0 = (size_t) ggml_backend_buffer_get_base(tensor->buffer);
-        const size_t p1 = p0 + ggml_backend_buffer_get_size(tensor->buffer);
+    const void * data = input + sizeof(rpc_tensor) + sizeof(offset);
+    save_cached_file(data, size);
+    ggml_backend_tensor_set(tensor, data, offset, size);
+    return true;
+}
 
-        if (in_tensor->data + offset < p0 || in_tensor->data + offset >= p1 || size > (p1 - in_tensor->data - offset)) {
-            GGML_LOG_ERROR("[%s] tensor data region (data=0x%" PRIx64 ", offset=%" PRIu64 ", size=%zu) out of buffer bounds [0x%zx, 0x%zx)\n",
-                           __func__, in_tensor->data, offset, size, p0, p1);
-            return false;
-        }
+void rpc_server::save_cached_file(const void * data, size_t size) {
+    if (cache_dir && size > HASH_THRESHOLD) {
+        uint64_t hash = fnv_hash((const uint8_t*)data, size);
+        char hash_str[17];
+        snprintf(hash_str, sizeof(hash_str), "%016" PRIx64, hash);
+        // save to cache_dir/hash_str
+        fs::path cache_file = fs::path(cache_dir) / hash_str;
+        std::ofstream ofs(cache_file, std::ios::binary);
+        ofs.write((const char *)data, size);
+        printf("[%s] saved to '%s'\n", __func__, cache_file.c_str());
+    }
+}
+
+bool rpc_server::set_tensor_encoded(const std::vector<uint8_t> & input) {
+    // serialization format: | rpc_msg_set_tensor_encoded_req | encoded data |
+    if (input.size() < sizeof(rpc_msg_set_tensor_encoded_req)) {
+        return false;
+    }
+    rpc_msg_set_tensor_encoded_req request;
+    memcpy(&request, input.data(), sizeof(request));
+
+    struct ggml_init_params params {
+        /*.mem_size   =*/ ggml_tensor_overhead(),
+        /*.mem_buffer =*/ NULL,
+        /*.no_alloc   =*/ true,
+    };
+    ggml_context_ptr ctx_ptr { ggml_init(params) };
+    GGML_ASSERT(ctx_ptr != nullptr);
+    ggml_context * ctx = ctx_ptr.get();
+    ggml_tensor * tensor = deserialize_tensor_region(ctx, &request.tensor, request.offset, request.size);
+    if (tensor == nullptr) {
+        return false;
     }
+    GGML_PRINT_DEBUG("[%s] buffer: %p, data: %p, offset: %" PRIu64 ", size: %" PRIu64 ", encoding: %d\n", __func__, (void*)tensor->buffer, tensor->data, request.offset, request.size, request.encoding);
 
-    const void * data = input.data() + sizeof(rpc_tensor) + sizeof(offset);
-    if (cache_dir && size > HASH_THRESHOLD) {
-        uint64_t hash = fnv_hash((const uint8_t*)data, size);
-        char hash_str[17];
-        snprintf(hash_str, sizeof(hash_str), "%016" PRIx64, hash);
-        // save to cache_dir/hash_str
-        fs::path cache_file = fs::path(cache_dir) / hash_str;
-        std::ofstream ofs(cache_file, std::ios::binary);
-        ofs.write((const char *)data, size);
-        printf("[%s] saved to '%s'\n", __func__, cache_file.c_str());
+    std::vector<uint8_t> data(request.size);
+    if (!rpc_decode(request.encoding, tensor->type, request.offset, input.data() + sizeof(request), input.size() - sizeof(request), data.data(), data.size())) {
+        GGML_LOG_ERROR("[%s] error decoding tensor data\n", __func__);
+        return false;
     }
-    ggml_backend_tensor_set(tensor, data, offset, size);
+    save_cached_file(data.data(), data.size());
+    ggml_backend_tensor_set(tensor, data.data(), request.offset, request.size);
     return true;
 }
 
@@ -1191,29 +2708,52 @@ bool rpc_server::get_tensor(const rpc_msg_get_tensor_req & request, std::vector<
     ggml_context_ptr ctx_ptr { ggml_init(params) };
     GGML_ASSERT(ctx_ptr != nullptr);
     ggml_context * ctx = ctx_ptr.get();
-    ggml_tensor * tensor = deserialize_tensor(ctx, &request.tensor);
+    ggml_tensor * tensor = deserialize_tensor_region(ctx, &request.tensor, request.offset, request.size);
     if (tensor == nullptr) {
-        GGML_LOG_ERROR("[%s] error deserializing tensor\n", __func__);
         return false;
     }
     GGML_PRINT_DEBUG("[%s] buffer: %p, data: %p, offset: %" PRIu64 ", size: %" PRIu64 "\n", __func__, (void*)tensor->buffer, tensor->data, request.offset, request.size);
 
-    // sanitize tensor->data
-    {
-        const size_t p0 = (size_t) ggml_backend_buffer_get_base(tensor->buffer);
-        const size_t p1 = p0 + ggml_backend_buffer_get_size(tensor->buffer);
+    response.resize(request.size, 0);
+    ggml_backend_tensor_get(tensor, response.data(), request.offset, request.size);
+    return true;
+}
 
-        if (request.tensor.data + request.offset < p0 ||
-            request.tensor.data + request.offset >= p1 ||
-            request.size > (p1 - request.tensor.data - request.offset)) {
-                GGML_LOG_ERROR("[%s] requested tensor region (data=0x%" PRIx64 ", offset=%" PRIu64 ", size=%" PRIu64 ") out of buffer bounds [0x%zx, 0x%zx)\n",
-                               __func__, request.tensor.data, request.offset, request.size, p0, p1);
-                return false;
-        }
+bool rpc_server::get_tensor(const rpc_msg_get_tensor_req & request, void * data) {
+    struct ggml_init_params params {
+        /*.mem_size   =*/ ggml_tensor_overhead(),
+        /*.mem_buffer =*/ NULL,
+        /*.no_alloc   =*/ true,
+    };
+    ggml_context_ptr ctx_ptr { ggml_init(params) };
+    GGML_ASSERT(ctx_ptr != nullptr);
+    ggml_context * ctx = ctx_ptr.get();
+    ggml_tensor * tensor = deserialize_tensor_region(ctx, &request.tensor, request.offset, request.size);
+    if (tensor == nullptr) {
+        return false;
     }
+    GGML_PRINT_DEBUG("[%s] buffer: %p, data: %p, offset: %" PRIu64 ", size: %" PRIu64 "\n", __func__, (void*)tensor->buffer, tensor->data, request.offset, request.size);
 
-    response.resize(request.size, 0);
-    ggml_backend_tensor_get(tensor, response.data(), request.offset, request.size);
+    ggml_backend_tensor_get(tensor, data, request.offset, request.size);
+    return true;
+}
+
+bool rpc_server::get_tensor_encoded(const rpc_msg_get_tensor_encoded_req & request, std::vector<uint8_t> & response) {
+    if (request.encoding >= RPC_ENCODING_COUNT) {
+        return false;
+    }
+    rpc_msg_get_tensor_req raw_request;
+    raw_request.tensor = request.tensor;
+    raw_request.offset = request.offset;
+    raw_request.size = request.size;
+    std::vector<uint8_t> data;
+    if (!get_tensor(raw_request, data)) {
+        return false;
+    }
+    // response format: | encoding (1 byte) | encoded data |
+    ggml_type type = (ggml_type) request.tensor.type;
+    response.resize(1);
+    response[0] = rpc_encode((rpc_encoding) request.encoding, type, request.offset, data.data(), data.size(), response);
     return true;
 }
 
@@ -1306,29 +2846,32 @@ ggml_tensor * rpc_server::create_node(uint64_t id,
             return nullptr;
         }
     }
-    result->view_offs = tensor->view_offs;
     return result;
 }
 
-bool rpc_server::graph_compute(const std::vector<uint8_t> & input, rpc_msg_graph_compute_rsp & response) {
+bool rpc_server::graph_compute(const std::vector<uint8_t> & input) {
     // serialization format:
-    // | n_nodes (4 bytes) | nodes (n_nodes * sizeof(uint64_t) | n_tensors (4 bytes) | tensors (n_tensors * sizeof(rpc_tensor)) |
-    if (input.size() < sizeof(uint32_t)) {
+    // | graph_id (8 bytes) | n_nodes (4 bytes) | nodes (n_nodes * sizeof(uint64_t) | n_tensors (4 bytes) | tensors (n_tensors * sizeof(rpc_tensor)) |
+    if (input.size() < sizeof(uint64_t) + sizeof(uint32_t)) {
         return false;
     }
+    uint64_t graph_id;
+    memcpy(&graph_id, input.data(), sizeof(graph_id));
+    const uint8_t * src = input.data() + sizeof(graph_id);
+    const size_t size = input.size() - sizeof(graph_id);
     uint32_t n_nodes;
-    memcpy(&n_nodes, input.data(), sizeof(n_nodes));
-    if (input.size() < sizeof(uint32_t) + n_nodes*sizeof(uint64_t) + sizeof(uint32_t)) {
+    memcpy(&n_nodes, src, sizeof(n_nodes));
+    if (size < sizeof(uint32_t) + n_nodes*sizeof(uint64_t) + sizeof(uint32_t)) {
         return false;
     }
-    const uint64_t * nodes = (const uint64_t *)(input.data() + sizeof(n_nodes));
+    const uint64_t * nodes = (const uint64_t *)(src + sizeof(n_nodes));
     uint32_t n_tensors;
-    memcpy(&n_tensors, input.data() + sizeof(n_nodes) + n_nodes*sizeof(uint64_t), sizeof(n_tensors));
-    if (input.size() < sizeof(uint32_t) + n_nodes*sizeof(uint64_t) + sizeof(uint32_t) + n_tensors*sizeof(rpc_tensor)) {
+    memcpy(&n_tensors, src + sizeof(n_nodes) + n_nodes*sizeof(uint64_t), sizeof(n_tensors));
+    if (size < sizeof(uint32_t) + n_nodes*sizeof(uint64_t) + sizeof(uint32_t) + n_tensors*sizeof(rpc_tensor)) {
         return false;
     }
-    const rpc_tensor * tensors = (const rpc_tensor *)(input.data() + sizeof(n_nodes) + n_nodes*sizeof(uint64_t) + sizeof(n_tensors));
-    GGML_PRINT_DEBUG("[%s] n_nodes: %u, n_tensors: %u\n", __func__, n_nodes, n_tensors);
+    const rpc_tensor * tensors = (const rpc_tensor *)(src + sizeof(n_nodes) + n_nodes*sizeof(uint64_t) + sizeof(n_tensors));
+    GGML_PRINT_DEBUG("[%s] id: %" PRIx64 ", n_nodes: %u, n_tensors: %u\n", __func__, graph_id, n_nodes, n_tensors);
 
     size_t buf_size = ggml_tensor_overhead()*(n_nodes + n_tensors) + ggml_graph_overhead_custom(n_nodes, false);
 
@@ -1360,54 +2903,259 @@ bool rpc_server::graph_compute(const std::vector<uint8_t> & input, rpc_msg_graph
             return false;
         }
     }
-    ggml_status status = ggml_backend_graph_compute(backend, graph);
-    response.result = status;
+
+    // keep the graph for RPC_CMD_GRAPH_RECOMPUTE, evicting in the same order as the client
+    if (graph_id == 0) {
+        compute(graph);
+        return true;
+    }
+    cached_graph cached;
+    cached.id = graph_id;
+    cached.graph = graph;
+    cached.tensors.assign(tensors, tensors + n_tensors);
+    cached.results.resize(n_tensors, nullptr);
+    for (uint32_t i = 0; i < n_tensors; i++) {
+        auto it = tensor_map.find(tensors[i].id);
+        if (it != tensor_map.end()) {
+            cached.results[i] = it->second;
+        }
+    }
+    cached.ctx = std::move(ctx_ptr);
+    for (auto it = graphs.begin(); it != graphs.end(); ++it) {
+        if (it->id == graph_id) {
+            graphs.erase(it);
+            break;
+        }
+    }
+    graphs.push_back(std::move(cached));
+    if (graphs.size() > GRAPH_CACHE_SIZE) {
+        graphs.pop_front();
+    }
+
+    compute(graph);
     return true;
 }
 
+bool rpc_server::graph_recompute(const std::vector<uint8_t> & input) {
+    // serialization format:
+    // | graph_id (8 bytes) | n_changed (4 bytes) | indices (n_changed * sizeof(uint32_t)) | tensors (n_changed * sizeof(rpc_tensor)) |
+    if (input.size() < sizeof(uint64_t) + sizeof(uint32_t)) {
+        return false;
+    }
+    uint64_t id;
+    memcpy(&id, input.data(), sizeof(id));
+    uint32_t n_changed;
+    memcpy(&n_changed, input.data() + sizeof(id), sizeof(n_changed));
+    if (input.size() < sizeof(uint64_t) + sizeof(uint32_t) + (uint64_t) n_changed*(sizeof(uint32_t) + sizeof(rpc_tensor))) {
+        return false;
+    }
+    const uint8_t * indices = input.data() + sizeof(id) + sizeof(n_changed);
+    const rpc_tensor * tensors = (const rpc_tensor *)(indices + n_changed*sizeof(uint32_t));
+    GGML_PRINT_DEBUG("[%s] id: %" PRIx64 ", n_changed: %u\n", __func__, id, n_changed);
+
+    cached_graph * cached = nullptr;
+    for (auto & g : graphs) {
+        if (g.id == id) {
+            cached = &g;
+            break;
+        }
+    }
+    if (cached == nullptr) {
+        GGML_LOG_ERROR("[%s] graph %" PRIx64 " not found\n", __func__, id);
+        return false;
+    }
+    for (uint32_t i = 0; i < n_changed; i++) {
+        uint32_t idx;
+        memcpy(&idx, indices + i*sizeof(uint32_t), sizeof(idx));
+        if (idx >= cached->tensors.size() || cached->results[idx] == nullptr) {
+            GGML_LOG_ERROR("[%s] invalid tensor index %u\n", __func__, idx);
+            return false;
+        }
+        rpc_tensor tensor;
+        memcpy(&tensor, &tensors[i], sizeof(tensor));
+        // only the parameters of a tensor can change, not its place in the graph
+        if (!rpc_tensor_same_node(cached->tensors[idx], tensor)) {
+            GGML_LOG_ERROR("[%s] tensor %u does not match the cached graph\n", __func__, idx);
+            return false;
+        }
+        if (!update_tensor(cached->results[idx], &tensor)) {
+            return false;
+        }
+        cached->tensors[idx] = tensor;
+    }
+
+    compute(cached->graph);
+    return true;
+}
+
+// there is no response, the client does not wait for the computation and receives the status with the next event
+void rpc_server::compute(ggml_cgraph * graph) {
+    ggml_status status = ggml_backend_graph_compute(backend, graph);
+    if (status != GGML_STATUS_SUCCESS) {
+        GGML_LOG_ERROR("[%s] graph compute failed: %s\n", __func__, ggml_status_to_string(status));
+        if (compute_status == GGML_STATUS_SUCCESS) {
+            compute_status = status;
+        }
+    }
+}
+
+void rpc_server::event_record(rpc_msg_event_record_rsp & response) {
+    response.status = compute_status;
+    compute_status = GGML_STATUS_SUCCESS;
+}
+
 rpc_server::~rpc_server() {
     for (auto buffer : buffers) {
         ggml_backend_buffer_free(buffer);
     }
 }
 
-static void rpc_serve_client(ggml_backend_t backend, const char * cache_dir,
-                             sockfd_t sockfd, size_t free_mem, size_t total_mem) {
-    rpc_server server(backend, cache_dir);
-    uint8_t cmd;
-    if (!recv_data(sockfd, &cmd, 1)) {
-        return;
+// a command received from a client
+struct rpc_request {
+    uint8_t              cmd;
+    std::vector<uint8_t> input;
+    // the input is in the shared memory at this position instead, until it is released
+    uint64_t             shm_pos = UINT64_MAX;
+    uint64_t             shm_size = 0;
+};
+
+// the commands of a client are received ahead of their execution by a separate thread, so that e.g. the upload of the
+// inputs of the next graph overlaps with the computation of the current one
+// the queue is bounded, and the reader waits for space before receiving the next command, so that a client that sends
+// faster than the server executes is slowed down by the socket instead of growing the memory of the server
+struct rpc_request_queue {
+    std::mutex              mutex;
+    std::condition_variable cv;       // signaled when a request is pushed or the connection is closed
+    std::condition_variable cv_space; // signaled when a request is popped or the server stops
+
+    std::deque<rpc_request> requests;
+    size_t                  n_bytes = 0;
+
+    bool closed  = false; // no more requests from the client
+    bool stopped = false; // no more requests are executed
+
+    // returns false when the server stops executing the requests
+    bool wait_space() {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv_space.wait(lock, [this] { return stopped || (requests.size() < REQUEST_QUEUE_SIZE && n_bytes < REQUEST_QUEUE_BYTES); });
+        return !stopped;
+    }
+
+    void push(rpc_request && request) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            n_bytes += request.input.size();
+            requests.push_back(std::move(request));
+        }
+        cv.notify_one();
     }
-    // the first command sent by the client must be HELLO
-    if (cmd != RPC_CMD_HELLO) {
-        fprintf(stderr, "Expected HELLO command, update client\n");
-        return;
+
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            closed = true;
+        }
+        cv.notify_one();
     }
-    if (!recv_msg(sockfd, nullptr, 0)) {
-        return;
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopped = true;
+        }
+        cv_space.notify_one();
     }
-    rpc_msg_hello_rsp response;
-    server.hello(response);
-    if (!send_msg(sockfd, &response, sizeof(response))) {
-        return;
+
+    // returns false when the connection is closed and all the requests have been processed
+    bool pop(rpc_request & request) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [this] { return closed || !requests.empty(); });
+            if (requests.empty()) {
+                return false;
+            }
+            request = std::move(requests.front());
+            requests.pop_front();
+            n_bytes -= request.input.size();
+        }
+        cv_space.notify_one();
+        return true;
     }
-    while (true) {
-        if (!recv_data(sockfd, &cmd, 1)) {
+};
+
+static bool recv_request(sockfd_t sockfd, rpc_shm * shm, rpc_request & request) {
+    if (!recv_data(sockfd, &request.cmd, 1)) {
+        return false;
+    }
+    if (request.cmd >= RPC_CMD_COUNT) {
+        // fail fast if the command is invalid
+        fprintf(stderr, "Unknown command: %d\n", request.cmd);
+        return false;
+    }
+    uint64_t size;
+    uint64_t pos;
+    if (!recv_msg_size(sockfd, shm, size, pos)) {
+        return false;
+    }
+    if (pos != UINT64_MAX) {
+        // the input stays in the shared memory, so that the tensor data is not copied
+        request.shm_pos = pos;
+        request.shm_size = size;
+        return true;
+    }
+    try {
+        request.input.resize(size);
+    } catch (const std::bad_alloc & e) {
+        fprintf(stderr, "Failed to allocate input buffer of size %" PRIu64 "\n", size);
+        return false;
+    }
+    return recv_data(sockfd, request.input.data(), size);
+}
+
+static void rpc_recv_requests(sockfd_t sockfd, rpc_shm * shm, rpc_request_queue & queue) {
+    while (queue.wait_space()) {
+        rpc_request request;
+        if (!recv_request(sockfd, shm, request)) {
             break;
         }
-        if (cmd >= RPC_CMD_COUNT) {
-            // fail fast if the command is invalid
-            fprintf(stderr, "Unknown command: %d\n", cmd);
-            break;
+        queue.push(std::move(request));
+    }
+    queue.close();
+}
+
+static bool parse_msg(const std::vector<uint8_t> & input, void * msg, size_t msg_size) {
+    if (input.size() != msg_size) {
+        return false;
+    }
+    if (msg_size > 0) {
+        memcpy(msg, input.data(), msg_size);
+    }
+    return true;
+}
+
+static void rpc_serve_requests(rpc_server & server, sockfd_t sockfd, rpc_shm * shm, rpc_request_queue & queue, size_t free_mem, size_t total_mem) {
+    rpc_request req;
+    while (queue.pop(req)) {
+        // the tensor data of SET_TENSOR is used in place, the other inputs are copied out of the shared memory
+        const uint8_t * input = req.input.data();
+        size_t input_size = req.input.size();
+        if (req.shm_pos != UINT64_MAX) {
+            input = shm_recv_ptr(shm, req.shm_pos);
+            input_size = req.shm_size;
+            if (req.cmd != RPC_CMD_SET_TENSOR) {
+                req.input.assign(input, input + input_size);
+                shm_release(shm, req.shm_pos + req.shm_size);
+                req.shm_pos = UINT64_MAX;
+            }
         }
-        switch (cmd) {
+        switch (req.cmd) {
             case RPC_CMD_HELLO: {
                 // HELLO command is handled above
                 return;
             }
             case RPC_CMD_ALLOC_BUFFER: {
                 rpc_msg_alloc_buffer_req request;
-                if (!recv_msg(sockfd, &request, sizeof(request))) {
+                if (!parse_msg(req.input, &request, sizeof(request))) {
                     return;
                 }
                 rpc_msg_alloc_buffer_rsp response;
@@ -1419,7 +3167,7 @@ static void rpc_serve_client(ggml_backend_t backend, const char * cache_dir,
             }
             case RPC_CMD_GET_ALLOC_SIZE: {
                 rpc_msg_get_alloc_size_req request;
-                if (!recv_msg(sockfd, &request, sizeof(request))) {
+                if (!parse_msg(req.input, &request, sizeof(request))) {
                     return;
                 }
                 rpc_msg_get_alloc_size_rsp response;
@@ -1432,7 +3180,7 @@ static void rpc_serve_client(ggml_backend_t backend, const char * cache_dir,
                 break;
             }
             case RPC_CMD_GET_ALIGNMENT: {
-                if (!recv_msg(sockfd, nullptr, 0)) {
+                if (!parse_msg(req.input, nullptr, 0)) {
                     return;
                 }
                 rpc_msg_get_alignment_rsp response;
@@ -1443,7 +3191,7 @@ static void rpc_serve_client(ggml_backend_t backend, const char * cache_dir,
                 break;
             }
             case RPC_CMD_GET_MAX_SIZE: {
-                if (!recv_msg(sockfd, nullptr, 0)) {
+                if (!parse_msg(req.input, nullptr, 0)) {
                     return;
                 }
                 rpc_msg_get_max_size_rsp response;
@@ -1455,7 +3203,7 @@ static void rpc_serve_client(ggml_backend_t backend, const char * cache_dir,
             }
             case RPC_CMD_BUFFER_GET_BASE: {
                 rpc_msg_buffer_get_base_req request;
-                if (!recv_msg(sockfd, &request, sizeof(request))) {
+                if (!parse_msg(req.input, &request, sizeof(request))) {
                     return;
                 }
                 rpc_msg_buffer_get_base_rsp response;
@@ -1469,7 +3217,7 @@ static void rpc_serve_client(ggml_backend_t backend, const char * cache_dir,
             }
             case RPC_CMD_FREE_BUFFER: {
                 rpc_msg_free_buffer_req request;
-                if (!recv_msg(sockfd, &request, sizeof(request))) {
+                if (!parse_msg(req.input, &request, sizeof(request))) {
                     return;
                 }
                 if (!server.free_buffer(request)) {
@@ -1482,7 +3230,7 @@ static void rpc_serve_client(ggml_backend_t backend, const char * cache_dir,
             }
             case RPC_CMD_BUFFER_CLEAR: {
                 rpc_msg_buffer_clear_req request;
-                if (!recv_msg(sockfd, &request, sizeof(request))) {
+                if (!parse_msg(req.input, &request, sizeof(request))) {
                     return;
                 }
                 if (!server.buffer_clear(request)) {
@@ -1494,18 +3242,20 @@ static void rpc_serve_client(ggml_backend_t backend, const char * cache_dir,
                 break;
             }
             case RPC_CMD_SET_TENSOR: {
-                std::vector<uint8_t> input;
-                if (!recv_msg(sockfd, input)) {
+                if (!server.set_tensor(input, input_size)) {
                     return;
                 }
-                if (!server.set_tensor(input)) {
+                break;
+            }
+            case RPC_CMD_SET_TENSOR_ENCODED: {
+                if (!server.set_tensor_encoded(req.input)) {
                     return;
                 }
                 break;
             }
             case RPC_CMD_SET_TENSOR_HASH: {
                 rpc_msg_set_tensor_hash_req request;
-                if (!recv_msg(sockfd, &request, sizeof(request))) {
+                if (!parse_msg(req.input, &request, sizeof(request))) {
                     return;
                 }
                 rpc_msg_set_tensor_hash_rsp response;
@@ -1519,7 +3269,7 @@ static void rpc_serve_client(ggml_backend_t backend, const char * cache_dir,
             }
             case RPC_CMD_INIT_TENSOR: {
                 rpc_msg_init_tensor_req request;
-                if (!recv_msg(sockfd, &request,sizeof(request))) {
+                if (!parse_msg(req.input, &request, sizeof(request))) {
                     return;
                 }
                 if (!server.init_tensor(request)) {
@@ -1532,9 +3282,20 @@ static void rpc_serve_client(ggml_backend_t backend, const char * cache_dir,
             }
             case RPC_CMD_GET_TENSOR: {
                 rpc_msg_get_tensor_req request;
-                if (!recv_msg(sockfd, &request, sizeof(request))) {
+                if (!parse_msg(req.input, &request, sizeof(request))) {
                     return;
                 }
+                uint64_t pos;
+                if (shm_reserve(shm, request.size, pos)) {
+                    // the data is written directly to the shared memory
+                    if (!server.get_tensor(request, shm_send_ptr(shm, pos))) {
+                        return;
+                    }
+                    if (!send_shm_msg(sockfd, request.size, pos)) {
+                        return;
+                    }
+                    break;
+                }
                 std::vector<uint8_t> response;
                 if (!server.get_tensor(request, response)) {
                     return;
@@ -1544,9 +3305,23 @@ static void rpc_serve_client(ggml_backend_t backend, const char * cache_dir,
                 }
                 break;
             }
+            case RPC_CMD_GET_TENSOR_ENCODED: {
+                rpc_msg_get_tensor_encoded_req request;
+                if (!parse_msg(req.input, &request, sizeof(request))) {
+                    return;
+                }
+                std::vector<uint8_t> response;
+                if (!server.get_tensor_encoded(request, response)) {
+                    return;
+                }
+                if (!send_msg(sockfd, response.data(), response.size())) {
+                    return;
+                }
+                break;
+            }
             case RPC_CMD_COPY_TENSOR: {
                 rpc_msg_copy_tensor_req request;
-                if (!recv_msg(sockfd, &request, sizeof(request))) {
+                if (!parse_msg(req.input, &request, sizeof(request))) {
                     return;
                 }
                 rpc_msg_copy_tensor_rsp response;
@@ -1559,21 +3334,39 @@ static void rpc_serve_client(ggml_backend_t backend, const char * cache_dir,
                 break;
             }
             case RPC_CMD_GRAPH_COMPUTE: {
-                std::vector<uint8_t> input;
-                if (!recv_msg(sockfd, input)) {
+                if (!server.graph_compute(req.input)) {
+                    return;
+                }
+                break;
+            }
+            case RPC_CMD_GRAPH_RECOMPUTE: {
+                if (!server.graph_recompute(req.input)) {
+                    return;
+                }
+                break;
+            }
+            case RPC_CMD_SHM_ATTACH: {
+                // the shared memory can only be attached right after HELLO
+                rpc_msg_shm_attach_rsp response = {};
+                if (!send_msg(sockfd, &response, sizeof(response))) {
                     return;
                 }
-                rpc_msg_graph_compute_rsp response;
-                if (!server.graph_compute(input, response)) {
+                break;
+            }
+            case RPC_CMD_EVENT_RECORD: {
+                // the commands are executed in order, so the previous ones are done when the response is sent
+                if (!parse_msg(req.input, nullptr, 0)) {
                     return;
                 }
+                rpc_msg_event_record_rsp response;
+                server.event_record(response);
                 if (!send_msg(sockfd, &response, sizeof(response))) {
                     return;
                 }
                 break;
             }
             case RPC_CMD_GET_DEVICE_MEMORY: {
-                if (!recv_msg(sockfd, nullptr, 0)) {
+                if (!parse_msg(req.input, nullptr, 0)) {
                     return;
                 }
                 rpc_msg_get_device_memory_rsp response;
@@ -1585,11 +3378,87 @@ static void rpc_serve_client(ggml_backend_t backend, const char * cache_dir,
                 break;
             }
             default: {
-                fprintf(stderr, "Unknown command: %d\n", cmd);
+                fprintf(stderr, "Unknown command: %d\n", req.cmd);
                 return;
             }
         }
+        if (req.shm_pos != UINT64_MAX) {
+            shm_release(shm, req.shm_pos + req.shm_size);
+        }
+    }
+}
+
+static void rpc_serve_client(ggml_backend_t backend, const char * cache_dir,
+                             sockfd_t sockfd, size_t free_mem, size_t total_mem) {
+    rpc_server server(backend, cache_dir);
+    uint8_t cmd;
+    if (!recv_data(sockfd, &cmd, 1)) {
+        return;
+    }
+    // the first command sent by the client must be HELLO
+    if (cmd != RPC_CMD_HELLO) {
+        fprintf(stderr, "Expected HELLO command, update client\n");
+        return;
+    }
+    std::vector<uint8_t> input;
+    if (!recv_msg(sockfd, input)) {
+        return;
+    }
+    rpc_msg_hello_req request = {};
+    if (input.empty()) {
+        // clients before v5.0.0 send no request and expect only the version, let them report the mismatch
+        rpc_msg_hello_rsp response = {};
+        server.hello(request, response);
+        send_msg(sockfd, &response, offsetof(rpc_msg_hello_rsp, encodings));
+        return;
+    }
+    if (!parse_msg(input, &request, sizeof(request))) {
+        return;
+    }
+    rpc_msg_hello_rsp response = {};
+    server.hello(request, response);
+    if (!send_msg(sockfd, &response, sizeof(response))) {
+        return;
+    }
+
+    rpc_request_queue queue;
+
+    // the client may attach shared memory right after HELLO, before the requests are received by the reader
+    std::unique_ptr<rpc_shm> shm;
+    rpc_request first;
+    if (!recv_request(sockfd, nullptr, first)) {
+        return;
+    }
+    if (first.cmd == RPC_CMD_SHM_ATTACH) {
+        rpc_msg_shm_attach_req attach_req;
+        if (!parse_msg(first.input, &attach_req, sizeof(attach_req))) {
+            return;
+        }
+#ifdef RPC_SHM_SUPPORTED
+        // the responses are sent by shm_attach(), a failure leaves the client on the socket
+        shm = shm_attach(sockfd, attach_req);
+#else
+        rpc_msg_shm_attach_rsp attach_rsp = {};
+        if (!send_msg(sockfd, &attach_rsp, sizeof(attach_rsp))) {
+            return;
+        }
+#endif
+    } else {
+        queue.push(std::move(first));
     }
+
+    std::thread reader(rpc_recv_requests, sockfd, shm.get(), std::ref(queue));
+
+    rpc_serve_requests(server, sockfd, shm.get(), queue, free_mem, total_mem);
+
+    // unblock the reader if the connection is still open
+    queue.stop();
+#ifdef _WIN32
+    shutdown(sockfd, SD_BOTH);
+#else
+    shutdown(sockfd, SHUT_RDWR);
+#endif
+    reader.join();
 }
 
 void ggml_backend_rpc_start_server(ggml_backend_t backend, const char * endpoint,
@@ -1642,11 +3511,6 @@ void ggml_backend_rpc_start_server(ggml_backend_t backend, const char * endpoint
 
 // device interface
 
-struct ggml_backend_rpc_device_context {
-    std::string endpoint;
-    std::string name;
-};
-
 static const char * ggml_backend_rpc_device_get_name(ggml_backend_dev_t dev) {
     ggml_backend_rpc_device_context * ctx = (ggml_backend_rpc_device_context *)dev->context;
 
@@ -1680,10 +3544,10 @@ static void ggml_backend_rpc_device_get_props(ggml_backend_dev_t dev, struct ggm
     props->type        = ggml_backend_rpc_device_get_type(dev);
     ggml_backend_rpc_device_get_memory(dev, &props->memory_free, &props->memory_total);
     props->caps = {
-        /* .async                 = */ false,
+        /* .async                 = */ true,
         /* .host_buffer           = */ false,
         /* .buffer_from_host_ptr  = */ false,
-        /* .events                = */ false,
+        /* .events                = */ true,
     };
 }
 
@@ -1704,13 +3568,30 @@ static ggml_backend_buffer_type_t ggml_backend_rpc_device_get_buffer_type(ggml_b
 }
 
 static bool ggml_backend_rpc_device_supports_op(ggml_backend_dev_t dev, const struct ggml_tensor * op) {
-    GGML_UNUSED(dev);
-    GGML_UNUSED(op);
+    // row-split weights can only be multiplied by the backend of the main device, see ggml_backend_rpc_split_mul_mat
+    for (int i = 0; i < GGML_MAX_SRC; i++) {
+        const ggml_tensor * src = op->src[i];
+        if (src == nullptr || src->buffer == nullptr || !ggml_backend_buft_is_rpc_split(src->buffer->buft)) {
+            continue;
+        }
+        if (i != 0 || op->op != GGML_OP_MUL_MAT || op->type != GGML_TYPE_F32) {
+            return false;
+        }
+        if (!ggml_is_contiguous(src) || src->ne[2] != 1 || src->ne[3] != 1) {
+            return false;
+        }
+        if (src->buffer->buft->device != dev) {
+            return false;
+        }
+    }
     //TODO: call the remote backend and cache the results
     return true;
 }
 
 static bool ggml_backend_rpc_device_supports_buft(ggml_backend_dev_t dev, ggml_backend_buffer_type_t buft) {
+    if (buft && ggml_backend_buft_is_rpc_split(buft)) {
+        return buft->device == dev;
+    }
     if (!buft || buft->iface.get_name != ggml_backend_rpc_buffer_type_name) {
         return false;
     }
@@ -1719,6 +3600,34 @@ static bool ggml_backend_rpc_device_supports_buft(ggml_backend_dev_t dev, ggml_b
     return buft_ctx->endpoint == dev_ctx->endpoint;
 }
 
+static ggml_backend_event_t ggml_backend_rpc_device_event_new(ggml_backend_dev_t dev) {
+    ggml_backend_rpc_device_context * ctx = (ggml_backend_rpc_device_context *)dev->context;
+    auto sock = get_socket(ctx->endpoint);
+    if (sock == nullptr) {
+        return nullptr;
+    }
+    return new ggml_backend_event {
+        /* .device  = */ dev,
+        /* .context = */ new ggml_backend_rpc_event_context { sock, 0 },
+    };
+}
+
+static void ggml_backend_rpc_device_event_free(ggml_backend_dev_t dev, ggml_backend_event_t event) {
+    ggml_backend_rpc_event_context * event_ctx = (ggml_backend_rpc_event_context *)event->context;
+    delete event_ctx;
+    delete event;
+
+    GGML_UNUSED(dev);
+}
+
+static void ggml_backend_rpc_device_event_synchronize(ggml_backend_dev_t dev, ggml_backend_event_t event) {
+    ggml_backend_rpc_event_context * event_ctx = (ggml_backend_rpc_event_context *)event->context;
+    bool status = recv_pending_rsp(event_ctx->sock, event_ctx->seq);
+    RPC_STATUS_ASSERT(status);
+
+    GGML_UNUSED(dev);
+}
+
 static const struct ggml_backend_device_i ggml_backend_rpc_device_i = {
     /* .get_name             = */ ggml_backend_rpc_device_get_name,
     /* .get_description      = */ ggml_backend_rpc_device_get_description,
@@ -1732,9 +3641,9 @@ static const struct ggml_backend_device_i ggml_backend_rpc_device_i = {
     /* .supports_op          = */ ggml_backend_rpc_device_supports_op,
     /* .supports_buft        = */ ggml_backend_rpc_device_supports_buft,
     /* .offload_op           = */ NULL,
-    /* .event_new            = */ NULL,
-    /* .event_free           = */ NULL,
-    /* .event_synchronize    = */ NULL,
+    /* .event_new            = */ ggml_backend_rpc_device_event_new,
+    /* .event_free           = */ ggml_backend_rpc_device_event_free,
+    /* .event_synchronize    = */ ggml_backend_rpc_device_event_synchronize,
 };
 
 // backend reg interface
@@ -1745,17 +3654,32 @@ static const char * ggml_backend_rpc_reg_get_name(ggml_backend_reg_t reg) {
     GGML_UNUSED(reg);
 }
 
+// the devices added with ggml_backend_rpc_add_device, in order
+struct ggml_backend_rpc_reg_context {
+    std::mutex mutex;
+    std::vector<ggml_backend_dev_t> devices;
+};
+
+static ggml_backend_rpc_reg_context & ggml_backend_rpc_reg_ctx() {
+    static ggml_backend_rpc_reg_context ctx;
+    return ctx;
+}
+
 static size_t ggml_backend_rpc_reg_get_device_count(ggml_backend_reg_t reg) {
-    return 0;
+    auto & ctx = ggml_backend_rpc_reg_ctx();
+    std::lock_guard<std::mutex> lock(ctx.mutex);
+    return ctx.devices.size();
 
     GGML_UNUSED(reg);
 }
 
 static ggml_backend_dev_t ggml_backend_rpc_reg_get_device(ggml_backend_reg_t reg, size_t index) {
-    GGML_ABORT("The RPC backend does not have enumerated devices - use ggml_backend_add_device instead");
+    auto & ctx = ggml_backend_rpc_reg_ctx();
+    std::lock_guard<std::mutex> lock(ctx.mutex);
+    GGML_ASSERT(index < ctx.devices.size());
+    return ctx.devices[index];
 
     GGML_UNUSED(reg);
-    GGML_UNUSED(index);
 }
 
 static void * ggml_backend_rpc_get_proc_address(ggml_backend_reg_t reg, const char * name) {
@@ -1765,6 +3689,9 @@ static void * ggml_backend_rpc_get_proc_address(ggml_backend_reg_t reg, const ch
     if (std::strcmp(name, "ggml_backend_rpc_start_server") == 0) {
         return (void *)ggml_backend_rpc_start_server;
     }
+    if (std::strcmp(name, "ggml_backend_split_buffer_type") == 0) {
+        return (void *)ggml_backend_rpc_split_buffer_type;
+    }
     return NULL;
 
     GGML_UNUSED(reg);
@@ -1790,8 +3717,8 @@ ggml_backend_reg_t ggml_backend_rpc_reg(void) {
 ggml_backend_dev_t ggml_backend_rpc_add_device(const char * endpoint) {
     static std::unordered_map<std::string, ggml_backend_dev_t> dev_map;
 
-    static std::mutex mutex;
-    std::lock_guard<std::mutex> lock(mutex);
+    auto & reg_ctx = ggml_backend_rpc_reg_ctx();
+    std::lock_guard<std::mutex> lock(reg_ctx.mutex);
 
     if (dev_map.find(endpoint) != dev_map.end()) {
         return dev_map[endpoint];
@@ -1809,6 +3736,7 @@ ggml_backend_dev_t ggml_backend_rpc_add_device(const char * endpoint) {
     };
 
     dev_map[endpoint] = dev;
+    reg_ctx.devices.push_back(dev);
 
     return dev;
 }
@@ -61,6 +61,7 @@ extern "C" {
     struct llama_model;
     struct llama_context;
     struct llama_sampler;
+    struct llama_detokenizer;
 
     typedef struct llama_memory_i * llama_memory_t;
 
@@ -328,6 +329,7 @@ extern "C" {
         bool use_mmap;      // use mmap if possible
         bool use_mlock;     // force system to keep model in RAM
         bool check_tensors; // validate model tensor data
+        bool use_direct_io; // read the model with direct I/O, bypassing the page cache (Linux only, implies no mmap)
     };
 
     // NOTE: changing the default values of parameters marked as [EXPERIMENTAL] may cause crashes or incorrect results in certain configurations
@@ -662,9 +664,11 @@ extern "C" {
               llama_seq_id seq_id);
 
     // Adds relative position "delta" to all tokens that belong to the specified sequence and have positions in [p0, p1)
+    // Returns false if there are not enough free cells to copy the tokens shared with other sequences,
+    // the positions are not modified in that case
     // p0 < 0 : [0,  p1]
     // p1 < 0 : [p0, inf)
-    LLAMA_API void llama_memory_seq_add(
+    LLAMA_API bool llama_memory_seq_add(
             llama_memory_t mem,
               llama_seq_id seq_id,
                  llama_pos p0,
@@ -672,9 +676,11 @@ extern "C" {
                  llama_pos delta);
 
     // Integer division of the positions by factor of `d > 1`
+    // Returns false if there are not enough free cells to copy the tokens shared with other sequences,
+    // the positions are not modified in that case
     // p0 < 0 : [0,  p1]
     // p1 < 0 : [p0, inf)
-    LLAMA_API void llama_memory_seq_div(
+    LLAMA_API bool llama_memory_seq_div(
             llama_memory_t mem,
               llama_seq_id seq_id,
                  llama_pos p0,
@@ -1105,6 +1111,19 @@ extern "C" {
                             bool   add_special,
                             bool   parse_special);
 
+    /// @details Same as llama_tokenize, but large texts are tokenized on n_threads threads.
+    /// The text is pre-tokenized first and the words are split into shards that are tokenized in parallel,
+    /// the result is identical to llama_tokenize. Only BPE vocabs use multiple threads.
+    LLAMA_API int32_t llama_tokenize_parallel(
+        const struct llama_vocab * vocab,
+                      const char * text,
+                         int32_t   text_len,
+                     llama_token * tokens,
+                         int32_t   n_tokens_max,
+                            bool   add_special,
+                            bool   parse_special,
+                         int32_t   n_threads);
+
     // Token Id -> Piece.
     // Uses the vocabulary in the provided context.
     // Does not write null terminator to the buffer.
@@ -1133,6 +1152,42 @@ extern "C" {
                             bool   remove_special,
                             bool   unparse_special);
 
+    //
+    // Incremental detokenization
+    //
+    // Converts the tokens to text one at a time, as they are generated, and outputs only complete UTF-8 characters.
+    // The bytes of a character that is split across tokens are held until the next tokens complete it.
+    // Invalid UTF-8 is output as is, as soon as it cannot become a valid character anymore.
+    //
+
+    LLAMA_API struct llama_detokenizer * llama_detokenizer_init(const struct llama_vocab * vocab);
+
+    LLAMA_API void llama_detokenizer_free(struct llama_detokenizer * detok);
+
+    /// @details Append the text of the token and write the complete UTF-8 characters that are ready to buf.
+    /// @return Returns the number of bytes written, no more than length.
+    /// @return Returns a negative number on failure - the number of bytes that would have been written. The token is not consumed.
+    /// @param special If true, special tokens are rendered in the output.
+    LLAMA_API int32_t llama_detokenizer_push(
+            struct llama_detokenizer * detok,
+                         llama_token   token,
+                                char * buf,
+                             int32_t   length,
+                                bool   special);
+
+    /// @details Write the held bytes of an incomplete character to buf, e.g. at the end of the generation, and clear them.
+    /// @return Same as llama_detokenizer_push.
+    LLAMA_API int32_t llama_detokenizer_flush(
+            struct llama_detokenizer * detok,
+                                char * buf,
+                             int32_t   length);
+
+    /// @details Number of bytes held until the current character is complete.
+    LLAMA_API int32_t llama_detokenizer_n_pending(const struct llama_detokenizer * detok);
+
+    /// @details Drop the held bytes, to start a new text.
+    LLAMA_API void llama_detokenizer_reset(struct llama_detokenizer * detok);
+
     //
     // Chat templates
     //
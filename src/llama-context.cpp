@@ -2434,30 +2434,30 @@ void llama_memory_seq_keep(
     mem->seq_keep(seq_id);
 }
 
-void llama_memory_seq_add(
+bool llama_memory_seq_add(
         llama_memory_t mem,
           llama_seq_id seq_id,
              llama_pos p0,
              llama_pos p1,
              llama_pos delta) {
     if (!mem) {
-        return;
+        return true;
     }
 
-    mem->seq_add(seq_id, p0, p1, delta);
+    return mem->seq_add(seq_id, p0, p1, delta);
 }
 
-void llama_memory_seq_div(
+bool llama_memory_seq_div(
         llama_memory_t mem,
           llama_seq_id seq_id,
              llama_pos p0,
              llama_pos p1,
                    int d) {
     if (!mem) {
-        return;
+        return true;
     }
 
-    mem->seq_div(seq_id, p0, p1, d);
+    return mem->seq_div(seq_id, p0, p1, d);
 }
 
 llama_pos llama_memory_seq_pos_min(
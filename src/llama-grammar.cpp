@@ -4,9 +4,15 @@
 #include "llama-vocab.h"
 #include "llama-sampling.h"
 
+#include <array>
 #include <cmath>
 #include <algorithm>
+#include <cstring>
+#include <list>
+#include <mutex>
 #include <stdexcept>
+#include <string_view>
+#include <unordered_map>
 
 //
 // helpers
@@ -823,11 +829,14 @@ llama_grammar_stacks & llama_grammar_get_stacks(struct llama_grammar * grammar)
     return grammar->stacks;
 }
 
-void llama_grammar_accept(struct llama_grammar * grammar, uint32_t chr) {
+static llama_grammar_stacks llama_grammar_accept_chr(
+        const llama_grammar_rules  & rules,
+        const llama_grammar_stacks & stacks,
+        uint32_t                     chr) {
     llama_grammar_stacks stacks_new;
-    stacks_new.reserve(grammar->stacks.size());
+    stacks_new.reserve(stacks.size());
 
-    for (const auto & stack : grammar->stacks) {
+    for (const auto & stack : stacks) {
         if (stack.empty()) {
             continue;
         }
@@ -841,11 +850,411 @@ void llama_grammar_accept(struct llama_grammar * grammar, uint32_t chr) {
             if (!llama_grammar_is_end_of_sequence(pos)) {
                 new_stack.push_back(pos);
             }
-            llama_grammar_advance_stack(grammar->rules, new_stack, stacks_new);
+            llama_grammar_advance_stack(rules, new_stack, stacks_new);
+        }
+    }
+
+    return stacks_new;
+}
+
+//
+// grammar automaton
+//
+
+// the sets of stacks reached by the grammar are numbered as they are discovered and the transitions between them are
+// memoized per code point, so once warmed up, advancing by a character is a table lookup instead of re-expanding the
+// stacks. the states are discovered lazily, because the set of reachable states can be unbounded (nesting)
+struct llama_grammar_dfa {
+    // start over when the automaton grows beyond this
+    static constexpr size_t max_states = 1 << 14;
+
+    struct state {
+        const llama_grammar_stacks * stacks; // key in ids
+
+        std::array<int32_t, 128> next_ascii; // -1 if not computed yet
+        std::unordered_map<uint32_t, uint32_t> next;
+
+        std::vector<uint32_t> key; // see get_key(), empty if not computed yet
+    };
+
+    std::vector<state> states;
+    std::map<llama_grammar_stacks, uint32_t> ids;
+
+    uint32_t get_id(const llama_grammar_stacks & stacks) {
+        auto it = ids.find(stacks);
+        if (it != ids.end()) {
+            return it->second;
+        }
+
+        const uint32_t id = states.size();
+
+        it = ids.emplace(stacks, id).first;
+
+        state st;
+        st.stacks = &it->first;
+        st.next_ascii.fill(-1);
+
+        states.push_back(std::move(st));
+
+        return id;
+    }
+
+    uint32_t get_next(const llama_grammar_rules & rules, uint32_t id, uint32_t chr) {
+        if (chr < 128) {
+            const int32_t res = states[id].next_ascii[chr];
+            if (res >= 0) {
+                return res;
+            }
+        } else {
+            const auto it = states[id].next.find(chr);
+            if (it != states[id].next.end()) {
+                return it->second;
+            }
+        }
+
+        const uint32_t res = get_id(llama_grammar_accept_chr(rules, *states[id].stacks, chr));
+
+        if (chr < 128) {
+            states[id].next_ascii[chr] = res;
+        } else {
+            states[id].next[chr] = res;
+        }
+
+        return res;
+    }
+
+    bool is_dead(uint32_t id) const {
+        return states[id].stacks->empty();
+    }
+
+    // the stacks with the elements given by their offset in the rules instead of their address, which identifies the
+    // state in all grammars with the same rules
+    const std::vector<uint32_t> & get_key(const llama_grammar_rules & rules, uint32_t id) {
+        auto & key = states[id].key;
+        if (!key.empty()) {
+            return key;
+        }
+
+        key.push_back(states[id].stacks->size());
+
+        for (const auto & stack : *states[id].stacks) {
+            key.push_back(stack.size());
+
+            for (const llama_grammar_element * elem : stack) {
+                uint32_t offset = 0;
+                for (const auto & rule : rules) {
+                    if (elem >= rule.data() && elem < rule.data() + rule.size()) {
+                        offset += elem - rule.data();
+                        break;
+                    }
+                    offset += rule.size();
+                }
+                key.push_back(offset);
+            }
+        }
+
+        return key;
+    }
+};
+
+static llama_grammar_dfa & llama_grammar_get_dfa(const struct llama_grammar & grammar) {
+    if (!grammar.dfa || grammar.dfa->states.size() > llama_grammar_dfa::max_states) {
+        grammar.dfa = std::make_shared<llama_grammar_dfa>();
+    }
+
+    return *grammar.dfa;
+}
+
+// the pieces of all tokens that the grammar can accept, as a byte trie stored in preorder: the first child of a node
+// immediately follows it, and skip jumps over its subtree. a single walk of the trie applies the grammar to all tokens,
+// sharing the work for common prefixes and pruning the subtrees rejected by the grammar
+struct llama_grammar_vocab_trie {
+    struct node {
+        uint8_t  byte;
+        uint32_t depth;
+        uint32_t skip;      // next node outside of the subtree
+        uint32_t tok_begin; // tokens whose piece ends at this node: [tok_begin, tok_end)
+        uint32_t tok_end;
+    };
+
+    std::vector<node>        nodes; // nodes[0] is the root
+    std::vector<llama_token> tokens;
+
+    uint32_t max_depth = 0;
+};
+
+static std::shared_ptr<const llama_grammar_vocab_trie> llama_grammar_build_trie_impl(const llama_vocab & vocab) {
+    auto res = std::make_shared<llama_grammar_vocab_trie>();
+
+    std::vector<std::pair<std::string_view, llama_token>> pieces;
+    pieces.reserve(vocab.n_tokens());
+
+    for (llama_token id = 0; id < (llama_token) vocab.n_tokens(); ++id) {
+        if (vocab.is_eog(id)) {
+            continue;
+        }
+
+        // the decoding stops at the first 0, and tokens that start with it are never allowed
+        const std::string & piece = vocab.token_to_piece(id);
+        const size_t len = strlen(piece.c_str());
+        if (len == 0) {
+            continue;
+        }
+
+        pieces.emplace_back(std::string_view(piece.data(), len), id);
+    }
+
+    std::sort(pieces.begin(), pieces.end());
+
+    auto & nodes = res->nodes;
+
+    nodes.push_back({ 0, 0, 0, 0, 0 });
+
+    // path[d] is the node at depth d on the path to the previous piece
+    std::vector<uint32_t> path = { 0 };
+    std::string_view prev;
+
+    for (const auto & [piece, id] : pieces) {
+        size_t n_common = 0;
+        while (n_common < prev.size() && n_common < piece.size() && prev[n_common] == piece[n_common]) {
+            n_common++;
+        }
+
+        while (path.size() > n_common + 1) {
+            nodes[path.back()].skip = nodes.size();
+            path.pop_back();
+        }
+
+        for (size_t i = n_common; i < piece.size(); ++i) {
+            path.push_back(nodes.size());
+            nodes.push_back({ (uint8_t) piece[i], (uint32_t) i + 1, 0, 0, 0 });
+        }
+
+        // duplicate pieces end at the same node and are adjacent in the sorted order
+        auto & last = nodes[path.back()];
+        if (last.tok_begin == last.tok_end) {
+            last.tok_begin = res->tokens.size();
+        }
+        res->tokens.push_back(id);
+        last.tok_end = res->tokens.size();
+
+        res->max_depth = std::max<uint32_t>(res->max_depth, piece.size());
+
+        prev = piece;
+    }
+
+    while (!path.empty()) {
+        nodes[path.back()].skip = nodes.size();
+        path.pop_back();
+    }
+
+    return res;
+}
+
+// the trie is shared by all grammars of the vocab while any of them is alive
+static std::shared_ptr<const llama_grammar_vocab_trie> llama_grammar_build_trie(const llama_vocab & vocab) {
+    static std::mutex mutex;
+    static std::map<const llama_vocab *, std::weak_ptr<const llama_grammar_vocab_trie>> tries;
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    auto it = tries.find(&vocab);
+    if (it != tries.end()) {
+        if (auto res = it->second.lock()) {
+            return res;
+        }
+    }
+
+    // a new entry: drop the ones of the vocabs that have no grammar anymore
+    for (it = tries.begin(); it != tries.end(); ) {
+        if (it->second.expired()) {
+            it = tries.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    auto res = llama_grammar_build_trie_impl(vocab);
+    tries[&vocab] = res;
+
+    return res;
+}
+
+// mark the tokens accepted by the grammar in the current state, equivalent to llama_grammar_reject_candidates() for
+// all tokens of the vocab that are not EOG
+static void llama_grammar_mask_tokens(const struct llama_grammar & grammar, std::vector<uint64_t> & allowed) {
+    if (!grammar.trie) {
+        grammar.trie = llama_grammar_build_trie(*grammar.vocab);
+    }
+
+    const auto & trie  = *grammar.trie;
+    const auto & nodes = trie.nodes;
+
+    auto & dfa = llama_grammar_get_dfa(grammar);
+
+    // the UTF-8 decoder of decode_utf8(), one byte at a time
+    struct walk_state {
+        uint32_t id;       // state of the automaton after the complete code points
+        uint32_t value;    // partial code point
+        int      n_remain; // bytes remaining in the partial code point
+        bool     cont;     // continuing the partial code point of the previous token (the bytes are validated)
+    };
+
+    static const int lookup[] = { 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 2, 2, 3, 4 };
+
+    std::vector<walk_state> path(trie.max_depth + 1);
+
+    const int n_remain = std::max(0, grammar.partial_utf8.n_remain);
+
+    path[0] = { dfa.get_id(grammar.stacks), grammar.partial_utf8.value, n_remain, n_remain > 0 };
+
+    size_t i = 1;
+    while (i < nodes.size()) {
+        const auto & node = nodes[i];
+
+        walk_state st = path[node.depth - 1];
+
+        bool valid = true;
+
+        if (st.n_remain > 0) {
+            if (st.cont && (node.byte >> 6) != 2) {
+                // invalid sequence
+                valid = false;
+            } else {
+                st.value = (st.value << 6) + (node.byte & 0x3F);
+                if (--st.n_remain == 0) {
+                    st.cont = false;
+                    st.id   = dfa.get_next(grammar.rules, st.id, st.value);
+                }
+            }
+        } else {
+            st.n_remain = lookup[node.byte >> 4] - 1;
+            if (st.n_remain < 0) {
+                // invalid sequence
+                valid = false;
+            } else {
+                st.value = node.byte & ((1 << (7 - st.n_remain)) - 1);
+                if (st.n_remain == 0) {
+                    st.id = dfa.get_next(grammar.rules, st.id, st.value);
+                }
+            }
         }
+
+        // no token with this prefix can be accepted
+        if (!valid || dfa.is_dead(st.id)) {
+            i = node.skip;
+            continue;
+        }
+
+        path[node.depth] = st;
+
+        if (node.tok_begin != node.tok_end) {
+            bool accept = st.n_remain == 0;
+
+            // a token that ends in a partial sequence needs a stack that can be continued with it
+            for (size_t is = 0; !accept && is < dfa.states[st.id].stacks->size(); ++is) {
+                const auto & stack = (*dfa.states[st.id].stacks)[is];
+
+                accept = !stack.empty() && llama_grammar_match_partial_char(stack.back(), { st.value, st.n_remain });
+            }
+
+            if (accept) {
+                for (uint32_t it = node.tok_begin; it < node.tok_end; ++it) {
+                    const llama_token id = trie.tokens[it];
+                    allowed[id / 64] |= uint64_t(1) << (id % 64);
+                }
+            }
+        }
+
+        ++i;
     }
+}
+
+//
+// token mask cache
+//
+
+// the tokens allowed in recently seen states of the grammar, as bitsets over the vocab. the states are identified by
+// the canonical form of the stacks and the partial UTF-8 sequence, so the cache is shared by all grammars with the same
+// text, e.g. the server slots that use the same tool call grammar
+struct llama_grammar_mask_cache {
+    using key_t  = std::vector<uint32_t>;
+    using mask_t = std::shared_ptr<const std::vector<uint64_t>>;
 
-    grammar->stacks = std::move(stacks_new);
+    // bound on the total size of the cached masks
+    static constexpr size_t max_size = 32u*1024*1024;
+
+    std::mutex mutex;
+
+    std::list<std::pair<key_t, mask_t>>      lru; // most recently used first
+    std::map<key_t, decltype(lru)::iterator> entries;
+
+    mask_t get(const key_t & key) {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        const auto it = entries.find(key);
+        if (it == entries.end()) {
+            return nullptr;
+        }
+
+        lru.splice(lru.begin(), lru, it->second);
+
+        return it->second->second;
+    }
+
+    void put(const key_t & key, mask_t mask) {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        if (entries.find(key) != entries.end()) {
+            return;
+        }
+
+        const size_t max_entries = std::max<size_t>(1, max_size/(mask->size()*sizeof(uint64_t)));
+
+        while (entries.size() >= max_entries) {
+            entries.erase(lru.back().first);
+            lru.pop_back();
+        }
+
+        lru.emplace_front(key, std::move(mask));
+        entries.emplace(key, lru.begin());
+    }
+};
+
+static std::shared_ptr<llama_grammar_mask_cache> llama_grammar_get_mask_cache(const llama_vocab * vocab, const char * grammar_str) {
+    static std::mutex mutex;
+    static std::map<std::pair<const llama_vocab *, std::string>, std::weak_ptr<llama_grammar_mask_cache>> caches;
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    auto key = std::make_pair(vocab, std::string(grammar_str));
+
+    auto it = caches.find(key);
+    if (it != caches.end()) {
+        if (auto res = it->second.lock()) {
+            return res;
+        }
+    }
+
+    // a new entry: drop the ones of the grammars that do not exist anymore
+    for (it = caches.begin(); it != caches.end(); ) {
+        if (it->second.expired()) {
+            it = caches.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    auto res = std::make_shared<llama_grammar_mask_cache>();
+    caches[std::move(key)] = res;
+
+    return res;
+}
+
+void llama_grammar_accept(struct llama_grammar * grammar, uint32_t chr) {
+    auto & dfa = llama_grammar_get_dfa(*grammar);
+
+    grammar->stacks = *dfa.states[dfa.get_next(grammar->rules, dfa.get_id(grammar->stacks), chr)].stacks;
 }
 
 llama_grammar_candidates llama_grammar_reject_candidates_for_stack(
@@ -970,6 +1379,9 @@ struct llama_grammar * llama_grammar_init_impl(
         /* .trigger_buffer = */   "",
         /* .trigger_tokens   = */ {},
         /* .trigger_patterns    = */ {},
+        /* .dfa = */              nullptr,
+        /* .trie = */             nullptr,
+        /* .masks = */            nullptr,
     };
 }
 
@@ -1075,6 +1487,9 @@ struct llama_grammar * llama_grammar_init_impl(
         /* .trigger_buffer = */   "",
         std::move(vec_trigger_tokens),
         std::move(vec_trigger_patterns),
+        /* .dfa = */              nullptr,
+        /* .trie = */             nullptr,
+        /* .masks = */            vocab ? llama_grammar_get_mask_cache(vocab, grammar_str) : nullptr,
     };
 }
 
@@ -1097,6 +1512,9 @@ struct llama_grammar * llama_grammar_clone_impl(const struct llama_grammar & gra
         grammar.trigger_buffer,
         grammar.trigger_tokens,
         grammar.trigger_patterns,
+        nullptr,       // the automaton points into the rules
+        grammar.trie,  // the trie depends only on the vocab
+        grammar.masks,
     };
 
     // redirect elements in stacks to point to new rules
@@ -1130,6 +1548,42 @@ void llama_grammar_apply_impl(const struct llama_grammar & grammar, llama_token_
         }
     }
 
+    if (!grammar.masks) {
+        grammar.masks = std::make_shared<llama_grammar_mask_cache>();
+    }
+
+    auto & dfa = llama_grammar_get_dfa(grammar);
+
+    llama_grammar_mask_cache::key_t key = dfa.get_key(grammar.rules, dfa.get_id(grammar.stacks));
+    key.push_back(grammar.partial_utf8.value);
+    key.push_back(grammar.partial_utf8.n_remain);
+
+    auto allowed = grammar.masks->get(key);
+
+    // for a large part of the vocab, a single walk of the vocab trie is cheaper than decoding every candidate
+    if (!allowed && 4*cur_p->size >= (size_t) grammar.vocab->n_tokens()) {
+        auto mask = std::make_shared<std::vector<uint64_t>>((grammar.vocab->n_tokens() + 63)/64, 0);
+        llama_grammar_mask_tokens(grammar, *mask);
+
+        grammar.masks->put(key, mask);
+        allowed = std::move(mask);
+    }
+
+    if (allowed) {
+        const uint64_t * bits = allowed->data();
+
+        for (size_t i = 0; i < cur_p->size; ++i) {
+            const llama_token id = cur_p->data[i].id;
+
+            // EOG tokens are never in the mask
+            if (!(bits[id / 64] >> (id % 64) & 1) && !(allow_eog && grammar.vocab->is_eog(id))) {
+                cur_p->data[i].logit = -INFINITY;
+            }
+        }
+
+        return;
+    }
+
     std::vector<std::pair<std::vector<uint32_t>, llama_partial_utf8>> candidates_decoded;
     candidates_decoded.reserve(cur_p->size);
 
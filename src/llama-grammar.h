@@ -3,12 +3,17 @@
 #include "llama.h"
 
 #include <map>
+#include <memory>
 #include <regex>
 #include <string>
 #include <vector>
 
 struct llama_vocab;
 
+struct llama_grammar_dfa;
+struct llama_grammar_vocab_trie;
+struct llama_grammar_mask_cache;
+
 // grammar element type
 enum llama_gretype {
     // end of rule definition
@@ -132,6 +137,13 @@ struct llama_grammar {
                              trigger_patterns;         // Regular expressions that trigger a lazy grammar. Must be a full match of the entire generated
                                                        // string, and the grammar will be given the string from the first match group onwards.
 
+    // lazily built: the memoized transitions between sets of stacks, and a trie over the pieces of the vocab
+    // the automaton points into the rules of this grammar, so it is not shared with clones
+    mutable std::shared_ptr<llama_grammar_dfa>              dfa;
+    mutable std::shared_ptr<const llama_grammar_vocab_trie> trie;
+
+    // the allowed tokens of recently seen states, shared by all grammars with the same text and vocab
+    mutable std::shared_ptr<llama_grammar_mask_cache> masks;
 };
 
 //
@@ -284,7 +284,7 @@ void llm_graph_input_attn_kv_unified::set_input(const llama_ubatch * ubatch) {
     mctx->set_input_k_idxs(self_k_idxs, ubatch);
     mctx->set_input_v_idxs(self_v_idxs, ubatch);
 
-    mctx->set_input_kq_mask(self_kq_mask, ubatch, cparams.causal_attn);
+    mctx->set_input_kq_mask(self_kq_mask, ubatch, cparams.causal_attn, kv_blocks);
 }
 
 void llm_graph_input_attn_kv_unified_iswa::set_input(const llama_ubatch * ubatch) {
@@ -1202,7 +1202,10 @@ llm_graph_input_attn_kv_unified * llm_graph_context::build_attn_inp_kv_unified()
     {
         GGML_ASSERT(hparams.swa_type == LLAMA_SWA_TYPE_NONE && "Use llama_kv_cache_unified_iswa for SWA");
 
-        const auto n_kv = mctx_cur->get_n_kv();
+        // paged KV layout: attend only to the blocks of the sequences in the ubatch
+        inp->kv_blocks = mctx_cur->get_blocks();
+
+        const auto n_kv = inp->kv_blocks.empty() ? mctx_cur->get_n_kv() : mctx_cur->get_n_kv(inp->kv_blocks);
 
         inp->self_k_idxs = mctx_cur->build_input_k_idxs(ctx0, ubatch);
         inp->self_v_idxs = mctx_cur->build_input_v_idxs(ctx0, ubatch);
@@ -1245,11 +1248,12 @@ ggml_tensor * llm_graph_context::build_attn(
         ggml_build_forward_expand(gf, mctx_cur->cpy_v(ctx0, v_cur, v_idxs, il));
     }
 
-    const auto & kq_mask = inp->get_kq_mask();
+    const auto & kq_mask   = inp->get_kq_mask();
+    const auto & kv_blocks = inp->kv_blocks;
 
     ggml_tensor * q = q_cur;
-    ggml_tensor * k = mctx_cur->get_k(ctx0, il);
-    ggml_tensor * v = mctx_cur->get_v(ctx0, il);
+    ggml_tensor * k = kv_blocks.empty() ? mctx_cur->get_k(ctx0, il) : mctx_cur->get_k(ctx0, gf, il, kv_blocks);
+    ggml_tensor * v = kv_blocks.empty() ? mctx_cur->get_v(ctx0, il) : mctx_cur->get_v(ctx0, gf, il, kv_blocks);
 
     ggml_tensor * cur = build_attn_mha(gf, q, k, v, kq_b, kq_mask, v_mla, kq_scale);
     cb(cur, "kqv_out", il);
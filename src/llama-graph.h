@@ -260,6 +260,9 @@ public:
     ggml_tensor * self_kq_mask     = nullptr; // F32 [n_kv, n_batch, 1, 1]
     ggml_tensor * self_kq_mask_cnv = nullptr; //     [n_kv, n_batch, 1, 1]
 
+    // the KV blocks gathered by the attention, empty for the flat range of cells
+    std::vector<uint32_t> kv_blocks;
+
     const llama_hparams & hparams;
     const llama_cparams & cparams;
 
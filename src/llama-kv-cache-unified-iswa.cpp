@@ -76,14 +76,22 @@ void llama_kv_cache_unified_iswa::seq_keep(llama_seq_id seq_id) {
     kv_swa ->seq_keep(seq_id);
 }
 
-void llama_kv_cache_unified_iswa::seq_add(llama_seq_id seq_id, llama_pos p0, llama_pos p1, llama_pos shift) {
-    kv_base->seq_add(seq_id, p0, p1, shift);
-    kv_swa ->seq_add(seq_id, p0, p1, shift);
+bool llama_kv_cache_unified_iswa::seq_add(llama_seq_id seq_id, llama_pos p0, llama_pos p1, llama_pos shift) {
+    // do not modify one of the caches if the copy-on-write of the other one would fail
+    if (!kv_base->seq_can_cow(seq_id, p0, p1) || !kv_swa->seq_can_cow(seq_id, p0, p1)) {
+        return false;
+    }
+
+    return kv_base->seq_add(seq_id, p0, p1, shift) && kv_swa->seq_add(seq_id, p0, p1, shift);
 }
 
-void llama_kv_cache_unified_iswa::seq_div(llama_seq_id seq_id, llama_pos p0, llama_pos p1, int d) {
-    kv_base->seq_div(seq_id, p0, p1, d);
-    kv_swa ->seq_div(seq_id, p0, p1, d);
+bool llama_kv_cache_unified_iswa::seq_div(llama_seq_id seq_id, llama_pos p0, llama_pos p1, int d) {
+    // do not modify one of the caches if the copy-on-write of the other one would fail
+    if (!kv_base->seq_can_cow(seq_id, p0, p1) || !kv_swa->seq_can_cow(seq_id, p0, p1)) {
+        return false;
+    }
+
+    return kv_base->seq_div(seq_id, p0, p1, d) && kv_swa->seq_div(seq_id, p0, p1, d);
 }
 
 llama_pos llama_kv_cache_unified_iswa::seq_pos_min(llama_seq_id seq_id) const {
@@ -8,6 +8,7 @@
 #include <algorithm>
 #include <cassert>
 #include <cmath>
+#include <cstring>
 #include <limits>
 #include <map>
 #include <stdexcept>
@@ -163,11 +164,30 @@ llama_kv_cache_unified::llama_kv_cache_unified(
     if (!supports_set_rows) {
         LLAMA_LOG_WARN("%s: LLAMA_SET_ROWS=0, using old ggml_cpy() method for backwards compatibility\n", __func__);
     }
+
+    const char * LLAMA_KV_CACHE_PAGED = getenv("LLAMA_KV_CACHE_PAGED");
+    n_block = LLAMA_KV_CACHE_PAGED ? atoi(LLAMA_KV_CACHE_PAGED) : 0;
+
+    if (n_block > 0) {
+        if (!supports_set_rows || swa_type != LLAMA_SWA_TYPE_NONE) {
+            // the blocks are not continuous and SWA reuses the masked cells in place
+            LLAMA_LOG_WARN("%s: the paged KV layout requires LLAMA_SET_ROWS=1 and no SWA - disabling\n", __func__);
+            n_block = 0;
+        } else if (kv_size % n_block != 0 || (n_pad % n_block != 0 && n_block % n_pad != 0)) {
+            LLAMA_LOG_WARN("%s: KV block size %u must divide the KV size %u and divide or be a multiple of the padding %u - disabling\n",
+                    __func__, n_block, kv_size, n_pad);
+            n_block = 0;
+        } else {
+            LLAMA_LOG_INFO("%s: paged KV layout, %u blocks of %u cells\n", __func__, kv_size/n_block, n_block);
+        }
+    }
 }
 
 void llama_kv_cache_unified::clear(bool data) {
     cells.reset();
 
+    cow_pending.clear();
+
     head = 0;
 
     if (data) {
@@ -264,9 +284,9 @@ void llama_kv_cache_unified::seq_keep(llama_seq_id seq_id) {
     }
 }
 
-void llama_kv_cache_unified::seq_add(llama_seq_id seq_id, llama_pos p0, llama_pos p1, llama_pos shift) {
+bool llama_kv_cache_unified::seq_add(llama_seq_id seq_id, llama_pos p0, llama_pos p1, llama_pos shift) {
     if (shift == 0) {
-        return;
+        return true;
     }
 
     uint32_t new_head = cells.size();
@@ -281,19 +301,30 @@ void llama_kv_cache_unified::seq_add(llama_seq_id seq_id, llama_pos p0, llama_po
 
     // If there is no range then return early to avoid looping over all cells.
     if (p0 == p1) {
-        return;
+        return true;
     }
 
+    std::vector<uint32_t> idxs;
+
     for (uint32_t i = 0; i < cells.size(); ++i) {
         if (!cells.pos_in(i, p0, p1)) {
             continue;
         }
 
         if (cells.seq_has(i, seq_id)) {
-            if (cells.pos_add(i, shift)) {
-                if (new_head == cells.size()) {
-                    new_head = i;
-                }
+            idxs.push_back(i);
+        }
+    }
+
+    // the cells shared with other sequences must keep their positions for them
+    if (!seq_cow(seq_id, idxs)) {
+        return false;
+    }
+
+    for (const uint32_t i : idxs) {
+        if (cells.pos_add(i, shift)) {
+            if (new_head == cells.size()) {
+                new_head = i;
             }
         }
     }
@@ -301,11 +332,13 @@ void llama_kv_cache_unified::seq_add(llama_seq_id seq_id, llama_pos p0, llama_po
     // If we freed up a slot, set head to it so searching can start there.
     // Otherwise we just start the next search from the beginning.
     head = new_head != cells.size() ? new_head : 0;
+
+    return true;
 }
 
-void llama_kv_cache_unified::seq_div(llama_seq_id seq_id, llama_pos p0, llama_pos p1, int d) {
+bool llama_kv_cache_unified::seq_div(llama_seq_id seq_id, llama_pos p0, llama_pos p1, int d) {
     if (d == 1) {
-        return;
+        return true;
     }
 
     if (p0 < 0) {
@@ -318,18 +351,91 @@ void llama_kv_cache_unified::seq_div(llama_seq_id seq_id, llama_pos p0, llama_po
 
     // If there is no range then return early to avoid looping over the cache.
     if (p0 == p1) {
-        return;
+        return true;
     }
 
+    std::vector<uint32_t> idxs;
+
     for (uint32_t i = 0; i < cells.size(); ++i) {
         if (!cells.pos_in(i, p0, p1)) {
             continue;
         }
 
         if (cells.seq_has(i, seq_id)) {
-            cells.pos_div(i, d);
+            idxs.push_back(i);
         }
     }
+
+    if (!seq_cow(seq_id, idxs)) {
+        return false;
+    }
+
+    for (const uint32_t i : idxs) {
+        cells.pos_div(i, d);
+    }
+
+    return true;
+}
+
+bool llama_kv_cache_unified::seq_can_cow(llama_seq_id seq_id, llama_pos p0, llama_pos p1) const {
+    if (p0 < 0) {
+        p0 = 0;
+    }
+
+    if (p1 < 0) {
+        p1 = std::numeric_limits<llama_pos>::max();
+    }
+
+    uint32_t n_shared = 0;
+
+    for (uint32_t i = 0; i < cells.size(); ++i) {
+        if (cells.pos_in(i, p0, p1) && cells.seq_has(i, seq_id) && cells.seq_count(i) > 1) {
+            n_shared++;
+        }
+    }
+
+    return n_shared <= cells.size() - cells.get_used();
+}
+
+bool llama_kv_cache_unified::seq_cow(llama_seq_id seq_id, std::vector<uint32_t> & idxs) {
+    uint32_t n_shared = 0;
+
+    for (const auto i : idxs) {
+        if (cells.seq_count(i) > 1) {
+            n_shared++;
+        }
+    }
+
+    // check before moving any cell, so that the cache is not modified on failure
+    if (n_shared > cells.size() - cells.get_used()) {
+        LLAMA_LOG_ERROR("%s: not enough free KV cells for copy-on-write of the %u cells that seq %d shares with other sequences\n",
+                __func__, n_shared, seq_id);
+        return false;
+    }
+
+    // next candidate for an empty cell
+    uint32_t j = 0;
+
+    for (auto & i : idxs) {
+        if (cells.seq_count(i) < 2) {
+            continue;
+        }
+
+        while (j < cells.size() && !cells.is_empty(j)) {
+            j++;
+        }
+
+        GGML_ASSERT(j < cells.size());
+
+        cells.seq_mv(i, j, seq_id);
+
+        // the data is copied lazily, with the next update of the cache
+        cow_pending.emplace_back(i, j);
+
+        i = j;
+    }
+
+    return true;
 }
 
 llama_pos llama_kv_cache_unified::seq_pos_min(llama_seq_id seq_id) const {
@@ -382,6 +488,7 @@ llama_memory_context_ptr llama_kv_cache_unified::init_full() {
 }
 
 llama_memory_context_ptr llama_kv_cache_unified::init_update(llama_context * lctx, bool optimize) {
+    bool do_copy  = !cow_pending.empty();
     bool do_shift = get_has_shift();
 
     defrag_info dinfo;
@@ -392,7 +499,8 @@ llama_memory_context_ptr llama_kv_cache_unified::init_update(llama_context * lct
 
         const auto thold = lctx->get_cparams().defrag_thold;
 
-        if (!do_defrag && thold > 0.0f) {
+        // the paged layout does not need to keep the used cells compact
+        if (!do_defrag && thold > 0.0f && n_block == 0) {
             const auto n_kv = cells.used_max_p1();
 
             // - do not defrag small contexts (i.e. < 2048 tokens)
@@ -411,7 +519,7 @@ llama_memory_context_ptr llama_kv_cache_unified::init_update(llama_context * lct
         }
     }
 
-    return std::make_unique<llama_kv_cache_unified_context>(this, lctx, do_shift, std::move(dinfo));
+    return std::make_unique<llama_kv_cache_unified_context>(this, lctx, do_copy, do_shift, std::move(dinfo));
 }
 
 llama_kv_cache_unified::slot_info_vec_t llama_kv_cache_unified::prepare(const std::vector<llama_ubatch> & ubatches) {
@@ -464,11 +572,51 @@ llama_kv_cache_unified::slot_info_vec_t llama_kv_cache_unified::prepare(const st
     return res;
 }
 
-bool llama_kv_cache_unified::update(llama_context * lctx, bool do_shift, const defrag_info & dinfo) {
+bool llama_kv_cache_unified::update(llama_context * lctx, bool do_copy, bool do_shift, const defrag_info & dinfo) {
     bool updated = false;
 
     auto * sched = lctx->get_sched();
 
+    // the copies refer to the cells before the defrag, so apply them first
+    if (do_copy && !cow_pending.empty()) {
+        LLAMA_LOG_DEBUG("%s: copying %zu shared KV cells\n", __func__, cow_pending.size());
+
+        const size_t n_layer = layers.size();
+
+        // each copy needs 6 nodes per layer: 4 views + 2 copies
+        const size_t max_copies = std::max<size_t>(1, (lctx->graph_max_nodes() - 2*n_layer)/(6*n_layer));
+
+        for (size_t i0 = 0; i0 < cow_pending.size(); i0 += max_copies) {
+            const size_t i1 = std::min(cow_pending.size(), i0 + max_copies);
+
+            ggml_backend_sched_reset(sched);
+
+            auto * gf = lctx->graph_init();
+
+            auto res = build_graph_cow(lctx->get_ctx_compute(), gf, i0, i1);
+            if (!res) {
+                LLAMA_LOG_ERROR("%s: failed to build graph for copy-on-write\n", __func__);
+                return updated;
+            }
+
+            if (!ggml_backend_sched_alloc_graph(sched, gf)) {
+                LLAMA_LOG_ERROR("%s: failed to allocate compute graph for copy-on-write\n", __func__);
+                return updated;
+            }
+
+            res->set_inputs(nullptr);
+
+            if (lctx->graph_compute(gf, false) != GGML_STATUS_SUCCESS) {
+                LLAMA_LOG_ERROR("%s: failed to compute copy-on-write\n", __func__);
+                return updated;
+            }
+        }
+
+        cow_pending.clear();
+
+        updated = true;
+    }
+
     if (do_shift) {
         if (!get_can_shift()) {
             GGML_ABORT("The current KV cache / model configuration does not support K-shift");
@@ -571,6 +719,10 @@ llama_kv_cache_unified::slot_info llama_kv_cache_unified::find_slot(const llama_
         return { };
     }
 
+    if (n_block > 0 && !cont) {
+        return find_slot_paged(ubatch);
+    }
+
     if (debug > 0) {
         LLAMA_LOG_DEBUG("%s: n = %5d, used = %5d, head = %5d, size = %5d, n_swa = %5d\n", __func__, cells.used_max_p1(), cells.get_used(), head, get_size(), n_swa);
 
@@ -713,6 +865,93 @@ llama_kv_cache_unified::slot_info llama_kv_cache_unified::find_slot(const llama_
     return res;
 }
 
+llama_kv_cache_unified::slot_info llama_kv_cache_unified::find_slot_paged(const llama_ubatch & ubatch) const {
+    const uint32_t n_blocks = cells.size()/n_block;
+
+    // the sequence that owns each block:
+    //   -1 - the block is empty
+    //   -2 - the block is shared by several sequences
+    std::vector<llama_seq_id> owner (n_blocks, -1);
+    std::vector<uint32_t>     n_free(n_blocks,  0);
+
+    for (uint32_t b = 0; b < n_blocks; ++b) {
+        for (uint32_t i = b*n_block; i < (b + 1)*n_block; ++i) {
+            if (cells.is_empty(i)) {
+                n_free[b]++;
+                continue;
+            }
+
+            const llama_seq_id seq_id = cells.seq_count(i) == 1 ? cells.seq_get(i) : -2;
+
+            if (owner[b] == -1) {
+                owner[b] = seq_id;
+            } else if (owner[b] != seq_id) {
+                owner[b] = -2;
+            }
+        }
+    }
+
+    // the block that each sequence is currently filling and the next cell to check in each block
+    std::vector<int32_t>  seq_block(LLAMA_MAX_SEQ, -1);
+    std::vector<uint32_t> next(n_blocks, 0);
+
+    slot_info res;
+
+    auto & idxs = res.idxs;
+
+    idxs.reserve(ubatch.n_tokens);
+
+    for (uint32_t i = 0; i < ubatch.n_tokens; ++i) {
+        const llama_seq_id seq_id = ubatch.seq_id[i][0];
+
+        int32_t b = seq_block[seq_id];
+
+        if (b < 0 || n_free[b] == 0) {
+            b = -1;
+
+            // prefer a block that already belongs to the sequence, then an empty block, then any block with free cells
+            for (uint32_t j = 0; j < n_blocks && b < 0; ++j) {
+                if (owner[j] == seq_id && n_free[j] > 0) {
+                    b = j;
+                }
+            }
+
+            for (uint32_t j = 0; j < n_blocks && b < 0; ++j) {
+                if (owner[j] == -1) {
+                    b = j;
+                }
+            }
+
+            for (uint32_t j = 0; j < n_blocks && b < 0; ++j) {
+                if (n_free[j] > 0) {
+                    b = j;
+                }
+            }
+
+            if (b < 0) {
+                return { };
+            }
+
+            if (owner[b] == -1) {
+                owner[b] = seq_id;
+            }
+
+            seq_block[seq_id] = b;
+        }
+
+        while (!cells.is_empty(b*n_block + next[b])) {
+            next[b]++;
+        }
+
+        idxs.push_back(b*n_block + next[b]);
+
+        next[b]++;
+        n_free[b]--;
+    }
+
+    return res;
+}
+
 void llama_kv_cache_unified::apply_ubatch(const slot_info & sinfo, const llama_ubatch & ubatch) {
     // keep track of the max sequence position that we would overwrite with this ubatch
     // for non-SWA cache, this would be always empty
@@ -780,6 +1019,140 @@ uint32_t llama_kv_cache_unified::get_n_kv() const {
     return std::min(cells.size(), std::max(n_pad, GGML_PAD(cells.used_max_p1(), n_pad)));
 }
 
+std::vector<uint32_t> llama_kv_cache_unified::get_blocks(const llama_ubatch & ubatch) const {
+    // the gather is not implemented for the transposed V cache
+    if (n_block == 0 || v_trans) {
+        return {};
+    }
+
+    std::vector<llama_seq_id> seq_ids;
+    for (uint32_t i = 0; i < ubatch.n_tokens; ++i) {
+        for (int32_t s = 0; s < ubatch.n_seq_id[i]; ++s) {
+            if (std::find(seq_ids.begin(), seq_ids.end(), ubatch.seq_id[i][s]) == seq_ids.end()) {
+                seq_ids.push_back(ubatch.seq_id[i][s]);
+            }
+        }
+    }
+
+    const uint32_t n_kv = get_n_kv();
+
+    // the blocks can be larger than the padding, so the last one may be only partially in the first n_kv cells
+    const uint32_t n_blocks = std::min((n_kv + n_block - 1)/n_block, cells.size()/n_block);
+
+    std::vector<uint32_t> res;
+
+    for (uint32_t b = 0; b < n_blocks; ++b) {
+        bool used = false;
+
+        for (uint32_t i = b*n_block; i < (b + 1)*n_block && !used; ++i) {
+            if (cells.is_empty(i)) {
+                continue;
+            }
+
+            for (const auto seq_id : seq_ids) {
+                if (cells.seq_has(i, seq_id)) {
+                    used = true;
+                    break;
+                }
+            }
+        }
+
+        if (used) {
+            res.push_back(b);
+        }
+    }
+
+    if (res.empty()) {
+        return {};
+    }
+
+    // memory traffic of the gather: the copies read and write their cells once (see gather_blocks()), then the
+    // attention reads the n_gather gathered cells - use it only if this is at most half of the traffic of the
+    // attention over the flat range of n_kv cells
+    // each copy is a node per layer, so fragmented block lists fall back to the flat range as well
+    const uint32_t n_gather = get_n_kv(res);
+
+    uint32_t s = 0;
+
+    const auto copies = get_gather_copies(res, s);
+
+    uint32_t n_copy = n_gather;
+    for (const auto & c : copies) {
+        n_copy += c.n;
+    }
+
+    if (copies.size() > 8 || 2*(2*n_copy + n_gather) > n_kv) {
+        return {};
+    }
+
+    return res;
+}
+
+std::vector<uint32_t> llama_kv_cache_unified::get_blocks_all() const {
+    if (n_block == 0 || v_trans) {
+        return {};
+    }
+
+    std::vector<uint32_t> res(cells.size()/n_block);
+    for (uint32_t b = 0; b < res.size(); ++b) {
+        res[b] = b;
+    }
+
+    return res;
+}
+
+uint32_t llama_kv_cache_unified::get_n_kv(const std::vector<uint32_t> & blocks) const {
+    return std::max(n_pad, GGML_PAD((uint32_t) blocks.size()*n_block, n_pad));
+}
+
+std::vector<llama_kv_cache_unified::gather_copy> llama_kv_cache_unified::get_gather_copies(const std::vector<uint32_t> & blocks, uint32_t & s) const {
+    const uint32_t n_gather = get_n_kv(blocks);
+
+    // the window of the cache that is copied as a whole, it starts at the first block if possible
+    s = std::min(blocks[0]*n_block, cells.size() - n_gather);
+
+    std::vector<gather_copy> res;
+
+    for (size_t i = 0; i < blocks.size(); ) {
+        size_t j = i + 1;
+        while (j < blocks.size() && blocks[j] == blocks[j - 1] + 1) {
+            ++j;
+        }
+
+        const uint32_t src = blocks[i]*n_block;
+        const uint32_t dst = i*n_block;
+
+        // runs of blocks that are already in place in the window are not copied again
+        if (src != s + dst) {
+            res.push_back({ src, dst, (uint32_t) (j - i)*n_block });
+        }
+
+        i = j;
+    }
+
+    return res;
+}
+
+ggml_tensor * llama_kv_cache_unified::gather_blocks(ggml_context * ctx, ggml_cgraph * gf, ggml_tensor * t, const std::vector<uint32_t> & blocks) const {
+    const uint32_t n_gather = get_n_kv(blocks);
+
+    uint32_t s = 0;
+
+    const auto copies = get_gather_copies(blocks, s);
+
+    // the gathered cells stay in the type of the cache
+    // the cells that are not overwritten below are padding, they hold finite data and are masked in set_input_kq_mask()
+    ggml_tensor * res = ggml_cont(ctx, ggml_view_2d(ctx, t, t->ne[0], n_gather, t->nb[1], s*t->nb[1]));
+
+    for (const auto & c : copies) {
+        ggml_build_forward_expand(gf, ggml_cpy(ctx,
+                    ggml_view_2d(ctx, t,   t->ne[0],   c.n, t->nb[1],   c.src*t->nb[1]),
+                    ggml_view_2d(ctx, res, res->ne[0], c.n, res->nb[1], c.dst*res->nb[1])));
+    }
+
+    return res;
+}
+
 ggml_tensor * llama_kv_cache_unified::get_k(ggml_context * ctx, int32_t il, uint32_t n_kv) const {
     const int32_t ikv = map_layer_ids.at(il);
 
@@ -814,6 +1187,32 @@ ggml_tensor * llama_kv_cache_unified::get_v(ggml_context * ctx, int32_t il, uint
             0);
 }
 
+ggml_tensor * llama_kv_cache_unified::get_k(ggml_context * ctx, ggml_cgraph * gf, int32_t il, const std::vector<uint32_t> & blocks) const {
+    const int32_t ikv = map_layer_ids.at(il);
+
+    ggml_tensor * k = gather_blocks(ctx, gf, layers[ikv].k, blocks);
+
+    return ggml_view_3d(ctx, k,
+            hparams.n_embd_head_k, hparams.n_head_kv(il), k->ne[1],
+            ggml_row_size(k->type, hparams.n_embd_head_k),
+            k->nb[1],
+            0);
+}
+
+ggml_tensor * llama_kv_cache_unified::get_v(ggml_context * ctx, ggml_cgraph * gf, int32_t il, const std::vector<uint32_t> & blocks) const {
+    GGML_ASSERT(!v_trans);
+
+    const int32_t ikv = map_layer_ids.at(il);
+
+    ggml_tensor * v = gather_blocks(ctx, gf, layers[ikv].v, blocks);
+
+    return ggml_view_3d(ctx, v,
+            hparams.n_embd_head_v, hparams.n_head_kv(il), v->ne[1],
+            ggml_row_size(v->type, hparams.n_embd_head_v),
+            v->nb[1],
+            0);
+}
+
 ggml_tensor * llama_kv_cache_unified::cpy_k(ggml_context * ctx, ggml_tensor * k_cur, ggml_tensor * k_idxs, int32_t il, const slot_info & sinfo) const {
     const int32_t ikv = map_layer_ids.at(il);
 
@@ -941,7 +1340,7 @@ void llama_kv_cache_unified::set_input_v_idxs(ggml_tensor * dst, const llama_uba
     }
 }
 
-void llama_kv_cache_unified::set_input_kq_mask(ggml_tensor * dst, const llama_ubatch * ubatch, bool causal_attn) const {
+void llama_kv_cache_unified::set_input_kq_mask(ggml_tensor * dst, const llama_ubatch * ubatch, bool causal_attn, const std::vector<uint32_t> & blocks) const {
     const uint32_t n_tokens = ubatch->n_tokens;
 
     GGML_ASSERT(ggml_backend_buffer_is_host(dst->buffer));
@@ -972,13 +1371,19 @@ void llama_kv_cache_unified::set_input_kq_mask(ggml_tensor * dst, const llama_ub
 
                 bool masked = false;
 
-                if (cells.is_empty(j)) {
+                // the cell behind column j, either the flat range or the gathered blocks
+                uint32_t idx = j;
+                if (!blocks.empty()) {
+                    idx = j/n_block < blocks.size() ? blocks[j/n_block]*n_block + j%n_block : cells.size();
+                }
+
+                if (idx == cells.size() || cells.is_empty(idx)) {
                     masked = true;
                 } else {
-                    const llama_pos p0 = cells.pos_get(j);
+                    const llama_pos p0 = cells.pos_get(idx);
 
                     // mask the token if not the same sequence
-                    masked = masked || (!cells.seq_has(j, seq_id));
+                    masked = masked || (!cells.seq_has(idx, seq_id));
 
                     // mask future tokens
                     masked = masked || (causal_attn && p0 > p1);
@@ -1332,6 +1737,150 @@ llm_graph_result_ptr llama_kv_cache_unified::build_graph_defrag(
     return res;
 }
 
+llm_graph_result_ptr llama_kv_cache_unified::build_graph_cow(
+                   ggml_context * ctx,
+                    ggml_cgraph * gf,
+                         size_t   i0,
+                         size_t   i1) const {
+    auto res = std::make_unique<llm_graph_result>();
+
+    for (size_t i = i0; i < i1; ++i) {
+        const uint32_t is = cow_pending[i].first;
+        const uint32_t id = cow_pending[i].second;
+
+        // batch copy [is, is+nm) to [id, id+nm)
+        // note: the copies are applied in order, so do not merge a copy that reads a cell written by this batch
+        uint32_t nm = 1;
+
+        while (i + nm < i1 &&
+               cow_pending[i + nm].first  == is + nm &&
+               cow_pending[i + nm].second == id + nm &&
+               (is > id ? is - id : id - is) > nm) {
+            nm++;
+        }
+
+        for (const auto & layer : layers) {
+            const uint32_t il = layer.il;
+
+            const int64_t n_embd_k_gqa = hparams.n_embd_k_gqa(il);
+            const int64_t n_embd_v_gqa = hparams.n_embd_v_gqa(il);
+
+            ggml_tensor * view_k_src = ggml_view_2d(ctx, layer.k,
+                    n_embd_k_gqa, nm,
+                    ggml_row_size(layer.k->type, n_embd_k_gqa),
+                    ggml_row_size(layer.k->type, n_embd_k_gqa*is));
+
+            ggml_tensor * view_k_dst = ggml_view_2d(ctx, layer.k,
+                    n_embd_k_gqa, nm,
+                    ggml_row_size(layer.k->type, n_embd_k_gqa),
+                    ggml_row_size(layer.k->type, n_embd_k_gqa*id));
+
+            ggml_tensor * view_v_src;
+            ggml_tensor * view_v_dst;
+
+            if (!v_trans) {
+                view_v_src = ggml_view_2d(ctx, layer.v,
+                        n_embd_v_gqa, nm,
+                        ggml_row_size(layer.v->type, n_embd_v_gqa),
+                        ggml_row_size(layer.v->type, n_embd_v_gqa*is));
+
+                view_v_dst = ggml_view_2d(ctx, layer.v,
+                        n_embd_v_gqa, nm,
+                        ggml_row_size(layer.v->type, n_embd_v_gqa),
+                        ggml_row_size(layer.v->type, n_embd_v_gqa*id));
+            } else {
+                view_v_src = ggml_view_2d(ctx, layer.v,
+                        nm, n_embd_v_gqa,
+                        ggml_row_size(layer.v->type, cells.size()),
+                        ggml_row_size(layer.v->type, is));
+
+                view_v_dst = ggml_view_2d(ctx, layer.v,
+                        nm, n_embd_v_gqa,
+                        ggml_row_size(layer.v->type, cells.size()),
+                        ggml_row_size(layer.v->type, id));
+            }
+
+            ggml_build_forward_expand(gf, ggml_cpy(ctx, view_k_src, view_k_dst));
+            ggml_build_forward_expand(gf, ggml_cpy(ctx, view_v_src, view_v_dst));
+        }
+
+        i += nm - 1;
+    }
+
+    return res;
+}
+
+void llama_kv_cache_unified::cow_apply() const {
+    if (cow_pending.empty()) {
+        return;
+    }
+
+    // the views of the source and the destination cells, recreated for each copy
+    ggml_init_params params = {
+        /*.mem_size   =*/ 2u*ggml_tensor_overhead(),
+        /*.mem_buffer =*/ NULL,
+        /*.no_alloc   =*/ true,
+    };
+
+    ggml_context_ptr ctx { ggml_init(params) };
+
+    // copy n rows of t from offs_src to offs_dst
+    auto copy_rows = [&](ggml_tensor * t, int64_t ne0, int64_t n, size_t nb1, size_t offs_src, size_t offs_dst) {
+        ggml_reset(ctx.get());
+
+        ggml_tensor * src = ggml_view_2d(ctx.get(), t, ne0, n, nb1, offs_src);
+        ggml_tensor * dst = ggml_view_2d(ctx.get(), t, ne0, n, nb1, offs_dst);
+
+        ggml_backend_view_init(src);
+        ggml_backend_view_init(dst);
+
+        ggml_backend_tensor_copy(src, dst);
+    };
+
+    for (size_t i = 0; i < cow_pending.size(); ++i) {
+        const uint32_t is = cow_pending[i].first;
+        const uint32_t id = cow_pending[i].second;
+
+        // batch copy [is, is+nm) to [id, id+nm), same as in build_graph_cow()
+        uint32_t nm = 1;
+
+        while (i + nm < cow_pending.size() &&
+               cow_pending[i + nm].first  == is + nm &&
+               cow_pending[i + nm].second == id + nm &&
+               (is > id ? is - id : id - is) > nm) {
+            nm++;
+        }
+
+        for (const auto & layer : layers) {
+            const uint32_t il = layer.il;
+
+            const int64_t n_embd_k_gqa = hparams.n_embd_k_gqa(il);
+            const int64_t n_embd_v_gqa = hparams.n_embd_v_gqa(il);
+
+            const size_t k_size_row = ggml_row_size(layer.k->type, n_embd_k_gqa);
+
+            copy_rows(layer.k, n_embd_k_gqa, nm, k_size_row, is*k_size_row, id*k_size_row);
+
+            if (!v_trans) {
+                const size_t v_size_row = ggml_row_size(layer.v->type, n_embd_v_gqa);
+
+                copy_rows(layer.v, n_embd_v_gqa, nm, v_size_row, is*v_size_row, id*v_size_row);
+            } else {
+                // the V cache is transposed - copy nm elements per embedding dimension
+                const size_t v_size_el = ggml_type_size(layer.v->type);
+
+                for (int64_t j = 0; j < n_embd_v_gqa; ++j) {
+                    copy_rows(layer.v, nm, 1, nm*v_size_el, (is + j*cells.size())*v_size_el, (id + j*cells.size())*v_size_el);
+                }
+            }
+        }
+
+        i += nm - 1;
+    }
+
+    cow_pending.clear();
+}
+
 llama_kv_cache_unified::defrag_info llama_kv_cache_unified::defrag_prepare(int32_t n_max_nodes) const {
     const uint32_t n_layer = layers.size();
 
@@ -1478,6 +2027,8 @@ bool llama_kv_cache_unified::is_masked_swa(llama_pos p0, llama_pos p1) const {
 }
 
 void llama_kv_cache_unified::state_write(llama_io_write_i & io, llama_seq_id seq_id) const {
+    cow_apply();
+
     std::vector<std::pair<uint32_t, uint32_t>> cell_ranges; // ranges, from inclusive, to exclusive
     uint32_t cell_count = 0;
 
@@ -1517,6 +2068,8 @@ void llama_kv_cache_unified::state_write(llama_io_write_i & io, llama_seq_id seq
 }
 
 void llama_kv_cache_unified::state_read(llama_io_read_i & io, llama_seq_id seq_id) {
+    cow_apply();
+
     uint32_t cell_count;
     io.read_to(&cell_count, sizeof(cell_count));
 
@@ -1884,9 +2437,10 @@ llama_kv_cache_unified_context::llama_kv_cache_unified_context(
 llama_kv_cache_unified_context::llama_kv_cache_unified_context(
         llama_kv_cache_unified * kv,
         llama_context * lctx,
+        bool do_copy,
         bool do_shift,
-        defrag_info dinfo) : status(LLAMA_MEMORY_STATUS_SUCCESS), kv(kv), lctx(lctx), do_shift(do_shift), dinfo(std::move(dinfo)) {
-    if (!do_shift && this->dinfo.empty()) {
+        defrag_info dinfo) : status(LLAMA_MEMORY_STATUS_SUCCESS), kv(kv), lctx(lctx), do_copy(do_copy), do_shift(do_shift), dinfo(std::move(dinfo)) {
+    if (!do_copy && !do_shift && this->dinfo.empty()) {
         status = LLAMA_MEMORY_STATUS_NO_UPDATE;
     }
 }
@@ -1914,7 +2468,7 @@ bool llama_kv_cache_unified_context::apply() {
 
     // no ubatches -> this is a KV cache update
     if (ubatches.empty()) {
-        kv->update(lctx, do_shift, dinfo);
+        kv->update(lctx, do_copy, do_shift, dinfo);
 
         return true;
     }
@@ -1940,6 +2494,20 @@ uint32_t llama_kv_cache_unified_context::get_n_kv() const {
     return n_kv;
 }
 
+std::vector<uint32_t> llama_kv_cache_unified_context::get_blocks() const {
+    // the graph of the full cache is used to reserve the compute buffers, so it gathers all blocks to account for
+    // the largest possible gather
+    if (ubatches.empty()) {
+        return kv->get_blocks_all();
+    }
+
+    return kv->get_blocks(ubatches[i_cur]);
+}
+
+uint32_t llama_kv_cache_unified_context::get_n_kv(const std::vector<uint32_t> & blocks) const {
+    return kv->get_n_kv(blocks);
+}
+
 ggml_tensor * llama_kv_cache_unified_context::get_k(ggml_context * ctx, int32_t il) const {
     return kv->get_k(ctx, il, n_kv);
 }
@@ -1948,6 +2516,14 @@ ggml_tensor * llama_kv_cache_unified_context::get_v(ggml_context * ctx, int32_t
     return kv->get_v(ctx, il, n_kv);
 }
 
+ggml_tensor * llama_kv_cache_unified_context::get_k(ggml_context * ctx, ggml_cgraph * gf, int32_t il, const std::vector<uint32_t> & blocks) const {
+    return kv->get_k(ctx, gf, il, blocks);
+}
+
+ggml_tensor * llama_kv_cache_unified_context::get_v(ggml_context * ctx, ggml_cgraph * gf, int32_t il, const std::vector<uint32_t> & blocks) const {
+    return kv->get_v(ctx, gf, il, blocks);
+}
+
 ggml_tensor * llama_kv_cache_unified_context::cpy_k(ggml_context * ctx, ggml_tensor * k_cur, ggml_tensor * k_idxs, int32_t il) const {
     return kv->cpy_k(ctx, k_cur, k_idxs, il, sinfos[i_cur]);
 }
@@ -1977,7 +2553,11 @@ void llama_kv_cache_unified_context::set_input_v_idxs(ggml_tensor * dst, const l
 }
 
 void llama_kv_cache_unified_context::set_input_kq_mask(ggml_tensor * dst, const llama_ubatch * ubatch, bool causal_attn) const {
-    kv->set_input_kq_mask(dst, ubatch, causal_attn);
+    kv->set_input_kq_mask(dst, ubatch, causal_attn, {});
+}
+
+void llama_kv_cache_unified_context::set_input_kq_mask(ggml_tensor * dst, const llama_ubatch * ubatch, bool causal_attn, const std::vector<uint32_t> & blocks) const {
+    kv->set_input_kq_mask(dst, ubatch, causal_attn, blocks);
 }
 
 void llama_kv_cache_unified_context::set_input_pos_bucket(ggml_tensor * dst, const llama_ubatch * ubatch) const {
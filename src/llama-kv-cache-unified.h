@@ -96,8 +96,8 @@ public:
     bool seq_rm  (llama_seq_id seq_id,                              llama_pos p0, llama_pos p1) override;
     void seq_cp  (llama_seq_id seq_id_src, llama_seq_id seq_id_dst, llama_pos p0, llama_pos p1) override;
     void seq_keep(llama_seq_id seq_id)                                                          override;
-    void seq_add (llama_seq_id seq_id,                              llama_pos p0, llama_pos p1, llama_pos shift) override;
-    void seq_div (llama_seq_id seq_id,                              llama_pos p0, llama_pos p1, int d) override;
+    bool seq_add (llama_seq_id seq_id,                              llama_pos p0, llama_pos p1, llama_pos shift) override;
+    bool seq_div (llama_seq_id seq_id,                              llama_pos p0, llama_pos p1, int d) override;
 
     llama_pos seq_pos_min(llama_seq_id seq_id) const override;
     llama_pos seq_pos_max(llama_seq_id seq_id) const override;
@@ -115,16 +115,34 @@ public:
 
     bool get_has_shift() const;
 
+    // copy-on-write: check if there are enough free cells for seq_add()/seq_div() of seq_id in [p0, p1)
+    bool seq_can_cow(llama_seq_id seq_id, llama_pos p0, llama_pos p1) const;
+
     //
     // graph_build API
     //
 
     uint32_t get_n_kv() const;
 
+    // paged layout: the indices of the KV blocks that hold cells of the sequences in the ubatch
+    // returns an empty vector if it is cheaper to attend to the flat range of cells [0, get_n_kv())
+    std::vector<uint32_t> get_blocks(const llama_ubatch & ubatch) const;
+
+    // paged layout: all KV blocks, used to reserve the compute buffers for the largest gather
+    std::vector<uint32_t> get_blocks_all() const;
+
+    // number of KV cells gathered from the blocks, including padding
+    uint32_t get_n_kv(const std::vector<uint32_t> & blocks) const;
+
     // get views of the current state of the cache
     ggml_tensor * get_k(ggml_context * ctx, int32_t il, uint32_t n_kv) const;
     ggml_tensor * get_v(ggml_context * ctx, int32_t il, uint32_t n_kv) const;
 
+    // gather the cells of the listed blocks into a contiguous tensor of the cache type
+    // the copies are added to gf, the result has get_n_kv(blocks) cells
+    ggml_tensor * get_k(ggml_context * ctx, ggml_cgraph * gf, int32_t il, const std::vector<uint32_t> & blocks) const;
+    ggml_tensor * get_v(ggml_context * ctx, ggml_cgraph * gf, int32_t il, const std::vector<uint32_t> & blocks) const;
+
     // store k_cur and v_cur in the cache based on the provided head location
     ggml_tensor * cpy_k(ggml_context * ctx, ggml_tensor * k_cur, ggml_tensor * k_idxs, int32_t il, const slot_info & sinfo) const;
     ggml_tensor * cpy_v(ggml_context * ctx, ggml_tensor * v_cur, ggml_tensor * v_idxs, int32_t il, const slot_info & sinfo) const;
@@ -137,7 +155,7 @@ public:
     // return empty vector on failure
     slot_info_vec_t prepare(const std::vector<llama_ubatch> & ubatches);
 
-    bool update(llama_context * lctx, bool do_shift, const defrag_info & dinfo);
+    bool update(llama_context * lctx, bool do_copy, bool do_shift, const defrag_info & dinfo);
 
     // find a slot of kv cells that can hold the ubatch
     // if cont == true, then the slot must be continuous
@@ -157,7 +175,7 @@ public:
     void set_input_k_idxs(ggml_tensor * dst, const llama_ubatch * ubatch, const slot_info & sinfo) const;
     void set_input_v_idxs(ggml_tensor * dst, const llama_ubatch * ubatch, const slot_info & sinfo) const;
 
-    void set_input_kq_mask   (ggml_tensor * dst, const llama_ubatch * ubatch, bool causal_attn) const;
+    void set_input_kq_mask   (ggml_tensor * dst, const llama_ubatch * ubatch, bool causal_attn, const std::vector<uint32_t> & blocks) const;
     void set_input_k_shift   (ggml_tensor * dst) const;
     void set_input_pos_bucket(ggml_tensor * dst, const llama_ubatch * ubatch) const;
 
@@ -191,6 +209,12 @@ private:
     // env: LLAMA_KV_CACHE_DEBUG
     int debug = 0;
 
+    // env: LLAMA_KV_CACHE_PAGED
+    // size of the KV blocks in the paged layout, 0 for the flat layout
+    // in the paged layout, each sequence allocates its cells in blocks that are not shared with other sequences, and
+    // the attention of a ubatch gathers only the blocks of its sequences instead of scanning all used cells
+    uint32_t n_block = 0;
+
     // env: LLAMA_SET_ROWS (temporary)
     // ref: https://github.com/ggml-org/llama.cpp/pull/14285
     int supports_set_rows = false;
@@ -207,6 +231,37 @@ private:
     // model layer id -> KV cache layer id
     std::unordered_map<int32_t, int32_t> map_layer_ids;
 
+    // copy-on-write: the KV cells are shared between sequences (see seq_cp()) and the number of sequences in a cell acts
+    //   as its reference count. a sequence that changes the position of a shared cell (seq_add(), seq_div()) first gets
+    //   a private copy of the cell. the data of the copies is moved lazily: cell .first -> cell .second
+    // note: mutable, because the pending copies are flushed when the state is written
+    mutable std::vector<std::pair<uint32_t, uint32_t>> cow_pending;
+
+    // give seq_id a private copy of the shared cells in idxs, idxs is updated with the indices of the copies
+    // returns false without modifying the cache if there are not enough free cells for the copies
+    bool seq_cow(llama_seq_id seq_id, std::vector<uint32_t> & idxs);
+
+    // apply the pending copies with direct buffer copies of the copied cells, used when there is no compute context
+    // (state save/load)
+    void cow_apply() const;
+
+    // find free cells for the ubatch in the blocks of its sequences (paged layout)
+    slot_info find_slot_paged(const llama_ubatch & ubatch) const;
+
+    // a run of consecutive blocks copied by the gather, in cells
+    struct gather_copy {
+        uint32_t src; // first cell in the cache
+        uint32_t dst; // first cell in the gathered tensor
+        uint32_t n;
+    };
+
+    // the gather copies the window of cells [s, s + get_n_kv(blocks)) of the cache, then the runs of blocks that are
+    // not already in place in the window are copied over it
+    std::vector<gather_copy> get_gather_copies(const std::vector<uint32_t> & blocks, uint32_t & s) const;
+
+    // gather the cells of the blocks of the cache tensor t (one row per cell)
+    ggml_tensor * gather_blocks(ggml_context * ctx, ggml_cgraph * gf, ggml_tensor * t, const std::vector<uint32_t> & blocks) const;
+
     // return non-empty vector if cells have been moved
     defrag_info defrag_prepare(int32_t n_max_nodes) const;
 
@@ -237,6 +292,13 @@ private:
                     ggml_cgraph * gf,
               const defrag_info & dinfo) const;
 
+    // copy the pending copy-on-write cells [i0, i1)
+    llm_graph_result_ptr build_graph_cow(
+                   ggml_context * ctx,
+                    ggml_cgraph * gf,
+                         size_t   i0,
+                         size_t   i1) const;
+
     void state_write_meta(llama_io_write_i & io, const std::vector<std::pair<uint32_t, uint32_t>> & cell_ranges, llama_seq_id seq_id = -1) const;
     void state_write_data(llama_io_write_i & io, const std::vector<std::pair<uint32_t, uint32_t>> & cell_ranges) const;
 
@@ -261,6 +323,7 @@ public:
     llama_kv_cache_unified_context(
             llama_kv_cache_unified * kv,
             llama_context * lctx,
+            bool do_copy,
             bool do_shift,
             defrag_info dinfo);
 
@@ -288,10 +351,19 @@ public:
 
     uint32_t get_n_kv() const;
 
+    // paged layout: the KV blocks of the sequences in the current ubatch (see llama_kv_cache_unified::get_blocks())
+    std::vector<uint32_t> get_blocks() const;
+
+    uint32_t get_n_kv(const std::vector<uint32_t> & blocks) const;
+
     // get views of the current state of the cache
     ggml_tensor * get_k(ggml_context * ctx, int32_t il) const;
     ggml_tensor * get_v(ggml_context * ctx, int32_t il) const;
 
+    // gather the listed KV blocks
+    ggml_tensor * get_k(ggml_context * ctx, ggml_cgraph * gf, int32_t il, const std::vector<uint32_t> & blocks) const;
+    ggml_tensor * get_v(ggml_context * ctx, ggml_cgraph * gf, int32_t il, const std::vector<uint32_t> & blocks) const;
+
     // store k_cur and v_cur in the cache based on the provided head location
     ggml_tensor * cpy_k(ggml_context * ctx, ggml_tensor * k_cur, ggml_tensor * k_idxs, int32_t il) const;
     ggml_tensor * cpy_v(ggml_context * ctx, ggml_tensor * v_cur, ggml_tensor * v_idxs, int32_t il) const;
@@ -304,6 +376,7 @@ public:
 
     void set_input_k_shift   (ggml_tensor * dst) const;
     void set_input_kq_mask   (ggml_tensor * dst, const llama_ubatch * ubatch, bool causal_attn) const;
+    void set_input_kq_mask   (ggml_tensor * dst, const llama_ubatch * ubatch, bool causal_attn, const std::vector<uint32_t> & blocks) const;
     void set_input_pos_bucket(ggml_tensor * dst, const llama_ubatch * ubatch) const;
 
 private:
@@ -316,6 +389,7 @@ private:
     // update context
     //
 
+    bool do_copy  = false;
     bool do_shift = false;
 
     defrag_info dinfo;
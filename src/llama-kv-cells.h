@@ -96,6 +96,25 @@ public:
         used.insert(idst);
     }
 
+    // move seq_id from the shared cell isrc to the empty cell idst, keeping the position and the shift (used for copy-on-write)
+    // note: call only if isrc has seq_id and at least one other sequence
+    void seq_mv(uint32_t isrc, uint32_t idst, llama_seq_id seq_id) {
+        assert(isrc < pos.size());
+        assert(idst < pos.size());
+
+        assert(pos[idst] == -1);
+        assert(seq[isrc].test(seq_id));
+        assert(seq[isrc].count() > 1);
+
+        seq[isrc].reset(seq_id);
+
+        pos  [idst] = pos  [isrc];
+        shift[idst] = shift[isrc];
+        seq  [idst].set(seq_id);
+
+        used.insert(idst);
+    }
+
     // copy the state of cells [i, i + n) (used for save/restore the state of the cells)
     llama_kv_cells_unified cp(uint32_t i, uint32_t n) const {
         assert(i + n <= pos.size());
@@ -143,14 +143,14 @@ void llama_memory_hybrid::seq_keep(llama_seq_id seq_id) {
     mem_recr->seq_keep(seq_id);
 }
 
-void llama_memory_hybrid::seq_add(llama_seq_id seq_id, llama_pos p0, llama_pos p1, llama_pos shift) {
-    mem_attn->seq_add(seq_id, p0, p1, shift);
-    mem_recr->seq_add(seq_id, p0, p1, shift);
+bool llama_memory_hybrid::seq_add(llama_seq_id seq_id, llama_pos p0, llama_pos p1, llama_pos shift) {
+    // the recurrent memory cannot fail, so it is updated only if the attention cache was
+    return mem_attn->seq_add(seq_id, p0, p1, shift) && mem_recr->seq_add(seq_id, p0, p1, shift);
 }
 
-void llama_memory_hybrid::seq_div(llama_seq_id seq_id, llama_pos p0, llama_pos p1, int d) {
-    mem_attn->seq_div(seq_id, p0, p1, d);
-    mem_recr->seq_div(seq_id, p0, p1, d);
+bool llama_memory_hybrid::seq_div(llama_seq_id seq_id, llama_pos p0, llama_pos p1, int d) {
+    // the recurrent memory cannot fail, so it is updated only if the attention cache was
+    return mem_attn->seq_div(seq_id, p0, p1, d) && mem_recr->seq_div(seq_id, p0, p1, d);
 }
 
 llama_pos llama_memory_hybrid::seq_pos_min(llama_seq_id seq_id) const {
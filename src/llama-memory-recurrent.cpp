@@ -274,9 +274,9 @@ void llama_memory_recurrent::seq_keep(llama_seq_id seq_id) {
     }
 }
 
-void llama_memory_recurrent::seq_add(llama_seq_id seq_id, llama_pos p0, llama_pos p1, llama_pos shift) {
+bool llama_memory_recurrent::seq_add(llama_seq_id seq_id, llama_pos p0, llama_pos p1, llama_pos shift) {
     if (shift == 0) {
-        return;
+        return true;
     }
 
     if (p0 < 0) {
@@ -289,7 +289,7 @@ void llama_memory_recurrent::seq_add(llama_seq_id seq_id, llama_pos p0, llama_po
 
     // If there is no range then return early to avoid looping over the
     if (p0 == p1) {
-        return;
+        return true;
     }
 
     // for Mamba-like or RWKV models, only the pos needs to be shifted
@@ -302,11 +302,13 @@ void llama_memory_recurrent::seq_add(llama_seq_id seq_id, llama_pos p0, llama_po
             }
         }
     }
+
+    return true;
 }
 
-void llama_memory_recurrent::seq_div(llama_seq_id seq_id, llama_pos p0, llama_pos p1, int d) {
+bool llama_memory_recurrent::seq_div(llama_seq_id seq_id, llama_pos p0, llama_pos p1, int d) {
     if (d == 1) {
-        return;
+        return true;
     }
 
     if (p0 < 0) {
@@ -319,7 +321,7 @@ void llama_memory_recurrent::seq_div(llama_seq_id seq_id, llama_pos p0, llama_po
 
     // If there is no range then return early to avoid looping over the cache.
     if (p0 == p1) {
-        return;
+        return true;
     }
 
     // for Mamba-like or RWKV models, only the pos needs to be changed
@@ -332,6 +334,8 @@ void llama_memory_recurrent::seq_div(llama_seq_id seq_id, llama_pos p0, llama_po
             }
         }
     }
+
+    return true;
 }
 
 llama_pos llama_memory_recurrent::seq_pos_min(llama_seq_id seq_id) const {
@@ -9,6 +9,8 @@
 #include <stdexcept>
 #include <cerrno>
 #include <algorithm>
+#include <mutex>
+#include <string>
 
 #ifdef __has_include
     #if __has_include(<unistd.h>)
@@ -132,6 +134,38 @@ struct llama_file::impl {
         return val;
     }
 
+    void read_raw_at(void * ptr, size_t len, size_t offset) const {
+        size_t bytes_read = 0;
+        while (bytes_read < len) {
+            size_t chunk_size = std::min<size_t>(len - bytes_read, 64*1024*1024);
+            OVERLAPPED overlapped = {};
+            overlapped.Offset     = (DWORD) ((offset + bytes_read) & 0xFFFFFFFF);
+            overlapped.OffsetHigh = (DWORD) ((uint64_t) (offset + bytes_read) >> 32);
+            DWORD chunk_read = 0;
+            BOOL result = ReadFile(fp_win32, reinterpret_cast<char*>(ptr) + bytes_read, chunk_size, &chunk_read, &overlapped);
+            if (!result) {
+                throw std::runtime_error(format("read error: %s", GetErrorMessageWin32(GetLastError()).c_str()));
+            }
+            if (chunk_read < chunk_size || chunk_read == 0) {
+                throw std::runtime_error("unexpectedly reached end of file");
+            }
+
+            bytes_read += chunk_read;
+        }
+    }
+
+    bool open_direct_io() {
+        // direct I/O is only implemented on Linux
+        return false;
+    }
+
+    size_t read_raw_direct(void * ptr, size_t len, size_t offset) const {
+        GGML_UNUSED(ptr);
+        GGML_UNUSED(len);
+        GGML_UNUSED(offset);
+        GGML_ABORT("direct I/O is not supported on this platform");
+    }
+
     void write_raw(const void * ptr, size_t len) const {
         size_t bytes_written = 0;
         while (bytes_written < len) {
@@ -159,7 +193,7 @@ struct llama_file::impl {
         }
     }
 #else
-    impl(const char * fname, const char * mode) {
+    impl(const char * fname, const char * mode) : fname(fname) {
         fp = ggml_fopen(fname, mode);
         if (fp == NULL) {
             throw std::runtime_error(format("failed to open %s: %s", fname, strerror(errno)));
@@ -215,6 +249,78 @@ struct llama_file::impl {
         return ret;
     }
 
+#ifdef _POSIX_VERSION
+    // returns the number of bytes read, which is less than len only at the end of the file
+    static size_t pread_full(int fd, void * ptr, size_t len, size_t offset) {
+        size_t bytes_read = 0;
+        while (bytes_read < len) {
+            ssize_t ret = pread(fd, (char *) ptr + bytes_read, len - bytes_read, (off_t) (offset + bytes_read));
+            if (ret == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error(format("read error: %s", strerror(errno)));
+            }
+            if (ret == 0) {
+                break;
+            }
+            bytes_read += ret;
+        }
+        return bytes_read;
+    }
+
+    void read_raw_at(void * ptr, size_t len, size_t offset) const {
+        if (pread_full(fileno(fp), ptr, len, offset) != len) {
+            throw std::runtime_error("unexpectedly reached end of file");
+        }
+    }
+#else
+    void read_raw_at(void * ptr, size_t len, size_t offset) const {
+        std::lock_guard<std::mutex> lock(mtx);
+        seek(offset, SEEK_SET);
+        read_raw(ptr, len);
+    }
+
+    mutable std::mutex mtx;
+#endif
+
+    bool open_direct_io() {
+#if defined(__linux__) && defined(O_DIRECT)
+        if (fd_direct != -1) {
+            return true;
+        }
+        fd_direct = open(fname.c_str(), O_RDONLY | O_DIRECT);
+        if (fd_direct == -1) {
+            LLAMA_LOG_WARN("%s: failed to open %s with O_DIRECT: %s\n", __func__, fname.c_str(), strerror(errno));
+            return false;
+        }
+        // some filesystems accept O_DIRECT on open but fail the reads, probe with a single aligned block
+        std::vector<uint8_t> probe(2*llama_file::DIRECT_IO_ALIGNMENT);
+        void * ptr = (void *) GGML_PAD((uintptr_t) probe.data(), llama_file::DIRECT_IO_ALIGNMENT);
+        if (pread(fd_direct, ptr, llama_file::DIRECT_IO_ALIGNMENT, 0) == -1) {
+            LLAMA_LOG_WARN("%s: O_DIRECT reads are not supported for %s: %s\n", __func__, fname.c_str(), strerror(errno));
+            close(fd_direct);
+            fd_direct = -1;
+            return false;
+        }
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    size_t read_raw_direct(void * ptr, size_t len, size_t offset) const {
+        GGML_ASSERT(fd_direct != -1);
+        GGML_ASSERT((uintptr_t) ptr % llama_file::DIRECT_IO_ALIGNMENT == 0);
+        GGML_ASSERT(len    % llama_file::DIRECT_IO_ALIGNMENT == 0);
+        GGML_ASSERT(offset % llama_file::DIRECT_IO_ALIGNMENT == 0);
+#ifdef _POSIX_VERSION
+        return pread_full(fd_direct, ptr, len, offset);
+#else
+        GGML_ABORT("direct I/O is not supported on this platform");
+#endif
+    }
+
     void write_raw(const void * ptr, size_t len) const {
         if (len == 0) {
             return;
@@ -231,10 +337,18 @@ struct llama_file::impl {
     }
 
     ~impl() {
+#ifdef _POSIX_VERSION
+        if (fd_direct != -1) {
+            close(fd_direct);
+        }
+#endif
         if (fp) {
             std::fclose(fp);
         }
     }
+
+    std::string fname;
+    int fd_direct = -1;
 #endif
 
     FILE * fp;
@@ -264,6 +378,20 @@ void llama_file::read_raw(void * ptr, size_t len) const { pimpl->read_raw(ptr, l
 
 uint32_t llama_file::read_u32() const { return pimpl->read_u32(); }
 
+void llama_file::read_raw_at(void * ptr, size_t len, size_t offset) const { pimpl->read_raw_at(ptr, len, offset); }
+
+bool llama_file::open_direct_io() { return pimpl->open_direct_io(); }
+
+bool llama_file::has_direct_io() const {
+#if defined(_WIN32)
+    return false;
+#else
+    return pimpl->fd_direct != -1;
+#endif
+}
+
+size_t llama_file::read_raw_direct(void * ptr, size_t len, size_t offset) const { return pimpl->read_raw_direct(ptr, len, offset); }
+
 void llama_file::write_raw(const void * ptr, size_t len) const { pimpl->write_raw(ptr, len); }
 void llama_file::write_u32(uint32_t val) const { pimpl->write_u32(val); }
 
@@ -26,6 +26,19 @@ struct llama_file {
     void read_raw(void * ptr, size_t len) const;
     uint32_t read_u32() const;
 
+    // positional read, does not move the file position and is safe to call from multiple threads
+    void read_raw_at(void * ptr, size_t len, size_t offset) const;
+
+    // direct I/O (O_DIRECT, Linux only) bypasses the page cache, buffer, offset and length must be multiples of DIRECT_IO_ALIGNMENT
+    // returns false if direct I/O is not supported for this file, reads then fall back to read_raw_at
+    bool open_direct_io();
+    bool has_direct_io() const;
+
+    // returns the number of bytes read, which is less than len only at the end of the file
+    size_t read_raw_direct(void * ptr, size_t len, size_t offset) const;
+
+    static constexpr size_t DIRECT_IO_ALIGNMENT = 4096;
+
     void write_raw(const void * ptr, size_t len) const;
     void write_u32(uint32_t val) const;
 
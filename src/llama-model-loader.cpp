@@ -2,10 +2,16 @@
 
 #include "ggml.h"
 
+#include <algorithm>
 #include <array>
+#include <atomic>
 #include <cinttypes>
+#include <condition_variable>
 #include <cstring>
+#include <deque>
 #include <future>
+#include <mutex>
+#include <thread>
 
 static const size_t kiB = 1024;
 static const size_t MiB = 1024*kiB;
@@ -469,6 +475,7 @@ llama_model_loader::llama_model_loader(
         const std::string & fname,
         std::vector<std::string> & splits,
         bool use_mmap,
+        bool use_direct_io,
         bool check_tensors,
         const llama_model_kv_override * param_overrides_p,
         const llama_model_tensor_buft_override * param_tensor_buft_overrides_p) {
@@ -711,7 +718,24 @@ llama_model_loader::llama_model_loader(
         use_mmap = false;
     }
 
+    if (use_direct_io) {
+        if (use_mmap) {
+            LLAMA_LOG_INFO("%s: direct I/O requested, disabling mmap\n", __func__);
+            use_mmap = false;
+        }
+        size_t n_direct = 0;
+        for (auto & file : files) {
+            n_direct += file->open_direct_io();
+        }
+        if (n_direct < files.size()) {
+            LLAMA_LOG_WARN("%s: direct I/O is not supported for %zu of %zu files, using buffered reads for them\n",
+                    __func__, files.size() - n_direct, files.size());
+        }
+        use_direct_io = n_direct > 0;
+    }
+
     this->use_mmap = use_mmap;
+    this->use_direct_io = use_direct_io;
     this->check_tensors = check_tensors;
 }
 
@@ -923,22 +947,172 @@ bool llama_model_loader::load_all_data(
         void * progress_callback_user_data) {
     GGML_ASSERT(size_data != 0 && "call init_mappings() first");
 
-    std::vector<no_init<uint8_t>> read_buf;
     std::vector<std::future<std::pair<ggml_tensor *, bool>>> validation_result;
 
-    // 4 staging buffers for async uploads, each sized 1MB seems to be a good default for single NVMe drives.
-    // NVMe raid configurations might require more / larger buffers.
-    constexpr size_t n_buffers = 4;
-    constexpr size_t buffer_size = 1 * 1024 * 1024; // 1MB
+    if (!use_mmap) {
+        if (!load_all_data_read(ctx, bufs, progress_callback, progress_callback_user_data)) {
+            return false;
+        }
+    } else {
+        for (struct ggml_tensor * cur = ggml_get_first_tensor(ctx); cur != NULL; cur = ggml_get_next_tensor(ctx, cur)) {
+            const auto * weight = get_weight(ggml_get_name(cur));
+            if (weight == nullptr) {
+                // this can happen with split experts models
+                continue;
+            }
+
+            if (progress_callback) {
+                if (!progress_callback((float) size_done / size_data, progress_callback_user_data)) {
+                    return false;
+                }
+            }
+
+            size_t n_size = ggml_nbytes(cur);
+
+            const auto & mapping = mappings.at(weight->idx);
+            ggml_backend_buffer_t buf_mmap = nullptr;
+            if (bufs.count(weight->idx)) {
+                buf_mmap = bufs.at(weight->idx);
+            }
+            uint8_t * data = (uint8_t *) mapping->addr() + weight->offs;
+
+            if (check_tensors) {
+                validation_result.emplace_back(std::async(std::launch::async, [cur, data, n_size] {
+                    return std::make_pair(cur, ggml_validate_row_data(cur->type, data, n_size));
+                }));
+            }
+
+            GGML_ASSERT(buf_mmap || cur->data); // either we have a buffer to allocate the tensor in, or it is already allocated
+            if (buf_mmap && cur->data == nullptr) {
+                ggml_backend_tensor_alloc(buf_mmap, cur, data);
+                if (lmlocks) {
+                    const auto & lmlock = lmlocks->at(weight->idx);
+                    lmlock->grow_to(weight->offs + n_size);
+                }
+
+                auto & mmap_used = mmaps_used[weight->idx];
+                mmap_used.first  = std::min(mmap_used.first,  weight->offs);
+                mmap_used.second = std::max(mmap_used.second, weight->offs + n_size);
+            } else {
+                ggml_backend_tensor_set(cur, data, 0, n_size);
+            }
+
+            size_done += n_size;
+        }
+    }
+
+    // check validation results
+    bool validation_failed = false;
+    for (auto & future : validation_result) {
+        auto result = future.get();
+        if (!result.second) {
+            LLAMA_LOG_ERROR("%s: tensor '%s' has invalid data\n", __func__, ggml_get_name(result.first));
+            validation_failed = true;
+        }
+    }
+    if (validation_failed) {
+        throw std::runtime_error("found tensors with invalid data");
+    }
+
+    // check if this is the last call and do final cleanup
+    if (size_done >= size_data) {
+        // unmap offloaded tensors and metadata
+        if (use_mmap) {
+            for (uint32_t idx = 0; idx < mappings.size(); idx++) {
+                const auto & mmap_used = mmaps_used.at(idx);
+                auto & mapping = mappings.at(idx);
+                mapping->unmap_fragment(0, mmap_used.first);
+                if (mmap_used.second != 0) {
+                    mapping->unmap_fragment(mmap_used.second, mapping->size());
+                }
+            }
+        }
+        if (progress_callback) {
+            // Even though the model is done loading, we still honor
+            // cancellation since we need to free allocations.
+            return progress_callback(1.0f, progress_callback_user_data);
+        }
+    }
+
+    return true;
+}
+
+// read the aligned span of the file covering [offs, offs + len) into buf, returns a pointer to the data at offs
+static const uint8_t * llama_file_read_direct(const llama_file * file, uint8_t * buf, size_t buf_size, size_t offs, size_t len) {
+    constexpr size_t align = llama_file::DIRECT_IO_ALIGNMENT;
+
+    const size_t first = offs - offs % align;
+    const size_t skip  = offs - first;
+    const size_t span  = GGML_PAD(skip + len, align);
+    GGML_ASSERT(span <= buf_size);
+
+    if (file->read_raw_direct(buf, span, first) < skip + len) {
+        throw std::runtime_error("unexpectedly reached end of file");
+    }
+
+    return buf + skip;
+}
+
+// read len bytes at offs into dst, with direct I/O the data goes through the aligned bounce buffer
+static void llama_file_read_at(const llama_file * file, void * dst, size_t len, size_t offs, std::vector<no_init<uint8_t>> & bounce) {
+    constexpr size_t align       = llama_file::DIRECT_IO_ALIGNMENT;
+    constexpr size_t bounce_size = 4*MiB;
+
+    if (!file->has_direct_io()) {
+        file->read_raw_at(dst, len, offs);
+        return;
+    }
+
+    bounce.resize(bounce_size + align);
+    uint8_t * buf = (uint8_t *) GGML_PAD((uintptr_t) bounce.data(), align);
+
+    size_t done = 0;
+    while (done < len) {
+        const size_t skip = (offs + done) % align;
+        const size_t n    = std::min(len - done, bounce_size - skip);
+
+        memcpy((uint8_t *) dst + done, llama_file_read_direct(file, buf, bounce_size, offs + done, n), n);
+        done += n;
+    }
+}
+
+bool llama_model_loader::load_all_data_read(
+        struct ggml_context * ctx,
+        llama_buf_map & bufs,
+        llama_progress_callback progress_callback,
+        void * progress_callback_user_data) {
+    // reads into host buffers are split in chunks of 16MB, so that large tensors are read by multiple threads
+    // uploads to the device go through staging buffers of 4MB in pinned memory, two per reader
+    // the chunks are aligned to the rows of the tensor so that they can be validated on their own
+    constexpr size_t chunk_size   = 16*MiB;
+    constexpr size_t staging_size =  4*MiB;
+    constexpr size_t align        = llama_file::DIRECT_IO_ALIGNMENT;
+
+    // the reads are I/O bound, more readers than cores keep more requests in flight on NVMe drives
+    const size_t n_readers = std::clamp<size_t>(std::thread::hardware_concurrency(), 4, 16);
+    const size_t n_staging = 2*n_readers;
+
+    enum load_kind {
+        LOAD_HOST,   // read directly into a host buffer
+        LOAD_SET,    // read the whole tensor and set it from the reader, e.g. to repack it for the CPU
+                     // the whole tensors read at the same time are limited to set_budget bytes
+        LOAD_UPLOAD, // read into a staging buffer, uploaded asynchronously by the main thread
+        LOAD_MAIN,   // read the whole tensor and set it from the main thread
+    };
+
+    struct load_job {
+        ggml_tensor      * tensor;
+        const llama_file * file;
+        size_t             offs;  // offset of the chunk in the file
+        size_t             first; // offset of the chunk in the tensor
+        size_t             size;
+        load_kind          kind;
+    };
 
     std::vector<ggml_backend_buffer_t> host_buffers;
     std::vector<ggml_backend_event_t> events;
-    std::vector<void *> host_ptrs;
-    size_t buffer_idx = 0; // buffer to use for async loads
+    std::vector<uint8_t *> host_ptrs;
     ggml_backend_t upload_backend = [&](const char * func) -> ggml_backend_t {
-        if (use_mmap || check_tensors) {
-            return nullptr;
-        }
         // When not using mmaped io use async uploads from pinned memory to GPU memory.
         // First determine if the backend supports the necessary features for async uploads.
         auto * buf = bufs.count(0) ? bufs.at(0) : nullptr;
@@ -976,8 +1150,15 @@ bool llama_model_loader::load_all_data(
             return nullptr;
         }
 
+        // a staging buffer must fit at least one row, plus the alignment of the direct reads
+        size_t buffer_size = staging_size;
+        for (ggml_tensor * cur = ggml_get_first_tensor(ctx); cur != NULL; cur = ggml_get_next_tensor(ctx, cur)) {
+            buffer_size = std::max(buffer_size, ggml_row_size(cur->type, cur->ne[0]));
+        }
+        buffer_size += 3*align;
+
         // If the backend is supported, create pinned memory buffers and events for synchronisation.
-        for (size_t idx = 0; idx < n_buffers; ++idx) {
+        for (size_t idx = 0; idx < n_staging; ++idx) {
             auto * buf = ggml_backend_buft_alloc_buffer(host_buft, buffer_size);
             if (!buf) {
                 LLAMA_LOG_DEBUG("%s: failed to allocate host buffer for async uploads for device %s\n", func,
@@ -986,7 +1167,7 @@ bool llama_model_loader::load_all_data(
             }
 
             host_buffers.emplace_back(buf);
-            host_ptrs.emplace_back(ggml_backend_buffer_get_base(buf));
+            host_ptrs.emplace_back((uint8_t *) GGML_PAD((uintptr_t) ggml_backend_buffer_get_base(buf), align));
 
             auto * event = ggml_backend_event_new(dev);
             if (!event) {
@@ -1015,91 +1196,266 @@ bool llama_model_loader::load_all_data(
             ggml_backend_name(upload_backend));
     }
 
-    for (struct ggml_tensor * cur = ggml_get_first_tensor(ctx); cur != NULL; cur = ggml_get_next_tensor(ctx, cur)) {
+    // the size of the staging buffers without the padding for the alignment
+    const size_t staging_usable = host_buffers.empty() ? 0 : ggml_backend_buffer_get_size(host_buffers[0]) - 2*align;
+
+    std::vector<load_job> jobs;
+    std::vector<load_job> jobs_main;
+    size_t size_total = 0;
+    size_t set_budget = 256*MiB;
+
+    for (ggml_tensor * cur = ggml_get_first_tensor(ctx); cur != NULL; cur = ggml_get_next_tensor(ctx, cur)) {
         const auto * weight = get_weight(ggml_get_name(cur));
         if (weight == nullptr) {
             // this can happen with split experts models
             continue;
         }
 
-        if (progress_callback) {
-            if (!progress_callback((float) size_done / size_data, progress_callback_user_data)) {
-                return false;
-            }
+        const size_t n_size = ggml_nbytes(cur);
+        const llama_file * file = files.at(weight->idx).get();
+        size_total += n_size;
+        if (n_size == 0) {
+            continue;
         }
 
-        size_t n_size = ggml_nbytes(cur);
-
-        if (use_mmap) {
-            const auto & mapping = mappings.at(weight->idx);
-            ggml_backend_buffer_t buf_mmap = nullptr;
-            if (bufs.count(weight->idx)) {
-                buf_mmap = bufs.at(weight->idx);
+        load_kind kind = LOAD_MAIN;
+        if (ggml_backend_buffer_is_host(cur->buffer)) {
+            kind = LOAD_HOST;
+        } else if (upload_backend) {
+            kind = LOAD_UPLOAD;
+        } else {
+            // the CPU backend can set different tensors concurrently, other backends are set from the main thread
+            auto * dev = ggml_backend_buft_get_device(ggml_backend_buffer_get_type(cur->buffer));
+            if (dev && ggml_backend_dev_type(dev) == GGML_BACKEND_DEVICE_TYPE_CPU) {
+                kind = LOAD_SET;
             }
-            uint8_t * data = (uint8_t *) mapping->addr() + weight->offs;
+        }
 
-            if (check_tensors) {
-                validation_result.emplace_back(std::async(std::launch::async, [cur, data, n_size] {
-                    return std::make_pair(cur, ggml_validate_row_data(cur->type, data, n_size));
-                }));
+        if (kind == LOAD_SET || kind == LOAD_MAIN) {
+            (kind == LOAD_SET ? jobs : jobs_main).push_back({ cur, file, weight->offs, 0, n_size, kind });
+            if (kind == LOAD_SET) {
+                // a tensor larger than the budget is read alone
+                set_budget = std::max(set_budget, n_size);
             }
+            continue;
+        }
 
-            GGML_ASSERT(buf_mmap || cur->data); // either we have a buffer to allocate the tensor in, or it is already allocated
-            if (buf_mmap && cur->data == nullptr) {
-                ggml_backend_tensor_alloc(buf_mmap, cur, data);
-                if (lmlocks) {
-                    const auto & lmlock = lmlocks->at(weight->idx);
-                    lmlock->grow_to(weight->offs + n_size);
+        const size_t row_size = ggml_row_size(cur->type, cur->ne[0]);
+        const size_t target   = kind == LOAD_HOST ? chunk_size : staging_usable - align;
+        const size_t n_chunk  = std::max<size_t>(1, target / row_size) * row_size;
+
+        for (size_t first = 0; first < n_size; first += n_chunk) {
+            jobs.push_back({ cur, file, weight->offs + first, first, std::min(n_chunk, n_size - first), kind });
+        }
+    }
+
+    std::mutex mutex;
+    std::condition_variable cv;
+
+    struct staged_chunk {
+        size_t          job;
+        size_t          slot;
+        const uint8_t * data;
+    };
+
+    std::deque<staged_chunk> ready;    // read into a staging buffer, waiting for upload
+    std::deque<size_t>       inflight; // staging buffers with an upload in flight
+    std::vector<size_t>      slots_free;
+    for (size_t i = 0; i < host_buffers.size(); ++i) {
+        slots_free.push_back(i);
+    }
+
+    std::atomic<size_t> next_job  = 0;
+    std::atomic<size_t> size_read = 0;
+    std::atomic<bool>   invalid   = false;
+
+    bool abort = false;
+    size_t n_finished = 0;
+    size_t set_in_flight = 0;
+    std::exception_ptr error;
+
+    auto validate = [&, func = __func__](const ggml_tensor * cur, const void * data, size_t size) {
+        if (check_tensors && !ggml_validate_row_data(cur->type, data, size)) {
+            LLAMA_LOG_ERROR("%s: tensor '%s' has invalid data\n", func, ggml_get_name(cur));
+            invalid = true;
+        }
+    };
+
+    auto worker = [&]() {
+        std::vector<no_init<uint8_t>> bounce;
+
+        try {
+            for (size_t i = next_job++; i < jobs.size(); i = next_job++) {
+                const load_job & job = jobs[i];
+                ggml_tensor * cur = job.tensor;
+
+                switch (job.kind) {
+                    case LOAD_HOST:
+                        {
+                            uint8_t * data = (uint8_t *) cur->data + job.first;
+                            llama_file_read_at(job.file, data, job.size, job.offs, bounce);
+                            validate(cur, data, job.size);
+                        } break;
+                    case LOAD_SET:
+                        {
+                            {
+                                std::unique_lock<std::mutex> lock(mutex);
+                                cv.wait(lock, [&] { return abort || set_in_flight + job.size <= set_budget; });
+                                if (abort) {
+                                    break;
+                                }
+                                set_in_flight += job.size;
+                            }
+
+                            {
+                                // freed right after the set so that idle readers do not hold on to the memory
+                                std::vector<no_init<uint8_t>> read_buf(job.size);
+                                llama_file_read_at(job.file, read_buf.data(), job.size, job.offs, bounce);
+                                validate(cur, read_buf.data(), job.size);
+                                ggml_backend_tensor_set(cur, read_buf.data(), 0, job.size);
+                            }
+
+                            std::lock_guard<std::mutex> lock(mutex);
+                            set_in_flight -= job.size;
+                        } break;
+                    case LOAD_UPLOAD:
+                        {
+                            size_t slot;
+                            {
+                                std::unique_lock<std::mutex> lock(mutex);
+                                cv.wait(lock, [&] { return abort || !slots_free.empty(); });
+                                if (abort) {
+                                    break;
+                                }
+                                slot = slots_free.back();
+                                slots_free.pop_back();
+                            }
+
+                            const uint8_t * data = host_ptrs[slot];
+                            if (job.file->has_direct_io()) {
+                                data = llama_file_read_direct(job.file, host_ptrs[slot], staging_usable, job.offs, job.size);
+                            } else {
+                                job.file->read_raw_at(host_ptrs[slot], job.size, job.offs);
+                            }
+                            validate(cur, data, job.size);
+
+                            std::lock_guard<std::mutex> lock(mutex);
+                            ready.push_back({ i, slot, data });
+                        } break;
+                    case LOAD_MAIN:
+                        GGML_ABORT("fatal error");
                 }
 
-                auto & mmap_used = mmaps_used[weight->idx];
-                mmap_used.first  = std::min(mmap_used.first,  weight->offs);
-                mmap_used.second = std::max(mmap_used.second, weight->offs + n_size);
-            } else {
-                ggml_backend_tensor_set(cur, data, 0, n_size);
-            }
-        } else {
-            const auto & file = files.at(weight->idx);
-            if (ggml_backend_buffer_is_host(cur->buffer)) {
-                file->seek(weight->offs, SEEK_SET);
-                file->read_raw(cur->data, n_size);
-                if (check_tensors) {
-                    validation_result.emplace_back(std::async(std::launch::async, [cur, n_size] {
-                        return std::make_pair(cur, ggml_validate_row_data(cur->type, cur->data, n_size));
-                    }));
+                size_read += job.size;
+
+                std::lock_guard<std::mutex> lock(mutex);
+                cv.notify_all();
+                if (abort) {
+                    break;
                 }
-            } else {
-                // If upload_backend is valid load the tensor in chunks to pinned memory and upload the buffers asynchronously to the GPU.
-                if (upload_backend) {
-                    file->seek(weight->offs, SEEK_SET);
-
-                    size_t bytes_read = 0;
-
-                    while (bytes_read < n_size) {
-                        size_t read_iteration = std::min<size_t>(buffer_size, n_size - bytes_read);
-
-                        ggml_backend_event_synchronize(events[buffer_idx]);
-                        file->read_raw(host_ptrs[buffer_idx], read_iteration);
-                        ggml_backend_tensor_set_async(upload_backend, cur, host_ptrs[buffer_idx], bytes_read, read_iteration);
-                        ggml_backend_event_record(events[buffer_idx], upload_backend);
-
-                        bytes_read += read_iteration;
-                        ++buffer_idx;
-                        buffer_idx %= n_buffers;
-                    }
-                } else {
-                    read_buf.resize(n_size);
-                    file->seek(weight->offs, SEEK_SET);
-                    file->read_raw(read_buf.data(), n_size);
-                    ggml_backend_tensor_set(cur, read_buf.data(), 0, n_size);
-                    if (check_tensors && !ggml_validate_row_data(cur->type, read_buf.data(), n_size)) {
-                        throw std::runtime_error(format("tensor '%s' has invalid data", ggml_get_name(cur)));
-                    }
+            }
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!error) {
+                error = std::current_exception();
+            }
+            abort = true;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        n_finished++;
+        cv.notify_all();
+    };
+
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < std::min(n_readers, jobs.size()); ++i) {
+        workers.emplace_back(worker);
+    }
+
+    LLAMA_LOG_DEBUG("%s: reading %zu chunks with %zu threads%s\n", __func__,
+            jobs.size() + jobs_main.size(), workers.size(), use_direct_io ? " using direct I/O" : "");
+
+    // the main thread reports the progress, uploads the staged chunks and sets the tensors that cannot be set concurrently
+    std::vector<no_init<uint8_t>> bounce;
+    std::vector<no_init<uint8_t>> read_buf;
+
+    bool cancelled = false;
+    size_t i_main = 0;
+
+    try {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!abort) {
+            if (progress_callback) {
+                lock.unlock();
+                cancelled = !progress_callback((float) (size_done + size_read) / size_data, progress_callback_user_data);
+                lock.lock();
+                if (cancelled) {
+                    abort = true;
+                    break;
                 }
             }
+
+            if (!ready.empty()) {
+                const staged_chunk chunk = ready.front();
+                ready.pop_front();
+                lock.unlock();
+
+                const load_job & job = jobs[chunk.job];
+                ggml_backend_tensor_set_async(upload_backend, job.tensor, chunk.data, job.first, job.size);
+                ggml_backend_event_record(events[chunk.slot], upload_backend);
+
+                lock.lock();
+                inflight.push_back(chunk.slot);
+                continue;
+            }
+
+            if (i_main < jobs_main.size()) {
+                lock.unlock();
+
+                const load_job & job = jobs_main[i_main++];
+                read_buf.resize(job.size);
+                llama_file_read_at(job.file, read_buf.data(), job.size, job.offs, bounce);
+                validate(job.tensor, read_buf.data(), job.size);
+                ggml_backend_tensor_set(job.tensor, read_buf.data(), 0, job.size);
+                size_read += job.size;
+
+                lock.lock();
+                continue;
+            }
+
+            if (!inflight.empty()) {
+                const size_t slot = inflight.front();
+                inflight.pop_front();
+                lock.unlock();
+
+                ggml_backend_event_synchronize(events[slot]);
+
+                lock.lock();
+                slots_free.push_back(slot);
+                cv.notify_all();
+                continue;
+            }
+
+            if (n_finished == workers.size()) {
+                break;
+            }
+
+            cv.wait(lock);
+        }
+    } catch (...) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!error) {
+            error = std::current_exception();
         }
+        abort = true;
+    }
 
-        size_done += n_size;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        cv.notify_all();
+    }
+    for (auto & w : workers) {
+        w.join();
     }
 
     // free temporary resources used for async uploads
@@ -1112,38 +1468,17 @@ bool llama_model_loader::load_all_data(
     }
     ggml_backend_free(upload_backend);
 
-    // check validation results
-    bool validation_failed = false;
-    for (auto & future : validation_result) {
-        auto result = future.get();
-        if (!result.second) {
-            LLAMA_LOG_ERROR("%s: tensor '%s' has invalid data\n", __func__, ggml_get_name(result.first));
-            validation_failed = true;
-        }
+    if (error) {
+        std::rethrow_exception(error);
     }
-    if (validation_failed) {
+    if (cancelled) {
+        return false;
+    }
+    if (invalid) {
         throw std::runtime_error("found tensors with invalid data");
     }
 
-    // check if this is the last call and do final cleanup
-    if (size_done >= size_data) {
-        // unmap offloaded tensors and metadata
-        if (use_mmap) {
-            for (uint32_t idx = 0; idx < mappings.size(); idx++) {
-                const auto & mmap_used = mmaps_used.at(idx);
-                auto & mapping = mappings.at(idx);
-                mapping->unmap_fragment(0, mmap_used.first);
-                if (mmap_used.second != 0) {
-                    mapping->unmap_fragment(mmap_used.second, mapping->size());
-                }
-            }
-        }
-        if (progress_callback) {
-            // Even though the model is done loading, we still honor
-            // cancellation since we need to free allocations.
-            return progress_callback(1.0f, progress_callback_user_data);
-        }
-    }
+    size_done += size_total;
 
     return true;
 }
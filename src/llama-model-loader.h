@@ -69,6 +69,7 @@ struct llama_model_loader {
     size_t   n_bytes    = 0;
 
     bool use_mmap = false;
+    bool use_direct_io = false;
     bool check_tensors;
 
     llama_files files;
@@ -95,6 +96,7 @@ struct llama_model_loader {
         const std::string & fname,
         std::vector<std::string> & splits, // optional, only need if the split does not follow naming scheme
         bool use_mmap,
+        bool use_direct_io,
         bool check_tensors,
         const llama_model_kv_override * param_overrides_p,
         const llama_model_tensor_buft_override * param_tensor_buft_overrides_p);
@@ -163,6 +165,14 @@ struct llama_model_loader {
             llama_progress_callback progress_callback,
             void * progress_callback_user_data);
 
+    // load_all_data without mmap: the tensors are read in chunks by a pool of threads
+    // returns false if cancelled by progress_callback
+    bool load_all_data_read(
+            struct ggml_context * ctx,
+            llama_buf_map & bufs,
+            llama_progress_callback progress_callback,
+            void * progress_callback_user_data);
+
     std::string ftype_name() const;
 
     void print_info() const;
@@ -15448,6 +15448,7 @@ llama_model_params llama_model_default_params() {
         /*.use_mmap                    =*/ true,
         /*.use_mlock                   =*/ false,
         /*.check_tensors               =*/ false,
+        /*.use_direct_io               =*/ false,
     };
 
 #ifdef GGML_USE_METAL
@@ -5,6 +5,7 @@
 #include "llama-grammar.h"
 
 #include <algorithm>
+#include <array>
 #include <cassert>
 #include <cfloat>
 #include <chrono>
@@ -200,11 +201,11 @@ static void llama_sampler_temp_impl(llama_token_data_array * cur_p, float temp)
     }
 }
 
-static void llama_sampler_softmax_impl(llama_token_data_array * cur_p) {
+static void llama_sampler_softmax_impl(llama_token_data_array * cur_p, bool do_sort = true) {
     GGML_ASSERT(cur_p->size > 0);
 
     // Sort the logits in descending order
-    if (!cur_p->sorted) {
+    if (!cur_p->sorted && do_sort) {
         std::sort(cur_p->data, cur_p->data + cur_p->size, [](const llama_token_data & a, const llama_token_data & b) {
             return a.logit > b.logit;
         });
@@ -212,7 +213,14 @@ static void llama_sampler_softmax_impl(llama_token_data_array * cur_p) {
     }
 
     float max_l = cur_p->data[0].logit;
-    float cum_sum = 0.0f;
+    if (!cur_p->sorted) {
+        for (size_t i = 1; i < cur_p->size; ++i) {
+            max_l = std::max(max_l, cur_p->data[i].logit);
+        }
+    }
+
+    // accumulate in double, so that the result does not depend on the order of the candidates
+    double cum_sum = 0.0;
 
     for (size_t i = 0; i < cur_p->size; ++i) {
         float p = expf(cur_p->data[i].logit - max_l);
@@ -221,12 +229,76 @@ static void llama_sampler_softmax_impl(llama_token_data_array * cur_p) {
     }
 
     for (size_t i = 0; i < cur_p->size; ++i) {
-        cur_p->data[i].p /= cum_sum;
+        cur_p->data[i].p /= (float) cum_sum;
+    }
+}
+
+// sort the front of the candidates in descending order, until it holds at least n_min candidates and a probability mass
+// of at least p_min (requires the probabilities from llama_sampler_softmax_impl). the logits are bucketed by their
+// distance to the maximum, and only the candidates in the buckets needed to reach both bounds are sorted
+// returns the number of sorted candidates, the rest of the array is left in arbitrary order
+static size_t llama_sampler_partial_sort_impl(llama_token_data_array * cur_p, size_t n_min, float p_min) {
+    auto comp = [](const llama_token_data & a, const llama_token_data & b) {
+        return a.logit > b.logit;
+    };
+
+    if (cur_p->sorted) {
+        return cur_p->size;
+    }
+
+    constexpr int   nbuckets     = 128;
+    constexpr float bucket_range = 32.0f; // logits further below the maximum go to the last bucket
+    constexpr float bucket_scale = nbuckets/bucket_range;
+
+    float max_l = cur_p->data[0].logit;
+    for (size_t i = 1; i < cur_p->size; ++i) {
+        max_l = std::max(max_l, cur_p->data[i].logit);
+    }
+
+    auto bucket = [&](float logit) {
+        return int(std::min<float>(nbuckets - 1, bucket_scale*(max_l - logit)));
+    };
+
+    std::array<size_t, nbuckets> histo = {};
+    std::array<float,  nbuckets> mass  = {};
+
+    for (size_t i = 0; i < cur_p->size; ++i) {
+        const int ib = bucket(cur_p->data[i].logit);
+        histo[ib] += 1;
+        if (p_min > 0.0f) {
+            mass[ib] += cur_p->data[i].p;
+        }
+    }
+
+    size_t n_have = 0;
+    float  p_have = 0.0f;
+
+    int ib = 0;
+    for ( ; ib < nbuckets - 1; ++ib) {
+        n_have += histo[ib];
+        p_have += mass [ib];
+        if (n_have >= n_min && p_have >= p_min) {
+            break;
+        }
+    }
+
+    if (ib == nbuckets - 1) {
+        std::sort(cur_p->data, cur_p->data + cur_p->size, comp);
+        cur_p->sorted = true;
+
+        return cur_p->size;
     }
+
+    auto * end = std::partition(cur_p->data, cur_p->data + cur_p->size, [&](const llama_token_data & a) {
+        return bucket(a.logit) <= ib;
+    });
+
+    std::sort(cur_p->data, end, comp);
+
+    return end - cur_p->data;
 }
 
 static void llama_sampler_top_k_impl(llama_token_data_array * cur_p, int32_t k) {
-    // TODO: move bucket sort to separate function so that top_p/typical/softmax first is equally fast
     // if (k >= (int32_t)cur_p->size) {
     //     return;
     // }
@@ -245,56 +317,7 @@ static void llama_sampler_top_k_impl(llama_token_data_array * cur_p, int32_t k)
         if (k <= 128) {
             std::partial_sort(cur_p->data, cur_p->data + k, cur_p->data + cur_p->size, comp);
         } else {
-            constexpr int   nbuckets     = 128;
-            constexpr float bucket_low   = -10.0f;
-            constexpr float bucket_high  =  10.0f;
-            constexpr float bucket_scale = nbuckets/(bucket_high - bucket_low);
-            constexpr float bucket_inter = -bucket_low * bucket_scale;
-
-            std::vector<int> bucket_idx(cur_p->size);
-            std::vector<int> histo(nbuckets, 0);
-
-            for (int i = 0; i < (int)cur_p->size; ++i) {
-                const float val = cur_p->data[i].logit;
-                int ib = int(bucket_scale * val + bucket_inter); //nbuckets * (val - bucket_low) / (bucket_high - bucket_low);
-                ib = std::max(0, std::min(nbuckets - 1, ib));
-                bucket_idx[i] = ib;
-                ++histo[ib];
-            }
-            int nhave = 0;
-            int ib = nbuckets - 1;
-            for ( ; ib >= 0; --ib) {
-                nhave += histo[ib];
-                if (nhave >= k) {
-                    break;
-                }
-            }
-            std::vector<llama_token_data> tmp_tokens(nhave);
-            auto * ptr = tmp_tokens.data();
-            std::vector<llama_token_data*> bucket_ptrs;
-            bucket_ptrs.reserve(nbuckets - ib);
-            for (int j = nbuckets - 1; j >= ib; --j) {
-                bucket_ptrs.push_back(ptr);
-                ptr += histo[j];
-            }
-            for (int i = 0; i < (int)cur_p->size; ++i) {
-                int j = bucket_idx[i];
-                if (j >= ib) {
-                    *bucket_ptrs[nbuckets - 1 - j]++ = cur_p->data[i];
-                }
-            }
-
-            ptr = tmp_tokens.data();
-            int ndone = 0;
-            for (int j = nbuckets - 1; j > ib; --j) {
-                std::sort(ptr, ptr + histo[j], comp);
-                ptr += histo[j];
-                ndone += histo[j];
-            }
-            std::partial_sort(ptr, ptr + k - ndone, ptr + histo[ib], comp);
-
-            std::memcpy(cur_p->data, tmp_tokens.data(), k*sizeof(llama_token_data));
-
+            llama_sampler_partial_sort_impl(cur_p, k, 0.0f);
         }
         cur_p->sorted = true;
     }
@@ -712,13 +735,24 @@ static void llama_sampler_top_p_apply(struct llama_sampler * smpl, llama_token_d
         return;
     }
 
-    llama_sampler_softmax_impl(cur_p);
+    llama_sampler_softmax_impl(cur_p, false);
+
+    // only the candidates that hold the probability mass p need to be sorted
+    size_t n_sorted = llama_sampler_partial_sort_impl(cur_p, ctx->min_keep, ctx->p);
 
     // Compute the cumulative probabilities
     float cum_sum = 0.0f;
     size_t last_idx = cur_p->size;
 
     for (size_t i = 0; i < cur_p->size; ++i) {
+        if (i == n_sorted) {
+            // the mass of the buckets was off due to rounding, sort the rest as well
+            std::sort(cur_p->data + i, cur_p->data + cur_p->size, [](const llama_token_data & a, const llama_token_data & b) {
+                return a.logit > b.logit;
+            });
+            n_sorted = cur_p->size;
+        }
+
         cum_sum += cur_p->data[i].p;
 
         // Check if the running sum is at least p or if we have kept at least min_keep tokens
@@ -730,7 +764,8 @@ static void llama_sampler_top_p_apply(struct llama_sampler * smpl, llama_token_d
     }
 
     // Resize the output vector to keep only the top-p tokens
-    cur_p->size = last_idx;
+    cur_p->size   = last_idx;
+    cur_p->sorted = true;
 }
 
 static struct llama_sampler * llama_sampler_top_p_clone(const struct llama_sampler * smpl) {
@@ -1655,26 +1690,45 @@ static void llama_sampler_penalties_apply(struct llama_sampler * smpl, llama_tok
         return;
     }
 
-    // Apply frequency and presence penalties to the cur_p
-    for (size_t i = 0; i < cur_p->size; ++i) {
-        const auto token_iter = ctx->token_count.find(cur_p->data[i].id);
-        if (token_iter == ctx->token_count.end()) {
-            continue;
-        }
-
-        const int count = token_iter->second;
-
+    auto apply_penalty = [&](llama_token_data & cur, int count) {
         assert(count > 0 && count <= ctx->penalty_last_n);
 
         // The academic publication that described this technique actually just only divided, but that would cause tokens with negative logits to become more likely, which is obviously wrong.
         // This is common fix for this problem, which is to multiply by the penalty instead of dividing.
-        if (cur_p->data[i].logit <= 0) {
-            cur_p->data[i].logit *= ctx->penalty_repeat;
+        if (cur.logit <= 0) {
+            cur.logit *= ctx->penalty_repeat;
         } else {
-            cur_p->data[i].logit /= ctx->penalty_repeat;
+            cur.logit /= ctx->penalty_repeat;
+        }
+
+        cur.logit -= float(count) * ctx->penalty_freq + float(count > 0) * ctx->penalty_present;
+    };
+
+    // usually the candidates are the full vocab in token order, so only the penalized tokens need to be visited
+    bool indexed = !cur_p->sorted;
+    for (const auto & [token, count] : ctx->token_count) {
+        if (!indexed) {
+            break;
+        }
+        indexed = token >= 0 && (size_t) token < cur_p->size && cur_p->data[token].id == token;
+    }
+
+    if (indexed) {
+        for (const auto & [token, count] : ctx->token_count) {
+            apply_penalty(cur_p->data[token], count);
+        }
+
+        return;
+    }
+
+    // Apply frequency and presence penalties to the cur_p
+    for (size_t i = 0; i < cur_p->size; ++i) {
+        const auto token_iter = ctx->token_count.find(cur_p->data[i].id);
+        if (token_iter == ctx->token_count.end()) {
+            continue;
         }
 
-        cur_p->data[i].logit -= float(count) * ctx->penalty_freq + float(count > 0) * ctx->penalty_present;
+        apply_penalty(cur_p->data[i], token_iter->second);
     }
 
     cur_p->sorted = false;
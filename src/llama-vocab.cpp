@@ -16,8 +16,10 @@
 #include <forward_list>
 #include <limits>
 #include <map>
+#include <mutex>
 #include <queue>
 #include <set>
+#include <thread>
 #include <unordered_map>
 
 //
@@ -270,11 +272,75 @@ struct llm_bigram_bpe {
     using queue = llama_priority_queue<llm_bigram_bpe, queue_storage, comparator>;
     llm_symbol::index left;
     llm_symbol::index right;
-    std::string text;
+    llama_token id; // id of the merged symbol
     int rank;
     size_t size;
 };
 
+struct llm_bpe_merge {
+    int rank;
+    llama_token id; // id of the merged symbol
+};
+
+// bounded cache of the tokens of the pre-tokenized words, shared by all sessions of a tokenizer
+// the words are spread over shards with their own lock, each shard keeps two generations of entries:
+// when the current generation is full, the previous one is dropped and the entries that are used again get promoted
+struct llm_tokenizer_bpe_cache {
+    static constexpr size_t N_SHARDS       = 16;
+    static constexpr size_t SHARD_CAPACITY = 4096; // words per generation and shard
+    static constexpr size_t MAX_WORD_LEN   = 64;   // longer words are not cached
+
+    // append the cached tokens of the word to the output
+    bool find(const std::string & word, std::vector<llama_token> & output) {
+        auto & shard = get_shard(word);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+
+        auto it = shard.cur.find(word);
+        if (it != shard.cur.end()) {
+            output.insert(output.end(), it->second.begin(), it->second.end());
+            return true;
+        }
+
+        it = shard.prev.find(word);
+        if (it != shard.prev.end()) {
+            output.insert(output.end(), it->second.begin(), it->second.end());
+            shard.insert(word, std::move(it->second));
+            return true;
+        }
+
+        return false;
+    }
+
+    void insert(const std::string & word, std::vector<llama_token> tokens) {
+        auto & shard = get_shard(word);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+
+        shard.insert(word, std::move(tokens));
+    }
+
+private:
+    struct shard {
+        std::mutex mutex;
+        std::unordered_map<std::string, std::vector<llama_token>> cur;
+        std::unordered_map<std::string, std::vector<llama_token>> prev;
+
+        // tokens is taken by value: on a hit in prev it refers to an entry that the rotation below frees
+        void insert(const std::string & word, std::vector<llama_token> tokens) {
+            if (cur.size() >= SHARD_CAPACITY) {
+                prev = std::move(cur);
+                cur  = {};
+            }
+            cur.emplace(word, std::move(tokens));
+        }
+    };
+
+    shard & get_shard(const std::string & word) {
+        return shards[std::hash<std::string>{}(word) % N_SHARDS];
+    }
+
+    shard shards[N_SHARDS];
+};
+
 struct llm_tokenizer_bpe : llm_tokenizer {
     llm_tokenizer_bpe(const llama_vocab & vocab) {
         GGML_ASSERT(vocab.get_type() == LLAMA_VOCAB_TYPE_BPE);
@@ -435,9 +501,88 @@ struct llm_tokenizer_bpe : llm_tokenizer {
                 };
                 break;
         }
+
+        // compile the regexes to DFAs once per vocab, unsupported regexes keep using the std::regex fallback
+        regex_dfas.reserve(regex_exprs.size());
+        for (const auto & regex_expr : regex_exprs) {
+            regex_dfas.push_back(unicode_regex_dfa_compile(regex_expr));
+        }
+
+        // index the merges by the pair of ids of their symbols
+        // the symbols of the merges that are not tokens of the vocab get ids past the end of the vocab
+        n_vocab = vocab.n_tokens();
+
+        const auto bpe_merges = vocab.get_bpe_merges();
+        merges.reserve(bpe_merges.size());
+        for (int rank = 0; rank < (int) bpe_merges.size(); ++rank) {
+            const std::string & merge = bpe_merges[rank];
+
+            const size_t pos = merge.find(' ', 1);
+            if (pos == std::string::npos || pos + 1 == merge.size()) {
+                continue;
+            }
+
+            const std::string left  = merge.substr(0, pos);
+            const std::string right = merge.substr(pos + 1);
+
+            const llama_token id_left  = add_symbol(vocab, left);
+            const llama_token id_right = add_symbol(vocab, right);
+            const llama_token id       = add_symbol(vocab, left + right);
+
+            merges.emplace(merge_key(id_left, id_right), llm_bpe_merge{rank, id});
+        }
+    }
+
+    // id of the symbol, or LLAMA_TOKEN_NULL if it is not part of any merge and not a token
+    llama_token find_symbol(const llama_vocab & vocab, const std::string & text) const {
+        const llama_token id = vocab.text_to_token(text);
+        if (id != LLAMA_TOKEN_NULL) {
+            return id;
+        }
+
+        const auto it = extra_symbols.find(text);
+        if (it != extra_symbols.end()) {
+            return it->second;
+        }
+
+        return LLAMA_TOKEN_NULL;
+    }
+
+    const llm_bpe_merge * find_merge(llama_token id_left, llama_token id_right) const {
+        const auto it = merges.find(merge_key(id_left, id_right));
+        if (it == merges.end()) {
+            return nullptr;
+        }
+
+        return &it->second;
     }
 
     std::vector<std::string> regex_exprs;
+    std::vector<std::shared_ptr<const unicode_regex_dfa>> regex_dfas;
+
+    llama_token n_vocab;
+
+    mutable llm_tokenizer_bpe_cache cache;
+
+private:
+    static uint64_t merge_key(llama_token id_left, llama_token id_right) {
+        return (uint64_t) (uint32_t) id_left << 32 | (uint32_t) id_right;
+    }
+
+    llama_token add_symbol(const llama_vocab & vocab, const std::string & text) {
+        const llama_token id = find_symbol(vocab, text);
+        if (id != LLAMA_TOKEN_NULL) {
+            return id;
+        }
+
+        const llama_token id_new = n_vocab + (llama_token) extra_symbols.size();
+        extra_symbols.emplace(text, id_new);
+
+        return id_new;
+    }
+
+    std::unordered_map<uint64_t, llm_bpe_merge> merges;
+    std::unordered_map<std::string, llama_token> extra_symbols; // symbols of the merges that are not tokens
 };
 
 struct llm_tokenizer_bpe_session {
@@ -481,123 +626,190 @@ struct llm_tokenizer_bpe_session {
     }
 
     void tokenize(const std::string & text, std::vector<llama_token> & output) {
-        int final_prev_index = -1;
-        const auto word_collection = unicode_regex_split(text, tokenizer.regex_exprs);
-
-        symbols_final.clear();
+        const auto word_collection = unicode_regex_split(text, tokenizer.regex_exprs, tokenizer.regex_dfas);
 
         for (const auto & word : word_collection) {
-            work_queue = llm_bigram_bpe::queue();
-            symbols.clear();
+            tokenize_word_cached(word, output);
+        }
+    }
 
-            int index = 0;
-            size_t offset = 0;
+    // same result as tokenize(), the text is pre-tokenized first and the words are split into shards of similar size
+    // that are tokenized on n_threads threads
+    void tokenize_parallel(const std::string & text, std::vector<llama_token> & output, int n_threads) {
+        // shards smaller than this are not worth a thread
+        constexpr size_t MIN_SHARD_SIZE = 16*1024;
 
-            //if (vocab.tokenizer_ignore_merges && vocab.token_to_id.find(word) != vocab.token_to_id.end()) {
-            if (vocab.get_ignore_merges() && vocab.text_to_token(word) != LLAMA_TOKEN_NULL) {
-                symbols.emplace_back(llm_symbol{-1, -1, word.c_str(), word.size()});
-                offset = word.size();
+        const size_t n_shards = std::min<size_t>(std::max(n_threads, 1), text.size() / MIN_SHARD_SIZE);
+        if (n_shards <= 1) {
+            tokenize(text, output);
+            return;
+        }
+
+        const auto word_lengths = unicode_regex_split_offsets(text, tokenizer.regex_exprs, tokenizer.regex_dfas);
+
+        // the shards end at word boundaries
+        struct shard {
+            size_t word_begin = 0;
+            size_t word_end   = 0;
+            size_t text_begin = 0;
+            std::vector<llama_token> output;
+        };
+
+        std::vector<shard> shards(n_shards);
+        {
+            size_t i_word = 0;
+            size_t pos    = 0;
+            for (size_t i = 0; i < n_shards; ++i) {
+                const size_t text_end = i + 1 == n_shards ? text.size() : text.size()*(i + 1)/n_shards;
+
+                shards[i].word_begin = i_word;
+                shards[i].text_begin = pos;
+                while (i_word < word_lengths.size() && pos < text_end) {
+                    pos += word_lengths[i_word++];
+                }
+                shards[i].word_end = i_word;
             }
+        }
 
-            while (offset < word.size()) {
-                llm_symbol sym;
-                size_t char_len = std::min(word.size() - offset, (size_t) unicode_len_utf8(word[offset]));
-                sym.text = word.c_str() + offset;
-                sym.n = char_len;
-                offset += sym.n;
-                sym.prev = index - 1;
-                sym.next = offset == word.size() ? -1 : index + 1;
-                index++;
-                symbols.emplace_back(sym);
+        auto tokenize_shard = [&](llm_tokenizer_bpe_session & session, shard & sh) {
+            size_t pos = sh.text_begin;
+            for (size_t i = sh.word_begin; i < sh.word_end; ++i) {
+                session.tokenize_word_cached(unicode_byte_encoding(text.substr(pos, word_lengths[i])), sh.output);
+                pos += word_lengths[i];
             }
-            for (int i = 1; i < (int) symbols.size(); ++i) {
-                add_new_bigram(i - 1, i);
+        };
+
+        std::vector<std::thread> workers;
+        workers.reserve(n_shards - 1);
+        for (size_t i = 1; i < n_shards; ++i) {
+            workers.emplace_back([&, i] {
+                llm_tokenizer_bpe_session session(vocab, tokenizer);
+                tokenize_shard(session, shards[i]);
+            });
+        }
+        tokenize_shard(*this, shards[0]);
+
+        for (auto & worker : workers) {
+            worker.join();
+        }
+
+        for (const auto & sh : shards) {
+            output.insert(output.end(), sh.output.begin(), sh.output.end());
+        }
+    }
+
+private:
+    void tokenize_word_cached(const std::string & word, std::vector<llama_token> & output) {
+        if (vocab.get_ignore_merges()) {
+            const llama_token token = vocab.text_to_token(word);
+            if (token != LLAMA_TOKEN_NULL) {
+                output.push_back(token);
+                return;
             }
+        }
+
+        const bool cacheable = word.size() <= llm_tokenizer_bpe_cache::MAX_WORD_LEN;
+        if (cacheable && tokenizer.cache.find(word, output)) {
+            return;
+        }
 
-            // build token(s)
-            while (!work_queue.empty()) {
-                auto bigram = work_queue.pop_move();
+        const size_t n_output = output.size();
 
-                auto & left_symbol = symbols[bigram.left];
-                auto & right_symbol = symbols[bigram.right];
+        tokenize_word(word, output);
 
-                if (left_symbol.n == 0 || right_symbol.n == 0) {
-                    continue;
-                }
-                std::string left_token = std::string(left_symbol.text, left_symbol.n);
-                std::string right_token = std::string(right_symbol.text, right_symbol.n);
-                if (left_token + right_token != bigram.text) {
-                    continue;  // Skip this bigram if it's outdated
-                }
+        if (cacheable) {
+            tokenizer.cache.insert(word, std::vector<llama_token>(output.begin() + n_output, output.end()));
+        }
+    }
+
+    void tokenize_word(const std::string & word, std::vector<llama_token> & output) {
+        if (word.empty()) {
+            return;
+        }
 
-                // merge the right sym into the left one
-                left_symbol.n += right_symbol.n;
-                right_symbol.n = 0;
+        work_queue = llm_bigram_bpe::queue();
+        symbols.clear();
+        symbol_ids.clear();
 
-                // remove the right sym from the chain
-                left_symbol.next = right_symbol.next;
-                if (right_symbol.next >= 0) {
-                    symbols[right_symbol.next].prev = bigram.left;
-                }
+        int index = 0;
+        size_t offset = 0;
+
+        while (offset < word.size()) {
+            llm_symbol sym;
+            size_t char_len = std::min(word.size() - offset, (size_t) unicode_len_utf8(word[offset]));
+            sym.text = word.c_str() + offset;
+            sym.n = char_len;
+            offset += sym.n;
+            sym.prev = index - 1;
+            sym.next = offset == word.size() ? -1 : index + 1;
+            index++;
+            symbols.emplace_back(sym);
+            symbol_ids.push_back(tokenizer.find_symbol(vocab, std::string(sym.text, sym.n)));
+        }
+        for (int i = 1; i < (int) symbols.size(); ++i) {
+            add_new_bigram(i - 1, i);
+        }
+
+        // build token(s)
+        while (!work_queue.empty()) {
+            auto bigram = work_queue.pop_move();
 
-                add_new_bigram(left_symbol.prev, bigram.left);  // left side of current symbol
-                add_new_bigram(bigram.left, left_symbol.next);  // right side of current symbol
+            auto & left_symbol = symbols[bigram.left];
+            auto & right_symbol = symbols[bigram.right];
+
+            // skip this bigram if it's outdated: one of the symbols has been merged since
+            if (left_symbol.n == 0 || right_symbol.n == 0 || left_symbol.n + right_symbol.n != bigram.size) {
+                continue;
             }
 
-            // add the finished tokens to the final list keeping correct order for next and prev
-            for (auto & sym : symbols) {
-                if (sym.n > 0) {
-                    sym.prev = final_prev_index;
-                    sym.next = -1;
-                    if (final_prev_index != -1) {
-                        symbols_final[final_prev_index].next = symbols_final.size();
-                    }
-                    symbols_final.emplace_back(sym);
-                    final_prev_index = symbols_final.size() - 1;
-                }
+            // merge the right sym into the left one
+            left_symbol.n += right_symbol.n;
+            right_symbol.n = 0;
+            symbol_ids[bigram.left] = bigram.id;
+
+            // remove the right sym from the chain
+            left_symbol.next = right_symbol.next;
+            if (right_symbol.next >= 0) {
+                symbols[right_symbol.next].prev = bigram.left;
             }
-        }
 
-        symbols = symbols_final;
+            add_new_bigram(left_symbol.prev, bigram.left);  // left side of current symbol
+            add_new_bigram(bigram.left, left_symbol.next);  // right side of current symbol
+        }
 
-        if (!symbols.empty()) {
-            for (int i = 0; i != -1; i = symbols[i].next) {
-                auto & symbol = symbols[i];
-                if (symbol.n == 0) {
-                    continue;
-                }
+        for (int i = 0; i != -1; i = symbols[i].next) {
+            const llama_token id = symbol_ids[i];
 
-                const std::string str = std::string(symbol.text, symbol.n);
-                const auto token = vocab.text_to_token(str);
+            if (id != LLAMA_TOKEN_NULL && id < tokenizer.n_vocab) {
+                output.push_back(id);
+                continue;
+            }
 
-                if (token == LLAMA_TOKEN_NULL) {
-                    for (auto j = str.begin(); j != str.end(); ++j) {
-                        std::string byte_str(1, *j);
-                        auto token_multibyte = vocab.text_to_token(byte_str);
-                        if (token_multibyte != LLAMA_TOKEN_NULL) {
-                            output.push_back(token_multibyte);
-                        }
-                    }
-                } else {
-                    output.push_back(token);
+            const auto & symbol = symbols[i];
+            for (size_t j = 0; j < symbol.n; ++j) {
+                std::string byte_str(1, symbol.text[j]);
+                auto token_multibyte = vocab.text_to_token(byte_str);
+                if (token_multibyte != LLAMA_TOKEN_NULL) {
+                    output.push_back(token_multibyte);
                 }
             }
         }
     }
 
-private:
     void add_new_bigram(int left, int right) {
         if (left == -1 || right == -1) {
             return;
         }
-        std::string left_token  = std::string(symbols[left].text,  symbols[left].n);
-        std::string right_token = std::string(symbols[right].text, symbols[right].n);
 
-        int rank_found = -1;
+        const llama_token id_left  = symbol_ids[left];
+        const llama_token id_right = symbol_ids[right];
 
-        rank_found = vocab.find_bpe_rank(left_token, right_token);
+        if (id_left == LLAMA_TOKEN_NULL || id_right == LLAMA_TOKEN_NULL) {
+            return;
+        }
 
-        if (rank_found < 0) {
+        const llm_bpe_merge * merge = tokenizer.find_merge(id_left, id_right);
+        if (merge == nullptr) {
             return;
         }
 
@@ -605,9 +817,9 @@ private:
 
         bigram.left  = left;
         bigram.right = right;
-        bigram.text  = left_token + right_token;
-        bigram.size  = left_token.size() + right_token.size();
-        bigram.rank  = rank_found;
+        bigram.id    = merge->id;
+        bigram.size  = symbols[left].n + symbols[right].n;
+        bigram.rank  = merge->rank;
 
         work_queue.push(bigram);
     }
@@ -616,7 +828,7 @@ private:
     const llm_tokenizer_bpe & tokenizer;
 
     std::vector<llm_symbol> symbols;
-    std::vector<llm_symbol> symbols_final;
+    std::vector<llama_token> symbol_ids; // LLAMA_TOKEN_NULL for the symbols that cannot be merged
     llm_bigram_bpe::queue work_queue;
 };
 
@@ -1332,7 +1544,8 @@ struct llama_vocab::impl {
     std::vector<llama_token> tokenize(
             const std::string & raw_text,
                          bool   add_special,
-                         bool   parse_special = false) const;
+                         bool   parse_special = false,
+                      int32_t   n_threads     = 1) const;
 
     int32_t tokenize(
                    const char * text,
@@ -2405,7 +2618,8 @@ static std::string llama_decode_text(const std::string & text) {
 std::vector<llama_token> llama_vocab::impl::tokenize(
         const std::string & raw_text,
         bool add_special,
-        bool parse_special) const {
+        bool parse_special,
+        int32_t n_threads) const {
     GGML_ASSERT(tokenizer && "Tokenizer not initialized. Call llama_vocab::init_tokenizer() first.");
 
     std::vector<llama_token> output;
@@ -2483,7 +2697,11 @@ std::vector<llama_token> llama_vocab::impl::tokenize(
 #ifdef PRETOKENIZERDEBUG
                         LLAMA_LOG_WARN("TT: (%ld %ld %ld) '%s'\n", text.length(), fragment.offset, fragment.length, text.c_str());
 #endif
-                        session.tokenize(text, output);
+                        if (n_threads > 1) {
+                            session.tokenize_parallel(text, output, n_threads);
+                        } else {
+                            session.tokenize(text, output);
+                        }
                     } else { // if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_TOKEN)
                         session.append(fragment.token, output);
                     }
@@ -3058,7 +3276,13 @@ int llama_vocab::find_bpe_rank(const std::string & token_left, const std::string
 }
 
 std::vector<std::string> llama_vocab::get_bpe_merges() const {
-    std::vector<std::string> result(pimpl->bpe_ranks.size());
+    // duplicated merges keep their first rank, so the ranks can go past the number of merges
+    int n_ranks = 0;
+    for (const auto & pair : pimpl->bpe_ranks) {
+        n_ranks = std::max(n_ranks, pair.second + 1);
+    }
+
+    std::vector<std::string> result(n_ranks);
 
     for (const auto & pair : pimpl->bpe_ranks) {
         result[pair.second] = pair.first.first + " " + pair.first.second;
@@ -3077,8 +3301,9 @@ int32_t llama_vocab::tokenize(
                  llama_token * tokens,
                      int32_t   n_tokens_max,
                         bool   add_special,
-                        bool   parse_special) const {
-    auto res = tokenize(std::string(text, text_len), add_special, parse_special);
+                        bool   parse_special,
+                     int32_t   n_threads) const {
+    auto res = tokenize(std::string(text, text_len), add_special, parse_special, n_threads);
     if (res.size() >= static_cast<size_t>(std::numeric_limits<int32_t>::max())) {
         LLAMA_LOG_ERROR("%s: tokenization result size %zu exceeds int32_t limit\n", __func__, res.size());
         return std::numeric_limits<int32_t>::min();
@@ -3099,8 +3324,9 @@ int32_t llama_vocab::tokenize(
 std::vector<llama_token> llama_vocab::tokenize(
         const std::string & raw_text,
         bool add_special,
-        bool parse_special) const {
-    return pimpl->tokenize(raw_text, add_special, parse_special);
+        bool parse_special,
+        int32_t n_threads) const {
+    return pimpl->tokenize(raw_text, add_special, parse_special, n_threads);
 }
 
 const std::string & llama_vocab::token_to_piece(llama_token token) const {
@@ -3359,6 +3585,18 @@ int32_t llama_tokenize(
     return vocab->tokenize(text, text_len, tokens, n_tokens_max, add_special, parse_special);
 }
 
+int32_t llama_tokenize_parallel(
+    const struct llama_vocab * vocab,
+                  const char * text,
+                     int32_t   text_len,
+                 llama_token * tokens,
+                     int32_t   n_tokens_max,
+                        bool   add_special,
+                        bool   parse_special,
+                     int32_t   n_threads) {
+    return vocab->tokenize(text, text_len, tokens, n_tokens_max, add_special, parse_special, n_threads);
+}
+
 int32_t llama_token_to_piece(
     const struct llama_vocab * vocab,
                  llama_token   token,
@@ -3380,3 +3618,92 @@ int32_t llama_detokenize(
     return vocab->detokenize(tokens, n_tokens, text, text_len_max, remove_special, unparse_special);
 }
 
+//
+// incremental detokenizer
+//
+
+struct llama_detokenizer {
+    const llama_vocab * vocab;
+
+    std::string pending; // bytes of the last character, until it is complete
+    std::string text;    // pending + text of the last token
+};
+
+// number of bytes at the end of the text that start a UTF-8 character that is not complete yet
+static size_t llama_utf8_incomplete_tail(const std::string & text) {
+    for (size_t i = 1; i <= 4 && i <= text.size(); ++i) {
+        const uint8_t c = text[text.size() - i];
+        if ((c & 0xC0) == 0x80) {
+            continue; // continuation byte
+        }
+        if ((c & 0xF8) == 0xF8) {
+            return 0; // not a valid first byte
+        }
+        return unicode_len_utf8(c) > i ? i : 0;
+    }
+
+    return 0;
+}
+
+llama_detokenizer * llama_detokenizer_init(const llama_vocab * vocab) {
+    return new llama_detokenizer { vocab, {}, {} };
+}
+
+void llama_detokenizer_free(llama_detokenizer * detok) {
+    delete detok;
+}
+
+int32_t llama_detokenizer_push(
+    llama_detokenizer * detok,
+          llama_token   token,
+                 char * buf,
+              int32_t   length,
+                 bool   special) {
+    auto & text = detok->text;
+
+    text = detok->pending;
+
+    const size_t n_pending = text.size();
+    text.resize(n_pending + 16);
+
+    int32_t n_piece = detok->vocab->token_to_piece(token, &text[n_pending], 16, 0, special);
+    if (n_piece < 0) {
+        text.resize(n_pending - n_piece);
+        n_piece = detok->vocab->token_to_piece(token, &text[n_pending], -n_piece, 0, special);
+    }
+    text.resize(n_pending + n_piece);
+
+    const size_t n_out = text.size() - llama_utf8_incomplete_tail(text);
+    if (n_out > (size_t) length) {
+        return -((int32_t) n_out);
+    }
+
+    memcpy(buf, text.data(), n_out);
+    detok->pending.assign(text, n_out, std::string::npos);
+
+    return n_out;
+}
+
+int32_t llama_detokenizer_flush(
+    llama_detokenizer * detok,
+                 char * buf,
+              int32_t   length) {
+    const int32_t n_out = detok->pending.size();
+    if (n_out > length) {
+        return -n_out;
+    }
+
+    memcpy(buf, detok->pending.data(), n_out);
+    detok->pending.clear();
+
+    return n_out;
+}
+
+int32_t llama_detokenizer_n_pending(const llama_detokenizer * detok) {
+    return detok->pending.size();
+}
+
+void llama_detokenizer_reset(llama_detokenizer * detok) {
+    detok->pending.clear();
+}
+
@@ -7,11 +7,14 @@
 
 #include <algorithm>
 #include <cassert>
+#include <cctype>
 #include <codecvt>
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
 #include <locale>
 #include <map>
+#include <memory>
 #include <regex>
 #include <stdexcept>
 #include <string>
@@ -223,17 +226,7 @@ static inline std::wstring unicode_wstring_from_utf8(const std::string & s) {
 static std::vector<std::string> unicode_byte_encoding_process(const std::vector<std::string> & bpe_words) {
     std::vector<std::string> bpe_encoded_words;
     for (const auto & word : bpe_words) {
-        std::string text_utf;
-        auto utf_word =  unicode_cpts_from_utf8(word);
-        for (size_t i = 0; i < utf_word.size(); ++i) {
-            text_utf += unicode_cpt_to_utf8(utf_word[i]);
-        }
-
-        std::string encoded_token;
-        for (char & c : text_utf) {
-            encoded_token += unicode_byte_to_utf8(c);
-        }
-        bpe_encoded_words.emplace_back(encoded_token);
+        bpe_encoded_words.emplace_back(unicode_byte_encoding(word));
     }
     return bpe_encoded_words;
 }
@@ -572,6 +565,688 @@ static std::vector<size_t> unicode_regex_split_custom(const std::string & text,
     return bpe_offsets;
 }
 
+//
+// regex to DFA compiler
+//
+// compiles the subset of the ECMAScript syntax used by the pre-tokenizer regexes: alternation, groups, greedy
+// quantifiers, character classes with \s \d \w \p{N} \p{L} \p{P} \p{M} \p{S}, $ and lookaheads of a single character.
+// the DFA has the same leftmost-first semantics as std::regex and matches the text like the std::regex fallback does:
+// the non-ASCII whitespaces match as \x0B, and the other non-ASCII codepoints match \p{..} by their category
+//
+
+// ASCII categories of the collapsed std::regex fallback, see k_ucat_map in unicode_regex_split
+static uint16_t unicode_regex_ascii_category(uint32_t cpt) {
+    if (cpt >= '0' && cpt <= '9') {
+        return unicode_cpt_flags::NUMBER;
+    }
+    if ((cpt >= 'A' && cpt <= 'Z') || (cpt >= 'a' && cpt <= 'z')) {
+        return unicode_cpt_flags::LETTER;
+    }
+    if (cpt < 128 && strchr("!\"#%&'()*,-./:;?@[\\]_{}", (int) cpt) != nullptr && cpt != 0) {
+        return unicode_cpt_flags::PUNCTUATION;
+    }
+    if (cpt < 128 && strchr("$+<=>^`|", (int) cpt) != nullptr && cpt != 0) {
+        return unicode_cpt_flags::SYMBOL;
+    }
+    return 0;
+}
+
+static bool unicode_regex_ascii_space(uint32_t cpt) {
+    return (cpt >= 0x09 && cpt <= 0x0D) || cpt == 0x20;
+}
+
+static bool unicode_regex_ascii_word(uint32_t cpt) {
+    return (cpt >= '0' && cpt <= '9') || (cpt >= 'A' && cpt <= 'Z') || (cpt >= 'a' && cpt <= 'z') || cpt == '_';
+}
+
+// a character class of the regex
+struct unicode_regex_set {
+    bool negated   = false;
+    bool space     = false; // \s
+    bool not_space = false; // \S
+    bool not_digit = false; // \D
+    bool not_word  = false; // \W
+    uint16_t categories = 0; // \p{..}
+    std::vector<std::pair<uint32_t, uint32_t>> ranges; // inclusive
+
+    bool operator==(const unicode_regex_set & other) const {
+        return negated == other.negated && space == other.space && not_space == other.not_space &&
+               not_digit == other.not_digit && not_word == other.not_word && categories == other.categories &&
+               ranges == other.ranges;
+    }
+
+    bool contains(uint32_t cpt) const {
+        // the non-ASCII whitespaces match as \x0B
+        if (cpt >= 128 && unicode_cpt_flags_from_cpt(cpt).is_whitespace) {
+            cpt = 0x0B;
+        }
+        const bool is_space = cpt < 128 && unicode_regex_ascii_space(cpt);
+        const uint16_t category = cpt < 128 ? unicode_regex_ascii_category(cpt) : unicode_cpt_flags_from_cpt(cpt).category_flag();
+
+        bool result = (space && is_space) || (not_space && !is_space) || (categories & category) ||
+                      (not_digit && !(cpt >= '0' && cpt <= '9')) || (not_word && !(cpt < 128 && unicode_regex_ascii_word(cpt)));
+        for (const auto & range : ranges) {
+            result = result || (cpt >= range.first && cpt <= range.second);
+        }
+        return result != negated;
+    }
+};
+
+// parses a regex into a tree, throws std::invalid_argument for the unsupported syntax
+struct unicode_regex_parser {
+    enum node_type {
+        NODE_SET,
+        NODE_CONCAT,
+        NODE_ALT,
+        NODE_REPEAT,           // min..max repetitions of the child, max < 0 for no limit
+        NODE_ASSERT_NEXT,      // (?=[set])
+        NODE_ASSERT_NOT_NEXT,  // (?![set])
+        NODE_ASSERT_END,       // $
+    };
+
+    struct node {
+        node_type type;
+        int set = -1;
+        int min = 0;
+        int max = 0;
+        std::vector<node> children;
+    };
+
+    std::vector<uint32_t> re;
+    size_t pos = 0;
+    std::vector<unicode_regex_set> sets;
+
+    unicode_regex_parser(const std::string & regex_expr) : re(unicode_cpts_from_utf8(regex_expr)) {}
+
+    node parse() {
+        node result = parse_alt();
+        if (pos != re.size()) {
+            throw std::invalid_argument("unexpected ')'");
+        }
+        return result;
+    }
+
+    static bool nullable(const node & n) {
+        switch (n.type) {
+            case NODE_SET:    return false;
+            case NODE_CONCAT: return std::all_of(n.children.begin(), n.children.end(), nullable);
+            case NODE_ALT:    return std::any_of(n.children.begin(), n.children.end(), nullable);
+            case NODE_REPEAT: return n.min == 0 || nullable(n.children[0]);
+            default:          return true;
+        }
+    }
+
+private:
+    bool eof() const { return pos >= re.size(); }
+    uint32_t peek() const { return eof() ? 0 : re[pos]; }
+
+    uint32_t next() {
+        if (eof()) {
+            throw std::invalid_argument("unexpected end of regex");
+        }
+        return re[pos++];
+    }
+
+    int add_set(const unicode_regex_set & set) {
+        for (size_t i = 0; i < sets.size(); ++i) {
+            if (sets[i] == set) {
+                return (int) i;
+            }
+        }
+        sets.push_back(set);
+        return (int) sets.size() - 1;
+    }
+
+    node make_set(const unicode_regex_set & set) {
+        node n { NODE_SET, add_set(set), 0, 0, {} };
+        return n;
+    }
+
+    node parse_alt() {
+        node n { NODE_ALT, -1, 0, 0, {} };
+        n.children.push_back(parse_concat());
+        while (!eof() && peek() == '|') {
+            pos++;
+            n.children.push_back(parse_concat());
+        }
+        return n.children.size() == 1 ? n.children[0] : n;
+    }
+
+    node parse_concat() {
+        node n { NODE_CONCAT, -1, 0, 0, {} };
+        while (!eof() && peek() != '|' && peek() != ')') {
+            n.children.push_back(parse_repeat());
+        }
+        return n.children.size() == 1 ? n.children[0] : n;
+    }
+
+    int parse_int() {
+        int result = 0;
+        if (!(peek() >= '0' && peek() <= '9')) {
+            throw std::invalid_argument("invalid quantifier");
+        }
+        while (peek() >= '0' && peek() <= '9') {
+            result = result*10 + (int) (next() - '0');
+            if (result > 1000) {
+                throw std::invalid_argument("quantifier too large");
+            }
+        }
+        return result;
+    }
+
+    node parse_repeat() {
+        node atom = parse_atom();
+        if (eof()) {
+            return atom;
+        }
+        int min;
+        int max;
+        switch (peek()) {
+            case '*': pos++; min = 0; max = -1; break;
+            case '+': pos++; min = 1; max = -1; break;
+            case '?': pos++; min = 0; max =  1; break;
+            case '{': {
+                pos++;
+                min = parse_int();
+                max = min;
+                if (peek() == ',') {
+                    pos++;
+                    max = peek() == '}' ? -1 : parse_int();
+                }
+                if (next() != '}' || (max >= 0 && max < min)) {
+                    throw std::invalid_argument("invalid quantifier");
+                }
+            } break;
+            default:
+                return atom;
+        }
+        if (atom.type != NODE_SET && atom.type != NODE_CONCAT && atom.type != NODE_ALT && atom.type != NODE_REPEAT) {
+            throw std::invalid_argument("quantified assertion");
+        }
+        if (!eof() && (peek() == '?' || peek() == '+' || peek() == '*' || peek() == '{')) {
+            throw std::invalid_argument("lazy or possessive quantifier");
+        }
+        if (max < 0 && nullable(atom)) {
+            throw std::invalid_argument("unbounded repetition of an empty match");
+        }
+        node n { NODE_REPEAT, -1, min, max, { atom } };
+        return n;
+    }
+
+    node parse_atom() {
+        const uint32_t c = next();
+        switch (c) {
+            case '(': {
+                node_type assert_type = NODE_CONCAT;
+                if (peek() == '?') {
+                    pos++;
+                    switch (next()) {
+                        case ':': break;
+                        case '=': assert_type = NODE_ASSERT_NEXT;     break;
+                        case '!': assert_type = NODE_ASSERT_NOT_NEXT; break;
+                        default: throw std::invalid_argument("unsupported group");
+                    }
+                }
+                node inner = parse_alt();
+                if (next() != ')') {
+                    throw std::invalid_argument("missing ')'");
+                }
+                if (assert_type == NODE_CONCAT) {
+                    return inner;
+                }
+                // only the lookaheads of a single character can be resolved by the DFA
+                if (inner.type != NODE_SET) {
+                    throw std::invalid_argument("unsupported lookahead");
+                }
+                node n { assert_type, inner.set, 0, 0, {} };
+                return n;
+            }
+            case '[':
+                return make_set(parse_class());
+            case '.': {
+                unicode_regex_set set;
+                set.negated = true;
+                set.ranges = { { '\n', '\n' }, { '\r', '\r' } };
+                return make_set(set);
+            }
+            case '$': {
+                node n { NODE_ASSERT_END, -1, 0, 0, {} };
+                return n;
+            }
+            case '\\': {
+                unicode_regex_set set;
+                parse_escape(set);
+                return make_set(set);
+            }
+            case ')': case '*': case '+': case '?': case '{': case '^':
+                throw std::invalid_argument("unsupported syntax");
+            default: {
+                unicode_regex_set set;
+                set.ranges = { { c, c } };
+                return make_set(set);
+            }
+        }
+    }
+
+    // parses an escape after the '\', adds it to the set and returns true if it is a single codepoint
+    bool parse_escape(unicode_regex_set & set, uint32_t * cpt = nullptr) {
+        uint32_t c = next();
+        switch (c) {
+            case 's': set.space = true;     return false;
+            case 'S': set.not_space = true; return false;
+            case 'd': set.ranges.push_back({ '0', '9' }); return false;
+            case 'D': set.not_digit = true; return false;
+            case 'w':
+                set.ranges.push_back({ '0', '9' });
+                set.ranges.push_back({ 'A', 'Z' });
+                set.ranges.push_back({ 'a', 'z' });
+                set.ranges.push_back({ '_', '_' });
+                return false;
+            case 'W': set.not_word = true;  return false;
+            case 'p': {
+                if (next() != '{') {
+                    throw std::invalid_argument("invalid \\p");
+                }
+                const uint32_t cat = next();
+                if (next() != '}') {
+                    throw std::invalid_argument("unsupported \\p");
+                }
+                switch (cat) {
+                    case 'N': set.categories |= unicode_cpt_flags::NUMBER;      break;
+                    case 'L': set.categories |= unicode_cpt_flags::LETTER;      break;
+                    case 'P': set.categories |= unicode_cpt_flags::PUNCTUATION; break;
+                    case 'M': set.categories |= unicode_cpt_flags::ACCENT_MARK; break;
+                    case 'S': set.categories |= unicode_cpt_flags::SYMBOL;      break;
+                    default: throw std::invalid_argument("unsupported \\p");
+                }
+                return false;
+            }
+            case 'r': c = '\r'; break;
+            case 'n': c = '\n'; break;
+            case 't': c = '\t'; break;
+            case 'f': c = '\f'; break;
+            case 'v': c = '\v'; break;
+            case 'x':
+            case 'u': {
+                const int n_digits = c == 'x' ? 2 : 4;
+                c = 0;
+                for (int i = 0; i < n_digits; ++i) {
+                    const uint32_t h = next();
+                    if (h >= '0' && h <= '9') {
+                        c = c*16 + (h - '0');
+                    } else if (h >= 'a' && h <= 'f') {
+                        c = c*16 + (h - 'a' + 10);
+                    } else if (h >= 'A' && h <= 'F') {
+                        c = c*16 + (h - 'A' + 10);
+                    } else {
+                        throw std::invalid_argument("invalid escape");
+                    }
+                }
+            } break;
+            default:
+                // other letters and digits are back-references, word boundaries, etc.
+                if (c < 128 && isalnum((int) c)) {
+                    throw std::invalid_argument("unsupported escape");
+                }
+                break;
+        }
+        set.ranges.push_back({ c, c });
+        if (cpt) {
+            *cpt = c;
+        }
+        return true;
+    }
+
+    unicode_regex_set parse_class() {
+        unicode_regex_set set;
+        if (peek() == '^') {
+            pos++;
+            set.negated = true;
+        }
+        while (true) {
+            uint32_t lo = next();
+            if (lo == ']') {
+                break;
+            }
+            if (lo == '\\') {
+                if (!parse_escape(set, &lo)) {
+                    continue;
+                }
+                set.ranges.pop_back();
+            }
+            uint32_t hi = lo;
+            if (peek() == '-' && pos + 1 < re.size() && re[pos + 1] != ']') {
+                pos++;
+                hi = next();
+                if (hi == '\\') {
+                    unicode_regex_set tmp;
+                    if (!parse_escape(tmp, &hi)) {
+                        throw std::invalid_argument("invalid range");
+                    }
+                }
+                if (hi < lo) {
+                    throw std::invalid_argument("invalid range");
+                }
+            }
+            set.ranges.push_back({ lo, hi });
+        }
+        return set;
+    }
+};
+
+struct unicode_regex_dfa {
+    // the codepoint classes, by blocks of 256 codepoints
+    std::vector<uint32_t> block_offset;
+    std::vector<uint16_t> classes;
+    uint32_t n_classes = 0; // the end of the text is the class n_classes
+
+    // transitions: trans[state*(n_classes + 1) + class] = next state << 1 | 1 if there is a match before the class
+    // the state 0 is the dead state
+    std::vector<uint32_t> trans;
+    uint32_t start = 0;
+
+    uint16_t cpt_class(uint32_t cpt) const {
+        return classes[block_offset[cpt >> 8] + (cpt & 0xFF)];
+    }
+
+    // returns the length of the match at pos, 0 if there is none
+    size_t match(const uint16_t * cpt_classes, size_t pos, size_t end) const {
+        const size_t n_sym = n_classes + 1;
+        size_t result = 0;
+        uint32_t state = start;
+        for (size_t i = pos; ; ++i) {
+            const uint32_t t = trans[state*n_sym + (i < end ? cpt_classes[i] : n_classes)];
+            if (t & 1) {
+                result = i - pos;
+            }
+            state = t >> 1;
+            if (state == 0 || i == end) {
+                break;
+            }
+        }
+        return result;
+    }
+};
+
+// the program of the NFA, with priorities: SPLIT prefers x over y
+struct unicode_regex_nfa {
+    enum op_type {
+        OP_CHAR,        // consume a codepoint of the set
+        OP_SPLIT,
+        OP_JMP,
+        OP_NEXT,        // the next codepoint is in the set
+        OP_NOT_NEXT,    // the next codepoint is not in the set, or this is the end of the text
+        OP_END,         // this is the end of the text
+        OP_MATCH,
+    };
+
+    struct inst {
+        op_type op;
+        int set;
+        int x;
+        int y;
+    };
+
+    std::vector<inst> prog;
+
+    int emit(op_type op, int set = -1, int x = -1, int y = -1) {
+        prog.push_back({ op, set, x, y });
+        return (int) prog.size() - 1;
+    }
+
+    void compile(const unicode_regex_parser::node & n) {
+        using parser = unicode_regex_parser;
+        switch (n.type) {
+            case parser::NODE_SET:             emit(OP_CHAR, n.set);     break;
+            case parser::NODE_ASSERT_NEXT:     emit(OP_NEXT, n.set);     break;
+            case parser::NODE_ASSERT_NOT_NEXT: emit(OP_NOT_NEXT, n.set); break;
+            case parser::NODE_ASSERT_END:      emit(OP_END);             break;
+            case parser::NODE_CONCAT: {
+                for (const auto & child : n.children) {
+                    compile(child);
+                }
+            } break;
+            case parser::NODE_ALT: {
+                std::vector<int> jumps;
+                for (size_t i = 0; i + 1 < n.children.size(); ++i) {
+                    const int split = emit(OP_SPLIT);
+                    prog[split].x = (int) prog.size();
+                    compile(n.children[i]);
+                    jumps.push_back(emit(OP_JMP));
+                    prog[split].y = (int) prog.size();
+                }
+                compile(n.children.back());
+                for (int j : jumps) {
+                    prog[j].x = (int) prog.size();
+                }
+            } break;
+            case parser::NODE_REPEAT: {
+                for (int i = 0; i < n.min; ++i) {
+                    compile(n.children[0]);
+                }
+                if (n.max < 0) {
+                    const int split = emit(OP_SPLIT);
+                    prog[split].x = (int) prog.size();
+                    compile(n.children[0]);
+                    emit(OP_JMP, -1, split);
+                    prog[split].y = (int) prog.size();
+                } else {
+                    std::vector<int> splits;
+                    for (int i = n.min; i < n.max; ++i) {
+                        const int split = emit(OP_SPLIT);
+                        prog[split].x = (int) prog.size();
+                        splits.push_back(split);
+                        compile(n.children[0]);
+                    }
+                    for (int s : splits) {
+                        prog[s].y = (int) prog.size();
+                    }
+                }
+            } break;
+        }
+    }
+
+    // adds the threads reachable from pc when the next symbol is sym, in priority order
+    // the threads of lower priority than a match are dropped, as the match takes precedence over them
+    void closure(int pc, uint32_t sym, const std::vector<uint64_t> & sym_sets, std::vector<uint8_t> & visited, std::vector<int> & threads, bool & matched) const {
+        if (matched || visited[pc]) {
+            return;
+        }
+        visited[pc] = 1;
+        const inst & in = prog[pc];
+        const bool in_set = sym < sym_sets.size() && in.set >= 0 && ((sym_sets[sym] >> in.set) & 1);
+        switch (in.op) {
+            case OP_CHAR:     threads.push_back(pc); break;
+            case OP_MATCH:    matched = true;        break;
+            case OP_JMP:      closure(in.x, sym, sym_sets, visited, threads, matched); break;
+            case OP_SPLIT:    closure(in.x, sym, sym_sets, visited, threads, matched);
+                              closure(in.y, sym, sym_sets, visited, threads, matched); break;
+            case OP_NEXT:     if ( in_set)                     { closure(pc + 1, sym, sym_sets, visited, threads, matched); } break;
+            case OP_NOT_NEXT: if (!in_set)                     { closure(pc + 1, sym, sym_sets, visited, threads, matched); } break;
+            case OP_END:      if (sym == sym_sets.size())      { closure(pc + 1, sym, sym_sets, visited, threads, matched); } break;
+        }
+    }
+};
+
+std::shared_ptr<const unicode_regex_dfa> unicode_regex_dfa_compile(const std::string & regex_expr) {
+    // the DFA states are limited to keep the tables small, the larger regexes use the std::regex fallback
+    const size_t max_states = 4096;
+
+    unicode_regex_parser parser(regex_expr);
+    unicode_regex_nfa nfa;
+    try {
+        nfa.compile(parser.parse());
+    } catch (const std::invalid_argument & /*ex*/) {
+        return nullptr;
+    }
+    nfa.emit(unicode_regex_nfa::OP_MATCH);
+
+    const auto & sets = parser.sets;
+    if (sets.size() > 64) {
+        return nullptr;
+    }
+
+    auto dfa = std::make_shared<unicode_regex_dfa>();
+
+    // split the codepoints into classes that belong to the same sets
+    // the sets are constant between the bounds of their ranges, of the categories and of the whitespaces
+    std::vector<uint32_t> bounds;
+    for (uint32_t cpt = 0; cpt <= 128; ++cpt) {
+        bounds.push_back(cpt);
+    }
+    for (const auto & set : sets) {
+        for (const auto & range : set.ranges) {
+            bounds.push_back(range.first);
+            bounds.push_back(range.second + 1);
+        }
+    }
+    for (const auto & range : unicode_ranges_flags) {
+        bounds.push_back(range.first);
+    }
+    for (const uint32_t cpt : unicode_set_whitespace) {
+        bounds.push_back(cpt);
+        bounds.push_back(cpt + 1);
+    }
+    bounds.push_back(MAX_CODEPOINTS);
+    std::sort(bounds.begin(), bounds.end());
+    bounds.erase(std::unique(bounds.begin(), bounds.end()), bounds.end());
+    while (bounds.back() > MAX_CODEPOINTS) {
+        bounds.pop_back();
+    }
+
+    std::vector<uint16_t> cpt_classes(MAX_CODEPOINTS);
+    std::vector<uint64_t> class_sets; // the sets of each class, as a bitmask
+    std::unordered_map<uint64_t, uint16_t> class_ids;
+    for (size_t i = 0; i + 1 < bounds.size(); ++i) {
+        uint64_t mask = 0;
+        for (size_t s = 0; s < sets.size(); ++s) {
+            if (sets[s].contains(bounds[i])) {
+                mask |= 1ULL << s;
+            }
+        }
+        auto it = class_ids.find(mask);
+        if (it == class_ids.end()) {
+            it = class_ids.emplace(mask, (uint16_t) class_sets.size()).first;
+            class_sets.push_back(mask);
+        }
+        std::fill(cpt_classes.begin() + bounds[i], cpt_classes.begin() + bounds[i + 1], it->second);
+    }
+    dfa->n_classes = (uint32_t) class_sets.size();
+
+    // deduplicate the blocks of 256 codepoints, most of them have a single class
+    {
+        std::unordered_map<uint16_t, uint32_t> uniform_blocks;
+        for (uint32_t b = 0; b < MAX_CODEPOINTS; b += 256) {
+            const auto first = cpt_classes.begin() + b;
+            const auto last  = first + 256;
+            const bool uniform = std::all_of(first, last, [&](uint16_t c) { return c == *first; });
+            if (uniform) {
+                auto it = uniform_blocks.find(*first);
+                if (it != uniform_blocks.end()) {
+                    dfa->block_offset.push_back(it->second);
+                    continue;
+                }
+                uniform_blocks.emplace(*first, (uint32_t) dfa->classes.size());
+            }
+            dfa->block_offset.push_back((uint32_t) dfa->classes.size());
+            dfa->classes.insert(dfa->classes.end(), first, last);
+        }
+    }
+
+    // subset construction, the states are the ordered lists of threads
+    const uint32_t n_sym = dfa->n_classes + 1;
+    std::map<std::vector<int>, uint32_t> state_ids;
+    std::vector<std::vector<int>> states;
+
+    auto add_state = [&](const std::vector<int> & threads) -> uint32_t {
+        auto it = state_ids.find(threads);
+        if (it != state_ids.end()) {
+            return it->second;
+        }
+        const uint32_t id = (uint32_t) states.size();
+        state_ids.emplace(threads, id);
+        states.push_back(threads);
+        return id;
+    };
+
+    add_state({});  // dead state
+    dfa->start = add_state({ 0 });
+
+    std::vector<uint8_t> visited(nfa.prog.size());
+    std::vector<int> threads;
+    for (uint32_t s = 0; s < states.size(); ++s) {
+        if (states.size() > max_states) {
+            return nullptr;
+        }
+        for (uint32_t sym = 0; sym < n_sym; ++sym) {
+            std::fill(visited.begin(), visited.end(), 0);
+            threads.clear();
+            bool matched = false;
+            for (int pc : states[s]) {
+                nfa.closure(pc, sym, class_sets, visited, threads, matched);
+            }
+            // step over the codepoint
+            std::vector<int> next;
+            if (sym < dfa->n_classes) {
+                for (int pc : threads) {
+                    if ((class_sets[sym] >> nfa.prog[pc].set) & 1) {
+                        next.push_back(pc + 1);
+                    }
+                }
+            }
+            const uint32_t id = add_state(next);
+            dfa->trans.push_back(id << 1 | (matched ? 1 : 0));
+        }
+    }
+
+    // an empty match would be an empty word
+    for (uint32_t sym = 0; sym < n_sym; ++sym) {
+        if (dfa->trans[dfa->start*n_sym + sym] & 1) {
+            return nullptr;
+        }
+    }
+
+    return dfa;
+}
+
+static std::vector<size_t> unicode_regex_split_dfa(const std::vector<uint32_t> & cpts, const unicode_regex_dfa & dfa, const std::vector<size_t> & offsets) {
+    std::vector<uint16_t> cpt_classes(cpts.size());
+    for (size_t i = 0; i < cpts.size(); ++i) {
+        cpt_classes[i] = dfa.cpt_class(cpts[i]);
+    }
+
+    std::vector<size_t> bpe_offsets; // store the offset of each word
+    bpe_offsets.reserve(offsets.size()); // Reserve memory for the approximate size
+
+    size_t start = 0;
+    for (auto offset : offsets) {
+        const size_t end = start + offset;
+
+        size_t prev = start; // end of the previous match
+        size_t pos  = start;
+        while (pos < end) {
+            const size_t len = dfa.match(cpt_classes.data(), pos, end);
+            if (len == 0) {
+                pos++;
+                continue;
+            }
+            if (pos > prev) {
+                bpe_offsets.emplace_back(pos - prev);
+            }
+            bpe_offsets.emplace_back(len);
+            pos += len;
+            prev = pos;
+        }
+
+        if (prev < end) {
+            bpe_offsets.emplace_back(end - prev);
+        }
+        start = end;
+    }
+
+    return bpe_offsets;
+}
+
 //
 // interface
 //
@@ -672,7 +1347,10 @@ uint32_t unicode_tolower(uint32_t cpt) {
     return cpt;  // Return the original code point if no lowercase mapping is found
 }
 
-std::vector<std::string> unicode_regex_split(const std::string & text, const std::vector<std::string> & regex_exprs) {
+// returns the number of codepoints of each word
+static std::vector<size_t> unicode_regex_split_cpts(const std::string & text, const std::vector<uint32_t> & cpts,
+                                                    const std::vector<std::string> & regex_exprs,
+                                                    const std::vector<std::shared_ptr<const unicode_regex_dfa>> & regex_dfas) {
     // unicode categories
     static const std::map<std::string, int> k_ucat_enum = {
         { "\\p{N}", unicode_cpt_flags::NUMBER },
@@ -698,9 +1376,17 @@ std::vector<std::string> unicode_regex_split(const std::string & text, const std
         { unicode_cpt_flags::SYMBOL,      "\\\x24\\\x2B\x3C-\x3E\x5E\x60\\\x7C" }, // $+<=>^`|
     };
 
+    auto get_dfa = [&](size_t i) -> const unicode_regex_dfa * {
+        return i < regex_dfas.size() ? regex_dfas[i].get() : nullptr;
+    };
+
     // compute collapsed codepoints only if needed by at least one regex
     bool need_collapse = false;
-    for (const auto & regex_expr : regex_exprs) {
+    for (size_t i = 0; i < regex_exprs.size(); ++i) {
+        const auto & regex_expr = regex_exprs[i];
+        if (get_dfa(i) != nullptr) {
+            continue;
+        }
         // search for unicode categories
         for (const auto & ucat : k_ucat_enum) {
             if (std::string::npos != regex_expr.find(ucat.first)) {
@@ -710,8 +1396,6 @@ std::vector<std::string> unicode_regex_split(const std::string & text, const std
         }
     }
 
-    const auto cpts = unicode_cpts_from_utf8(text);
-
     // generate a "collapsed" representation of the text, where all codepoints are replaced by a single byte
     // ref: https://github.com/ggml-org/llama.cpp/pull/6920#issuecomment-2081479935
     std::string text_collapsed;
@@ -742,7 +1426,9 @@ std::vector<std::string> unicode_regex_split(const std::string & text, const std
 
     std::vector<size_t> bpe_offsets = { cpts.size() };
 
-    for (const auto & regex_expr : regex_exprs) {
+    for (size_t i = 0; i < regex_exprs.size(); ++i) {
+        const auto & regex_expr = regex_exprs[i];
+
         // first, see if we have an efficient custom regex implementation
         auto tmp = unicode_regex_split_custom(text, regex_expr, bpe_offsets);
 
@@ -751,6 +1437,12 @@ std::vector<std::string> unicode_regex_split(const std::string & text, const std
             continue;
         }
 
+        // then, the regex compiled to a DFA
+        if (const unicode_regex_dfa * dfa = get_dfa(i)) {
+            bpe_offsets = unicode_regex_split_dfa(cpts, *dfa, bpe_offsets);
+            continue;
+        }
+
         // fallback to general-purpose std::regex / std::wregex
         try {
             // if a unicode category is used in the regex, we use the collapsed text and replace the unicode category
@@ -838,11 +1530,20 @@ std::vector<std::string> unicode_regex_split(const std::string & text, const std
         }
     }
 
+    return bpe_offsets;
+}
+
+std::vector<std::string> unicode_regex_split(const std::string & text, const std::vector<std::string> & regex_exprs,
+                                             const std::vector<std::shared_ptr<const unicode_regex_dfa>> & regex_dfas) {
+    const auto cpts = unicode_cpts_from_utf8(text);
+
+    const auto bpe_offsets = unicode_regex_split_cpts(text, cpts, regex_exprs, regex_dfas);
+
     std::vector<std::string> bpe_words;
     bpe_words.reserve(bpe_offsets.size()); // reserve memory for the approximate size
 
     size_t start = 0;
-    for (size_t & offset : bpe_offsets) {
+    for (const size_t offset : bpe_offsets) {
         bpe_words.emplace_back();
         for (size_t i = start; i < start + offset; ++i) {
             bpe_words.back() += unicode_cpt_to_utf8(cpts[i]);
@@ -852,3 +1553,40 @@ std::vector<std::string> unicode_regex_split(const std::string & text, const std
 
     return unicode_byte_encoding_process(bpe_words);
 }
+
+std::vector<size_t> unicode_regex_split_offsets(const std::string & text, const std::vector<std::string> & regex_exprs,
+                                                const std::vector<std::shared_ptr<const unicode_regex_dfa>> & regex_dfas) {
+    const auto cpts = unicode_cpts_from_utf8(text);
+
+    std::vector<size_t> bpe_offsets = unicode_regex_split_cpts(text, cpts, regex_exprs, regex_dfas);
+
+    // convert the offsets to bytes, the invalid UTF-8 bytes are one codepoint each like in unicode_cpts_from_utf8
+    size_t pos = 0;
+    for (size_t & offset : bpe_offsets) {
+        const size_t start = pos;
+        for (size_t i = 0; i < offset; ++i) {
+            try {
+                unicode_cpt_from_utf8(text, pos);
+            } catch (const std::invalid_argument & /*ex*/) {
+                ++pos;
+            }
+        }
+        offset = pos - start;
+    }
+
+    return bpe_offsets;
+}
+
+std::string unicode_byte_encoding(const std::string & utf8) {
+    std::string text_utf;
+    for (const uint32_t cpt : unicode_cpts_from_utf8(utf8)) {
+        text_utf += unicode_cpt_to_utf8(cpt);
+    }
+
+    std::string encoded;
+    for (const char c : text_utf) {
+        encoded += unicode_byte_to_utf8(c);
+    }
+
+    return encoded;
+}
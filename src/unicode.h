@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cstdint>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -63,4 +64,19 @@ uint8_t     unicode_utf8_to_byte(const std::string & utf8);
 
 uint32_t unicode_tolower(uint32_t cpt);
 
-std::vector<std::string> unicode_regex_split(const std::string & text, const std::vector<std::string> & regex_exprs);
+// a pre-tokenizer regex compiled to a DFA
+struct unicode_regex_dfa;
+
+// returns nullptr if the regex uses syntax that is not supported by the DFA
+std::shared_ptr<const unicode_regex_dfa> unicode_regex_dfa_compile(const std::string & regex_expr);
+
+// regex_dfas are the compiled regex_exprs, the regexes without a DFA use std::regex
+std::vector<std::string> unicode_regex_split(const std::string & text, const std::vector<std::string> & regex_exprs,
+                                             const std::vector<std::shared_ptr<const unicode_regex_dfa>> & regex_dfas = {});
+
+// same split as unicode_regex_split, returns the length in bytes of each word of the text instead of the words
+std::vector<size_t> unicode_regex_split_offsets(const std::string & text, const std::vector<std::string> & regex_exprs,
+                                                const std::vector<std::shared_ptr<const unicode_regex_dfa>> & regex_dfas = {});
+
+// the byte-level encoding of the words returned by unicode_regex_split
+std::string unicode_byte_encoding(const std::string & utf8);
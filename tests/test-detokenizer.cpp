@@ -0,0 +1,185 @@
+//  Tests the incremental detokenizer (llama_detokenizer_*) with the single-byte tokens of a byte-level BPE vocab.
+
+#include "llama.h"
+#include "common.h"
+
+#include <cstdio>
+#include <iostream>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+template <class T> static void assert_equals(const T & expected, const T & actual) {
+    if (expected != actual) {
+        std::cerr << "Expected: " << expected << std::endl;
+        std::cerr << "  Actual: " << actual << std::endl;
+        std::cerr << std::flush;
+        throw std::runtime_error("Test failed");
+    }
+}
+
+struct detokenizer {
+    llama_detokenizer * detok;
+
+    detokenizer(const llama_vocab * vocab) : detok(llama_detokenizer_init(vocab)) {}
+    ~detokenizer() { llama_detokenizer_free(detok); }
+
+    std::string push(llama_token token) {
+        char buf[64];
+        const int32_t n = llama_detokenizer_push(detok, token, buf, sizeof(buf), false);
+        if (n < 0) {
+            throw std::runtime_error("llama_detokenizer_push failed");
+        }
+        return std::string(buf, n);
+    }
+
+    std::string flush() {
+        char buf[64];
+        const int32_t n = llama_detokenizer_flush(detok, buf, sizeof(buf));
+        if (n < 0) {
+            throw std::runtime_error("llama_detokenizer_flush failed");
+        }
+        return std::string(buf, n);
+    }
+
+    int32_t n_pending() const {
+        return llama_detokenizer_n_pending(detok);
+    }
+};
+
+static void test_detokenizer(const llama_vocab * vocab) {
+    // the token of each byte
+    std::map<uint8_t, llama_token> byte_tokens;
+    for (llama_token t = 0; t < llama_vocab_n_tokens(vocab); ++t) {
+        char buf[8];
+        if (llama_token_to_piece(vocab, t, buf, sizeof(buf), 0, false) == 1 && byte_tokens.count(buf[0]) == 0) {
+            byte_tokens[(uint8_t) buf[0]] = t;
+        }
+    }
+    if (byte_tokens.size() != 256) {
+        throw std::runtime_error("the vocab does not have a token for each byte");
+    }
+    auto tok = [&](uint8_t c) { return byte_tokens.at(c); };
+
+    std::cerr << "#  Testing a character split across tokens\n";
+    {
+        detokenizer d(vocab);
+
+        // U+00E9 (2 bytes)
+        assert_equals(std::string(), d.push(tok(0xC3)));
+        assert_equals(1, d.n_pending());
+        assert_equals(std::string("\xC3\xA9"), d.push(tok(0xA9)));
+        assert_equals(0, d.n_pending());
+
+        // U+1F600 (4 bytes), with the ASCII before it output right away
+        assert_equals(std::string("a"), d.push(tok('a')));
+        assert_equals(std::string(), d.push(tok(0xF0)));
+        assert_equals(std::string(), d.push(tok(0x9F)));
+        assert_equals(std::string(), d.push(tok(0x98)));
+        assert_equals(3, d.n_pending());
+        assert_equals(std::string("\xF0\x9F\x98\x80"), d.push(tok(0x80)));
+
+        // the held bytes are output by flush at the end of the text
+        assert_equals(std::string(), d.push(tok(0xE2)));
+        assert_equals(std::string(), d.push(tok(0x82)));
+        assert_equals(std::string("\xE2\x82"), d.flush());
+        assert_equals(0, d.n_pending());
+        assert_equals(std::string(), d.flush());
+
+        // reset drops them
+        assert_equals(std::string(), d.push(tok(0xE2)));
+        llama_detokenizer_reset(d.detok);
+        assert_equals(0, d.n_pending());
+        assert_equals(std::string("b"), d.push(tok('b')));
+    }
+
+    std::cerr << "#  Testing invalid UTF-8\n";
+    {
+        detokenizer d(vocab);
+
+        // a continuation byte without a first byte
+        assert_equals(std::string("\xA9"), d.push(tok(0xA9)));
+        assert_equals(0, d.n_pending());
+
+        // a first byte that is not followed by a continuation byte
+        assert_equals(std::string(), d.push(tok(0xE2)));
+        assert_equals(std::string("\xE2" "a"), d.push(tok('a')));
+
+        // a character that is cut by the first byte of the next one: the first one is output, the next one held
+        assert_equals(std::string(), d.push(tok(0xE2)));
+        assert_equals(std::string(), d.push(tok(0x82)));
+        assert_equals(std::string("\xE2\x82"), d.push(tok(0xC3)));
+        assert_equals(1, d.n_pending());
+        assert_equals(std::string("\xC3\xA9"), d.push(tok(0xA9)));
+
+        // bytes that are never valid in UTF-8
+        assert_equals(std::string("\xFF"), d.push(tok(0xFF)));
+        assert_equals(std::string("\xF8"), d.push(tok(0xF8)));
+        assert_equals(0, d.n_pending());
+    }
+
+    std::cerr << "#  Testing a buffer that is too small\n";
+    {
+        detokenizer d(vocab);
+
+        assert_equals(std::string(), d.push(tok(0xC3)));
+
+        // the token is not consumed
+        char buf[2];
+        assert_equals(-2, llama_detokenizer_push(d.detok, tok(0xA9), buf, 1, false));
+        assert_equals(1, d.n_pending());
+        assert_equals(2, llama_detokenizer_push(d.detok, tok(0xA9), buf, 2, false));
+        assert_equals(std::string("\xC3\xA9"), std::string(buf, 2));
+
+        assert_equals(std::string(), d.push(tok(0xE2)));
+        assert_equals(-1, llama_detokenizer_flush(d.detok, buf, 0));
+        assert_equals(1, d.n_pending());
+    }
+
+    std::cerr << "#  Testing the tokens of a text\n";
+    {
+        const std::string text = "Hello w\xC3\xB6rld! \xE4\xBD\xA0\xE5\xA5\xBD \xF0\x9F\x98\x80\xF0\x9F\x91\x8D caf\xC3\xA9 \xE2\x82\xAC" "42";
+
+        const auto tokens = common_tokenize(vocab, text, false, false);
+
+        detokenizer d(vocab);
+
+        // the text is output in order, and never up to the middle of a character
+        std::string out;
+        for (const auto token : tokens) {
+            out += d.push(token);
+            assert_equals(0, text.compare(0, out.size(), out));
+            assert_equals(true, out.size() == text.size() || (text[out.size()] & 0xC0) != 0x80);
+        }
+        out += d.flush();
+
+        assert_equals(text, out);
+    }
+}
+
+int main(int argc, char ** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <vocab-file>\n", argv[0]);
+        return 1;
+    }
+
+    llama_backend_init();
+
+    auto mparams = llama_model_default_params();
+    mparams.vocab_only = true;
+
+    llama_model * model = llama_model_load_from_file(argv[1], mparams);
+    if (model == NULL) {
+        fprintf(stderr, "%s: error: failed to load vocab '%s'\n", __func__, argv[1]);
+        return 1;
+    }
+
+    test_detokenizer(llama_model_get_vocab(model));
+
+    llama_model_free(model);
+    llama_backend_free();
+
+    std::cerr << "All tests passed.\n";
+    return 0;
+}
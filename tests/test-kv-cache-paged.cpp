@@ -0,0 +1,194 @@
+// compare the logits of the paged KV layout (LLAMA_KV_CACHE_PAGED) with the flat layout
+
+#include "llama.h"
+#include "get-model.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+static const int n_seq    = 16;
+static const int n_prompt = 96;
+
+// decode the tokens of a single sequence, return the logits of the last token
+static bool decode_seq(llama_context * ctx, llama_seq_id seq_id, const std::vector<llama_token> & tokens, std::vector<float> & out) {
+    llama_memory_t mem = llama_get_memory(ctx);
+
+    const llama_pos pos0 = llama_memory_seq_pos_max(mem, seq_id) + 1;
+
+    llama_batch batch = llama_batch_init(tokens.size(), 0, 1);
+    for (size_t i = 0; i < tokens.size(); ++i) {
+        batch.token   [i]    = tokens[i];
+        batch.pos     [i]    = pos0 + i;
+        batch.n_seq_id[i]    = 1;
+        batch.seq_id  [i][0] = seq_id;
+        batch.logits  [i]    = i == tokens.size() - 1;
+    }
+    batch.n_tokens = tokens.size();
+
+    const int ret = llama_decode(ctx, batch);
+    llama_batch_free(batch);
+
+    if (ret != 0) {
+        fprintf(stderr, "%s: llama_decode() failed with %d\n", __func__, ret);
+        return false;
+    }
+
+    const int n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(llama_get_model(ctx)));
+    const float * logits = llama_get_logits_ith(ctx, -1);
+
+    out.insert(out.end(), logits, logits + n_vocab);
+
+    return true;
+}
+
+// the sequences are decoded one at a time, so that the attention of each ubatch covers only the blocks of a single
+// sequence out of all used cells, which is the case where the blocks are gathered
+// with partial, the blocks are larger than the padding and the last block of a sequence is only partially covered by
+// the used cells
+static bool run(llama_model * model, uint32_t n_block, ggml_type type_kv, bool partial, std::vector<float> & out) {
+    if (n_block > 0) {
+        setenv("LLAMA_KV_CACHE_PAGED", std::to_string(n_block).c_str(), 1);
+    } else {
+        unsetenv("LLAMA_KV_CACHE_PAGED");
+    }
+
+    auto cparams = llama_context_default_params();
+    cparams.n_ctx      = 4096;
+    cparams.n_batch    = 512;
+    cparams.n_ubatch   = 512;
+    cparams.n_seq_max  = n_seq;
+    cparams.flash_attn = true;
+    cparams.type_k     = type_kv;
+    cparams.type_v     = type_kv;
+
+    llama_context * ctx = llama_init_from_model(model, cparams);
+    if (ctx == nullptr) {
+        fprintf(stderr, "%s: failed to create the context\n", __func__);
+        return false;
+    }
+
+    const int n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(model));
+
+    std::mt19937 rng(42);
+    auto random_tokens = [&](int n) {
+        std::vector<llama_token> res(n);
+        for (auto & t : res) {
+            t = rng() % n_vocab;
+        }
+        return res;
+    };
+
+    bool ok = true;
+
+    if (partial) {
+        // with 512-cell blocks: sequences 1..5 fill blocks 0..4, sequence 0 fills block 5 and 88 cells of block 6, so
+        // the used cells end in the middle of block 6
+        for (int s = 1; s < 6 && ok; ++s) {
+            ok = decode_seq(ctx, s, random_tokens(n_prompt), out);
+        }
+        for (int i = 0; i < 3 && ok; ++i) {
+            ok = decode_seq(ctx, 0, random_tokens(200), out);
+        }
+        for (int i = 0; i < 4 && ok; ++i) {
+            for (int s = 0; s < 6 && ok; ++s) {
+                ok = decode_seq(ctx, s, random_tokens(1), out);
+            }
+        }
+
+        llama_free(ctx);
+
+        return ok;
+    }
+
+    for (int s = 0; s < n_seq && ok; ++s) {
+        ok = decode_seq(ctx, s, random_tokens(n_prompt), out);
+    }
+
+    // a second run of blocks for some of the sequences
+    for (int s = 0; s < n_seq/4 && ok; ++s) {
+        ok = decode_seq(ctx, s, random_tokens(n_prompt/4), out);
+    }
+
+    for (int i = 0; i < 4 && ok; ++i) {
+        for (int s = 0; s < n_seq && ok; ++s) {
+            ok = decode_seq(ctx, s, random_tokens(1), out);
+        }
+    }
+
+    llama_free(ctx);
+
+    return ok;
+}
+
+int main(int argc, char ** argv) {
+// skip on windows, because setenv is not supported
+#ifdef _WIN32
+    printf("test-kv-cache-paged: skip on windows build\n");
+    return EXIT_SUCCESS;
+#else
+    auto * model_path = get_model_or_exit(argc, argv);
+
+    // the paged layout requires ggml_set_rows()
+    setenv("LLAMA_SET_ROWS", "1", 1);
+
+    llama_backend_init();
+
+    llama_model * model = llama_model_load_from_file(model_path, llama_model_default_params());
+    if (model == nullptr) {
+        fprintf(stderr, "failed to load the model '%s'\n", model_path);
+        return EXIT_FAILURE;
+    }
+
+    int n_fail = 0;
+
+    struct test_case {
+        uint32_t  n_block;
+        ggml_type type_kv;
+        bool      partial;
+    };
+
+    const test_case cases[] = {
+        {  16, GGML_TYPE_F16,  false },
+        {  16, GGML_TYPE_Q8_0, false },
+        { 512, GGML_TYPE_F16,  true  }, // blocks larger than the padding of 256 cells
+    };
+
+    for (const auto & tc : cases) {
+        const ggml_type type_kv = tc.type_kv;
+
+        std::vector<float> ref;
+        std::vector<float> res;
+
+        if (!run(model, 0, type_kv, tc.partial, ref) || !run(model, tc.n_block, type_kv, tc.partial, res) || ref.size() != res.size()) {
+            fprintf(stderr, "n_block = %u, type_kv = %s: FAIL (decode)\n", tc.n_block, ggml_type_name(type_kv));
+            n_fail++;
+            continue;
+        }
+
+        double max_err = 0.0;
+        double max_ref = 0.0;
+        for (size_t i = 0; i < ref.size(); ++i) {
+            max_err = std::max(max_err, (double) std::fabs(ref[i] - res[i]));
+            max_ref = std::max(max_ref, (double) std::fabs(ref[i]));
+        }
+
+        // the cells hold the same data in a different order, which changes the rounding of the attention
+        const bool ok = max_err <= 1e-3*std::max(1.0, max_ref);
+
+        printf("n_block = %u, type_kv = %s: max abs logit diff = %g (max abs logit = %g): %s\n",
+                tc.n_block, ggml_type_name(type_kv), max_err, max_ref, ok ? "OK" : "FAIL");
+
+        n_fail += ok ? 0 : 1;
+    }
+
+    llama_model_free(model);
+    llama_backend_free();
+
+    return n_fail == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+#endif
+}
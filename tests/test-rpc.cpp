@@ -0,0 +1,323 @@
+// round trip of the tensor data through an RPC server with each of the encodings of the transfer:
+//   none and GGML_RPC_COMPRESS=1 are lossless
+//   GGML_RPC_TRANSFER_TYPE=f16|bf16 round the F32 data received from the server, the data sent is not changed
+// and a mul_mat with the weights split by rows across two RPC servers, compared with the CPU backend
+
+#include "ggml.h"
+#include "ggml-alloc.h"
+#include "ggml-backend.h"
+#include "ggml-cpu.h"
+#include "ggml-rpc.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+enum transfer_mode {
+    TRANSFER_RAW,
+    TRANSFER_RLE,
+    TRANSFER_F16,
+    TRANSFER_BF16,
+};
+
+static const char * transfer_mode_name(transfer_mode mode) {
+    switch (mode) {
+        case TRANSFER_RAW:  return "raw";
+        case TRANSFER_RLE:  return "rle";
+        case TRANSFER_F16:  return "f16";
+        case TRANSFER_BF16: return "bf16";
+    }
+    return "?";
+}
+
+// the encodings are chosen by the client when it connects to the server
+static void set_transfer_mode(transfer_mode mode) {
+    unsetenv("GGML_RPC_COMPRESS");
+    unsetenv("GGML_RPC_TRANSFER_TYPE");
+    switch (mode) {
+        case TRANSFER_RAW:  break;
+        case TRANSFER_RLE:  setenv("GGML_RPC_COMPRESS", "1", 1); break;
+        case TRANSFER_F16:  setenv("GGML_RPC_TRANSFER_TYPE", "f16", 1); break;
+        case TRANSFER_BF16: setenv("GGML_RPC_TRANSFER_TYPE", "bf16", 1); break;
+    }
+}
+
+// the data expected back from the server for the data sent
+static std::vector<uint8_t> expected_data(transfer_mode mode, ggml_type type, size_t offset, const std::vector<uint8_t> & data) {
+    std::vector<uint8_t> res = data;
+    if (type != GGML_TYPE_F32 || offset % sizeof(float) != 0 || data.size() % sizeof(float) != 0) {
+        return res;
+    }
+    float * x = (float *) res.data();
+    const size_t n = res.size() / sizeof(float);
+    for (size_t i = 0; i < n; ++i) {
+        if (mode == TRANSFER_F16) {
+            x[i] = ggml_fp16_to_fp32(ggml_fp32_to_fp16(x[i]));
+        } else if (mode == TRANSFER_BF16) {
+            x[i] = ggml_bf16_to_fp32(ggml_fp32_to_bf16(x[i]));
+        }
+    }
+    return res;
+}
+
+// random data, or data with long runs of equal elements that the lossless compression reduces
+static std::vector<uint8_t> make_data(std::mt19937 & rng, ggml_type type, size_t size, bool runs) {
+    std::vector<uint8_t> data(size);
+    if (type == GGML_TYPE_F32 && size % sizeof(float) == 0) {
+        std::uniform_real_distribution<float> dist(-4.0f, 4.0f);
+        float * x = (float *) data.data();
+        const float vals[] = { 0.0f, 1.0f, -0.5f, 3.25f };
+        for (size_t i = 0; i < size / sizeof(float); ++i) {
+            x[i] = runs ? vals[(i / 37) % 4] : dist(rng);
+        }
+        return data;
+    }
+    for (size_t i = 0; i < size; ++i) {
+        data[i] = runs ? (uint8_t) ((i / 53) % 3) : (uint8_t) rng();
+    }
+    return data;
+}
+
+struct test_case {
+    ggml_type type;
+    int64_t   ne;
+    size_t    offset; // of the range written and read back, in bytes
+    size_t    size;   // 0 for the whole tensor
+    bool      runs;
+};
+
+static bool run_test(ggml_backend_buffer_type_t buft, transfer_mode mode, std::mt19937 & rng) {
+    const test_case cases[] = {
+        { GGML_TYPE_F32,   16384,  0, 0,    false },
+        { GGML_TYPE_F32,   16384,  0, 0,    true  },
+        { GGML_TYPE_F32,   16384, 64, 8192, true  },
+        { GGML_TYPE_F32,   16384,  6, 8190, true  }, // not aligned to the elements
+        { GGML_TYPE_F32,     256,  0, 0,    false }, // below the size that is encoded
+        { GGML_TYPE_F16,   16384,  0, 0,    false },
+        { GGML_TYPE_F16,   16384,  0, 0,    true  },
+        { GGML_TYPE_Q8_0,  16384,  0, 0,    true  },
+        { GGML_TYPE_I32,   16384,  0, 0,    true  },
+    };
+    const size_t n_cases = sizeof(cases) / sizeof(cases[0]);
+
+    ggml_init_params params = {
+        /*.mem_size   =*/ n_cases*ggml_tensor_overhead(),
+        /*.mem_buffer =*/ NULL,
+        /*.no_alloc   =*/ true,
+    };
+    ggml_context * ctx = ggml_init(params);
+
+    std::vector<ggml_tensor *> tensors;
+    for (const auto & tc : cases) {
+        tensors.push_back(ggml_new_tensor_1d(ctx, tc.type, tc.ne));
+    }
+
+    // the buffer holds the connection to the server, with the encodings of the current mode
+    ggml_backend_buffer_t buf = ggml_backend_alloc_ctx_tensors_from_buft(ctx, buft);
+    if (buf == nullptr) {
+        fprintf(stderr, "%s: failed to allocate the tensors\n", __func__);
+        ggml_free(ctx);
+        return false;
+    }
+
+    bool ok = true;
+    for (size_t i = 0; i < n_cases; ++i) {
+        const test_case & tc = cases[i];
+        ggml_tensor * t = tensors[i];
+        const size_t size = tc.size == 0 ? ggml_nbytes(t) : tc.size;
+
+        const std::vector<uint8_t> data = make_data(rng, tc.type, size, tc.runs);
+        ggml_backend_tensor_set(t, data.data(), tc.offset, size);
+
+        std::vector<uint8_t> out(size);
+        ggml_backend_tensor_get(t, out.data(), tc.offset, size);
+
+        // only the F32 data of at least 4 KiB is encoded
+        const bool lossy = tc.type == GGML_TYPE_F32 && size >= 4096 && tc.offset % sizeof(float) == 0 && size % sizeof(float) == 0;
+        const std::vector<uint8_t> ref = lossy ? expected_data(mode, tc.type, tc.offset, data) : data;
+        const bool case_ok = out == ref;
+
+        printf("  %-4s %-5s ne = %6" PRId64 ", offset = %2zu, size = %6zu, %s: %s\n",
+            transfer_mode_name(mode), ggml_type_name(tc.type), tc.ne, tc.offset, size,
+            tc.runs ? "runs  " : "random", case_ok ? "OK" : "FAIL");
+        ok = ok && case_ok;
+    }
+
+    ggml_backend_buffer_free(buf);
+    ggml_free(ctx);
+
+    return ok;
+}
+
+struct split_test_case {
+    ggml_type type;
+    int64_t   k;      // columns of the weights
+    int64_t   m;      // rows of the weights, split across the servers
+    int64_t   n;      // columns of the result
+    float     split;  // fraction of the rows on the first server (0 = even)
+};
+
+// computes the graph of a mul_mat of src0 and src1 (with the given data) on a backend, src0 is allocated in buft_src0
+static std::vector<float> compute_mul_mat(ggml_backend_t backend, ggml_backend_buffer_type_t buft_src0, const split_test_case & tc,
+        const std::vector<uint8_t> & src0_data, const std::vector<float> & src1_data) {
+    ggml_init_params params = {
+        /*.mem_size   =*/ 3*ggml_tensor_overhead() + ggml_graph_overhead(),
+        /*.mem_buffer =*/ NULL,
+        /*.no_alloc   =*/ true,
+    };
+    ggml_context * ctx_src0 = ggml_init(params);
+    ggml_context * ctx      = ggml_init(params);
+
+    ggml_tensor * src0 = ggml_new_tensor_2d(ctx_src0, tc.type, tc.k, tc.m);
+    ggml_tensor * src1 = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, tc.k, tc.n);
+    ggml_tensor * dst  = ggml_mul_mat(ctx, src0, src1);
+
+    ggml_cgraph * gf = ggml_new_graph(ctx);
+    ggml_build_forward_expand(gf, dst);
+
+    ggml_backend_buffer_t buf_src0 = ggml_backend_alloc_ctx_tensors_from_buft(ctx_src0, buft_src0);
+    ggml_backend_buffer_t buf      = ggml_backend_alloc_ctx_tensors(ctx, backend);
+    GGML_ASSERT(buf_src0 != nullptr && buf != nullptr);
+
+    ggml_backend_tensor_set(src0, src0_data.data(), 0, src0_data.size());
+    ggml_backend_tensor_set(src1, src1_data.data(), 0, src1_data.size()*sizeof(float));
+
+    std::vector<float> res;
+    if (ggml_backend_graph_compute(backend, gf) == GGML_STATUS_SUCCESS) {
+        res.resize(ggml_nelements(dst));
+        ggml_backend_tensor_get(dst, res.data(), 0, ggml_nbytes(dst));
+    }
+
+    ggml_backend_buffer_free(buf);
+    ggml_backend_buffer_free(buf_src0);
+    ggml_free(ctx);
+    ggml_free(ctx_src0);
+
+    return res;
+}
+
+// the rows of the weights on each server are multiplied there and gathered on the server of the main device,
+// the result is the same as on the CPU, which computes the same dot products
+static bool run_split_test(int main_device, const std::string & endpoint_main, std::mt19937 & rng) {
+    const split_test_case cases[] = {
+        { GGML_TYPE_F32,  256, 100, 1, 0.0f  },
+        { GGML_TYPE_F32,  256, 100, 7, 0.0f  },
+        { GGML_TYPE_F32,  128,  61, 3, 0.3f  }, // the rows are not split evenly
+        { GGML_TYPE_F16,  256,  96, 5, 0.75f },
+        { GGML_TYPE_Q8_0, 512,  64, 9, 0.5f  },
+        { GGML_TYPE_Q4_0, 256,  40, 2, 0.25f },
+    };
+
+    ggml_backend_t backend_cpu = ggml_backend_cpu_init();
+    ggml_backend_t backend_rpc = ggml_backend_rpc_init(endpoint_main.c_str());
+
+    bool ok = true;
+    for (const auto & tc : cases) {
+        const float tensor_split[2] = { tc.split, 1.0f - tc.split };
+        ggml_backend_buffer_type_t buft_split = ggml_backend_rpc_split_buffer_type(main_device, tc.split > 0.0f ? tensor_split : nullptr);
+        GGML_ASSERT(buft_split != nullptr);
+
+        // random weights, quantized rows are valid blocks
+        std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+        std::vector<float> src0_f32(tc.k*tc.m);
+        std::vector<float> src1(tc.k*tc.n);
+        for (auto & x : src0_f32) {
+            x = dist(rng);
+        }
+        for (auto & x : src1) {
+            x = dist(rng);
+        }
+        std::vector<uint8_t> src0(ggml_row_size(tc.type, tc.k)*tc.m);
+        if (tc.type == GGML_TYPE_F32) {
+            memcpy(src0.data(), src0_f32.data(), src0.size());
+        } else {
+            ggml_quantize_chunk(tc.type, src0_f32.data(), src0.data(), 0, tc.m, tc.k, nullptr);
+        }
+
+        const std::vector<float> ref = compute_mul_mat(backend_cpu, ggml_backend_cpu_buffer_type(), tc, src0, src1);
+        const std::vector<float> out = compute_mul_mat(backend_rpc, buft_split, tc, src0, src1);
+
+        double max_err = INFINITY;
+        if (out.size() == ref.size()) {
+            max_err = 0.0;
+            for (size_t i = 0; i < ref.size(); ++i) {
+                max_err = std::max(max_err, (double) std::fabs(out[i] - ref[i]));
+            }
+        }
+        const bool case_ok = max_err <= 1e-4;
+
+        printf("  split main = %d, %-5s k = %3" PRId64 ", m = %3" PRId64 ", n = %" PRId64 ", split = %.2f, max err = %g: %s\n",
+            main_device, ggml_type_name(tc.type), tc.k, tc.m, tc.n, tc.split, max_err, case_ok ? "OK" : "FAIL");
+        ok = ok && case_ok;
+    }
+
+    ggml_backend_free(backend_rpc);
+    ggml_backend_free(backend_cpu);
+
+    return ok;
+}
+
+int main(void) {
+    const int port = 50000 + 2*(getpid() % 5000);
+    const std::string endpoint   = "127.0.0.1:" + std::to_string(port);
+    const std::string endpoint_2 = "127.0.0.1:" + std::to_string(port + 1);
+
+    // the servers serve one client at a time, each buffer below is a new client
+    for (const std::string & ep : { endpoint, endpoint_2 }) {
+        ggml_backend_t backend = ggml_backend_cpu_init();
+        std::thread server([backend, ep]() {
+            ggml_backend_rpc_start_server(backend, ep.c_str(), nullptr, 1ull << 30, 1ull << 30);
+        });
+        server.detach();
+    }
+
+    // this also adds the devices of the split buffer, in this order: endpoint (0), endpoint_2 (1)
+    ggml_backend_buffer_type_t buft = nullptr;
+    for (const std::string & ep : { endpoint, endpoint_2 }) {
+        ggml_backend_buffer_type_t buft_ep = nullptr;
+        for (int i = 0; i < 100 && buft_ep == nullptr; ++i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            buft_ep = ggml_backend_rpc_buffer_type(ep.c_str());
+        }
+        if (buft_ep == nullptr) {
+            fprintf(stderr, "failed to connect to the RPC server at %s\n", ep.c_str());
+            std::_Exit(EXIT_FAILURE);
+        }
+        if (buft == nullptr) {
+            buft = buft_ep;
+        }
+    }
+
+    std::mt19937 rng(42);
+
+    int n_fail = 0;
+    for (transfer_mode mode : { TRANSFER_RAW, TRANSFER_RLE, TRANSFER_F16, TRANSFER_BF16 }) {
+        set_transfer_mode(mode);
+        if (!run_test(buft, mode, rng)) {
+            n_fail++;
+        }
+    }
+
+    set_transfer_mode(TRANSFER_RAW);
+    if (!run_split_test(0, endpoint, rng)) {
+        n_fail++;
+    }
+    if (!run_split_test(1, endpoint_2, rng)) {
+        n_fail++;
+    }
+
+    printf("%s\n", n_fail == 0 ? "OK" : "FAIL");
+    fflush(stdout);
+
+    // the server never returns, exit without waiting for it
+    std::_Exit(n_fail == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,182 @@
+//  Tests common_stop_matcher against a brute-force search of the stop strings and string_find_partial_stop().
+
+#include "common.h"
+
+#include <algorithm>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+template <class T> static void assert_equals(const T & expected, const T & actual) {
+    if (expected != actual) {
+        std::cerr << "Expected: " << expected << std::endl;
+        std::cerr << "  Actual: " << actual << std::endl;
+        std::cerr << std::flush;
+        throw std::runtime_error("Test failed");
+    }
+}
+
+// the stop string that starts first among those that end in text[pos:], the shorter one if several start at the same
+// position, the first one if several are equal
+static common_stop_matcher::match find_stop(const std::vector<std::string> & words, const std::string & text, size_t pos) {
+    common_stop_matcher::match res;
+    size_t res_start = 0;
+    for (size_t end = pos + 1; end <= text.size(); ++end) {
+        for (size_t i = 0; i < words.size(); ++i) {
+            const std::string & word = words[i];
+            if (word.empty() || word.size() > end || text.compare(end - word.size(), word.size(), word) != 0) {
+                continue;
+            }
+            const size_t start = end - word.size();
+            if (res.word < 0 || start < res_start) {
+                res.word  = (int32_t) i;
+                res.end   = end - pos;
+                res_start = start;
+            }
+        }
+    }
+    return res;
+}
+
+// the length of the longest suffix of the text that is the start of a stop string
+static size_t find_partial(const std::vector<std::string> & words, const std::string & text) {
+    size_t res = 0;
+    for (const auto & word : words) {
+        const size_t pos = string_find_partial_stop(text, word);
+        if (pos != std::string::npos) {
+            res = std::max(res, text.size() - pos);
+        }
+    }
+    return res;
+}
+
+// feeds the text in chunks and checks each step against the brute-force search
+static void test_feed(const std::vector<std::string> & words, const std::vector<std::string> & chunks) {
+    common_stop_matcher matcher(words);
+
+    std::string text;
+    for (const auto & chunk : chunks) {
+        const size_t pos = text.size();
+        text += chunk;
+
+        const auto expected = find_stop(words, text, pos);
+        const auto actual   = matcher.feed(chunk);
+
+        assert_equals(expected.word, actual.word);
+        if (expected.word >= 0) {
+            assert_equals(expected.end, actual.end);
+        }
+        assert_equals(find_partial(words, text), matcher.n_partial());
+    }
+}
+
+static void test_cases() {
+    std::cerr << "#  Testing the stop strings\n";
+
+    // a stop string split across the chunks
+    {
+        common_stop_matcher matcher({ "</s>" });
+        assert_equals(-1, matcher.feed("hello <").word);
+        assert_equals((size_t) 1, matcher.n_partial());
+        assert_equals(-1, matcher.feed("/").word);
+        assert_equals((size_t) 2, matcher.n_partial());
+        const auto match = matcher.feed("s> world");
+        assert_equals(0, match.word);
+        assert_equals((size_t) 2, match.end);
+    }
+
+    // the stop string that starts first wins, even if another one ends before it in the same chunk
+    {
+        common_stop_matcher matcher({ "bc", "abcd" });
+        const auto match = matcher.feed("xabcdx");
+        assert_equals(1, match.word);
+        assert_equals((size_t) 5, match.end);
+    }
+
+    // the same text fed byte by byte: the shorter stop string is found first
+    {
+        common_stop_matcher matcher({ "bc", "abcd" });
+        assert_equals(-1, matcher.feed("a").word);
+        assert_equals(-1, matcher.feed("b").word);
+        assert_equals( 0, matcher.feed("c").word);
+    }
+
+    // a stop string that starts before the chunk wins over one that is fully in the chunk
+    {
+        common_stop_matcher matcher({ "abc", "c" });
+        matcher.feed("ab");
+        const auto match = matcher.feed("c");
+        assert_equals(0, match.word);
+        assert_equals((size_t) 1, match.end);
+    }
+
+    // overlapping stop strings, one a suffix of the other
+    test_feed({ "abab", "bab", "b" }, { "a", "ba", "b", "ab", "bab" });
+    test_feed({ "aaa", "aa" }, { "a", "a", "a", "aaaa" });
+
+    // duplicates: the first one is reported
+    {
+        common_stop_matcher matcher({ "stop", "end", "stop" });
+        assert_equals(0, matcher.feed("full stop").word);
+    }
+
+    // the empty stop string never matches and is never a partial match
+    {
+        common_stop_matcher matcher({ "" });
+        assert_equals(-1, matcher.feed("text").word);
+        assert_equals((size_t) 0, matcher.n_partial());
+    }
+    test_feed({ "", "x", "" }, { "ab", "x", "" });
+
+    // reset starts a new text
+    {
+        common_stop_matcher matcher({ "abc" });
+        matcher.feed("ab");
+        assert_equals((size_t) 2, matcher.n_partial());
+        matcher.reset();
+        assert_equals((size_t) 0, matcher.n_partial());
+        assert_equals(-1, matcher.feed("c").word);
+    }
+
+    // no stop strings
+    test_feed({}, { "abc", "" });
+}
+
+static void test_random() {
+    std::cerr << "#  Testing random stop strings and texts\n";
+
+    std::mt19937 rng(1234);
+
+    auto random_string = [&](size_t max_len) {
+        std::string res(rng() % (max_len + 1), ' ');
+        for (auto & c : res) {
+            c = "abc"[rng() % 3];
+        }
+        return res;
+    };
+
+    for (int i = 0; i < 2000; ++i) {
+        std::vector<std::string> words(rng() % 5);
+        for (auto & word : words) {
+            word = random_string(5);
+        }
+        if (!words.empty() && rng() % 4 == 0) {
+            words.push_back(words[rng() % words.size()]);
+        }
+
+        std::vector<std::string> chunks(1 + rng() % 8);
+        for (auto & chunk : chunks) {
+            chunk = random_string(6);
+        }
+
+        test_feed(words, chunks);
+    }
+}
+
+int main() {
+    test_cases();
+    test_random();
+    std::cerr << "All tests passed.\n";
+    return 0;
+}
@@ -252,6 +252,40 @@ int main(int argc, char **argv) {
         threads[i].join();
     }
 
+    // parallel tokenization of a large text: the tests concatenated, with invalid UTF-8 between them
+    if (!k_tests.empty()) {
+        const char * invalid[] = { "\xff", "\xe2\x82", "\x80\x80", "\xf0\x9f", "\xc3" };
+
+        std::string text;
+        for (size_t i = 0; text.size() < 160*1024; ++i) {
+            for (const auto & test_kv : k_tests) {
+                text += test_kv.first;
+                text += invalid[i++ % (sizeof(invalid)/sizeof(invalid[0]))];
+            }
+        }
+
+        const std::vector<llama_token> ref = common_tokenize(ctx, text, add_special, false);
+
+        for (const int n_threads : { 2, 3, 8 }) {
+            const std::vector<llama_token> res = common_tokenize(ctx, text, add_special, false, n_threads);
+
+            const bool correct = res == ref;
+
+            printf("\n");
+            printf("parallel: text size = %zu, n_threads = %d, tokens = %zu: %s\n", text.size(), n_threads, res.size(), correct ? "OK" : "FAIL");
+
+            if (!correct) {
+                size_t i = 0;
+                while (i < res.size() && i < ref.size() && res[i] == ref[i]) {
+                    i++;
+                }
+                fprintf(stderr, "%s : parallel tokenization with %d threads differs at token %zu of %zu\n", __func__, n_threads, i, ref.size());
+
+                success = false;
+            }
+        }
+    }
+
     // single threaded tokenization
     if (!fname_text.empty()) {
         fprintf(stderr, "%s : tokenizing: '%s'\n", __func__, fname_text.c_str());
@@ -70,6 +70,30 @@ enum server_task_type {
     SERVER_TASK_TYPE_SET_LORA,
 };
 
+// scheduling class of a completion task
+enum server_task_priority {
+    SERVER_TASK_PRIORITY_INTERACTIVE, // default, can preempt batch tasks when no slot is available
+    SERVER_TASK_PRIORITY_BATCH,       // background work, can be preempted and is resumed later
+};
+
+static server_task_priority server_task_priority_from_str(const std::string & str) {
+    if (str == "interactive") {
+        return SERVER_TASK_PRIORITY_INTERACTIVE;
+    }
+    if (str == "batch") {
+        return SERVER_TASK_PRIORITY_BATCH;
+    }
+    throw std::runtime_error("Error: \"priority\" must be \"interactive\" or \"batch\"");
+}
+
+static const char * server_task_priority_to_str(server_task_priority priority) {
+    switch (priority) {
+        case SERVER_TASK_PRIORITY_INTERACTIVE: return "interactive";
+        case SERVER_TASK_PRIORITY_BATCH:       return "batch";
+    }
+    return "unknown";
+}
+
 enum oaicompat_type {
     OAICOMPAT_TYPE_NONE,
     OAICOMPAT_TYPE_CHAT,
@@ -129,6 +153,8 @@ struct slot_params {
     bool post_sampling_probs = false;
     bool ignore_eos = false;
 
+    server_task_priority priority = SERVER_TASK_PRIORITY_INTERACTIVE;
+
     struct common_params_sampling sampling;
     struct common_params_speculative speculative;
 
@@ -188,6 +214,7 @@ struct slot_params {
             {"n_discard",                 n_discard},
             {"ignore_eos",                sampling.ignore_eos},
             {"stream",                    stream},
+            {"priority",                  server_task_priority_to_str(priority)},
             {"logit_bias",                format_logit_bias(sampling.logit_bias)},
             {"n_probs",                   sampling.n_probs},
             {"min_keep",                  sampling.min_keep},
@@ -210,6 +237,8 @@ struct slot_params {
     }
 };
 
+struct server_task_resume;
+
 struct server_task {
     int id    = -1; // to be filled by server_queue
     int index = -1; // used when there are multiple prompts (batch request)
@@ -224,6 +253,9 @@ struct server_task {
     server_tokens prompt_tokens;
     int id_selected_slot = -1;
 
+    // set when the task was preempted while generating
+    std::shared_ptr<server_task_resume> resume;
+
     // used by SERVER_TASK_TYPE_SLOT_SAVE, SERVER_TASK_TYPE_SLOT_RESTORE, SERVER_TASK_TYPE_SLOT_ERASE
     struct slot_action {
         int slot_id;
@@ -269,6 +301,7 @@ struct server_task {
       //params.t_max_prompt_ms  = json_value(data, "t_max_prompt_ms",    defaults.t_max_prompt_ms); // TODO: implement
         params.t_max_predict_ms = json_value(data, "t_max_predict_ms",   defaults.t_max_predict_ms);
         params.response_fields  = json_value(data, "response_fields",   std::vector<std::string>());
+        params.priority         = server_task_priority_from_str(json_value(data, "priority", std::string("interactive")));
 
         params.sampling.top_k              = json_value(data, "top_k",              defaults.sampling.top_k);
         params.sampling.top_p              = json_value(data, "top_p",              defaults.sampling.top_p);
@@ -1238,6 +1271,25 @@ struct server_task_result_apply_lora : server_task_result {
     }
 };
 
+// the output of a preempted task, restored in the slot when the task is resumed
+struct server_task_resume {
+    std::string  generated_text;
+    llama_tokens generated_tokens;
+    common_chat_msg chat_msg;
+
+    std::vector<completion_token_output> generated_token_probs;
+    std::vector<std::string> generated_tool_call_ids;
+
+    size_t  n_sent_text  = 0;
+    size_t  last_nl_pos  = 0;
+    bool    has_new_line = false;
+    int32_t n_decoded    = 0;
+
+    // the prompt of the request, the prompt of the resumed task also contains the generated tokens
+    std::string prompt;
+    int32_t     n_prompt_tokens = 0;
+};
+
 struct server_slot {
     int id;
     int id_task = -1;
@@ -1275,6 +1327,13 @@ struct server_slot {
     int32_t i_batch     = -1;
     int32_t n_predict   = -1; // TODO: disambiguate from params.n_predict
 
+    // tokens generated before the task was preempted (see server_task_resume), reported together with n_decoded
+    int32_t n_decoded_prev = 0;
+
+    // the prompt of the request of a resumed task (see server_task_resume), reported instead of prompt_tokens
+    std::string prompt_prev;
+    int32_t     n_prompt_tokens_prev = -1;
+
     // n_prompt_tokens may not be equal to prompt_tokens.size(), because prompt maybe truncated
     int32_t n_prompt_tokens           = 0;
     int32_t n_prompt_tokens_processed = 0;
@@ -1288,8 +1347,17 @@ struct server_slot {
     llama_tokens generated_tokens;
     common_chat_msg chat_msg;
 
+    // converts the generated tokens to complete UTF-8 characters
+    llama_detokenizer_ptr detok;
+
+    // the stop strings of the task, fed with the generated text
+    common_stop_matcher stop_matcher;
+
     server_tokens cache_tokens;
 
+    // the KV state of cache_tokens is already in the prompt cache (saved when the slot was preempted)
+    bool prompt_cache_saved = false;
+
     std::vector<completion_token_output> generated_token_probs;
 
     bool has_next_token = true;
@@ -1336,12 +1404,18 @@ struct server_slot {
         stopping_word      = "";
         n_past             = 0;
         n_sent_text        = 0;
+        n_decoded_prev     = 0;
         task_type          = SERVER_TASK_TYPE_COMPLETION;
         chat_format        = COMMON_CHAT_FORMAT_CONTENT_ONLY;
 
+        prompt_prev          = "";
+        n_prompt_tokens_prev = -1;
+
         generated_tokens.clear();
         generated_token_probs.clear();
         chat_msg = {};
+        llama_detokenizer_reset(detok.get());
+        stop_matcher = {};
         json_schema = json();
         generated_tool_call_ids.clear();
 
@@ -1390,6 +1464,15 @@ struct server_slot {
         return state != SLOT_STATE_IDLE;
     }
 
+    // the prompt of the request - the prompt_tokens of a resumed task also contain the tokens generated before it was preempted
+    std::string get_prompt() const {
+        return n_prompt_tokens_prev >= 0 ? prompt_prev : prompt_tokens.detokenize(ctx, true);
+    }
+
+    int32_t get_n_prompt_tokens() const {
+        return n_prompt_tokens_prev >= 0 ? n_prompt_tokens_prev : n_prompt_tokens;
+    }
+
     bool can_speculate() const {
         return ctx_dft && params.speculative.n_max > 0 && params.cache_prompt;
     }
@@ -1449,35 +1532,6 @@ struct server_slot {
         return chat_msg;
     }
 
-    size_t find_stopping_strings(const std::string & text, const size_t last_token_size, bool is_full_stop) {
-        size_t stop_pos = std::string::npos;
-
-        for (const std::string & word : params.antiprompt) {
-            size_t pos;
-
-            if (is_full_stop) {
-                const size_t tmp      = word.size() + last_token_size;
-                const size_t from_pos = text.size() > tmp ? text.size() - tmp : 0;
-
-                pos = text.find(word, from_pos);
-            } else {
-                // otherwise, partial stop
-                pos = string_find_partial_stop(text, word);
-            }
-
-            if (pos != std::string::npos && (stop_pos == std::string::npos || pos < stop_pos)) {
-                if (is_full_stop) {
-                    stop           = STOP_TYPE_WORD;
-                    stopping_word  = word;
-                    has_next_token = false;
-                }
-                stop_pos = pos;
-            }
-        }
-
-        return stop_pos;
-    }
-
     void print_timings() const {
         const double t_prompt        =       t_prompt_processing / n_prompt_tokens_processed;
         const double n_prompt_second = 1e3 / t_prompt_processing * n_prompt_tokens_processed;
@@ -1635,10 +1689,15 @@ struct server_queue {
     }
 
     // Add a new task, but defer until one slot is available
-    void defer(server_task && task) {
+    // the deferred tasks are ordered by priority, then by arrival (front = first within its priority class)
+    void defer(server_task && task, bool front = false) {
         std::unique_lock<std::mutex> lock(mutex_tasks);
-        QUE_DBG("defer task, id = %d\n", task.id);
-        queue_tasks_deferred.push_back(std::move(task));
+        QUE_DBG("defer task, id = %d, priority = %s, front = %d\n", task.id, server_task_priority_to_str(task.params.priority), front);
+        const auto priority = task.params.priority;
+        auto it = std::find_if(queue_tasks_deferred.begin(), queue_tasks_deferred.end(), [&](const server_task & other) {
+            return front ? other.params.priority >= priority : other.params.priority > priority;
+        });
+        queue_tasks_deferred.insert(it, std::move(task));
         condition_tasks.notify_one();
     }
 
@@ -1914,6 +1973,16 @@ struct server_context {
     // Necessary similarity of prompt for slot selection
     float slot_prompt_similarity = 0.0f;
 
+    // the slot that is offered the prompt budget first, rotated every iteration
+    size_t i_slot_prompt = 0;
+
+    // cached prompt prefixes of all slots, used to attach a prefix computed by another slot
+    bool kv_prefix_share = false;
+    server_prefix_tree prefix_tree;
+
+    // KV state of prompts evicted from slots, kept in host memory
+    server_prompt_cache prompt_cache;
+
     common_chat_templates_ptr chat_templates;
     oaicompat_parser_options  oai_parser_opt;
 
@@ -2047,6 +2116,27 @@ struct server_context {
             }
         }
 
+        if (params_base.kv_prefix_share) {
+            // note: a slot that shifts its shared cells (context shift, cache reuse) gets private copies of them
+            if (mctx) {
+                SRV_WRN("%s\n", "kv_prefix_share is not supported by multimodal, it will be disabled");
+            } else if (!llama_get_memory(ctx) || !llama_memory_can_shift(llama_get_memory(ctx))) {
+                SRV_WRN("%s\n", "kv_prefix_share is not supported by this context, it will be disabled");
+            } else {
+                kv_prefix_share = true;
+            }
+        }
+
+        if (params_base.cache_ram_mib > 0) {
+            if (mctx) {
+                SRV_WRN("%s\n", "cache_ram is not supported by multimodal, it will be disabled");
+            } else if (!llama_get_memory(ctx)) {
+                SRV_WRN("%s\n", "cache_ram is not supported by this context, it will be disabled");
+            } else {
+                prompt_cache.limit_size = (size_t) params_base.cache_ram_mib * 1024 * 1024;
+            }
+        }
+
         return true;
     }
 
@@ -2064,6 +2154,7 @@ struct server_context {
             slot.n_predict = params_base.n_predict;
             slot.mctx = mctx;
             slot.cache_tokens.has_mtmd = mctx != nullptr;
+            slot.detok.reset(llama_detokenizer_init(vocab));
 
             if (model_dft) {
                 slot.batch_spec = llama_batch_init(params_base.speculative.n_max + 1, 0, 1);
@@ -2086,7 +2177,10 @@ struct server_context {
             slot.params.sampling = params_base.sampling;
             slot.params.n_keep = params_base.n_keep;
 
-            slot.callback_on_release = [this](int) {
+            slot.callback_on_release = [this](int id_slot) {
+                // the KV cache of the slot now holds exactly its cached tokens
+                prefix_tree_update(slots[id_slot]);
+
                 queue_tasks.pop_deferred_task();
             };
 
@@ -2128,6 +2222,239 @@ struct server_context {
         return nullptr;
     }
 
+    void prefix_tree_update(const server_slot & slot) {
+        if (!kv_prefix_share) {
+            return;
+        }
+
+        prefix_tree.insert(slot.id, slot.cache_tokens.get_text_tokens());
+    }
+
+    // attach the longest cached prefix of the prompt that is held by another slot, if it is longer than n_past
+    void prefix_tree_attach(server_slot & slot) {
+        const llama_tokens & tokens = slot.prompt_tokens.get_text_tokens();
+
+        llama_seq_id id_src = -1;
+        const int n_shared = (int) prefix_tree.find(tokens, [&](llama_seq_id id) {
+            return id != slot.id && are_lora_equal(slots[id].lora, slot.lora);
+        }, id_src);
+
+        if (n_shared <= slot.n_past) {
+            return;
+        }
+
+        llama_memory_t mem = llama_get_memory(ctx);
+
+        // with SWA, the source may no longer hold the cells needed to continue from the shared prefix
+        const auto n_swa = llama_model_n_swa(model);
+        if (llama_memory_seq_pos_min(mem, id_src) > std::max(0, n_shared - n_swa)) {
+            return;
+        }
+
+        SLT_INF(slot, "attaching %d cached prompt tokens from slot %d, n_past = %d\n", n_shared, id_src, slot.n_past);
+
+        llama_memory_seq_rm(mem, slot.id, -1, -1);
+        llama_memory_seq_cp(mem, id_src, slot.id, -1, n_shared);
+
+        slot.cache_tokens.clear();
+        slot.cache_tokens.insert({ tokens.begin(), tokens.begin() + n_shared });
+
+        prefix_tree_update(slot);
+
+        slot.n_past = n_shared;
+    }
+
+    // move the KV state of the slot to the host-memory prompt cache
+    void prompt_cache_save(const server_slot & slot) {
+        const int64_t t_start = ggml_time_us();
+
+        const size_t n_bytes = llama_state_seq_get_size(ctx, slot.id);
+        if (n_bytes > prompt_cache.limit_size) {
+            SLT_WRN(slot, "state of %zu bytes does not fit in the prompt cache, limit = %zu bytes\n", n_bytes, prompt_cache.limit_size);
+            return;
+        }
+
+        std::vector<uint8_t> data(n_bytes);
+        if (llama_state_seq_get_data(ctx, data.data(), data.size(), slot.id) != n_bytes) {
+            SLT_WRN(slot, "%s", "failed to get the state of the slot\n");
+            return;
+        }
+
+        llama_tokens tokens = slot.cache_tokens.get_text_tokens(); // copy
+
+        prompt_cache.put(std::move(tokens), std::move(data), slot.lora);
+
+        SLT_INF(slot, "saved %zu tokens to the prompt cache in %.3f ms, n_entries = %zu, size = %.3f MiB\n",
+                slot.cache_tokens.size(), (ggml_time_us() - t_start) / 1e3, prompt_cache.n_entries(), prompt_cache.size() / (1024.0 * 1024.0));
+    }
+
+    // keep the prompt of the slot in host memory if most of it is about to be discarded, and restore
+    // an evicted prompt if it has a longer common prefix with the new prompt than the one in the slot
+    void prompt_cache_update(server_slot & slot) {
+        const llama_tokens & tokens = slot.prompt_tokens.get_text_tokens();
+
+        size_t n_common = 0;
+        auto it = prompt_cache.find(tokens, slot.lora, slot.n_past, n_common);
+
+        // take the entry out of the pool first, saving the slot can evict it
+        const bool found = it != prompt_cache.end();
+
+        server_prompt_cache::entry entry;
+        if (found) {
+            entry = prompt_cache.take(it);
+        }
+
+        if (2*slot.n_past < (int) slot.cache_tokens.size() && !slot.prompt_cache_saved) {
+            prompt_cache_save(slot);
+        }
+
+        if (!found) {
+            return;
+        }
+
+        const int64_t t_start = ggml_time_us();
+
+        if (llama_state_seq_set_data(ctx, entry.data.data(), entry.data.size(), slot.id) == 0) {
+            SLT_WRN(slot, "%s", "failed to restore the state from the prompt cache\n");
+
+            llama_memory_seq_rm(llama_get_memory(ctx), slot.id, -1, -1);
+            slot.cache_tokens.clear();
+            prefix_tree.remove(slot.id);
+
+            slot.n_past = 0;
+            return;
+        }
+
+        slot.cache_tokens.clear();
+        slot.cache_tokens.insert(entry.tokens);
+
+        prefix_tree_update(slot);
+
+        slot.n_past = n_common;
+
+        SLT_INF(slot, "restored %zu tokens from the prompt cache in %.3f ms, n_past = %d\n",
+                entry.tokens.size(), (ggml_time_us() - t_start) / 1e3, slot.n_past);
+    }
+
+    int n_slots_processing(server_task_priority priority) const {
+        int n = 0;
+
+        for (const server_slot & slot : slots) {
+            if (slot.is_processing() && slot.params.priority == priority) {
+                n++;
+            }
+        }
+
+        return n;
+    }
+
+    // free a slot that is processing a batch task for an interactive task
+    // the KV state of the batch task goes to the prompt cache (if enabled) and the task is deferred, to be resumed
+    // from its prompt and the tokens generated so far
+    // returns nullptr if no slot can be preempted
+    server_slot * preempt_slot() {
+        server_slot * ret = nullptr;
+
+        for (server_slot & slot : slots) {
+            if (slot.params.priority != SERVER_TASK_PRIORITY_BATCH) {
+                continue;
+            }
+
+            // only completions are resumable, and the grammar state cannot be restored from the tokens
+            if (slot.task_type != SERVER_TASK_TYPE_COMPLETION && slot.task_type != SERVER_TASK_TYPE_INFILL) {
+                continue;
+            }
+
+            if (!slot.params.sampling.grammar.empty() || mctx) {
+                continue;
+            }
+
+            if (slot.state != SLOT_STATE_STARTED && slot.state != SLOT_STATE_PROCESSING_PROMPT && slot.state != SLOT_STATE_GENERATING) {
+                continue;
+            }
+
+            // a task that did not start processing loses nothing
+            if (slot.state == SLOT_STATE_STARTED) {
+                ret = &slot;
+                break;
+            }
+
+            // without the prompt cache, the KV state of the task would have to be recomputed when it is resumed
+            if (!prompt_cache.enabled()) {
+                continue;
+            }
+
+            // otherwise, preempt the task that started last
+            if (!ret || slot.t_start_process_prompt > ret->t_start_process_prompt) {
+                ret = &slot;
+            }
+        }
+
+        if (ret == nullptr) {
+            return nullptr;
+        }
+
+        server_slot & slot = *ret;
+
+        server_task task(slot.task_type);
+
+        task.id     = slot.id_task;
+        task.index  = slot.index;
+        task.params = slot.params;
+
+        if (slot.state == SLOT_STATE_GENERATING) {
+            // continue from the prompt and the generated tokens - the last sampled token is not in the cache yet
+            llama_tokens tokens = slot.cache_tokens.get_text_tokens(); // copy
+            tokens.push_back(slot.sampled);
+
+            task.prompt_tokens = server_tokens(tokens, false);
+
+            const int32_t n_predict = slot.params.n_predict != -1 ? slot.params.n_predict : params_base.n_predict;
+            if (n_predict != -1) {
+                task.params.n_predict = std::max(1, n_predict - slot.n_decoded);
+            }
+
+            task.resume = std::make_shared<server_task_resume>();
+
+            // the bytes of an incomplete character are kept in the text, the next token completes them
+            common_detokenizer_flush(slot.detok.get(), slot.generated_text);
+
+            task.resume->generated_text          = std::move(slot.generated_text);
+            task.resume->generated_tokens        = std::move(slot.generated_tokens);
+            task.resume->chat_msg                = std::move(slot.chat_msg);
+            task.resume->generated_token_probs   = std::move(slot.generated_token_probs);
+            task.resume->generated_tool_call_ids = std::move(slot.generated_tool_call_ids);
+            task.resume->n_sent_text             = slot.n_sent_text;
+            task.resume->last_nl_pos             = slot.last_nl_pos;
+            task.resume->has_new_line            = slot.has_new_line;
+            task.resume->n_decoded               = slot.n_decoded_prev + slot.n_decoded;
+            task.resume->prompt                  = slot.get_prompt();
+            task.resume->n_prompt_tokens         = slot.get_n_prompt_tokens();
+        } else {
+            task.prompt_tokens = std::move(slot.prompt_tokens);
+        }
+
+        SLT_INF(slot, "preempting batch task %d, state = %d, n_past = %d, n_decoded = %d\n", slot.id_task, (int) slot.state, slot.n_past, slot.n_decoded);
+
+        if (prompt_cache.enabled() && !slot.cache_tokens.empty()) {
+            prompt_cache_save(slot);
+
+            // the next task of the slot does not save the state again in prompt_cache_update()
+            slot.prompt_cache_saved = true;
+        }
+
+        // the slot is free without a response, the task continues when it is resumed
+        slot.t_last_used = ggml_time_us();
+        slot.state       = SLOT_STATE_IDLE;
+        slot.i_batch     = -1;
+
+        prefix_tree_update(slot);
+
+        queue_tasks.defer(std::move(task), true);
+
+        return &slot;
+    }
+
     server_slot * get_available_slot(const server_task & task) {
         server_slot * ret = nullptr;
 
@@ -2199,6 +2526,27 @@ struct server_context {
         slot.params        = std::move(task.params);
         slot.prompt_tokens = std::move(task.prompt_tokens);
 
+        if (task.resume) {
+            // continue the output of a preempted task
+            slot.generated_text          = std::move(task.resume->generated_text);
+            slot.generated_tokens        = std::move(task.resume->generated_tokens);
+            slot.chat_msg                = std::move(task.resume->chat_msg);
+            slot.generated_token_probs   = std::move(task.resume->generated_token_probs);
+            slot.generated_tool_call_ids = std::move(task.resume->generated_tool_call_ids);
+            slot.n_sent_text             = task.resume->n_sent_text;
+            slot.last_nl_pos             = task.resume->last_nl_pos;
+            slot.has_new_line            = task.resume->has_new_line;
+            slot.n_decoded_prev          = task.resume->n_decoded;
+            slot.prompt_prev             = std::move(task.resume->prompt);
+            slot.n_prompt_tokens_prev    = task.resume->n_prompt_tokens;
+        }
+
+        slot.stop_matcher = common_stop_matcher(slot.params.antiprompt);
+        if (slot.n_sent_text < slot.generated_text.size()) {
+            // the held back text can be the start of a stop string
+            slot.stop_matcher.feed(std::string_view(slot.generated_text).substr(slot.n_sent_text));
+        }
+
         if (!are_lora_equal(slot.params.lora, slot.lora)) {
             // if lora is changed, we cannot reuse cached tokens
             slot.cache_tokens.clear();
@@ -2253,6 +2601,12 @@ struct server_context {
         // clear the entire KV cache
         llama_memory_clear(llama_get_memory(ctx), true);
         clean_kv_cache = false;
+
+        prefix_tree.clear();
+    }
+
+    bool accept_special_token(const server_slot & slot, llama_token token) const {
+        return params_base.special || slot.params.sampling.preserved_tokens.find(token) != slot.params.sampling.preserved_tokens.end();
     }
 
     bool process_token(completion_token_output & result, server_slot & slot) {
@@ -2260,36 +2614,35 @@ struct server_context {
         const std::string token_str = result.text_to_send;
         slot.sampled = result.tok;
 
-        slot.generated_text += token_str;
+        // only complete UTF-8 characters are added to the text, the detokenizer holds the bytes of an incomplete one
+        const size_t n_text = slot.generated_text.size();
+        common_detokenizer_push(slot.detok.get(), result.tok, accept_special_token(slot, result.tok), slot.generated_text);
+
         if (slot.params.return_tokens) {
             slot.generated_tokens.push_back(result.tok);
         }
         slot.has_next_token = true;
 
-        // check if there is incomplete UTF-8 character at the end
-        bool incomplete = validate_utf8(slot.generated_text) < slot.generated_text.size();
+        const bool incomplete = llama_detokenizer_n_pending(slot.detok.get()) > 0;
 
         // search stop word and delete it
-        if (!incomplete) {
-            size_t pos = std::min(slot.n_sent_text, slot.generated_text.size());
-
-            const std::string str_test = slot.generated_text.substr(pos);
-            bool send_text = true;
-
-            size_t stop_pos = slot.find_stopping_strings(str_test, token_str.size(), true);
-            if (stop_pos != std::string::npos) {
-                slot.generated_text.erase(
-                    slot.generated_text.begin() + pos + stop_pos,
-                    slot.generated_text.end());
-                pos = std::min(slot.n_sent_text, slot.generated_text.size());
-            } else if (slot.has_next_token) {
-                stop_pos = slot.find_stopping_strings(str_test, token_str.size(), false);
-                send_text = stop_pos == std::string::npos;
-            }
+        const auto match = slot.stop_matcher.feed(std::string_view(slot.generated_text).substr(n_text));
+        if (match.word >= 0) {
+            const std::string & word = slot.stop_matcher.get_words()[match.word];
+
+            slot.stop           = STOP_TYPE_WORD;
+            slot.stopping_word  = word;
+            slot.has_next_token = false;
+
+            slot.generated_text.erase(n_text + match.end - word.size());
+            llama_detokenizer_reset(slot.detok.get());
+        }
+
+        if (match.word >= 0 || !incomplete) {
+            const size_t pos = std::min(slot.n_sent_text, slot.generated_text.size());
 
-            // check if there is any token to predict
-            if (send_text) {
-                // no send the stop word in the response
+            // do not send the text that can be the start of a stop word
+            if (match.word >= 0 || slot.stop_matcher.n_partial() == 0) {
                 result.text_to_send = slot.generated_text.substr(pos, std::string::npos);
                 slot.n_sent_text += result.text_to_send.size();
                 // add the token to slot queue and cache
@@ -2303,10 +2656,6 @@ struct server_context {
             }
         }
 
-        if (incomplete) {
-            slot.has_next_token = true;
-        }
-
         // if context shifting is disabled, make sure that we don't run out of context
         if (!params_base.ctx_shift && slot.n_past + 1 >= slot.n_ctx) {
             slot.stop           = STOP_TYPE_LIMIT;
@@ -2343,6 +2692,7 @@ struct server_context {
 
                         // cut the last line
                         slot.generated_text.erase(pos, std::string::npos);
+                        llama_detokenizer_reset(slot.detok.get());
 
                         SLT_DBG(slot, "stopped by indentation limit, n_decoded = %d, n_indent = %d\n", slot.n_decoded, n_indent);
                     }
@@ -2404,6 +2754,11 @@ struct server_context {
 
         SLT_DBG(slot, "n_decoded = %d, n_remaining = %d, next token: %5d '%s'\n", slot.n_decoded, slot.n_remaining, result.tok, token_str.c_str());
 
+        if (!slot.has_next_token) {
+            // the final text keeps the bytes of an incomplete character
+            common_detokenizer_flush(slot.detok.get(), slot.generated_text);
+        }
+
         return slot.has_next_token; // continue
     }
 
@@ -2492,8 +2847,8 @@ struct server_context {
         res->content = tkn.text_to_send;
         res->tokens  = { tkn.tok };
 
-        res->n_decoded           = slot.n_decoded;
-        res->n_prompt_tokens     = slot.n_prompt_tokens;
+        res->n_decoded           = slot.n_decoded_prev + slot.n_decoded;
+        res->n_prompt_tokens     = slot.get_n_prompt_tokens();
         res->post_sampling_probs = slot.params.post_sampling_probs;
 
         res->verbose               = slot.params.verbose;
@@ -2525,12 +2880,12 @@ struct server_context {
         res->content         = slot.generated_text;
         res->tokens          = std::move(slot.generated_tokens);
         res->timings         = slot.get_timings();
-        res->prompt          = slot.prompt_tokens.detokenize(ctx, true);
+        res->prompt          = slot.get_prompt();
         res->response_fields = std::move(slot.params.response_fields);
 
         res->truncated           = slot.truncated;
-        res->n_decoded           = slot.n_decoded;
-        res->n_prompt_tokens     = slot.n_prompt_tokens;
+        res->n_decoded           = slot.n_decoded_prev + slot.n_decoded;
+        res->n_prompt_tokens     = slot.get_n_prompt_tokens();
         res->n_tokens_cached     = slot.n_past;
         res->has_new_line        = slot.has_new_line;
         res->stopping_word       = slot.stopping_word;
@@ -2751,8 +3106,19 @@ struct server_context {
                 {
                     const int id_slot = task.id_selected_slot;
 
+                    if (task.params.priority == SERVER_TASK_PRIORITY_BATCH && params_base.n_parallel_batch > 0 &&
+                        n_slots_processing(SERVER_TASK_PRIORITY_BATCH) >= params_base.n_parallel_batch) {
+                        SRV_DBG("too many batch tasks are processing, defer task, id_task = %d\n", task.id);
+                        queue_tasks.defer(std::move(task));
+                        break;
+                    }
+
                     server_slot * slot = id_slot != -1 ? get_slot_by_id(id_slot) : get_available_slot(task);
 
+                    if (slot == nullptr && task.params.priority == SERVER_TASK_PRIORITY_INTERACTIVE) {
+                        slot = preempt_slot();
+                    }
+
                     if (slot == nullptr) {
                         // if no slot is available, we defer this task for processing later
                         SRV_DBG("no slot is available, defer task, id_task = %d\n", task.id);
@@ -2900,12 +3266,14 @@ struct server_context {
                     size_t nread = llama_state_seq_load_file(ctx, filepath.c_str(), slot->id, tokens.data(), tokens.size(), &token_count);
                     if (nread == 0) {
                         slot->cache_tokens.clear(); // KV may already been invalidated?
+                        prefix_tree.remove(slot->id);
                         send_error(task, "Unable to restore slot, no available space in KV cache or invalid slot save file", ERROR_TYPE_INVALID_REQUEST);
                         break;
                     }
                     tokens.resize(token_count);
                     slot->cache_tokens.clear();
                     slot->cache_tokens.insert(tokens);
+                    prefix_tree_update(*slot);
 
                     const int64_t t_end = ggml_time_us();
                     const double t_restore_ms = (t_end - t_start) / 1000.0;
@@ -2940,6 +3308,7 @@ struct server_context {
                     const size_t n_erased = slot->cache_tokens.size();
                     llama_memory_seq_rm(llama_get_memory(ctx), slot->id, -1, -1);
                     slot->cache_tokens.clear();
+                    prefix_tree.remove(slot->id);
 
                     auto res = std::make_unique<server_task_result_slot_erase>();
                     res->id       = task.id;
@@ -3014,7 +3383,17 @@ struct server_context {
                 SLT_WRN(slot, "slot context shift, n_keep = %d, n_left = %d, n_discard = %d\n", n_keep, n_left, n_discard);
 
                 llama_memory_seq_rm (llama_get_memory(ctx), slot.id, n_keep            , n_keep + n_discard);
-                llama_memory_seq_add(llama_get_memory(ctx), slot.id, n_keep + n_discard, slot.n_past,        -n_discard);
+
+                if (!llama_memory_seq_add(llama_get_memory(ctx), slot.id, n_keep + n_discard, slot.n_past, -n_discard)) {
+                    // the cells shared with other slots could not be copied - the positions of the slot are not consistent
+                    llama_memory_seq_rm(llama_get_memory(ctx), slot.id, -1, -1);
+                    slot.cache_tokens.clear();
+                    prefix_tree.remove(slot.id);
+
+                    slot.release();
+                    send_error(slot, "failed to shift the context: not enough free KV cells", ERROR_TYPE_SERVER);
+                    continue;
+                }
 
                 // add generated tokens to cache
                 {
@@ -3028,6 +3407,8 @@ struct server_context {
                     slot.cache_tokens.insert(new_tokens);
                 }
 
+                prefix_tree_update(slot);
+
                 slot.n_past -= n_discard;
 
                 slot.truncated = true;
@@ -3040,10 +3421,6 @@ struct server_context {
         // track if given slot can be batched with slots already in the batch
         server_slot * slot_batched = nullptr;
 
-        auto accept_special_token = [&](server_slot & slot, llama_token token) {
-            return params_base.special || slot.params.sampling.preserved_tokens.find(token) != slot.params.sampling.preserved_tokens.end();
-        };
-
         // frist, add sampled tokens from any ongoing sequences
         for (auto & slot : slots) {
             if (slot.state != SLOT_STATE_GENERATING) {
@@ -3072,9 +3449,31 @@ struct server_context {
         int32_t n_batch  = llama_n_batch(ctx);
         int32_t n_ubatch = llama_n_ubatch(ctx);
 
+        // while slots are generating, limit the size of the batch so that a large prompt does not stall their tokens
+        // the prompts fill the remainder, but always make some progress
+        int32_t n_batch_max = n_batch;
+        if (batch.n_tokens > 0 && params_base.n_batch_budget > 0) {
+            n_batch_max = std::min(n_batch, std::max(params_base.n_batch_budget, batch.n_tokens + 1));
+        }
+
+        // split the prompt tokens fairly between the slots that are processing a prompt
+        int32_t n_prompt_left = n_batch_max - batch.n_tokens;
+        int32_t n_slots_left  = 0;
+
+        for (const auto & slot : slots) {
+            if (slot.state == SLOT_STATE_PROCESSING_PROMPT || slot.state == SLOT_STATE_STARTED) {
+                n_slots_left++;
+            }
+        }
+
         // next, batch any pending prompts without exceeding n_batch
         if (params_base.cont_batching || batch.n_tokens == 0) {
-            for (auto & slot : slots) {
+            // start from a different slot each iteration, so that the rounding of the shares does not favor any slot
+            const size_t i_slot_first = i_slot_prompt++ % slots.size();
+
+            for (size_t i_slot = 0; i_slot < slots.size(); ++i_slot) {
+                auto & slot = slots[(i_slot_first + i_slot) % slots.size()];
+
                 // check if we can batch this slot with the previous one
                 if (slot.is_processing()) {
                     if (!slot_batched) {
@@ -3088,6 +3487,13 @@ struct server_context {
                 if (slot.state == SLOT_STATE_PROCESSING_PROMPT || slot.state == SLOT_STATE_STARTED) {
                     auto & prompt_tokens = slot.prompt_tokens;
 
+                    // the share of this slot from the remaining prompt budget (rounded up)
+                    // note: a prompt that cannot be split is processed entirely
+                    const int32_t n_share = slot.can_split() ? (n_prompt_left + n_slots_left - 1)/n_slots_left : n_batch;
+                    const int32_t n_tokens_max = std::min(n_batch, batch.n_tokens + n_share);
+
+                    n_slots_left--;
+
                     // TODO: maybe move branch to outside of this loop in the future
                     if (slot.state == SLOT_STATE_STARTED) {
                         slot.t_start_process_prompt = ggml_time_us();
@@ -3193,6 +3599,16 @@ struct server_context {
                                 // reuse any previously computed tokens that are common with the new prompt
                                 slot.n_past = slot.cache_tokens.get_common_prefix(prompt_tokens);
 
+                                // a longer prefix may be held by a prompt evicted to host memory
+                                if (prompt_cache.enabled()) {
+                                    prompt_cache_update(slot);
+                                }
+
+                                // a longer prefix may have been computed by another slot
+                                if (kv_prefix_share) {
+                                    prefix_tree_attach(slot);
+                                }
+
                                 // reuse chunks from the cached prompt by shifting their KV cache in the new position
                                 if (params_base.n_cache_reuse > 0) {
                                     size_t head_c = slot.n_past; // cache
@@ -3225,7 +3641,12 @@ struct server_context {
                                             const int64_t kv_shift = (int64_t) head_p - (int64_t) head_c;
 
                                             llama_memory_seq_rm (llama_get_memory(ctx), slot.id, head_p, head_c);
-                                            llama_memory_seq_add(llama_get_memory(ctx), slot.id, head_c, head_c + n_match, kv_shift);
+
+                                            if (!llama_memory_seq_add(llama_get_memory(ctx), slot.id, head_c, head_c + n_match, kv_shift)) {
+                                                // the rest of the cache is removed from slot.n_past below
+                                                SLT_WRN(slot, "%s", "failed to shift the KV cache chunk, stopping the cache reuse\n");
+                                                break;
+                                            }
 
                                             for (size_t i = 0; i < n_match; i++) {
                                                 slot.cache_tokens.set_token(head_p + i, slot.cache_tokens[head_c + i]);
@@ -3240,6 +3661,8 @@ struct server_context {
                                     }
 
                                     SLT_DBG(slot, "after context reuse, new slot.n_past = %d\n", slot.n_past);
+
+                                    prefix_tree_update(slot);
                                 }
                             } else {
                                 // if we don't cache the prompt, we have to remove the entire KV cache
@@ -3292,6 +3715,9 @@ struct server_context {
 
                     // remove the non-common part from the cache
                     slot.cache_tokens.keep_first(slot.n_past);
+                    prefix_tree.keep_first(slot.id, slot.n_past);
+
+                    slot.prompt_cache_saved = false;
 
                     // check if we should process the image
                     if (slot.n_past < slot.n_prompt_tokens && slot.prompt_tokens[slot.n_past] == LLAMA_TOKEN_NULL) {
@@ -3317,8 +3743,10 @@ struct server_context {
                         slot.n_prompt_tokens_processed += n_pos;
                     }
 
+                    const int32_t n_tokens_prev = batch.n_tokens;
+
                     // add prompt tokens for processing in the current batch
-                    while (slot.n_past < slot.n_prompt_tokens && batch.n_tokens < n_batch) {
+                    while (slot.n_past < slot.n_prompt_tokens && batch.n_tokens < n_tokens_max) {
                         // get next token to process
                         llama_token cur_tok = slot.prompt_tokens[slot.n_past];
                         if (cur_tok == LLAMA_TOKEN_NULL) {
@@ -3335,6 +3763,8 @@ struct server_context {
                         slot.n_past++;
                     }
 
+                    n_prompt_left -= batch.n_tokens - n_tokens_prev;
+
                     // SLT_INF(slot, "new cache_tokens: %s\n", slot.cache_tokens.str().c_str());
 
                     SLT_INF(slot, "prompt processing progress, n_past = %d, n_tokens = %d, progress = %f\n", slot.n_past, batch.n_tokens, (float) slot.n_prompt_tokens_processed / slot.n_prompt_tokens);
@@ -3366,7 +3796,7 @@ struct server_context {
                     }
                 }
 
-                if (batch.n_tokens >= n_batch) {
+                if (batch.n_tokens >= n_batch_max) {
                     break;
                 }
             }
@@ -3430,6 +3860,9 @@ struct server_context {
                         for (auto & slot : slots) {
                             slot.release();
                             send_error(slot, err);
+
+                            // the KV cache of the slot is in an unknown state
+                            prefix_tree.remove(slot.id);
                         }
                         break;
                     }
@@ -3449,6 +3882,11 @@ struct server_context {
             // on successful decode, restore the original batch size
             n_batch = llama_n_batch(ctx);
 
+            // the slots that sample a token from this view of the batch
+            std::vector<server_slot *>    slots_sample;
+            std::vector<common_sampler *> smpls_sample;
+            std::vector<int>              idxs_sample;
+
             for (auto & slot : slots) {
                 if (slot.i_batch < (int) i || slot.i_batch >= (int) (i + n_tokens)) {
                     continue; // continue loop of slots
@@ -3472,13 +3910,27 @@ struct server_context {
 
                     // prompt evaluated for next-token prediction
                     slot.state = SLOT_STATE_GENERATING;
+
+                    // the prompt is now in the KV cache and can be shared with other slots
+                    prefix_tree_update(slot);
                 } else if (slot.state != SLOT_STATE_GENERATING) {
                     continue; // continue loop of slots
                 }
 
-                const int tok_idx = slot.i_batch - i;
+                slots_sample.push_back(&slot);
+                smpls_sample.push_back(slot.smpl);
+                idxs_sample .push_back(slot.i_batch - i);
+            }
+
+            // the samplers of the slots are independent, so they can run in parallel
+            const auto ids = common_sampler_sample_batch(smpls_sample, ctx, idxs_sample, params_base.cpuparams.n_threads);
+
+            for (size_t is = 0; is < slots_sample.size(); ++is) {
+                auto & slot = *slots_sample[is];
+
+                const int tok_idx = idxs_sample[is];
 
-                llama_token id = common_sampler_sample(slot.smpl, ctx, tok_idx);
+                llama_token id = ids[is];
 
                 slot.i_batch = -1;
 
@@ -3633,6 +4085,13 @@ struct server_context {
     }
 };
 
+// the priority of a completion can also be set with the X-Priority header, the JSON field takes precedence
+static void priority_from_header(const httplib::Request & req, json & data) {
+    if (req.has_header("X-Priority") && !data.contains("priority")) {
+        data["priority"] = req.get_header_value("X-Priority");
+    }
+}
+
 static void log_server_request(const httplib::Request & req, const httplib::Response & res) {
     // skip GH copilot requests when using default port
     if (req.path == "/v1/health" || req.path == "/v1/completions") {
@@ -4333,6 +4792,7 @@ int main(int argc, char ** argv) {
 
     const auto handle_completions = [&handle_completions_impl](const httplib::Request & req, httplib::Response & res) {
         json data = json::parse(req.body);
+        priority_from_header(req, data);
         std::vector<raw_buffer> files; // dummy
         handle_completions_impl(
             SERVER_TASK_TYPE_COMPLETION,
@@ -4345,6 +4805,7 @@ int main(int argc, char ** argv) {
 
     const auto handle_completions_oai = [&handle_completions_impl](const httplib::Request & req, httplib::Response & res) {
         json data = oaicompat_completion_params_parse(json::parse(req.body));
+        priority_from_header(req, data);
         std::vector<raw_buffer> files; // dummy
         handle_completions_impl(
             SERVER_TASK_TYPE_COMPLETION,
@@ -4373,6 +4834,7 @@ int main(int argc, char ** argv) {
         }
 
         json data = json::parse(req.body);
+        priority_from_header(req, data);
 
         // validate input
         if (data.contains("prompt") && !data.at("prompt").is_string()) {
@@ -4443,6 +4905,7 @@ int main(int argc, char ** argv) {
             body,
             ctx_server.oai_parser_opt,
             files);
+        priority_from_header(req, data);
 
         handle_completions_impl(
             SERVER_TASK_TYPE_COMPLETION,
@@ -0,0 +1,95 @@
+import pytest
+import requests
+from utils import *
+
+server = ServerPreset.tinyllama2()
+
+BATCH_BUDGET = 8
+
+LONG_PROMPT = (
+    "Once upon a time, there was a little girl named Lily. She loved to play outside in the park with her friends. "
+    "One day, she found a big red ball under a tree. She wanted to show it to her mom, so she ran home as fast as she could. "
+    "Her mom was very happy and gave her a big hug. Then they went to the park together and played with the ball all day long. "
+    "When the sun went down, they walked home and ate a yummy dinner."
+)
+
+
+@pytest.fixture(scope="module", autouse=True)
+def create_server():
+    global server
+    server = ServerPreset.tinyllama2()
+    server.n_ctx = 2048
+    server.n_slots = 2
+    server.n_predict = None
+    server.server_continuous_batching = True
+    server.server_metrics = True
+    server.batch_budget = BATCH_BUDGET
+    server.temperature = 0.0
+
+
+def get_metrics() -> dict[str, float]:
+    res = requests.get(f"http://{server.server_host}:{server.server_port}/metrics")
+    assert res.status_code == 200
+    metrics = {}
+    for line in res.text.splitlines():
+        if line.startswith("llamacpp:"):
+            name, value = line.split(" ")
+            metrics[name[len("llamacpp:"):]] = float(value)
+    return metrics
+
+
+# the number of decodes in which both slots were busy
+def get_n_decode_two_slots(metrics: dict[str, float]) -> int:
+    n_decode = metrics["n_decode_total"]
+    n_busy_slots = round(metrics["n_busy_slots_per_decode"] * n_decode)
+    return n_busy_slots - round(n_decode)
+
+
+def test_prompt_split_while_generating():
+    global server
+    server.start()
+
+    data = {
+        "prompt": LONG_PROMPT,
+        "n_predict": 8,
+        "cache_prompt": False,
+    }
+
+    # reference: the prompt processed alone, in one batch of n_batch tokens
+    res = server.make_request("POST", "/completion", data=data)
+    assert res.status_code == 200
+    content = res.body["content"]
+    n_prompt = res.body["timings"]["prompt_n"]
+    assert n_prompt > 4 * BATCH_BUDGET
+
+    # another slot is generating while the same prompt is processed
+    stream = server.make_stream_request("POST", "/completion", data={
+        "prompt": "Hello",
+        "n_predict": 900,
+        "ignore_eos": True,
+        "stream": True,
+    })
+    assert next(stream)["content"] is not None
+
+    metrics_before = get_metrics()
+
+    res = server.make_request("POST", "/completion", data=data)
+    assert res.status_code == 200
+
+    metrics_after = get_metrics()
+
+    # the generating slot takes one token of the budget of each iteration, the prompt gets the rest
+    n_decode_two_slots = get_n_decode_two_slots(metrics_after) - get_n_decode_two_slots(metrics_before)
+    assert n_decode_two_slots >= (n_prompt + BATCH_BUDGET - 2) // (BATCH_BUDGET - 1)
+
+    # the prompt processed in pieces gives the same completion
+    assert res.body["timings"]["prompt_n"] == n_prompt
+    assert res.body["content"] == content
+
+    # the generating slot is not interrupted
+    n_chunks = 1
+    for chunk in stream:
+        n_chunks += 1
+        if chunk["stop"]:
+            assert chunk["timings"]["predicted_n"] == 900
+    assert n_chunks > 1
@@ -0,0 +1,40 @@
+import pytest
+from utils import *
+
+server = ServerPreset.tinyllama2()
+
+@pytest.fixture(scope="module", autouse=True)
+def create_server():
+    global server
+    server = ServerPreset.tinyllama2()
+    server.n_slots = 1
+    server.cache_ram = 16
+    server.temperature = 0.0
+
+
+def test_evicted_prompt_is_restored():
+    global server
+    server.start()
+
+    # First prompt should be fully processed
+    res = server.make_request("POST", "/completion", data={
+        "prompt": "What is the capital of France?",
+        "cache_prompt": True,
+    })
+    assert res.status_code == 200
+    assert res.body["timings"]["prompt_n"] == 21  # all tokens are processed
+
+    # An unrelated prompt evicts the first one from the slot
+    res = server.make_request("POST", "/completion", data={
+        "prompt": "Once upon a time, there was a little dog named Max.",
+        "cache_prompt": True,
+    })
+    assert res.status_code == 200
+
+    # The first prompt is restored from host memory instead of being processed again
+    res = server.make_request("POST", "/completion", data={
+        "prompt": "What is the capital of France?",
+        "cache_prompt": True,
+    })
+    assert res.status_code == 200
+    assert res.body["timings"]["prompt_n"] == 1  # fully cached, last token is re-evaluated
@@ -0,0 +1,109 @@
+import pytest
+from utils import *
+
+server = ServerPreset.tinyllama2()
+
+N_PREDICT = 1000
+
+
+@pytest.fixture(scope="module", autouse=True)
+def create_server():
+    global server
+    server = ServerPreset.tinyllama2()
+    server.n_ctx = 2048
+    server.n_slots = 1
+    server.n_predict = None
+    server.cache_ram = 16
+    server.temperature = 0.0
+
+
+# starts a batch task on the only slot and preempts it with an interactive task once it has generated n_tokens
+# returns the final chunk of the batch task and its content
+def run_preempted(data: dict, n_tokens: int) -> tuple[dict, str]:
+    stream = server.make_stream_request("POST", "/completion", data={
+        **data,
+        "priority": "batch",
+        "stream": True,
+    })
+
+    # there is a chunk for each token, also when its text is held back
+    content = ""
+    for _ in range(n_tokens):
+        chunk = next(stream)
+        content += chunk["content"]
+
+    res = server.make_request("POST", "/completion", data={
+        "prompt": "What is the capital of France?",
+        "n_predict": 8,
+    })
+    assert res.status_code == 200
+    assert res.body["tokens_predicted"] == 8
+
+    for chunk in stream:
+        content += chunk["content"]
+    assert chunk["stop"]
+
+    return chunk, content
+
+
+def test_preempted_task_resumes():
+    global server
+    server.start()
+
+    data = {
+        "prompt": "Once upon a time, there was a little girl named Lily.",
+        "n_predict": N_PREDICT,
+        "ignore_eos": True,
+    }
+
+    # reference: the batch task without interruption
+    res = server.make_request("POST", "/completion", data={**data, "cache_prompt": False})
+    assert res.status_code == 200
+    ref = res.body
+    assert ref["tokens_predicted"] == N_PREDICT
+
+    final, content = run_preempted(data, 4)
+
+    # the task was resumed from the prompt cache, only the last token is evaluated again
+    assert final["timings"]["prompt_n"] < ref["timings"]["prompt_n"]
+
+    # the output continues exactly where it stopped
+    assert content == ref["content"]
+    assert final["tokens_predicted"] == N_PREDICT
+
+    # the prompt of the request is reported, without the tokens generated before the preemption
+    assert final["tokens_evaluated"] == ref["tokens_evaluated"]
+    assert final["prompt"] == ref["prompt"]
+
+
+def test_preempted_task_keeps_partial_stop_string():
+    global server
+    server.start()
+
+    data = {
+        "prompt": "Once upon a time, there was a little girl named Lily.",
+        "n_predict": N_PREDICT,
+        "ignore_eos": True,
+    }
+
+    res = server.make_request("POST", "/completion", data={**data, "cache_prompt": False, "return_tokens": True})
+    assert res.status_code == 200
+    text = res.body["content"]
+
+    # a stop string that starts after the first tokens and covers almost all of the output: the text after its start
+    # is held back until it is complete, so the task is preempted in the middle of it and the resumed task must find
+    # the rest
+    n_tokens = 4
+    res = server.make_request("POST", "/detokenize", data={"tokens": res.body["tokens"][:n_tokens]})
+    assert res.status_code == 200
+    start = len(res.body["content"])
+    assert text[:start] == res.body["content"]
+
+    stop = text[start:len(text) - 8]
+    assert text.find(stop) == start
+
+    final, content = run_preempted({**data, "stop": [stop]}, n_tokens + 4)
+
+    assert final["stop_type"] == "word"
+    assert final["stopping_word"] == stop
+    assert content == text[:start]
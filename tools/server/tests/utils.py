@@ -80,6 +80,9 @@ class ServerProcess:
     api_key: str | None = None
     lora_files: List[str] | None = None
     disable_ctx_shift: int | None = False
+    kv_prefix_share: bool | None = None
+    cache_ram: int | None = None
+    batch_budget: int | None = None
     draft_min: int | None = None
     draft_max: int | None = None
     no_webui: bool | None = None
@@ -180,6 +183,12 @@ class ServerProcess:
                 server_args.extend(["--lora", lora_file])
         if self.disable_ctx_shift:
             server_args.extend(["--no-context-shift"])
+        if self.kv_prefix_share:
+            server_args.append("--kv-prefix-share")
+        if self.cache_ram is not None:
+            server_args.extend(["--cache-ram", self.cache_ram])
+        if self.batch_budget is not None:
+            server_args.extend(["--batch-budget", self.batch_budget])
         if self.api_key:
             server_args.extend(["--api-key", self.api_key])
         if self.draft_max:
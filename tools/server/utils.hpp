@@ -18,7 +18,11 @@
 #define JSON_ASSERT GGML_ASSERT
 #include <nlohmann/json.hpp>
 
+#include <functional>
+#include <list>
+#include <map>
 #include <random>
+#include <set>
 #include <sstream>
 #include <string>
 #include <vector>
@@ -1343,6 +1347,300 @@ public:
     }
 };
 
+/**
+ * server_prefix_tree is a radix tree over the token prefixes that are currently stored in the KV cache.
+ * each edge holds a run of tokens and each node records the sequences whose cached prefix covers the entire edge
+ * leading to it, so a sequence that covers a node also covers all of its ancestors.
+ * it is used to find the longest cached prefix of a new prompt among all slots, so that it can be attached via seq_cp.
+ */
+struct server_prefix_tree {
+    struct node {
+        llama_tokens edge; // tokens on the edge leading to this node
+
+        std::set<llama_seq_id> seqs; // sequences covering the entire edge
+
+        std::map<llama_token, std::unique_ptr<node>> children;
+    };
+
+    // index the tokens of a sequence, replacing any previous entry for it
+    void insert(llama_seq_id seq_id, const llama_tokens & tokens) {
+        remove(seq_id);
+
+        if (tokens.empty()) {
+            return;
+        }
+
+        node * cur = &root;
+
+        size_t i = 0;
+        while (i < tokens.size()) {
+            auto it = cur->children.find(tokens[i]);
+            if (it == cur->children.end()) {
+                auto child = std::make_unique<node>();
+                child->edge.assign(tokens.begin() + i, tokens.end());
+                child->seqs.insert(seq_id);
+                cur->children[tokens[i]] = std::move(child);
+                break;
+            }
+
+            node * child = it->second.get();
+
+            size_t n_match = 0;
+            while (n_match < child->edge.size() && i + n_match < tokens.size() && child->edge[n_match] == tokens[i + n_match]) {
+                n_match++;
+            }
+
+            if (n_match < child->edge.size()) {
+                split(child, n_match);
+            }
+
+            child->seqs.insert(seq_id);
+
+            i  += n_match;
+            cur = child;
+        }
+
+        seq_tokens[seq_id] = tokens;
+    }
+
+    // keep only the first n tokens of a sequence
+    void keep_first(llama_seq_id seq_id, size_t n) {
+        auto it_seq = seq_tokens.find(seq_id);
+        if (it_seq == seq_tokens.end()) {
+            return;
+        }
+
+        llama_tokens & tokens = it_seq->second;
+        if (n >= tokens.size()) {
+            return;
+        }
+
+        node * cur = &root;
+
+        size_t i = 0;
+        while (i < tokens.size()) {
+            auto it = cur->children.find(tokens[i]);
+            GGML_ASSERT(it != cur->children.end());
+
+            node * child = it->second.get();
+
+            if (i >= n) {
+                child->seqs.erase(seq_id);
+                if (child->seqs.empty()) {
+                    // no other sequence covers this node, so none covers its descendants either
+                    cur->children.erase(it);
+                    break;
+                }
+            } else if (i + child->edge.size() > n) {
+                // the new end falls in the middle of the edge
+                split(child, n - i);
+            }
+
+            i  += child->edge.size();
+            cur = child;
+        }
+
+        if (n == 0) {
+            seq_tokens.erase(it_seq);
+        } else {
+            tokens.resize(n);
+        }
+    }
+
+    void remove(llama_seq_id seq_id) {
+        keep_first(seq_id, 0);
+    }
+
+    void clear() {
+        root.children.clear();
+        seq_tokens.clear();
+    }
+
+    // number of indexed tokens for a sequence
+    size_t n_tokens(llama_seq_id seq_id) const {
+        auto it = seq_tokens.find(seq_id);
+        return it == seq_tokens.end() ? 0 : it->second.size();
+    }
+
+    // find the longest prefix of tokens that is indexed for a sequence accepted by the filter
+    // returns the length of the prefix and sets seq_id to the sequence that holds it (-1 if none)
+    size_t find(const llama_tokens & tokens, const std::function<bool(llama_seq_id)> & filter, llama_seq_id & seq_id) const {
+        seq_id = -1;
+
+        size_t n_best = 0;
+
+        const node * cur = &root;
+
+        size_t i = 0;
+        while (i < tokens.size()) {
+            auto it = cur->children.find(tokens[i]);
+            if (it == cur->children.end()) {
+                break;
+            }
+
+            const node * child = it->second.get();
+
+            size_t n_match = 0;
+            while (n_match < child->edge.size() && i + n_match < tokens.size() && child->edge[n_match] == tokens[i + n_match]) {
+                n_match++;
+            }
+
+            llama_seq_id seq_cur = -1;
+            for (llama_seq_id s : child->seqs) {
+                if (filter(s)) {
+                    seq_cur = s;
+                    break;
+                }
+            }
+
+            // the sequences of the descendants are a subset of this node's sequences
+            if (seq_cur < 0) {
+                break;
+            }
+
+            n_best = i + n_match;
+            seq_id = seq_cur;
+
+            if (n_match < child->edge.size()) {
+                break;
+            }
+
+            i  += n_match;
+            cur = child;
+        }
+
+        return n_best;
+    }
+
+private:
+    node root;
+
+    // the indexed tokens of each sequence, used to walk its path on removal
+    std::map<llama_seq_id, llama_tokens> seq_tokens;
+
+    // split the edge of a node after n tokens, moving the remainder into a new child
+    static void split(node * nd, size_t n) {
+        GGML_ASSERT(n > 0 && n < nd->edge.size());
+
+        auto tail = std::make_unique<node>();
+        tail->edge.assign(nd->edge.begin() + n, nd->edge.end());
+        tail->seqs     = nd->seqs;
+        tail->children = std::move(nd->children);
+
+        nd->edge.resize(n);
+        nd->children.clear();
+        nd->children[tail->edge[0]] = std::move(tail);
+    }
+};
+
+/**
+ * server_prompt_cache is an LRU pool in host memory with the serialized KV state of prompts evicted from slots.
+ * the state is obtained with llama_state_seq_get_data and can be restored into any slot with llama_state_seq_set_data.
+ */
+struct server_prompt_cache {
+    struct entry {
+        llama_tokens tokens;
+
+        std::vector<uint8_t> data;
+
+        // the KV state depends on the adapters that were applied when it was computed
+        std::vector<common_adapter_lora_info> lora;
+    };
+
+    using iterator = std::list<entry>::iterator;
+
+    size_t limit_size = 0; // in bytes, 0 = disabled
+
+    bool enabled() const {
+        return limit_size > 0;
+    }
+
+    size_t size() const {
+        return size_total;
+    }
+
+    size_t n_entries() const {
+        return entries.size();
+    }
+
+    iterator end() {
+        return entries.end();
+    }
+
+    // add a new entry as the most recently used one and evict the least recently used entries over the limit
+    void put(llama_tokens && tokens, std::vector<uint8_t> && data, const std::vector<common_adapter_lora_info> & lora) {
+        if (data.size() > limit_size) {
+            return;
+        }
+
+        // entries that are a prefix of the new one are redundant
+        for (auto it = entries.begin(); it != entries.end(); ) {
+            if (it->tokens.size() <= tokens.size() && are_lora_equal(it->lora, lora) &&
+                std::equal(it->tokens.begin(), it->tokens.end(), tokens.begin())) {
+                size_total -= it->data.size();
+                it = entries.erase(it);
+            } else {
+                ++it;
+            }
+        }
+
+        size_total += data.size();
+        entries.push_front({ std::move(tokens), std::move(data), lora });
+
+        while (size_total > limit_size) {
+            size_total -= entries.back().data.size();
+            entries.pop_back();
+        }
+    }
+
+    // find the entry with the longest common prefix with the tokens, if it is longer than n_min
+    // the entry found becomes the most recently used one
+    iterator find(const llama_tokens & tokens, const std::vector<common_adapter_lora_info> & lora, size_t n_min, size_t & n_common) {
+        iterator res = entries.end();
+
+        n_common = n_min;
+
+        for (auto it = entries.begin(); it != entries.end(); ++it) {
+            if (!are_lora_equal(it->lora, lora)) {
+                continue;
+            }
+
+            const size_t n_max = std::min(it->tokens.size(), tokens.size());
+
+            size_t n = 0;
+            while (n < n_max && it->tokens[n] == tokens[n]) {
+                n++;
+            }
+
+            if (n > n_common) {
+                n_common = n;
+                res = it;
+            }
+        }
+
+        if (res != entries.end()) {
+            entries.splice(entries.begin(), entries, res);
+        }
+
+        return res;
+    }
+
+    // remove an entry from the pool and return it
+    entry take(iterator it) {
+        entry res = std::move(*it);
+
+        size_total -= res.data.size();
+        entries.erase(it);
+
+        return res;
+    }
+
+private:
+    std::list<entry> entries; // the most recently used entry is at the front
+
+    size_t size_total = 0;
+};
+
 // Computes FNV-1a hash of the data
 static std::string fnv_hash(const uint8_t * data, size_t len) {
     const uint64_t fnv_prime = 0x100000001b3ULL;